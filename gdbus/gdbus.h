@@ -52,6 +52,8 @@ gboolean g_dbus_set_disconnect_function(DBusConnection *connection,
 
 typedef void (* GDBusDestroyFunction) (void *user_data);
 
+typedef void (* GDBusFlushFunction) (DBusConnection *connection);
+
 typedef DBusMessage * (* GDBusMethodFunction) (DBusConnection *connection,
 					DBusMessage *message, void *user_data);
 
@@ -142,6 +144,8 @@ DBusMessage *g_dbus_create_reply(DBusMessage *message, int type, ...);
 DBusMessage *g_dbus_create_reply_valist(DBusMessage *message,
 						int type, va_list args);
 
+void g_dbus_set_flush_function(GDBusFlushFunction function);
+
 gboolean g_dbus_send_message(DBusConnection *connection, DBusMessage *message);
 gboolean g_dbus_send_reply(DBusConnection *connection,
 				DBusMessage *message, int type, ...);
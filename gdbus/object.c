@@ -215,6 +215,20 @@ static DBusMessage *introspect(DBusConnection *connection,
 	return reply;
 }
 
+static GDBusFlushFunction flush_function = NULL;
+
+/* Lets messages held back by the caller go out before ours */
+static void flush_messages(DBusConnection *connection)
+{
+	if (flush_function != NULL)
+		flush_function(connection);
+}
+
+void g_dbus_set_flush_function(GDBusFlushFunction function)
+{
+	flush_function = function;
+}
+
 static DBusHandlerResult process_message(DBusConnection *connection,
 			DBusMessage *message, const GDBusMethodTable *method,
 							void *iface_user_data)
@@ -237,6 +251,8 @@ static DBusHandlerResult process_message(DBusConnection *connection,
 	if (reply == NULL)
 		return DBUS_HANDLER_RESULT_NEED_MEMORY;
 
+	flush_messages(connection);
+
 	dbus_connection_send(connection, reply, NULL);
 	dbus_message_unref(reply);
 
@@ -288,6 +304,7 @@ void g_dbus_pending_error_valist(DBusConnection *connection,
 		reply = g_dbus_create_error_valist(secdata->message,
 							name, format, args);
 		if (reply != NULL) {
+			flush_messages(connection);
 			dbus_connection_send(connection, reply, NULL);
 			dbus_message_unref(reply);
 		}
@@ -661,6 +678,8 @@ static dbus_bool_t emit_signal_valist(DBusConnection *conn,
 		goto fail;
 	}
 
+	flush_messages(conn);
+
 	ret = dbus_connection_send(conn, signal, NULL);
 
 fail:
@@ -712,6 +731,8 @@ gboolean g_dbus_unregister_interface(DBusConnection *connection,
 	if (data == NULL)
 		return FALSE;
 
+	flush_messages(connection);
+
 	if (remove_interface(data, name) == FALSE)
 		return FALSE;
 
@@ -803,6 +824,8 @@ gboolean g_dbus_send_message(DBusConnection *connection, DBusMessage *message)
 	if (dbus_message_get_type(message) == DBUS_MESSAGE_TYPE_METHOD_CALL)
 		dbus_message_set_no_reply(message, TRUE);
 
+	flush_messages(connection);
+
 	result = dbus_connection_send(connection, message, NULL);
 
 	dbus_message_unref(message);
@@ -62,6 +62,15 @@ struct filter_callback {
 	guint id;
 };
 
+struct filter_key {
+	DBusConnection *connection;
+	const char *sender;
+	const char *path;
+	const char *interface;
+	const char *member;
+	const char *argument;
+};
+
 struct filter_data {
 	DBusConnection *connection;
 	DBusHandleMessageFunction handle_func;
@@ -71,6 +80,8 @@ struct filter_data {
 	char *interface;
 	char *member;
 	char *argument;
+	struct filter_key key;
+	guint mask;
 	GSList *callbacks;
 	GSList *processed;
 	guint name_watch;
@@ -78,13 +89,224 @@ struct filter_data {
 	gboolean registered;
 };
 
-static struct filter_data *filter_data_find(DBusConnection *connection,
-							const char *name,
-							const char *owner,
-							const char *path,
-							const char *interface,
-							const char *member,
-							const char *argument)
+struct filter_bucket {
+	struct filter_key key;
+	GSList *listeners;
+};
+
+#define MATCH_SENDER	(1 << 0)
+#define MATCH_PATH	(1 << 1)
+#define MATCH_INTERFACE	(1 << 2)
+#define MATCH_MEMBER	(1 << 3)
+#define MATCH_ARGUMENT	(1 << 4)
+#define MATCH_MASKS	(1 << 5)
+
+/* Listeners by the arguments they were registered with */
+static GHashTable *listener_table = NULL;
+
+/*
+ * Listeners by the fields a signal has to match. A NULL field of a
+ * listener matches anything, so a signal is looked up once for each
+ * combination of fields that is in use.
+ */
+static GHashTable *signal_table = NULL;
+static guint mask_count[MATCH_MASKS];
+
+/* Listeners that match on arg0, without their argument */
+static GHashTable *argument_table = NULL;
+
+static guint filter_key_hash(gconstpointer key)
+{
+	const struct filter_key *k = key;
+	const char *fields[5] = { k->sender, k->path, k->interface,
+						k->member, k->argument };
+	guint i, hash = GPOINTER_TO_UINT(k->connection);
+
+	for (i = 0; i < G_N_ELEMENTS(fields); i++)
+		hash = hash * 33 + (fields[i] ? g_str_hash(fields[i]) : i);
+
+	return hash;
+}
+
+static gboolean filter_key_equal(gconstpointer a, gconstpointer b)
+{
+	const struct filter_key *k1 = a, *k2 = b;
+
+	return k1->connection == k2->connection &&
+			g_strcmp0(k1->sender, k2->sender) == 0 &&
+			g_strcmp0(k1->path, k2->path) == 0 &&
+			g_strcmp0(k1->interface, k2->interface) == 0 &&
+			g_strcmp0(k1->member, k2->member) == 0 &&
+			g_strcmp0(k1->argument, k2->argument) == 0;
+}
+
+/* Returns FALSE if the mask needs a field that is not set */
+static gboolean filter_key_mask(struct filter_key *key,
+				const struct filter_key *fields, guint mask)
+{
+	memset(key, 0, sizeof(*key));
+
+	key->connection = fields->connection;
+
+	if (mask & MATCH_SENDER) {
+		if (fields->sender == NULL)
+			return FALSE;
+		key->sender = fields->sender;
+	}
+
+	if (mask & MATCH_PATH) {
+		if (fields->path == NULL)
+			return FALSE;
+		key->path = fields->path;
+	}
+
+	if (mask & MATCH_INTERFACE) {
+		if (fields->interface == NULL)
+			return FALSE;
+		key->interface = fields->interface;
+	}
+
+	if (mask & MATCH_MEMBER) {
+		if (fields->member == NULL)
+			return FALSE;
+		key->member = fields->member;
+	}
+
+	if (mask & MATCH_ARGUMENT) {
+		if (fields->argument == NULL)
+			return FALSE;
+		key->argument = fields->argument;
+	}
+
+	return TRUE;
+}
+
+static void filter_data_fields(struct filter_data *data,
+					struct filter_key *fields)
+{
+	/* Signals carry the unique name of the sender */
+	fields->connection = data->connection;
+	fields->sender = data->owner;
+	fields->path = data->path;
+	fields->interface = data->interface;
+	fields->member = data->member;
+	fields->argument = data->argument;
+}
+
+static void bucket_add(GHashTable *table, struct filter_data *data,
+								guint mask)
+{
+	struct filter_key fields, key;
+	struct filter_bucket *bucket;
+
+	filter_data_fields(data, &fields);
+	filter_key_mask(&key, &fields, mask);
+
+	bucket = g_hash_table_lookup(table, &key);
+	if (bucket == NULL) {
+		bucket = g_new0(struct filter_bucket, 1);
+		bucket->key = key;
+		g_hash_table_insert(table, &bucket->key, bucket);
+	}
+
+	bucket->listeners = g_slist_append(bucket->listeners, data);
+}
+
+static void bucket_remove(GHashTable *table, struct filter_data *data,
+								guint mask)
+{
+	struct filter_key fields, key;
+	struct filter_bucket *bucket;
+
+	filter_data_fields(data, &fields);
+	filter_key_mask(&key, &fields, mask);
+
+	bucket = g_hash_table_lookup(table, &key);
+	if (bucket == NULL)
+		return;
+
+	bucket->listeners = g_slist_remove(bucket->listeners, data);
+
+	if (bucket->listeners == NULL) {
+		g_hash_table_remove(table, &bucket->key);
+		g_free(bucket);
+		return;
+	}
+
+	/* The key points to the strings of one of the listeners */
+	filter_data_fields(bucket->listeners->data, &fields);
+	filter_key_mask(&bucket->key, &fields, mask);
+}
+
+static void filter_data_index(struct filter_data *data)
+{
+	guint mask = 0;
+
+	if (data->owner)
+		mask |= MATCH_SENDER;
+	if (data->path)
+		mask |= MATCH_PATH;
+	if (data->interface)
+		mask |= MATCH_INTERFACE;
+	if (data->member)
+		mask |= MATCH_MEMBER;
+	if (data->argument)
+		mask |= MATCH_ARGUMENT;
+
+	data->mask = mask;
+	mask_count[mask]++;
+
+	bucket_add(signal_table, data, mask);
+
+	if (mask & MATCH_ARGUMENT)
+		bucket_add(argument_table, data, mask & ~MATCH_ARGUMENT);
+}
+
+static void filter_data_unindex(struct filter_data *data)
+{
+	mask_count[data->mask]--;
+
+	bucket_remove(signal_table, data, data->mask);
+
+	if (data->mask & MATCH_ARGUMENT)
+		bucket_remove(argument_table, data,
+					data->mask & ~MATCH_ARGUMENT);
+}
+
+static void listener_add(struct filter_data *data)
+{
+	if (listener_table == NULL) {
+		listener_table = g_hash_table_new(filter_key_hash,
+							filter_key_equal);
+		signal_table = g_hash_table_new(filter_key_hash,
+							filter_key_equal);
+		argument_table = g_hash_table_new(filter_key_hash,
+							filter_key_equal);
+	}
+
+	listeners = g_slist_append(listeners, data);
+	g_hash_table_insert(listener_table, &data->key, data);
+	filter_data_index(data);
+}
+
+static void listener_remove(struct filter_data *data)
+{
+	listeners = g_slist_remove(listeners, data);
+	g_hash_table_remove(listener_table, &data->key);
+	filter_data_unindex(data);
+
+	if (listeners != NULL)
+		return;
+
+	g_hash_table_destroy(argument_table);
+	argument_table = NULL;
+	g_hash_table_destroy(signal_table);
+	signal_table = NULL;
+	g_hash_table_destroy(listener_table);
+	listener_table = NULL;
+}
+
+static struct filter_data *filter_data_find(DBusConnection *connection)
 {
 	GSList *current;
 
@@ -92,37 +314,86 @@ static struct filter_data *filter_data_find(DBusConnection *connection,
 			current != NULL; current = current->next) {
 		struct filter_data *data = current->data;
 
-		if (connection != data->connection)
-			continue;
+		if (connection == data->connection)
+			return data;
+	}
 
-		if (name && data->name &&
-				g_str_equal(name, data->name) == FALSE)
-			continue;
+	return NULL;
+}
 
-		if (owner && data->owner &&
-				g_str_equal(owner, data->owner) == FALSE)
-			continue;
+static struct filter_data *filter_data_find_match(DBusConnection *connection,
+							const char *sender,
+							const char *path,
+							const char *interface,
+							const char *member,
+							const char *argument)
+{
+	struct filter_key key;
 
-		if (path && data->path &&
-				g_str_equal(path, data->path) == FALSE)
-			continue;
+	if (listener_table == NULL)
+		return NULL;
 
-		if (interface && data->interface &&
-				g_str_equal(interface, data->interface) == FALSE)
+	key.connection = connection;
+	key.sender = sender;
+	key.path = path;
+	key.interface = interface;
+	key.member = member;
+	key.argument = argument;
+
+	return g_hash_table_lookup(listener_table, &key);
+}
+
+/* Returns a new list of all listeners the signal matches */
+static GSList *filter_data_match(DBusConnection *connection,
+						DBusMessage *message)
+{
+	struct filter_key fields, key;
+	struct filter_bucket *bucket;
+	gboolean parsed = FALSE;
+	GSList *matches = NULL;
+	guint mask;
+
+	if (signal_table == NULL)
+		return NULL;
+
+	fields.connection = connection;
+	fields.sender = dbus_message_get_sender(message);
+	fields.path = dbus_message_get_path(message);
+	fields.interface = dbus_message_get_interface(message);
+	fields.member = dbus_message_get_member(message);
+	fields.argument = NULL;
+
+	for (mask = 0; mask < MATCH_MASKS; mask++) {
+		if (mask_count[mask] == 0)
 			continue;
 
-		if (member && data->member &&
-				g_str_equal(member, data->member) == FALSE)
+		/* Only extract arg0 if a listener might need it */
+		if ((mask & MATCH_ARGUMENT) && parsed == FALSE) {
+			if (filter_key_mask(&key, &fields,
+					mask & ~MATCH_ARGUMENT) == FALSE)
+				continue;
+
+			if (g_hash_table_lookup(argument_table, &key) == NULL)
+				continue;
+
+			dbus_message_get_args(message, NULL,
+					DBUS_TYPE_STRING, &fields.argument,
+					DBUS_TYPE_INVALID);
+			parsed = TRUE;
+		}
+
+		if (filter_key_mask(&key, &fields, mask) == FALSE)
 			continue;
 
-		if (argument && data->argument &&
-				g_str_equal(argument, data->argument) == FALSE)
+		bucket = g_hash_table_lookup(signal_table, &key);
+		if (bucket == NULL)
 			continue;
 
-		return data;
+		matches = g_slist_concat(matches,
+					g_slist_copy(bucket->listeners));
 	}
 
-	return NULL;
+	return matches;
 }
 
 static void format_rule(struct filter_data *data, char *rule, size_t size)
@@ -204,7 +475,7 @@ static struct filter_data *filter_data_get(DBusConnection *connection,
 	struct filter_data *data;
 	const char *name = NULL, *owner = NULL;
 
-	if (filter_data_find(connection, NULL, NULL, NULL, NULL, NULL, NULL) == NULL) {
+	if (filter_data_find(connection) == NULL) {
 		if (!dbus_connection_add_filter(connection,
 					message_filter, NULL, NULL)) {
 			error("dbus_connection_add_filter() failed");
@@ -221,7 +492,7 @@ static struct filter_data *filter_data_get(DBusConnection *connection,
 		name = sender;
 
 proceed:
-	data = filter_data_find(connection, name, owner, path, interface,
+	data = filter_data_find_match(connection, sender, path, interface,
 					member, argument);
 	if (data)
 		return data;
@@ -236,12 +507,19 @@ proceed:
 	data->member = g_strdup(member);
 	data->argument = g_strdup(argument);
 
+	data->key.connection = data->connection;
+	data->key.sender = data->name ? : data->owner;
+	data->key.path = data->path;
+	data->key.interface = data->interface;
+	data->key.member = data->member;
+	data->key.argument = data->argument;
+
 	if (!add_match(data, filter)) {
 		g_free(data);
 		return NULL;
 	}
 
-	listeners = g_slist_append(listeners, data);
+	listener_add(data);
 
 	return data;
 }
@@ -375,12 +653,11 @@ static gboolean filter_data_remove_callback(struct filter_data *data,
 		return FALSE;
 
 	connection = dbus_connection_ref(data->connection);
-	listeners = g_slist_remove(listeners, data);
+	listener_remove(data);
 	filter_data_free(data);
 
 	/* Remove filter if there are no listeners left for the connection */
-	data = filter_data_find(connection, NULL, NULL, NULL, NULL, NULL,
-					NULL);
+	data = filter_data_find(connection);
 	if (data == NULL)
 		dbus_connection_remove_filter(connection, message_filter,
 						NULL);
@@ -427,8 +704,13 @@ static void update_name_cache(const char *name, const char *owner)
 		if (g_strcmp0(data->name, name) != 0)
 			continue;
 
+		/* The owner is part of the signal index */
+		filter_data_unindex(data);
+
 		g_free(data->owner);
 		data->owner = g_strdup(owner);
+
+		filter_data_index(data);
 	}
 }
 
@@ -501,47 +783,50 @@ static DBusHandlerResult message_filter(DBusConnection *connection,
 					DBusMessage *message, void *user_data)
 {
 	struct filter_data *data;
-	const char *sender, *path, *iface, *member, *arg = NULL;
+	GSList *matches, *l;
 
 	/* Only filter signals */
 	if (dbus_message_get_type(message) != DBUS_MESSAGE_TYPE_SIGNAL)
 		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 
-	sender = dbus_message_get_sender(message);
-	path = dbus_message_get_path(message);
-	iface = dbus_message_get_interface(message);
-	member = dbus_message_get_member(message);
-	dbus_message_get_args(message, NULL, DBUS_TYPE_STRING, &arg, DBUS_TYPE_INVALID);
-
-	/* Sender is always bus name */
-	data = filter_data_find(connection, NULL, sender, path, iface, member,
-					arg);
-	if (data == NULL) {
-		error("Got %s.%s signal which has no listeners", iface, member);
+	matches = filter_data_match(connection, message);
+	if (matches == NULL) {
+		error("Got %s.%s signal which has no listeners",
+					dbus_message_get_interface(message),
+					dbus_message_get_member(message));
 		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 	}
 
-	if (data->handle_func) {
+	/* Keep the listeners alive while the callbacks of others run */
+	for (l = matches; l != NULL; l = l->next) {
+		data = l->data;
 		data->lock = TRUE;
+	}
 
-		data->handle_func(connection, message, data);
+	for (l = matches; l != NULL; l = l->next) {
+		data = l->data;
 
-		data->callbacks = data->processed;
+		if (data->handle_func)
+			data->handle_func(connection, message, data);
+
+		data->callbacks = g_slist_concat(data->callbacks,
+							data->processed);
 		data->processed = NULL;
 		data->lock = FALSE;
-	}
 
-	if (data->callbacks)
-		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+		if (data->callbacks)
+			continue;
 
-	remove_match(data);
+		remove_match(data);
 
-	listeners = g_slist_remove(listeners, data);
-	filter_data_free(data);
+		listener_remove(data);
+		filter_data_free(data);
+	}
+
+	g_slist_free(matches);
 
 	/* Remove filter if there no listener left for the connection */
-	data = filter_data_find(connection, NULL, NULL, NULL, NULL, NULL,
-					NULL);
+	data = filter_data_find(connection);
 	if (data == NULL)
 		dbus_connection_remove_filter(connection, message_filter,
 						NULL);
@@ -738,9 +1023,8 @@ void g_dbus_remove_all_watches(DBusConnection *connection)
 {
 	struct filter_data *data;
 
-	while ((data = filter_data_find(connection, NULL, NULL, NULL, NULL,
-					NULL, NULL))) {
-		listeners = g_slist_remove(listeners, data);
+	while ((data = filter_data_find(connection))) {
+		listener_remove(data);
 		filter_data_call_and_free(data);
 	}
 
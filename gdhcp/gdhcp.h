@@ -137,6 +137,8 @@ void g_dhcp_server_set_lease_time(GDHCPServer *dhcp_server,
 						unsigned int lease_time);
 void g_dhcp_server_set_save_lease(GDHCPServer *dhcp_server,
 				GDHCPSaveLeaseFunc func, gpointer user_data);
+int g_dhcp_server_set_lease_file(GDHCPServer *dhcp_server,
+						const char *path);
 #ifdef __cplusplus
 }
 #endif
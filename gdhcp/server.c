@@ -28,7 +28,11 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
 
 #include <netpacket/packet.h>
@@ -48,6 +52,12 @@
 /* 5 minutes  */
 #define OFFER_TIME (5*60)
 
+#define LEASE_JOURNAL_MAGIC	0x4C454153
+#define LEASE_JOURNAL_VERSION	1
+
+/* The journal is rewritten once it holds twice as many records as leases */
+#define LEASE_JOURNAL_MIN_COMPACT	1024
+
 struct _GDHCPServer {
 	gint ref_count;
 	GDHCPType type;
@@ -61,8 +71,22 @@ struct _GDHCPServer {
 	int listener_sockfd;
 	guint listener_watch;
 	GIOChannel *listener_channel;
-	GList *lease_list;
+	GPtrArray *expire_heap;	/* Leases as a min-heap on expire */
 	GHashTable *nip_lease_hash;
+	GHashTable *mac_lease_hash;
+	guint32 *addr_map;	/* One bit per pool address, set if taken */
+	guint32 *full_map;	/* One bit per addr_map word, set if full */
+	uint32_t map_bits;
+	uint32_t map_words;
+	uint32_t full_words;
+	uint32_t alloc_cursor;
+	char *lease_file;
+	int journal_fd;
+	guint8 *journal_addr;
+	size_t journal_len;
+	size_t journal_end;
+	unsigned int journal_records;
+	gboolean journal_replay;
 	GHashTable *option_hash; /* Options send to client */
 	GDHCPSaveLeaseFunc save_lease_func;
 	GDHCPDebugFunc debug_func;
@@ -73,6 +97,40 @@ struct dhcp_lease {
 	time_t expire;
 	uint32_t lease_nip;
 	uint8_t lease_mac[ETH_ALEN];
+	guint heap_index;
+};
+
+/*
+ * Lease journal
+ *
+ * Every change of an acknowledged lease is appended as a fixed size
+ * record to a file that is mapped into memory. Offers are not recorded,
+ * a client that did not get its ACK before a restart just asks again. On start the records are replayed in order,
+ * which leaves the lease table as it was before the restart. Each record
+ * is synced to disk as it is appended, so a lease also survives a power
+ * loss. A record that was cut short fails its checksum and ends replay.
+ * Once most of the records are stale, the journal is rewritten with one
+ * record per lease into a new file that replaces the old one.
+ */
+struct lease_journal_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t reserved;
+};
+
+enum lease_record_type {
+	LEASE_RECORD_ADD = 1,
+	LEASE_RECORD_REMOVE = 2,
+};
+
+struct lease_record {
+	uint64_t expire;
+	uint32_t nip;
+	uint8_t mac[ETH_ALEN];
+	uint8_t type;
+	uint8_t reserved;
+	uint32_t check;
 };
 
 static inline void debug(GDHCPServer *server, const char *format, ...)
@@ -91,28 +149,534 @@ static inline void debug(GDHCPServer *server, const char *format, ...)
 	va_end(ap);
 }
 
+static guint mac_hash(gconstpointer key)
+{
+	const uint8_t *mac = key;
+	guint hash = 0;
+	int i;
+
+	for (i = 0; i < ETH_ALEN; i++)
+		hash = hash * 33 + mac[i];
+
+	return hash;
+}
+
+static gboolean mac_equal(gconstpointer a, gconstpointer b)
+{
+	return memcmp(a, b, ETH_ALEN) == 0 ? TRUE : FALSE;
+}
+
 static struct dhcp_lease *find_lease_by_mac(GDHCPServer *dhcp_server,
 						const uint8_t *mac)
 {
-	GList *list;
+	return g_hash_table_lookup(dhcp_server->mac_lease_hash, mac);
+}
 
-	for (list = dhcp_server->lease_list; list; list = list->next) {
-		struct dhcp_lease *lease = list->data;
+static struct dhcp_lease *find_lease_by_nip(GDHCPServer *dhcp_server,
+								uint32_t nip)
+{
+	return g_hash_table_lookup(dhcp_server->nip_lease_hash,
+						GINT_TO_POINTER((int) nip));
+}
 
-		if (memcmp(lease->lease_mac, mac, ETH_ALEN) == 0)
-			return lease;
+/*
+ * The leases are kept in a binary min-heap ordered by expiry time, so
+ * the oldest lease is always at the top and renewing a lease only
+ * moves it along one path of the heap.
+ */
+static void heap_set(GDHCPServer *dhcp_server, guint index,
+						struct dhcp_lease *lease)
+{
+	dhcp_server->expire_heap->pdata[index] = lease;
+	lease->heap_index = index;
+}
+
+static struct dhcp_lease *heap_get(GDHCPServer *dhcp_server, guint index)
+{
+	return g_ptr_array_index(dhcp_server->expire_heap, index);
+}
+
+static void heap_sift_up(GDHCPServer *dhcp_server, guint index)
+{
+	struct dhcp_lease *lease = heap_get(dhcp_server, index);
+
+	while (index > 0) {
+		guint parent = (index - 1) / 2;
+		struct dhcp_lease *above = heap_get(dhcp_server, parent);
+
+		if (above->expire <= lease->expire)
+			break;
+
+		heap_set(dhcp_server, index, above);
+		index = parent;
 	}
 
-	return NULL;
+	heap_set(dhcp_server, index, lease);
 }
 
-static void remove_lease(GDHCPServer *dhcp_server, struct dhcp_lease *lease)
+static void heap_sift_down(GDHCPServer *dhcp_server, guint index)
+{
+	struct dhcp_lease *lease = heap_get(dhcp_server, index);
+	guint len = dhcp_server->expire_heap->len;
+
+	while (index * 2 + 1 < len) {
+		guint child = index * 2 + 1;
+		struct dhcp_lease *below = heap_get(dhcp_server, child);
+
+		if (child + 1 < len &&
+				heap_get(dhcp_server, child + 1)->expire <
+								below->expire)
+			below = heap_get(dhcp_server, ++child);
+
+		if (lease->expire <= below->expire)
+			break;
+
+		heap_set(dhcp_server, index, below);
+		index = child;
+	}
+
+	heap_set(dhcp_server, index, lease);
+}
+
+static void heap_update(GDHCPServer *dhcp_server, guint index)
+{
+	if (index > 0 && heap_get(dhcp_server, (index - 1) / 2)->expire >
+					heap_get(dhcp_server, index)->expire)
+		heap_sift_up(dhcp_server, index);
+	else
+		heap_sift_down(dhcp_server, index);
+}
+
+static void heap_insert(GDHCPServer *dhcp_server, struct dhcp_lease *lease)
+{
+	g_ptr_array_add(dhcp_server->expire_heap, lease);
+	heap_sift_up(dhcp_server, dhcp_server->expire_heap->len - 1);
+}
+
+static void heap_remove(GDHCPServer *dhcp_server, struct dhcp_lease *lease)
+{
+	guint index = lease->heap_index;
+
+	/* The last lease takes the place of the removed one */
+	g_ptr_array_remove_index_fast(dhcp_server->expire_heap, index);
+
+	if (index < dhcp_server->expire_heap->len)
+		heap_update(dhcp_server, index);
+}
+
+/*
+ * Every address of the pool has one bit in addr_map, which is set
+ * while the address is leased or offered and for the .0 and .255
+ * addresses that are never handed out. A second level full_map marks
+ * the addr_map words without any free address, so a free address is
+ * found by skipping 1024 taken addresses per summary word.
+ */
+static gboolean nip_to_bit(GDHCPServer *dhcp_server, uint32_t nip,
+							uint32_t *bit)
+{
+	uint32_t ip_addr = ntohl(nip);
+
+	if (dhcp_server->addr_map == NULL)
+		return FALSE;
+
+	if (ip_addr < dhcp_server->start_ip || ip_addr > dhcp_server->end_ip)
+		return FALSE;
+
+	*bit = ip_addr - dhcp_server->start_ip;
+
+	return TRUE;
+}
+
+static void mark_bit(GDHCPServer *dhcp_server, uint32_t bit)
+{
+	uint32_t word = bit / 32;
+
+	dhcp_server->addr_map[word] |= 1U << (bit % 32);
+
+	if (dhcp_server->addr_map[word] == ~0U)
+		dhcp_server->full_map[word / 32] |= 1U << (word % 32);
+}
+
+static void mark_addr(GDHCPServer *dhcp_server, uint32_t nip)
+{
+	uint32_t bit;
+
+	if (nip_to_bit(dhcp_server, nip, &bit) == TRUE)
+		mark_bit(dhcp_server, bit);
+}
+
+static void unmark_addr(GDHCPServer *dhcp_server, uint32_t nip)
+{
+	uint32_t bit, word;
+	uint32_t ip_addr = ntohl(nip);
+
+	if (nip_to_bit(dhcp_server, nip, &bit) == FALSE)
+		return;
+
+	/* The reserved addresses stay taken */
+	if ((ip_addr & 0xff) == 0 || (ip_addr & 0xff) == 0xff)
+		return;
+
+	word = bit / 32;
+
+	dhcp_server->addr_map[word] &= ~(1U << (bit % 32));
+	dhcp_server->full_map[word / 32] &= ~(1U << (word % 32));
+}
+
+/* Index of the first clear bit, the word must not be all ones */
+static uint32_t first_zero(guint32 word)
+{
+	return ffs(~word) - 1;
+}
+
+static gboolean find_free_bit(GDHCPServer *dhcp_server, uint32_t from,
+							uint32_t *bit)
 {
-	dhcp_server->lease_list =
-			g_list_remove(dhcp_server->lease_list, lease);
+	uint32_t word = from / 32;
+	guint32 bits;
+
+	if (word >= dhcp_server->map_words)
+		return FALSE;
+
+	bits = dhcp_server->addr_map[word] | ((1U << (from % 32)) - 1);
+	if (bits != ~0U) {
+		*bit = word * 32 + first_zero(bits);
+		return TRUE;
+	}
+
+	word++;
+
+	while (word < dhcp_server->map_words) {
+		uint32_t index = word / 32;
+
+		bits = dhcp_server->full_map[index] | ((1U << (word % 32)) - 1);
+		if (bits != ~0U) {
+			word = index * 32 + first_zero(bits);
+			if (word >= dhcp_server->map_words)
+				return FALSE;
+
+			*bit = word * 32 +
+				first_zero(dhcp_server->addr_map[word]);
+			return TRUE;
+		}
+
+		word = (index + 1) * 32;
+	}
+
+	return FALSE;
+}
+
+static void free_addr_map(GDHCPServer *dhcp_server)
+{
+	g_free(dhcp_server->addr_map);
+	g_free(dhcp_server->full_map);
+
+	dhcp_server->addr_map = NULL;
+	dhcp_server->full_map = NULL;
+	dhcp_server->map_bits = 0;
+	dhcp_server->map_words = 0;
+	dhcp_server->full_words = 0;
+	dhcp_server->alloc_cursor = 0;
+}
+
+static int create_addr_map(GDHCPServer *dhcp_server)
+{
+	uint32_t bit, word;
+	guint64 ip_addr;
+	guint i;
+
+	free_addr_map(dhcp_server);
+
+	if (dhcp_server->end_ip < dhcp_server->start_ip)
+		return -EINVAL;
+
+	if (dhcp_server->end_ip - dhcp_server->start_ip == G_MAXUINT32)
+		return -EINVAL;
+
+	dhcp_server->map_bits = dhcp_server->end_ip -
+					dhcp_server->start_ip + 1;
+	dhcp_server->map_words = (dhcp_server->map_bits + 31) / 32;
+	dhcp_server->full_words = (dhcp_server->map_words + 31) / 32;
+
+	dhcp_server->addr_map = g_try_new0(guint32, dhcp_server->map_words);
+	dhcp_server->full_map = g_try_new0(guint32, dhcp_server->full_words);
+	if (dhcp_server->addr_map == NULL || dhcp_server->full_map == NULL) {
+		free_addr_map(dhcp_server);
+		return -ENOMEM;
+	}
+
+	/* Bits past the end of the pool are never free */
+	for (bit = dhcp_server->map_bits; bit % 32 != 0; bit++)
+		dhcp_server->addr_map[bit / 32] |= 1U << (bit % 32);
+
+	for (word = dhcp_server->map_words; word % 32 != 0; word++)
+		dhcp_server->full_map[word / 32] |= 1U << (word % 32);
+
+	/* e.g. 192.168.55.0 and 192.168.55.255 */
+	for (ip_addr = dhcp_server->start_ip & ~0xff;
+			ip_addr <= dhcp_server->end_ip; ip_addr += 256) {
+		if (ip_addr >= dhcp_server->start_ip)
+			mark_bit(dhcp_server, ip_addr - dhcp_server->start_ip);
+
+		if ((ip_addr | 0xff) <= dhcp_server->end_ip)
+			mark_bit(dhcp_server, (ip_addr | 0xff) -
+						dhcp_server->start_ip);
+	}
+
+	for (i = 0; i < dhcp_server->expire_heap->len; i++)
+		mark_addr(dhcp_server, heap_get(dhcp_server, i)->lease_nip);
+
+	return 0;
+}
+
+static uint32_t record_checksum(const struct lease_record *record)
+{
+	const uint8_t *ptr = (const uint8_t *) record;
+	uint32_t hash = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < offsetof(struct lease_record, check); i++)
+		hash = (hash ^ ptr[i]) * 16777619U;
+
+	return hash;
+}
+
+static gboolean record_is_valid(const struct lease_record *record)
+{
+	if (record->type != LEASE_RECORD_ADD &&
+				record->type != LEASE_RECORD_REMOVE)
+		return FALSE;
+
+	return record->check == record_checksum(record);
+}
+
+static void fill_record(struct lease_record *record,
+			enum lease_record_type type, struct dhcp_lease *lease)
+{
+	memset(record, 0, sizeof(*record));
+
+	record->expire = lease->expire;
+	record->nip = lease->lease_nip;
+	memcpy(record->mac, lease->lease_mac, ETH_ALEN);
+	record->type = type;
+	record->check = record_checksum(record);
+}
+
+static void fill_journal_header(struct lease_journal_header *hdr)
+{
+	memset(hdr, 0, sizeof(*hdr));
+
+	hdr->magic = LEASE_JOURNAL_MAGIC;
+	hdr->version = LEASE_JOURNAL_VERSION;
+	hdr->record_size = sizeof(struct lease_record);
+}
+
+static int journal_map(GDHCPServer *dhcp_server, size_t size)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	void *addr;
+
+	size = (size + page_size - 1) & ~(page_size - 1);
+
+	if (ftruncate(dhcp_server->journal_fd, size) < 0)
+		return -errno;
 
+	if (dhcp_server->journal_addr != NULL)
+		munmap(dhcp_server->journal_addr, dhcp_server->journal_len);
+
+	dhcp_server->journal_addr = NULL;
+	dhcp_server->journal_len = 0;
+
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+						dhcp_server->journal_fd, 0);
+	if (addr == MAP_FAILED)
+		return -errno;
+
+	dhcp_server->journal_addr = addr;
+	dhcp_server->journal_len = size;
+
+	return 0;
+}
+
+static void journal_close(GDHCPServer *dhcp_server)
+{
+	if (dhcp_server->journal_addr != NULL) {
+		msync(dhcp_server->journal_addr, dhcp_server->journal_len,
+								MS_SYNC);
+		munmap(dhcp_server->journal_addr, dhcp_server->journal_len);
+	}
+
+	if (dhcp_server->journal_fd >= 0)
+		close(dhcp_server->journal_fd);
+
+	dhcp_server->journal_fd = -1;
+	dhcp_server->journal_addr = NULL;
+	dhcp_server->journal_len = 0;
+	dhcp_server->journal_end = 0;
+	dhcp_server->journal_records = 0;
+}
+
+static int write_all(int fd, const guint8 *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t count = write(fd, buf, len);
+
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return -errno;
+		}
+
+		buf += count;
+		len -= count;
+	}
+
+	return 0;
+}
+
+/* Writes the current leases into a new journal and swaps it in */
+static int journal_compact(GDHCPServer *dhcp_server)
+{
+	struct lease_record *records;
+	guint8 *buf;
+	char *name;
+	size_t size;
+	guint i, count = dhcp_server->expire_heap->len;
+	int fd, err;
+
+	size = sizeof(struct lease_journal_header) +
+				count * sizeof(struct lease_record);
+
+	buf = g_try_malloc(size);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	fill_journal_header((struct lease_journal_header *) buf);
+
+	records = (struct lease_record *)
+				(buf + sizeof(struct lease_journal_header));
+	for (i = 0; i < count; i++)
+		fill_record(&records[i], LEASE_RECORD_ADD,
+						heap_get(dhcp_server, i));
+
+	name = g_strdup_printf("%s.tmp", dhcp_server->lease_file);
+
+	fd = open(name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		err = -errno;
+		goto done;
+	}
+
+	err = write_all(fd, buf, size);
+	if (err == 0 && fsync(fd) < 0)
+		err = -errno;
+	if (err == 0 && rename(name, dhcp_server->lease_file) < 0)
+		err = -errno;
+
+	if (err < 0) {
+		close(fd);
+		unlink(name);
+		goto done;
+	}
+
+	journal_close(dhcp_server);
+
+	dhcp_server->journal_fd = fd;
+
+	err = journal_map(dhcp_server, size + 1);
+	if (err < 0) {
+		journal_close(dhcp_server);
+		goto done;
+	}
+
+	dhcp_server->journal_end = size;
+	dhcp_server->journal_records = count;
+
+	debug(dhcp_server, "Compacted lease journal to %u records", count);
+
+done:
+	if (err < 0)
+		debug(dhcp_server, "Lease journal compaction failed: %s",
+							strerror(-err));
+
+	g_free(name);
+	g_free(buf);
+
+	return err;
+}
+
+/* Flushes the pages holding the given range of the journal to disk */
+static void journal_sync(GDHCPServer *dhcp_server, size_t offset, size_t len)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	size_t start = offset & ~(page_size - 1);
+
+	if (msync(dhcp_server->journal_addr + start,
+				offset + len - start, MS_SYNC) < 0)
+		debug(dhcp_server, "Lease journal sync failed: %s",
+							strerror(errno));
+}
+
+static void journal_append(GDHCPServer *dhcp_server,
+			enum lease_record_type type, struct dhcp_lease *lease)
+{
+	struct lease_record *record;
+
+	if (dhcp_server->journal_addr == NULL ||
+				dhcp_server->journal_replay == TRUE)
+		return;
+
+	if (dhcp_server->journal_end + sizeof(*record) >
+					dhcp_server->journal_len) {
+		int err = journal_map(dhcp_server,
+					dhcp_server->journal_len * 2);
+		if (err < 0) {
+			debug(dhcp_server, "Lease journal disabled: %s",
+							strerror(-err));
+			journal_close(dhcp_server);
+			return;
+		}
+	}
+
+	record = (struct lease_record *) (dhcp_server->journal_addr +
+						dhcp_server->journal_end);
+	fill_record(record, type, lease);
+
+	journal_sync(dhcp_server, dhcp_server->journal_end, sizeof(*record));
+
+	dhcp_server->journal_end += sizeof(*record);
+	dhcp_server->journal_records++;
+
+	if (dhcp_server->journal_records >= LEASE_JOURNAL_MIN_COMPACT &&
+			dhcp_server->journal_records >
+					2 * dhcp_server->expire_heap->len)
+		journal_compact(dhcp_server);
+}
+
+static void link_lease(GDHCPServer *dhcp_server, struct dhcp_lease *lease)
+{
+	g_hash_table_insert(dhcp_server->nip_lease_hash,
+				GINT_TO_POINTER((int) lease->lease_nip), lease);
+	g_hash_table_replace(dhcp_server->mac_lease_hash,
+						lease->lease_mac, lease);
+	heap_insert(dhcp_server, lease);
+	mark_addr(dhcp_server, lease->lease_nip);
+}
+
+static void unlink_lease(GDHCPServer *dhcp_server, struct dhcp_lease *lease)
+{
 	g_hash_table_remove(dhcp_server->nip_lease_hash,
 				GINT_TO_POINTER((int) lease->lease_nip));
+	g_hash_table_remove(dhcp_server->mac_lease_hash, lease->lease_mac);
+	heap_remove(dhcp_server, lease);
+	unmark_addr(dhcp_server, lease->lease_nip);
+}
+
+static void remove_lease(GDHCPServer *dhcp_server, struct dhcp_lease *lease)
+{
+	unlink_lease(dhcp_server, lease);
+	journal_append(dhcp_server, LEASE_RECORD_REMOVE, lease);
 	g_free(lease);
 }
 
@@ -139,34 +703,22 @@ static int get_lease(GDHCPServer *dhcp_server, uint32_t yiaddr,
 
 	lease_mac = find_lease_by_mac(dhcp_server, mac);
 
-	lease_nip = g_hash_table_lookup(dhcp_server->nip_lease_hash,
-						GINT_TO_POINTER((int) yiaddr));
+	lease_nip = find_lease_by_nip(dhcp_server, yiaddr);
 	debug(dhcp_server, "lease_mac %p lease_nip %p", lease_mac, lease_nip);
 
 	if (lease_nip != NULL) {
-		dhcp_server->lease_list =
-				g_list_remove(dhcp_server->lease_list,
-								lease_nip);
-		g_hash_table_remove(dhcp_server->nip_lease_hash,
-					GINT_TO_POINTER((int) yiaddr));
-
-		if (lease_mac == NULL)
-			*lease = lease_nip;
-		else if (lease_nip != lease_mac) {
+		unlink_lease(dhcp_server, lease_nip);
+
+		if (lease_mac != NULL && lease_nip != lease_mac)
 			remove_lease(dhcp_server, lease_mac);
-			*lease = lease_nip;
-		} else
-			*lease = lease_nip;
+
+		*lease = lease_nip;
 
 		return 0;
 	}
 
 	if (lease_mac != NULL) {
-		dhcp_server->lease_list =
-				g_list_remove(dhcp_server->lease_list,
-								lease_mac);
-		g_hash_table_remove(dhcp_server->nip_lease_hash,
-				GINT_TO_POINTER((int) lease_mac->lease_nip));
+		unlink_lease(dhcp_server, lease_mac);
 		*lease = lease_mac;
 
 		return 0;
@@ -179,14 +731,6 @@ static int get_lease(GDHCPServer *dhcp_server, uint32_t yiaddr,
 	return 0;
 }
 
-static gint compare_expire(gconstpointer a, gconstpointer b)
-{
-	const struct dhcp_lease *lease1 = a;
-	const struct dhcp_lease *lease2 = b;
-
-	return lease2->expire - lease1->expire;
-}
-
 static struct dhcp_lease *add_lease(GDHCPServer *dhcp_server, uint32_t expire,
 					const uint8_t *chaddr, uint32_t yiaddr)
 {
@@ -207,22 +751,11 @@ static struct dhcp_lease *add_lease(GDHCPServer *dhcp_server, uint32_t expire,
 	else
 		lease->expire = expire;
 
-	dhcp_server->lease_list = g_list_insert_sorted(dhcp_server->lease_list,
-							lease, compare_expire);
-
-	g_hash_table_insert(dhcp_server->nip_lease_hash,
-				GINT_TO_POINTER((int) lease->lease_nip), lease);
+	link_lease(dhcp_server, lease);
 
 	return lease;
 }
 
-static struct dhcp_lease *find_lease_by_nip(GDHCPServer *dhcp_server,
-								uint32_t nip)
-{
-	return g_hash_table_lookup(dhcp_server->nip_lease_hash,
-						GINT_TO_POINTER((int) nip));
-}
-
 /* Check if the IP is taken; if it is, add it to the lease table */
 static gboolean arp_check(uint32_t nip, const uint8_t *safe_mac)
 {
@@ -241,41 +774,41 @@ static gboolean is_expired_lease(struct dhcp_lease *lease)
 static uint32_t find_free_or_expired_nip(GDHCPServer *dhcp_server,
 					const uint8_t *safe_mac)
 {
-	uint32_t ip_addr;
 	struct dhcp_lease *lease;
-	GList *list;
-	ip_addr = dhcp_server->start_ip;
-	for (; ip_addr <= dhcp_server->end_ip; ip_addr++) {
-		/* e.g. 192.168.55.0 */
-		if ((ip_addr & 0xff) == 0)
-			continue;
+	uint32_t bit, tries;
 
-		/* e.g. 192.168.55.255 */
-		if ((ip_addr & 0xff) == 0xff)
-			continue;
+	/*
+	 * Hand out the pool round robin from the last allocation, so a
+	 * released address is not given to the next client right away.
+	 */
+	for (tries = 0; tries < dhcp_server->map_bits; tries++) {
+		uint32_t nip;
 
-		lease = find_lease_by_nip(dhcp_server,
-				(uint32_t) htonl(ip_addr));
-		if (lease != NULL)
-			continue;
+		if (find_free_bit(dhcp_server, dhcp_server->alloc_cursor,
+							&bit) == FALSE &&
+				find_free_bit(dhcp_server, 0, &bit) == FALSE)
+			break;
 
-		if (arp_check(htonl(ip_addr), safe_mac) == TRUE)
-			return htonl(ip_addr);
+		dhcp_server->alloc_cursor = bit + 1;
+		if (dhcp_server->alloc_cursor >= dhcp_server->map_bits)
+			dhcp_server->alloc_cursor = 0;
+
+		nip = htonl(dhcp_server->start_ip + bit);
+
+		if (arp_check(nip, safe_mac) == TRUE)
+			return nip;
 	}
 
-	/* The last lease is the oldest one */
-	list = g_list_last(dhcp_server->lease_list);
-	if (list == NULL)
+	/* The top of the heap is the oldest lease */
+	if (dhcp_server->expire_heap->len == 0)
 		return 0;
 
-	lease = list->data;
-	if (lease == NULL)
-		return 0;
+	lease = heap_get(dhcp_server, 0);
 
-	 if (is_expired_lease(lease) == FALSE)
+	if (is_expired_lease(lease) == FALSE)
 		return 0;
 
-	 if (arp_check(lease->lease_nip, safe_mac) == FALSE)
+	if (arp_check(lease->lease_nip, safe_mac) == FALSE)
 		return 0;
 
 	return lease->lease_nip;
@@ -284,32 +817,123 @@ static uint32_t find_free_or_expired_nip(GDHCPServer *dhcp_server,
 static void lease_set_expire(GDHCPServer *dhcp_server,
 			struct dhcp_lease *lease, uint32_t expire)
 {
-	dhcp_server->lease_list = g_list_remove(dhcp_server->lease_list, lease);
-
 	lease->expire = expire;
 
-	dhcp_server->lease_list = g_list_insert_sorted(dhcp_server->lease_list,
-							lease, compare_expire);
+	heap_update(dhcp_server, lease->heap_index);
+
+	journal_append(dhcp_server, LEASE_RECORD_ADD, lease);
+}
+
+static void replay_record(GDHCPServer *dhcp_server,
+				const struct lease_record *record)
+{
+	struct dhcp_lease *lease;
+
+	switch (record->type) {
+	case LEASE_RECORD_ADD:
+		add_lease(dhcp_server, record->expire, record->mac,
+								record->nip);
+		break;
+	case LEASE_RECORD_REMOVE:
+		lease = find_lease_by_mac(dhcp_server, record->mac);
+		if (lease != NULL && lease->lease_nip == record->nip)
+			remove_lease(dhcp_server, lease);
+		break;
+	}
+}
+
+static int journal_open(GDHCPServer *dhcp_server)
+{
+	struct lease_journal_header *hdr;
+	struct stat st;
+	size_t offset;
+	int err;
+
+	dhcp_server->journal_fd = open(dhcp_server->lease_file,
+					O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (dhcp_server->journal_fd < 0)
+		return -errno;
+
+	if (fstat(dhcp_server->journal_fd, &st) < 0) {
+		err = -errno;
+		goto error;
+	}
+
+	err = journal_map(dhcp_server, MAX((size_t) st.st_size,
+				sizeof(struct lease_journal_header) + 1));
+	if (err < 0)
+		goto error;
+
+	hdr = (struct lease_journal_header *) dhcp_server->journal_addr;
+	offset = sizeof(*hdr);
+
+	if (hdr->magic != LEASE_JOURNAL_MAGIC ||
+			hdr->version != LEASE_JOURNAL_VERSION ||
+			hdr->record_size != sizeof(struct lease_record)) {
+		memset(dhcp_server->journal_addr, 0,
+						dhcp_server->journal_len);
+		fill_journal_header(hdr);
+		goto done;
+	}
+
+	dhcp_server->journal_replay = TRUE;
+
+	while (offset + sizeof(struct lease_record) <=
+					dhcp_server->journal_len) {
+		const struct lease_record *record = (const void *)
+				(dhcp_server->journal_addr + offset);
+
+		if (record_is_valid(record) == FALSE)
+			break;
+
+		replay_record(dhcp_server, record);
+
+		offset += sizeof(struct lease_record);
+		dhcp_server->journal_records++;
+	}
+
+	dhcp_server->journal_replay = FALSE;
+
+done:
+	dhcp_server->journal_end = offset;
+
+	debug(dhcp_server, "Replayed %u lease records, %u leases",
+				dhcp_server->journal_records,
+				dhcp_server->expire_heap->len);
+
+	if (dhcp_server->journal_records >= LEASE_JOURNAL_MIN_COMPACT &&
+			dhcp_server->journal_records >
+					2 * dhcp_server->expire_heap->len)
+		journal_compact(dhcp_server);
+
+	return 0;
+
+error:
+	journal_close(dhcp_server);
+
+	return err;
 }
 
 static void destroy_lease_table(GDHCPServer *dhcp_server)
 {
-	GList *list;
+	guint i;
 
 	g_hash_table_destroy(dhcp_server->nip_lease_hash);
+	g_hash_table_destroy(dhcp_server->mac_lease_hash);
 
 	dhcp_server->nip_lease_hash = NULL;
+	dhcp_server->mac_lease_hash = NULL;
 
-	for (list = dhcp_server->lease_list; list; list = list->next) {
-		struct dhcp_lease *lease = list->data;
+	for (i = 0; i < dhcp_server->expire_heap->len; i++)
+		g_free(heap_get(dhcp_server, i));
 
-		g_free(lease);
-	}
+	g_ptr_array_free(dhcp_server->expire_heap, TRUE);
 
-	g_list_free(dhcp_server->lease_list);
+	dhcp_server->expire_heap = NULL;
 
-	dhcp_server->lease_list = NULL;
+	free_addr_map(dhcp_server);
 }
+
 static uint32_t get_interface_address(int index)
 {
 	struct ifreq ifr;
@@ -382,6 +1006,9 @@ GDHCPServer *g_dhcp_server_new(GDHCPType type,
 
 	dhcp_server->nip_lease_hash = g_hash_table_new_full(g_direct_hash,
 						g_direct_equal, NULL, NULL);
+	dhcp_server->mac_lease_hash = g_hash_table_new_full(mac_hash,
+						mac_equal, NULL, NULL);
+	dhcp_server->expire_heap = g_ptr_array_new();
 	dhcp_server->option_hash = g_hash_table_new_full(g_direct_hash,
 						g_direct_equal, NULL, NULL);
 
@@ -398,6 +1025,7 @@ GDHCPServer *g_dhcp_server_new(GDHCPType type,
 	dhcp_server->listener_sockfd = -1;
 	dhcp_server->listener_watch = -1;
 	dhcp_server->listener_channel = NULL;
+	dhcp_server->journal_fd = -1;
 	dhcp_server->save_lease_func = NULL;
 	dhcp_server->debug_func = NULL;
 	dhcp_server->debug_data = NULL;
@@ -577,13 +1205,13 @@ static void send_offer(GDHCPServer *dhcp_server,
 
 static void save_lease(GDHCPServer *dhcp_server)
 {
-	GList *list;
+	guint i;
 
 	if (dhcp_server->save_lease_func == NULL)
 		return;
 
-	for (list = dhcp_server->lease_list; list; list = list->next) {
-		struct dhcp_lease *lease = list->data;
+	for (i = 0; i < dhcp_server->expire_heap->len; i++) {
+		struct dhcp_lease *lease = heap_get(dhcp_server, i);
 		dhcp_server->save_lease_func(lease->lease_mac,
 					lease->lease_nip, lease->expire);
 	}
@@ -593,6 +1221,7 @@ static void send_ACK(GDHCPServer *dhcp_server,
 		struct dhcp_packet *client_packet, uint32_t yiaddr)
 {
 	struct dhcp_packet packet;
+	struct dhcp_lease *lease;
 	uint32_t lease_time_sec;
 	struct in_addr addr;
 
@@ -611,7 +1240,9 @@ static void send_ACK(GDHCPServer *dhcp_server,
 
 	send_packet_to_client(dhcp_server, &packet);
 
-	add_lease(dhcp_server, 0, packet.chaddr, packet.yiaddr);
+	lease = add_lease(dhcp_server, 0, packet.chaddr, packet.yiaddr);
+	if (lease != NULL)
+		journal_append(dhcp_server, LEASE_RECORD_ADD, lease);
 }
 
 static void send_NAK(GDHCPServer *dhcp_server,
@@ -753,6 +1384,13 @@ int g_dhcp_server_start(GDHCPServer *dhcp_server)
 	if (dhcp_server->started == TRUE)
 		return 0;
 
+	if (dhcp_server->lease_file != NULL && dhcp_server->journal_fd < 0) {
+		int err = journal_open(dhcp_server);
+		if (err < 0)
+			debug(dhcp_server, "Can not open lease journal %s: %s",
+					dhcp_server->lease_file, strerror(-err));
+	}
+
 	listener_sockfd = dhcp_l3_socket(SERVER_PORT,
 				dhcp_server->interface);
 	if (listener_sockfd < 0)
@@ -831,6 +1469,10 @@ void g_dhcp_server_stop(GDHCPServer *dhcp_server)
 	/* Save leases, before stop; load them before start */
 	save_lease(dhcp_server);
 
+	if (dhcp_server->journal_addr != NULL)
+		msync(dhcp_server->journal_addr, dhcp_server->journal_len,
+								MS_SYNC);
+
 	if (dhcp_server->listener_watch > 0) {
 		g_source_remove(dhcp_server->listener_watch);
 		dhcp_server->listener_watch = 0;
@@ -853,8 +1495,11 @@ void g_dhcp_server_unref(GDHCPServer *dhcp_server)
 
 	g_hash_table_destroy(dhcp_server->option_hash);
 
+	journal_close(dhcp_server);
+
 	destroy_lease_table(dhcp_server);
 
+	g_free(dhcp_server->lease_file);
 	g_free(dhcp_server->interface);
 
 	g_free(dhcp_server);
@@ -863,7 +1508,11 @@ void g_dhcp_server_unref(GDHCPServer *dhcp_server)
 void g_dhcp_server_load_lease(GDHCPServer *dhcp_server, unsigned int expire,
 				unsigned char *mac, unsigned int lease_ip)
 {
-	add_lease(dhcp_server, expire, mac, lease_ip);
+	struct dhcp_lease *lease;
+
+	lease = add_lease(dhcp_server, expire, mac, lease_ip);
+	if (lease != NULL)
+		journal_append(dhcp_server, LEASE_RECORD_ADD, lease);
 }
 
 int g_dhcp_server_set_ip_range(GDHCPServer *dhcp_server,
@@ -881,6 +1530,22 @@ int g_dhcp_server_set_ip_range(GDHCPServer *dhcp_server,
 
 	dhcp_server->end_ip = ntohl(_host_addr.s_addr);
 
+	return create_addr_map(dhcp_server);
+}
+
+int g_dhcp_server_set_lease_file(GDHCPServer *dhcp_server, const char *path)
+{
+	if (dhcp_server == NULL)
+		return -EINVAL;
+
+	if (dhcp_server->started == TRUE)
+		return -EBUSY;
+
+	journal_close(dhcp_server);
+
+	g_free(dhcp_server->lease_file);
+	dhcp_server->lease_file = g_strdup(path);
+
 	return 0;
 }
 
@@ -27,6 +27,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <dbus/dbus.h>
+#include <glib.h>
 
 #include "dbus.h"
 
@@ -34,11 +35,75 @@
 
 static DBusConnection *connection;
 
+/* Signal handlers by interface, and within that by member */
+static GHashTable *signal_table;
+
 void supplicant_dbus_setup(DBusConnection *conn)
 {
 	connection = conn;
 }
 
+/*
+ * The map must stay around until supplicant_dbus_signal_unregister(),
+ * its strings are used as keys without copying them.
+ */
+void supplicant_dbus_signal_register(const struct supplicant_dbus_signal *map)
+{
+	supplicant_dbus_signal_unregister();
+
+	signal_table = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+					(GDestroyNotify) g_hash_table_destroy);
+
+	for (; map->interface != NULL; map++) {
+		GHashTable *members;
+
+		members = g_hash_table_lookup(signal_table, map->interface);
+		if (members == NULL) {
+			members = g_hash_table_new(g_str_hash, g_str_equal);
+			g_hash_table_replace(signal_table,
+					(gpointer) map->interface, members);
+		}
+
+		g_hash_table_replace(members, (gpointer) map->member,
+						(gpointer) map->function);
+	}
+}
+
+void supplicant_dbus_signal_unregister(void)
+{
+	if (signal_table == NULL)
+		return;
+
+	g_hash_table_destroy(signal_table);
+	signal_table = NULL;
+}
+
+/* Returns the handler for a signal, or NULL if it is none of ours */
+supplicant_dbus_signal_function supplicant_dbus_signal_lookup(
+							DBusMessage *message)
+{
+	GHashTable *members;
+	const char *interface, *member;
+
+	if (signal_table == NULL)
+		return NULL;
+
+	if (dbus_message_get_type(message) != DBUS_MESSAGE_TYPE_SIGNAL)
+		return NULL;
+
+	interface = dbus_message_get_interface(message);
+	member = dbus_message_get_member(message);
+	if (interface == NULL || member == NULL)
+		return NULL;
+
+	members = g_hash_table_lookup(signal_table, interface);
+	if (members == NULL)
+		return NULL;
+
+	return (supplicant_dbus_signal_function) g_hash_table_lookup(members,
+								member);
+}
+
 void supplicant_dbus_array_foreach(DBusMessageIter *iter,
 				supplicant_dbus_array_function function,
 							void *user_data)
@@ -191,10 +256,10 @@ static void property_get_reply(DBusPendingCall *call, void *user_data)
 	reply = dbus_pending_call_steal_reply(call);
 
 	if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR)
-		goto done;
+		goto error;
 
 	if (dbus_message_iter_init(reply, &iter) == FALSE)
-		goto done;
+		goto error;
 
 	if (dbus_message_iter_get_arg_type(&iter) == DBUS_TYPE_VARIANT) {
 		DBusMessageIter variant;
@@ -203,7 +268,15 @@ static void property_get_reply(DBusPendingCall *call, void *user_data)
 
 		if (data->function != NULL)
 			data->function(NULL, &variant, data->user_data);
+
+		goto done;
 	}
+
+error:
+	/* The caller still gets to finish what it was waiting for */
+	if (data->function != NULL)
+		data->function(NULL, NULL, data->user_data);
+
 done:
 	dbus_message_unref(reply);
 
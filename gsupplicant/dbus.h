@@ -37,8 +37,22 @@ typedef void (*supplicant_dbus_setup_function) (DBusMessageIter *iter,
 typedef void (*supplicant_dbus_result_function) (const char *error,
 				DBusMessageIter *iter, void *user_data);
 
+typedef void (*supplicant_dbus_signal_function) (const char *path,
+							DBusMessageIter *iter);
+
+struct supplicant_dbus_signal {
+	const char *interface;
+	const char *member;
+	supplicant_dbus_signal_function function;
+};
+
 void supplicant_dbus_setup(DBusConnection *conn);
 
+void supplicant_dbus_signal_register(const struct supplicant_dbus_signal *map);
+void supplicant_dbus_signal_unregister(void);
+supplicant_dbus_signal_function supplicant_dbus_signal_lookup(
+							DBusMessage *message);
+
 void supplicant_dbus_array_foreach(DBusMessageIter *iter,
 				supplicant_dbus_array_function function,
 							void *user_data);
@@ -138,6 +138,9 @@ int g_supplicant_set_country(const char *alpha2,
 				GSupplicantCountryCallback callback,
 						const void *user_data);
 
+void g_supplicant_set_signal_filter(unsigned int weight,
+				unsigned int hysteresis, unsigned int interval);
+
 /* Interface API */
 struct _GSupplicantInterface;
 
@@ -210,6 +213,8 @@ struct _GSupplicantCallbacks {
 	void (*scan_started) (GSupplicantInterface *interface);
 	void (*scan_finished) (GSupplicantInterface *interface);
 	void (*network_added) (GSupplicantNetwork *network);
+	void (*networks_added) (GSupplicantInterface *interface,
+					GSList *networks);
 	void (*network_removed) (GSupplicantNetwork *network);
 	void (*network_changed) (GSupplicantNetwork *network,
 					const char *property);
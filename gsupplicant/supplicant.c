@@ -30,6 +30,7 @@
 #include <stdint.h>
 #include <syslog.h>
 #include <ctype.h>
+#include <time.h>
 
 #include <glib.h>
 #include <gdbus.h>
@@ -43,6 +44,8 @@
 #define IEEE80211_CAP_IBSS	0x0002
 #define IEEE80211_CAP_PRIVACY	0x0010
 
+#define SIGNAL_SCALE		16
+
 static DBusConnection *connection;
 
 static const GSupplicantCallbacks *callbacks_pointer;
@@ -60,6 +63,10 @@ static const char *debug_strings[] = {
 
 static unsigned int eap_methods;
 
+static unsigned int signal_weight = 1;
+static unsigned int signal_hysteresis = 0;
+static unsigned int signal_interval = 0;
+
 struct strvalmap {
 	const char *str;
 	unsigned int val;
@@ -136,6 +143,7 @@ static struct strvalmap mode_capa_map[] = {
 
 static GHashTable *interface_table;
 static GHashTable *bss_mapping;
+static GHashTable *path_table;
 
 struct _GSupplicantWpsCredentials {
 	unsigned char ssid[32];
@@ -167,6 +175,8 @@ struct _GSupplicantInterface {
 	GHashTable *network_table;
 	GHashTable *net_mapping;
 	GHashTable *bss_mapping;
+	GHashTable *scan_networks;
+	GSList *scan_list;
 	void *data;
 };
 
@@ -187,6 +197,7 @@ struct g_supplicant_bss {
 	dbus_bool_t privacy;
 	dbus_bool_t psk;
 	dbus_bool_t ieee8021x;
+	guint heap_index;
 };
 
 struct _GSupplicantNetwork {
@@ -197,7 +208,12 @@ struct _GSupplicantNetwork {
 	unsigned char ssid[32];
 	unsigned int ssid_len;
 	dbus_int16_t signal;
+	int signal_avg;
+	guint64 signal_reported;
+	guint signal_timeout;
+	unsigned int signal_suppressed;
 	struct g_supplicant_bss *best_bss;
+	GPtrArray *bss_heap;
 	GSupplicantMode mode;
 	GSupplicantSecurity security;
 	dbus_bool_t wps;
@@ -397,6 +413,26 @@ static void callback_network_added(GSupplicantNetwork *network)
 	callbacks_pointer->network_added(network);
 }
 
+static void callback_networks_added(GSupplicantInterface *interface,
+							GSList *networks)
+{
+	GSList *list;
+
+	if (callbacks_pointer == NULL)
+		return;
+
+	if (callbacks_pointer->networks_added != NULL) {
+		callbacks_pointer->networks_added(interface, networks);
+		return;
+	}
+
+	if (callbacks_pointer->network_added == NULL)
+		return;
+
+	for (list = networks; list != NULL; list = list->next)
+		callbacks_pointer->network_added(list->data);
+}
+
 static void callback_network_removed(GSupplicantNetwork *network)
 {
 	if (callbacks_pointer == NULL)
@@ -420,6 +456,69 @@ static void callback_network_changed(GSupplicantNetwork *network,
 	callbacks_pointer->network_changed(network, property);
 }
 
+/*
+ * Object paths of interfaces and BSSs are interned, so the tables keyed
+ * by them compare pointers instead of hashing strings again. A path that
+ * is not interned is not a key of any of them.
+ */
+struct supplicant_path {
+	char *path;
+	unsigned int refcount;
+};
+
+static void free_path(gpointer data)
+{
+	struct supplicant_path *entry = data;
+
+	g_free(entry->path);
+	g_free(entry);
+}
+
+static char *path_ref(const char *path)
+{
+	struct supplicant_path *entry;
+
+	entry = g_hash_table_lookup(path_table, path);
+	if (entry == NULL) {
+		entry = g_new0(struct supplicant_path, 1);
+		entry->path = g_strdup(path);
+		g_hash_table_replace(path_table, entry->path, entry);
+	}
+
+	entry->refcount++;
+
+	return entry->path;
+}
+
+static void path_unref(const char *path)
+{
+	struct supplicant_path *entry;
+
+	if (path_table == NULL || path == NULL)
+		return;
+
+	entry = g_hash_table_lookup(path_table, path);
+	if (entry == NULL)
+		return;
+
+	if (--entry->refcount == 0)
+		g_hash_table_remove(path_table, path);
+}
+
+static const char *path_lookup(const char *path)
+{
+	struct supplicant_path *entry;
+
+	if (path_table == NULL || path == NULL)
+		return NULL;
+
+	entry = g_hash_table_lookup(path_table, path);
+	if (entry == NULL)
+		return NULL;
+
+	return entry->path;
+}
+
 static void remove_interface(gpointer data)
 {
 	GSupplicantInterface *interface = data;
@@ -427,11 +526,13 @@ static void remove_interface(gpointer data)
 	g_hash_table_destroy(interface->bss_mapping);
 	g_hash_table_destroy(interface->net_mapping);
 	g_hash_table_destroy(interface->network_table);
+	g_hash_table_destroy(interface->scan_networks);
+	g_slist_free(interface->scan_list);
 
 	callback_interface_removed(interface);
 
 	g_free(interface->wps_cred.key);
-	g_free(interface->path);
+	path_unref(interface->path);
 	g_free(interface->network_path);
 	g_free(interface->ifname);
 	g_free(interface->driver);
@@ -442,7 +543,17 @@ static void remove_interface(gpointer data)
 static void remove_network(gpointer data)
 {
 	GSupplicantNetwork *network = data;
+	GSupplicantInterface *interface = network->interface;
+
+	if (g_hash_table_remove(interface->scan_networks,
+						network->group) == TRUE)
+		interface->scan_list = g_slist_remove(interface->scan_list,
+								network);
 
+	if (network->signal_timeout > 0)
+		g_source_remove(network->signal_timeout);
+
+	g_ptr_array_free(network->bss_heap, TRUE);
 	g_hash_table_destroy(network->bss_table);
 
 	callback_network_removed(network);
@@ -459,7 +570,11 @@ static void remove_bss(gpointer data)
 {
 	struct g_supplicant_bss *bss = data;
 
-	g_free(bss->path);
+	/* The path may be interned again for another object */
+	if (bss_mapping != NULL)
+		g_hash_table_remove(bss_mapping, bss->path);
+
+	path_unref(bss->path);
 	g_free(bss);
 }
 
@@ -1010,10 +1125,222 @@ static char *create_group(struct g_supplicant_bss *bss)
 	return g_string_free(str, FALSE);
 }
 
+/*
+ * Networks seen while a scan is in progress are collected and handed
+ * to the plugin in one go once the scan is done, instead of one by one
+ * for every BSS that shows up.
+ */
+static void scan_network_queue(GSupplicantInterface *interface,
+					GSupplicantNetwork *network)
+{
+	if (g_hash_table_lookup(interface->scan_networks,
+						network->group) != NULL)
+		return;
+
+	g_hash_table_replace(interface->scan_networks,
+						network->group, network);
+	interface->scan_list = g_slist_prepend(interface->scan_list, network);
+}
+
+static void scan_network_flush(GSupplicantInterface *interface)
+{
+	GSList *networks;
+
+	networks = g_slist_reverse(interface->scan_list);
+	interface->scan_list = NULL;
+
+	g_hash_table_remove_all(interface->scan_networks);
+
+	SUPPLICANT_DBG("%d networks", g_slist_length(networks));
+
+	if (networks != NULL)
+		callback_networks_added(interface, networks);
+
+	g_slist_free(networks);
+}
+
+/*
+ * The BSSs of a network are kept in a binary max-heap ordered by
+ * signal, so the best BSS is always at the top and a signal change
+ * only moves one BSS along one path of the heap.
+ */
+static void bss_heap_set(GSupplicantNetwork *network, guint index,
+					struct g_supplicant_bss *bss)
+{
+	network->bss_heap->pdata[index] = bss;
+	bss->heap_index = index;
+}
+
+static struct g_supplicant_bss *bss_heap_get(GSupplicantNetwork *network,
+							guint index)
+{
+	return g_ptr_array_index(network->bss_heap, index);
+}
+
+static void bss_heap_sift_up(GSupplicantNetwork *network, guint index)
+{
+	struct g_supplicant_bss *bss = bss_heap_get(network, index);
+
+	while (index > 0) {
+		guint parent = (index - 1) / 2;
+		struct g_supplicant_bss *above = bss_heap_get(network, parent);
+
+		if (above->signal >= bss->signal)
+			break;
+
+		bss_heap_set(network, index, above);
+		index = parent;
+	}
+
+	bss_heap_set(network, index, bss);
+}
+
+static void bss_heap_sift_down(GSupplicantNetwork *network, guint index)
+{
+	struct g_supplicant_bss *bss = bss_heap_get(network, index);
+	guint len = network->bss_heap->len;
+
+	while (index * 2 + 1 < len) {
+		guint child = index * 2 + 1;
+		struct g_supplicant_bss *below = bss_heap_get(network, child);
+
+		if (child + 1 < len &&
+				bss_heap_get(network, child + 1)->signal >
+								below->signal)
+			below = bss_heap_get(network, ++child);
+
+		if (bss->signal >= below->signal)
+			break;
+
+		bss_heap_set(network, index, below);
+		index = child;
+	}
+
+	bss_heap_set(network, index, bss);
+}
+
+static void bss_heap_update(GSupplicantNetwork *network, guint index)
+{
+	if (index > 0 && bss_heap_get(network, (index - 1) / 2)->signal <
+					bss_heap_get(network, index)->signal)
+		bss_heap_sift_up(network, index);
+	else
+		bss_heap_sift_down(network, index);
+}
+
+static void bss_heap_insert(GSupplicantNetwork *network,
+					struct g_supplicant_bss *bss)
+{
+	g_ptr_array_add(network->bss_heap, bss);
+	bss_heap_sift_up(network, network->bss_heap->len - 1);
+}
+
+static void bss_heap_remove(GSupplicantNetwork *network,
+					struct g_supplicant_bss *bss)
+{
+	guint index = bss->heap_index;
+
+	/* The last BSS takes the place of the removed one */
+	g_ptr_array_remove_index_fast(network->bss_heap, index);
+
+	if (index < network->bss_heap->len)
+		bss_heap_update(network, index);
+}
+
+static guint64 signal_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (guint64) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static dbus_int16_t signal_average(GSupplicantNetwork *network)
+{
+	int avg = network->signal_avg;
+
+	if (avg < 0)
+		return -((-avg + SIGNAL_SCALE / 2) / SIGNAL_SCALE);
+
+	return (avg + SIGNAL_SCALE / 2) / SIGNAL_SCALE;
+}
+
+static gboolean network_signal_timeout(gpointer user_data);
+
+/*
+ * The smoothed signal is only reported once it moved by at least
+ * signal_hysteresis dB, and not more often than every signal_interval
+ * milliseconds. A change that comes too early is reported when the
+ * interval is over.
+ */
+static void report_network_signal(GSupplicantNetwork *network)
+{
+	dbus_int16_t signal = signal_average(network);
+	guint64 now;
+
+	if (signal == network->signal)
+		return;
+
+	if ((unsigned int) abs(signal - network->signal) < signal_hysteresis) {
+		network->signal_suppressed++;
+		return;
+	}
+
+	now = signal_time();
+
+	if (now - network->signal_reported < signal_interval) {
+		network->signal_suppressed++;
+
+		if (network->signal_timeout == 0)
+			network->signal_timeout = g_timeout_add(signal_interval -
+					(now - network->signal_reported),
+					network_signal_timeout, network);
+		return;
+	}
+
+	network->signal = signal;
+	network->signal_reported = now;
+
+	SUPPLICANT_DBG("New network signal for %s %d dBm (%u suppressed)",
+			network->name, signal, network->signal_suppressed);
+
+	callback_network_changed(network, "Signal");
+}
+
+static gboolean network_signal_timeout(gpointer user_data)
+{
+	GSupplicantNetwork *network = user_data;
+
+	network->signal_timeout = 0;
+
+	report_network_signal(network);
+
+	return FALSE;
+}
+
+/* Feeds the signal of the best BSS into the average */
+static void update_network_signal(GSupplicantNetwork *network)
+{
+	struct g_supplicant_bss *best;
+
+	if (network->bss_heap->len == 0)
+		return;
+
+	best = bss_heap_get(network, 0);
+	network->best_bss = best;
+
+	network->signal_avg += (best->signal * SIGNAL_SCALE -
+				network->signal_avg) / signal_weight;
+
+	report_network_signal(network);
+}
+
 static void add_bss_to_network(struct g_supplicant_bss *bss)
 {
 	GSupplicantInterface *interface = bss->interface;
 	GSupplicantNetwork *network;
+	struct g_supplicant_bss *old;
 	char *group;
 
 	group = create_group(bss);
@@ -1042,14 +1369,16 @@ static void add_bss_to_network(struct g_supplicant_bss *bss)
 	network->ssid_len = bss->ssid_len;
 	memcpy(network->ssid, bss->ssid, bss->ssid_len);
 	network->signal = bss->signal;
+	network->signal_avg = bss->signal * SIGNAL_SCALE;
 	network->best_bss = bss;
+	network->bss_heap = g_ptr_array_new();
 
 	network->wps = FALSE;
 	if ((bss->keymgmt & G_SUPPLICANT_KEYMGMT_WPS) != 0)
 		network->wps = TRUE;
 
-	network->bss_table = g_hash_table_new_full(g_str_hash, g_str_equal,
-							NULL, remove_bss);
+	network->bss_table = g_hash_table_new_full(g_direct_hash,
+					g_direct_equal, NULL, remove_bss);
 
 	network->config_table = g_hash_table_new_full(g_str_hash, g_str_equal,
 							g_free, g_free);
@@ -1057,14 +1386,24 @@ static void add_bss_to_network(struct g_supplicant_bss *bss)
 	g_hash_table_replace(interface->network_table,
 						network->group, network);
 
-	callback_network_added(network);
+	/* Announced together with the scan results */
+	if (interface->scan_callback != NULL)
+		scan_network_queue(interface, network);
+	else
+		callback_network_added(network);
 
 done:
-	if (bss->signal > network->signal) {
-		network->signal = bss->signal;
-		network->best_bss = bss;
-		callback_network_changed(network, "Signal");
-	}
+	/* A BSS that was announced twice replaces the earlier copy */
+	old = g_hash_table_lookup(network->bss_table, bss->path);
+	if (old != NULL)
+		bss_heap_remove(network, old);
+
+	bss_heap_insert(network, bss);
+
+	if (network->best_bss == old ||
+			(bss != network->best_bss &&
+				bss_heap_get(network, 0) == bss))
+		update_network_signal(network);
 
 	g_hash_table_replace(interface->bss_mapping, bss->path, network);
 	g_hash_table_replace(network->bss_table, bss->path, bss);
@@ -1360,9 +1699,11 @@ static struct g_supplicant_bss *interface_bss_added(DBusMessageIter *iter,
 
 	SUPPLICANT_DBG("%s", path);
 
-	network = g_hash_table_lookup(interface->bss_mapping, path);
+	network = g_hash_table_lookup(interface->bss_mapping,
+						path_lookup(path));
 	if (network != NULL) {
-		bss = g_hash_table_lookup(network->bss_table, path);
+		bss = g_hash_table_lookup(network->bss_table,
+						path_lookup(path));
 		if (bss != NULL)
 			return NULL;
 	}
@@ -1372,7 +1713,7 @@ static struct g_supplicant_bss *interface_bss_added(DBusMessageIter *iter,
 		return NULL;
 
 	bss->interface = interface;
-	bss->path = g_strdup(path);
+	bss->path = path_ref(path);
 
 	return bss;
 }
@@ -1413,36 +1754,16 @@ static void interface_bss_added_without_keys(DBusMessageIter *iter,
 							bss_property, bss);
 }
 
-static void update_signal(gpointer key, gpointer value,
-						gpointer user_data)
-{
-	struct g_supplicant_bss *bss = value;
-	GSupplicantNetwork *network = user_data;
-
-	if (bss->signal > network->signal) {
-		network->signal = bss->signal;
-		network->best_bss = bss;
-	}
-}
-
-static void update_network_signal(GSupplicantNetwork *network)
-{
-	if (g_hash_table_size(network->bss_table) <= 1)
-		return;
-
-	g_hash_table_foreach(network->bss_table,
-				update_signal, network);
-
-	SUPPLICANT_DBG("New network signal %d", network->signal);
-}
-
 static void interface_bss_removed(DBusMessageIter *iter, void *user_data)
 {
 	GSupplicantInterface *interface = user_data;
 	GSupplicantNetwork *network;
+	struct g_supplicant_bss *bss;
 	const char *path = NULL;
 
 	dbus_message_iter_get_basic(iter, &path);
+
+	path = path_lookup(path);
 	if (path == NULL)
 		return;
 
@@ -1450,15 +1771,22 @@ static void interface_bss_removed(DBusMessageIter *iter, void *user_data)
 	if (network == NULL)
 		return;
 
+	bss = g_hash_table_lookup(network->bss_table, path);
+	if (bss != NULL)
+		bss_heap_remove(network, bss);
+
 	g_hash_table_remove(bss_mapping, path);
 
 	g_hash_table_remove(interface->bss_mapping, path);
 	g_hash_table_remove(network->bss_table, path);
 
-	update_network_signal(network);
-
-	if (g_hash_table_size(network->bss_table) == 0)
+	if (g_hash_table_size(network->bss_table) == 0) {
 		g_hash_table_remove(interface->network_table, network->group);
+		return;
+	}
+
+	if (bss == network->best_bss)
+		update_network_signal(network);
 }
 
 static void interface_property(const char *key, DBusMessageIter *iter,
@@ -1582,9 +1910,10 @@ static void scan_network_update(DBusMessageIter *iter, void *user_data)
 		return;
 
 	/* Update the network details based on scan BSS data */
-	network = g_hash_table_lookup(interface->bss_mapping, path);
+	network = g_hash_table_lookup(interface->bss_mapping,
+						path_lookup(path));
 	if (network != NULL)
-		callback_network_added(network);
+		scan_network_queue(interface, network);
 }
 
 static void scan_bss_data(const char *key, DBusMessageIter *iter,
@@ -1596,8 +1925,12 @@ static void scan_bss_data(const char *key, DBusMessageIter *iter,
 		supplicant_dbus_array_foreach(iter, scan_network_update,
 						interface);
 
+	scan_network_flush(interface);
+
+	/* Without the list it is unknown which networks are still around */
 	if (interface->scan_callback != NULL)
-		interface->scan_callback(0, interface, interface->scan_data);
+		interface->scan_callback(iter != NULL ? 0 : -EIO, interface,
+							interface->scan_data);
 
 	interface->scan_callback = NULL;
 	interface->scan_data = NULL;
@@ -1611,15 +1944,17 @@ static GSupplicantInterface *interface_alloc(const char *path)
 	if (interface == NULL)
 		return NULL;
 
-	interface->path = g_strdup(path);
+	interface->path = path_ref(path);
 
 	interface->network_table = g_hash_table_new_full(g_str_hash,
 					g_str_equal, NULL, remove_network);
 
 	interface->net_mapping = g_hash_table_new_full(g_str_hash, g_str_equal,
 								NULL, NULL);
-	interface->bss_mapping = g_hash_table_new_full(g_str_hash, g_str_equal,
-								NULL, NULL);
+	interface->bss_mapping = g_hash_table_new_full(g_direct_hash,
+						g_direct_equal, NULL, NULL);
+	interface->scan_networks = g_hash_table_new_full(g_str_hash,
+						g_str_equal, NULL, NULL);
 
 	g_hash_table_replace(interface_table, interface->path, interface);
 
@@ -1640,7 +1975,7 @@ static void interface_added(DBusMessageIter *iter, void *user_data)
 	if (g_strcmp0(path, "/") == 0)
 		return;
 
-	interface = g_hash_table_lookup(interface_table, path);
+	interface = g_hash_table_lookup(interface_table, path_lookup(path));
 	if (interface != NULL)
 		return;
 
@@ -1669,7 +2004,7 @@ static void interface_removed(DBusMessageIter *iter, void *user_data)
 	if (path == NULL)
 		return;
 
-	g_hash_table_remove(interface_table, path);
+	g_hash_table_remove(interface_table, path_lookup(path));
 }
 
 static void eap_method(DBusMessageIter *iter, void *user_data)
@@ -1824,6 +2159,8 @@ static void signal_scan_done(const char *path, DBusMessageIter *iter)
 	 * and update the network details accordingly
 	 */
 	if (success == FALSE) {
+		scan_network_flush(interface);
+
 		if (interface->scan_callback != NULL)
 			interface->scan_callback(-EIO, interface,
 						interface->scan_data);
@@ -1895,6 +2232,7 @@ static void signal_bss_changed(const char *path, DBusMessageIter *iter)
 	GSupplicantInterface *interface;
 	GSupplicantNetwork *network;
 	struct g_supplicant_bss *bss;
+	dbus_int16_t signal;
 
 	SUPPLICANT_DBG("");
 
@@ -1910,28 +2248,20 @@ static void signal_bss_changed(const char *path, DBusMessageIter *iter)
 	if (bss == NULL)
 		return;
 
+	signal = bss->signal;
+
 	supplicant_dbus_property_foreach(iter, bss_property, bss);
 
-	if (bss->signal == network->signal)
+	if (bss->signal == signal)
 		return;
 
-	/*
-	 * If the new signal is lower than the SSID signal, we need
-	 * to check for the new maximum.
-	 */
-	if (bss->signal < network->signal) {
-		if (bss != network->best_bss)
-			return;
-		network->signal = bss->signal;
-		update_network_signal(network);
-	} else {
-		network->signal = bss->signal;
-		network->best_bss = bss;
-	}
+	bss_heap_update(network, bss->heap_index);
 
-	SUPPLICANT_DBG("New network signal for %s %d dBm", network->ssid, network->signal);
+	/* Only the best BSS, or one that becomes it, moves the network */
+	if (bss != network->best_bss && bss_heap_get(network, 0) != bss)
+		return;
 
-	callback_network_changed(network, "Signal");
+	update_network_signal(network);
 }
 
 static void wps_credentials(const char *key, DBusMessageIter *iter,
@@ -2034,11 +2364,7 @@ static void signal_wps_event(const char *path, DBusMessageIter *iter)
 	supplicant_dbus_property_foreach(iter, wps_event_args, interface);
 }
 
-static struct {
-	const char *interface;
-	const char *member;
-	void (*function) (const char *path, DBusMessageIter *iter);
-} signal_map[] = {
+static const struct supplicant_dbus_signal signal_map[] = {
 	{ DBUS_INTERFACE_DBUS,  "NameOwnerChanged",  signal_name_owner_changed },
 
 	{ SUPPLICANT_INTERFACE, "PropertiesChanged", signal_properties_changed },
@@ -2064,9 +2390,13 @@ static struct {
 static DBusHandlerResult g_supplicant_filter(DBusConnection *conn,
 					DBusMessage *message, void *data)
 {
+	supplicant_dbus_signal_function function;
 	DBusMessageIter iter;
-	const char *path;
-	int i;
+	const char *path, *interned;
+
+	function = supplicant_dbus_signal_lookup(message);
+	if (function == NULL)
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 
 	path = dbus_message_get_path(message);
 	if (path == NULL)
@@ -2075,20 +2405,16 @@ static DBusHandlerResult g_supplicant_filter(DBusConnection *conn,
 	if (dbus_message_iter_init(message, &iter) == FALSE)
 		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 
-	for (i = 0; signal_map[i].interface != NULL; i++) {
-		if (dbus_message_has_interface(message,
-					signal_map[i].interface) == FALSE)
-			continue;
+	/* Lets the handlers look up known paths by pointer */
+	interned = path_lookup(path);
 
-		if (dbus_message_has_member(message,
-					signal_map[i].member) == FALSE)
-			continue;
+	function(interned != NULL ? interned : path, &iter);
 
-		signal_map[i].function(path, &iter);
-		break;
-	}
+	/* Others may watch NameOwnerChanged, but nobody else the supplicant */
+	if (dbus_message_has_interface(message, DBUS_INTERFACE_DBUS) == TRUE)
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 
-	return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+	return DBUS_HANDLER_RESULT_HANDLED;
 }
 
 struct supplicant_regdom {
@@ -2154,6 +2480,22 @@ int g_supplicant_set_country(const char *alpha2,
 						regdom);
 }
 
+/*
+ * Network signal changes are averaged with the given weight, where 1
+ * means no smoothing, and reported once they moved by hysteresis dB
+ * but at most every interval milliseconds.
+ */
+void g_supplicant_set_signal_filter(unsigned int weight,
+				unsigned int hysteresis, unsigned int interval)
+{
+	SUPPLICANT_DBG("weight %u hysteresis %u interval %u",
+					weight, hysteresis, interval);
+
+	signal_weight = weight > 0 ? weight : 1;
+	signal_hysteresis = hysteresis;
+	signal_interval = interval;
+}
+
 struct interface_data {
 	GSupplicantInterface *interface;
 	GSupplicantInterfaceCallback callback;
@@ -2218,7 +2560,8 @@ static void interface_create_result(const char *error,
 		goto done;
 	}
 
-	data->interface = g_hash_table_lookup(interface_table, path);
+	data->interface = g_hash_table_lookup(interface_table,
+							path_lookup(path));
 	if (data->interface == NULL) {
 		data->interface = interface_alloc(path);
 		if (data->interface == NULL) {
@@ -2285,7 +2628,7 @@ static void interface_get_result(const char *error,
 		goto done;
 	}
 
-	interface = g_hash_table_lookup(interface_table, path);
+	interface = g_hash_table_lookup(interface_table, path_lookup(path));
 	if (interface == NULL) {
 		err = -ENOENT;
 		goto done;
@@ -3224,12 +3567,17 @@ int g_supplicant_register(const GSupplicantCallbacks *callbacks)
 	callbacks_pointer = callbacks;
 	eap_methods = 0;
 
-	interface_table = g_hash_table_new_full(g_str_hash, g_str_equal,
+	path_table = g_hash_table_new_full(g_str_hash, g_str_equal,
+							NULL, free_path);
+
+	interface_table = g_hash_table_new_full(g_direct_hash, g_direct_equal,
 						NULL, remove_interface);
 
-	bss_mapping = g_hash_table_new_full(g_str_hash, g_str_equal,
+	bss_mapping = g_hash_table_new_full(g_direct_hash, g_direct_equal,
 								NULL, NULL);
 
+	supplicant_dbus_signal_register(signal_map);
+
 	supplicant_dbus_setup(connection);
 
 	dbus_bus_add_match(connection, g_supplicant_rule0, NULL);
@@ -3306,6 +3654,13 @@ void g_supplicant_unregister(const GSupplicantCallbacks *callbacks)
 		interface_table = NULL;
 	}
 
+	supplicant_dbus_signal_unregister();
+
+	if (path_table != NULL) {
+		g_hash_table_destroy(path_table);
+		path_table = NULL;
+	}
+
 	if (connection != NULL) {
 		dbus_connection_unref(connection);
 		connection = NULL;
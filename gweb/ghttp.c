@@ -0,0 +1,376 @@
+/*
+ *
+ *  Web service library with GLib integration
+ *
+ *  Copyright (C) 2009-2010  Intel Corporation. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <string.h>
+
+#include "ghttp.h"
+
+#define HEADER_INITIAL_SIZE	2048
+#define HEADER_MAX_SIZE		65536
+#define HEADER_MIN_SPACE	512
+
+/*
+ * The response header is read straight into one buffer owned by the
+ * parser and split in place: line ends, colons and trailing blanks are
+ * overwritten with NUL bytes and every field is remembered by offsets,
+ * since the buffer may still move while it grows.
+ */
+struct http_field {
+	gsize name;
+	gsize value;
+	gsize value_len;
+};
+
+struct _GHttpParser {
+	guint8 *buf;
+	gsize size;
+	gsize len;
+	gsize line;
+	gsize scan;
+	gsize body;
+	gboolean done;
+	guint16 status;
+	gboolean http11;
+	GArray *fields;
+	gboolean have_last;
+	GSList *joined;
+};
+
+GHttpParser *g_http_parser_new(void)
+{
+	GHttpParser *parser;
+
+	parser = g_try_new0(GHttpParser, 1);
+	if (parser == NULL)
+		return NULL;
+
+	parser->buf = g_try_malloc(HEADER_INITIAL_SIZE);
+	if (parser->buf == NULL) {
+		g_free(parser);
+		return NULL;
+	}
+
+	parser->size = HEADER_INITIAL_SIZE;
+	parser->fields = g_array_sized_new(FALSE, FALSE,
+					sizeof(struct http_field), 16);
+
+	return parser;
+}
+
+void g_http_parser_free(GHttpParser *parser)
+{
+	GSList *list;
+
+	if (parser == NULL)
+		return;
+
+	for (list = parser->joined; list; list = list->next)
+		g_free(list->data);
+
+	g_slist_free(parser->joined);
+
+	g_array_free(parser->fields, TRUE);
+	g_free(parser->buf);
+	g_free(parser);
+}
+
+/*
+ * Returns where the next read should go. One byte is always held back
+ * so that the data can be NUL terminated after it has been committed.
+ */
+guint8 *g_http_parser_get_space(GHttpParser *parser, gsize *space)
+{
+	if (parser == NULL || parser->done == TRUE)
+		return NULL;
+
+	if (parser->size - parser->len < HEADER_MIN_SPACE) {
+		gsize size = parser->size * 2;
+		guint8 *buf;
+
+		if (size > HEADER_MAX_SIZE)
+			size = HEADER_MAX_SIZE;
+
+		if (size - parser->len < 2)
+			return NULL;
+
+		buf = g_try_realloc(parser->buf, size);
+		if (buf == NULL)
+			return NULL;
+
+		parser->buf = buf;
+		parser->size = size;
+	}
+
+	*space = parser->size - parser->len - 1;
+
+	return parser->buf + parser->len;
+}
+
+static void parse_status(GHttpParser *parser, const char *str)
+{
+	guint16 status = 0;
+	int i;
+
+	parser->http11 = strncmp(str, "HTTP/1.1", 8) == 0 ? TRUE : FALSE;
+
+	while (*str != ' ' && *str != '\0')
+		str++;
+
+	while (*str == ' ')
+		str++;
+
+	for (i = 0; i < 3; i++) {
+		if (str[i] < '0' || str[i] > '9')
+			return;
+
+		status = status * 10 + str[i] - '0';
+	}
+
+	parser->status = status;
+}
+
+static gsize trim_blanks(const char *str, gsize len)
+{
+	while (len > 0 && (str[len - 1] == ' ' || str[len - 1] == '\t'))
+		len--;
+
+	return len;
+}
+
+static void add_field(GHttpParser *parser, char *str, gsize len)
+{
+	struct http_field field;
+	char *colon, *value;
+
+	colon = memchr(str, ':', len);
+	if (colon == NULL)
+		return;
+
+	*colon = '\0';
+
+	value = colon + 1;
+	while (*value == ' ' || *value == '\t')
+		value++;
+
+	field.name = (guint8 *) str - parser->buf;
+	field.value = (guint8 *) value - parser->buf;
+	field.value_len = trim_blanks(value, str + len - value);
+	value[field.value_len] = '\0';
+
+	g_array_append_val(parser->fields, field);
+	parser->have_last = TRUE;
+}
+
+/*
+ * A continuation line is appended to the previous value. The value
+ * always ends before the current line starts, so moving the text down
+ * over the line break never overlaps anything still in use.
+ */
+static void fold_line(GHttpParser *parser, char *str, gsize len)
+{
+	struct http_field *field;
+	char *end;
+
+	if (parser->have_last == FALSE)
+		return;
+
+	field = &g_array_index(parser->fields, struct http_field,
+						parser->fields->len - 1);
+
+	while (len > 0 && (*str == ' ' || *str == '\t')) {
+		str++;
+		len--;
+	}
+
+	len = trim_blanks(str, len);
+
+	end = (char *) parser->buf + field->value + field->value_len;
+	end[0] = ' ';
+	memmove(end + 1, str, len);
+	end[len + 1] = '\0';
+
+	field->value_len += len + 1;
+}
+
+/* Returns TRUE for the empty line that terminates the header */
+static gboolean parse_line(GHttpParser *parser, gsize start, gsize end)
+{
+	char *str = (char *) parser->buf + start;
+	gsize len = end - start;
+
+	if (len > 0 && str[len - 1] == '\r')
+		len--;
+
+	str[len] = '\0';
+
+	if (len == 0)
+		return TRUE;
+
+	if (parser->status == 0 && strncmp(str, "HTTP/", 5) == 0)
+		parse_status(parser, str);
+	else if (str[0] == ' ' || str[0] == '\t')
+		fold_line(parser, str, len);
+	else
+		add_field(parser, str, len);
+
+	return FALSE;
+}
+
+/*
+ * Parses the bytes added by the last read. Only the new bytes are
+ * searched for line ends. Returns 1 once the header is complete, 0 if
+ * more data is needed and a negative error if it can never complete.
+ */
+int g_http_parser_commit(GHttpParser *parser, gsize length)
+{
+	guint8 *pos;
+
+	if (parser == NULL)
+		return -EINVAL;
+
+	if (parser->done == TRUE)
+		return 1;
+
+	parser->len += length;
+	parser->buf[parser->len] = '\0';
+
+	while (parser->scan < parser->len) {
+		gsize end;
+
+		pos = memchr(parser->buf + parser->scan, '\n',
+					parser->len - parser->scan);
+		if (pos == NULL) {
+			parser->scan = parser->len;
+			break;
+		}
+
+		end = pos - parser->buf;
+		parser->scan = end + 1;
+
+		if (parse_line(parser, parser->line, end) == TRUE) {
+			parser->done = TRUE;
+			parser->body = end + 1;
+			return 1;
+		}
+
+		parser->line = end + 1;
+	}
+
+	if (parser->len + 1 >= HEADER_MAX_SIZE)
+		return -E2BIG;
+
+	return 0;
+}
+
+guint16 g_http_parser_get_status(GHttpParser *parser)
+{
+	if (parser == NULL)
+		return 0;
+
+	return parser->status;
+}
+
+gboolean g_http_parser_is_http11(GHttpParser *parser)
+{
+	if (parser == NULL)
+		return FALSE;
+
+	return parser->http11;
+}
+
+/*
+ * Field names are compared case-insensitively. Repeated fields are
+ * reported joined with "; " like before, which is the only case that
+ * needs an allocation.
+ */
+const char *g_http_parser_get_header(GHttpParser *parser, const char *name)
+{
+	GString *joined = NULL;
+	const char *found = NULL;
+	guint i;
+
+	if (parser == NULL || name == NULL)
+		return NULL;
+
+	for (i = 0; i < parser->fields->len; i++) {
+		struct http_field *field = &g_array_index(parser->fields,
+						struct http_field, i);
+		const char *value = (char *) parser->buf + field->value;
+
+		if (g_ascii_strcasecmp((char *) parser->buf + field->name,
+								name) != 0)
+			continue;
+
+		if (found == NULL) {
+			found = value;
+			continue;
+		}
+
+		if (joined == NULL)
+			joined = g_string_new(found);
+
+		g_string_append(joined, "; ");
+		g_string_append(joined, value);
+	}
+
+	if (joined == NULL)
+		return found;
+
+	parser->joined = g_slist_prepend(parser->joined, joined->str);
+	g_string_free(joined, FALSE);
+
+	return parser->joined->data;
+}
+
+void g_http_parser_foreach_header(GHttpParser *parser,
+				GHttpHeaderFunc func, gpointer user_data)
+{
+	guint i;
+
+	if (parser == NULL || func == NULL)
+		return;
+
+	for (i = 0; i < parser->fields->len; i++) {
+		struct http_field *field = &g_array_index(parser->fields,
+						struct http_field, i);
+
+		func((char *) parser->buf + field->name,
+				(char *) parser->buf + field->value, user_data);
+	}
+}
+
+/* Bytes that followed the header in the same read, NUL terminated */
+guint8 *g_http_parser_get_body(GHttpParser *parser, gsize *length)
+{
+	if (parser == NULL || parser->done == FALSE) {
+		*length = 0;
+		return NULL;
+	}
+
+	*length = parser->len - parser->body;
+
+	return parser->buf + parser->body;
+}
@@ -0,0 +1,57 @@
+/*
+ *
+ *  Web service library with GLib integration
+ *
+ *  Copyright (C) 2009-2010  Intel Corporation. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __G_HTTP_H
+#define __G_HTTP_H
+
+#include <glib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct _GHttpParser;
+
+typedef struct _GHttpParser GHttpParser;
+
+typedef void (*GHttpHeaderFunc)(const char *name, const char *value,
+							gpointer user_data);
+
+GHttpParser *g_http_parser_new(void);
+void g_http_parser_free(GHttpParser *parser);
+
+guint8 *g_http_parser_get_space(GHttpParser *parser, gsize *space);
+int g_http_parser_commit(GHttpParser *parser, gsize length);
+
+guint16 g_http_parser_get_status(GHttpParser *parser);
+gboolean g_http_parser_is_http11(GHttpParser *parser);
+
+const char *g_http_parser_get_header(GHttpParser *parser, const char *name);
+void g_http_parser_foreach_header(GHttpParser *parser,
+				GHttpHeaderFunc func, gpointer user_data);
+
+guint8 *g_http_parser_get_body(GHttpParser *parser, gsize *length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __G_HTTP_H */
@@ -28,15 +28,23 @@
 #include <stdarg.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 #include <resolv.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <net/if.h>
+#include <ifaddrs.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <arpa/nameser.h>
 
 #include "gresolv.h"
 
+#define CACHE_SIZE		64
+#define CACHE_MAX_TTL		3600
+#define CACHE_NEGATIVE_TTL	30
+#define SOURCE_CACHE_TTL	30
+
 struct sort_result {
 	int precedence;
 	int src_scope;
@@ -56,6 +64,23 @@ struct sort_result {
 	} dst;
 };
 
+union sockaddr_union {
+	struct sockaddr sa;
+	struct sockaddr_in sin;
+	struct sockaddr_in6 sin6;
+};
+
+struct local_address {
+	int prefixlen;
+	union sockaddr_union addr;
+};
+
+struct default_source {
+	time_t expire;
+	gboolean reachable;
+	union sockaddr_union addr;
+};
+
 struct resolv_query;
 
 struct resolv_lookup {
@@ -71,6 +96,8 @@ struct resolv_lookup {
 	guint ipv4_status;
 	guint ipv6_status;
 
+	guint cache_idle;
+
 	GResolvResultFunc result_func;
 	gpointer result_data;
 };
@@ -81,6 +108,8 @@ struct resolv_query {
 	guint timeout;
 
 	uint16_t msgid;
+	char *name;
+	int type;
 
 	struct resolv_lookup *lookup;
 };
@@ -108,6 +137,14 @@ struct _GResolv {
 	int index;
 	GList *nameserver_list;
 
+	GHashTable *cache;
+	guint cache_size;
+	GResolvCacheStats cache_stats;
+
+	GArray *local_addrs;
+	time_t local_expire;
+	struct default_source default_src[2];
+
 	struct __res_state res;
 
 	GResolvDebugFunc debug_func;
@@ -130,16 +167,221 @@ static inline void debug(GResolv *resolv, const char *format, ...)
 	va_end(ap);
 }
 
+/*
+ * Answers are cached per hostname and record type, positive ones for
+ * their smallest TTL and negative ones (NXDOMAIN or no addresses of
+ * that type) for a short fixed time.
+ */
+struct cache_entry {
+	GResolvResultStatus status;
+	time_t expire;
+	int family;
+	int count;
+	guint8 *addrs;
+};
+
+static time_t cache_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec;
+}
+
+static char *cache_key(const char *hostname, int type)
+{
+	char *name, *key;
+
+	name = g_ascii_strdown(hostname, -1);
+	key = g_strdup_printf("%d:%s", type, name);
+	g_free(name);
+
+	return key;
+}
+
+static void free_cache_entry(gpointer data)
+{
+	struct cache_entry *entry = data;
+
+	g_free(entry->addrs);
+	g_free(entry);
+}
+
+static gboolean cache_entry_expired(gpointer key, gpointer value,
+							gpointer user_data)
+{
+	struct cache_entry *entry = value;
+	time_t *now = user_data;
+
+	return entry->expire <= *now;
+}
+
+static void cache_make_room(GResolv *resolv, time_t now)
+{
+	GHashTableIter iter;
+	gpointer key, value, oldest = NULL;
+	time_t expire = 0;
+
+	resolv->cache_stats.expired += g_hash_table_foreach_remove(
+				resolv->cache, cache_entry_expired, &now);
+
+	if (g_hash_table_size(resolv->cache) < resolv->cache_size)
+		return;
+
+	g_hash_table_iter_init(&iter, resolv->cache);
+
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		struct cache_entry *entry = value;
+
+		if (oldest == NULL || entry->expire < expire) {
+			oldest = key;
+			expire = entry->expire;
+		}
+	}
+
+	if (oldest != NULL) {
+		g_hash_table_remove(resolv->cache, oldest);
+		resolv->cache_stats.evictions++;
+	}
+}
+
+static void cache_store(GResolv *resolv, struct resolv_query *query,
+			GResolvResultStatus status, guint32 ttl,
+			const struct sort_result *results, int count)
+{
+	struct cache_entry *entry;
+	int family, size, i, n = 0;
+	time_t now;
+
+	if (resolv->cache == NULL || query->name == NULL)
+		return;
+
+	if (query->type == ns_t_aaaa) {
+		family = AF_INET6;
+		size = NS_IN6ADDRSZ;
+	} else {
+		family = AF_INET;
+		size = NS_INADDRSZ;
+	}
+
+	for (i = 0; i < count; i++)
+		if (results[i].dst.sa.sa_family == family)
+			n++;
+
+	if (status == G_RESOLV_RESULT_STATUS_SUCCESS && n > 0) {
+		if (ttl > CACHE_MAX_TTL)
+			ttl = CACHE_MAX_TTL;
+	} else if (status == G_RESOLV_RESULT_STATUS_SUCCESS ||
+				status == G_RESOLV_RESULT_STATUS_NAME_ERROR)
+		ttl = CACHE_NEGATIVE_TTL;
+	else
+		return;
+
+	if (ttl == 0)
+		return;
+
+	entry = g_try_new0(struct cache_entry, 1);
+	if (entry == NULL)
+		return;
+
+	entry->addrs = g_try_malloc(n * size + 1);
+	if (entry->addrs == NULL) {
+		g_free(entry);
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		const struct sort_result *res = &results[i];
+
+		if (res->dst.sa.sa_family != family)
+			continue;
+
+		if (family == AF_INET)
+			memcpy(entry->addrs + entry->count * size,
+						&res->dst.sin.sin_addr, size);
+		else
+			memcpy(entry->addrs + entry->count * size,
+						&res->dst.sin6.sin6_addr, size);
+
+		entry->count++;
+	}
+
+	now = cache_time();
+
+	entry->status = status;
+	entry->family = family;
+	entry->expire = now + ttl;
+
+	if (g_hash_table_size(resolv->cache) >= resolv->cache_size)
+		cache_make_room(resolv, now);
+
+	g_hash_table_replace(resolv->cache,
+				cache_key(query->name, query->type), entry);
+}
+
+static void add_result(struct resolv_lookup *lookup, int family,
+							const void *data);
+
+static gboolean cache_lookup(struct resolv_lookup *lookup,
+					const char *hostname, int type)
+{
+	GResolv *resolv = lookup->resolv;
+	struct cache_entry *entry;
+	char *key;
+	int i, size;
+
+	if (resolv->cache == NULL)
+		return FALSE;
+
+	key = cache_key(hostname, type);
+	entry = g_hash_table_lookup(resolv->cache, key);
+
+	if (entry != NULL && entry->expire <= cache_time()) {
+		g_hash_table_remove(resolv->cache, key);
+		resolv->cache_stats.expired++;
+		entry = NULL;
+	}
+
+	g_free(key);
+
+	if (entry == NULL) {
+		resolv->cache_stats.misses++;
+		return FALSE;
+	}
+
+	if (entry->count == 0)
+		resolv->cache_stats.negative_hits++;
+	else
+		resolv->cache_stats.hits++;
+
+	size = entry->family == AF_INET ? NS_INADDRSZ : NS_IN6ADDRSZ;
+
+	for (i = 0; i < entry->count; i++)
+		add_result(lookup, entry->family, entry->addrs + i * size);
+
+	if (type == ns_t_aaaa)
+		lookup->ipv6_status = entry->status;
+	else
+		lookup->ipv4_status = entry->status;
+
+	return TRUE;
+}
+
 static void destroy_query(struct resolv_query *query)
 {
 	if (query->timeout > 0)
 		g_source_remove(query->timeout);
 
+	g_free(query->name);
 	g_free(query);
 }
 
 static void destroy_lookup(struct resolv_lookup *lookup)
 {
+	if (lookup->cache_idle > 0)
+		g_source_remove(lookup->cache_idle);
+
 	if (lookup->ipv4_query != NULL) {
 		g_queue_remove(lookup->resolv->query_queue,
 						lookup->ipv4_query);
@@ -156,30 +398,6 @@ static void destroy_lookup(struct resolv_lookup *lookup)
 	g_free(lookup);
 }
 
-static void find_srcaddr(struct sort_result *res)
-{
-	socklen_t sl = sizeof(res->src);
-	int fd;
-
-	fd = socket(res->dst.sa.sa_family, SOCK_DGRAM | SOCK_CLOEXEC,
-			IPPROTO_IP);
-	if (fd < 0)
-		return;
-
-	if (connect(fd, &res->dst.sa, sizeof(res->dst)) < 0) {
-		close(fd);
-		return;
-	}
-
-	if (getsockname(fd, &res->src.sa, &sl) < 0) {
-		close(fd);
-		return;
-	}
-
-	res->reachable = TRUE;
-	close(fd);
-}
-
 struct gai_table
 {
 	unsigned char addr[NS_IN6ADDRSZ];
@@ -433,13 +651,176 @@ static int rfc3484_compare(const void *__one, const void *__two)
 		return 1;
 }
 
+static int netmask_to_prefixlen(struct sockaddr *sa)
+{
+	const unsigned char *mask;
+	int i, len, prefixlen = 0;
+
+	if (sa->sa_family == AF_INET) {
+		mask = (void *) &((struct sockaddr_in *) sa)->sin_addr;
+		len = NS_INADDRSZ;
+	} else {
+		mask = (void *) &((struct sockaddr_in6 *) sa)->sin6_addr;
+		len = NS_IN6ADDRSZ;
+	}
+
+	for (i = 0; i < len; i++) {
+		unsigned char bits = mask[i];
+
+		while (bits & 0x80) {
+			prefixlen++;
+			bits <<= 1;
+		}
+
+		if (mask[i] != 0xff)
+			break;
+	}
+
+	return prefixlen;
+}
+
+static void refresh_local_addrs(GResolv *resolv, time_t now)
+{
+	struct ifaddrs *ifaddr, *ifa;
+
+	debug(resolv, "refreshing local addresses");
+
+	g_array_set_size(resolv->local_addrs, 0);
+
+	memset(resolv->default_src, 0, sizeof(resolv->default_src));
+	resolv->local_expire = now + SOURCE_CACHE_TTL;
+
+	if (getifaddrs(&ifaddr) < 0)
+		return;
+
+	for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
+		struct local_address local;
+
+		if (ifa->ifa_addr == NULL || ifa->ifa_netmask == NULL)
+			continue;
+
+		if (!(ifa->ifa_flags & IFF_UP))
+			continue;
+
+		memset(&local, 0, sizeof(local));
+
+		if (ifa->ifa_addr->sa_family == AF_INET)
+			memcpy(&local.addr.sin, ifa->ifa_addr,
+						sizeof(struct sockaddr_in));
+		else if (ifa->ifa_addr->sa_family == AF_INET6)
+			memcpy(&local.addr.sin6, ifa->ifa_addr,
+						sizeof(struct sockaddr_in6));
+		else
+			continue;
+
+		local.prefixlen = netmask_to_prefixlen(ifa->ifa_netmask);
+
+		g_array_append_val(resolv->local_addrs, local);
+	}
+
+	freeifaddrs(ifaddr);
+}
+
+static const unsigned char *sockaddr_bytes(const union sockaddr_union *addr)
+{
+	if (addr->sa.sa_family == AF_INET)
+		return (const unsigned char *) &addr->sin.sin_addr;
+
+	return (const unsigned char *) &addr->sin6.sin6_addr;
+}
+
+/*
+ * Asks the kernel which source address it would use to reach the
+ * destination. This costs a socket, connect, getsockname and close.
+ */
+static gboolean route_srcaddr(const struct sockaddr *dst,
+						union sockaddr_union *src)
+{
+	socklen_t sl = sizeof(*src);
+	int fd;
+
+	fd = socket(dst->sa_family, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_IP);
+	if (fd < 0)
+		return FALSE;
+
+	if (connect(fd, dst, sizeof(union sockaddr_union)) < 0 ||
+				getsockname(fd, &src->sa, &sl) < 0) {
+		close(fd);
+		return FALSE;
+	}
+
+	close(fd);
+
+	return TRUE;
+}
+
+/*
+ * Destinations on a local subnet are reached from the address on that
+ * subnet, all others through the default route. Both come from a view
+ * of the local addresses that is refreshed every SOURCE_CACHE_TTL
+ * seconds or when the cache is flushed, and the kernel is asked for
+ * the default route source only once per family in that time. Sorting
+ * a large answer set is then done in memory.
+ */
+static void find_srcaddr(GResolv *resolv, struct sort_result *res)
+{
+	const struct local_address *best = NULL;
+	struct default_source *def;
+	const unsigned char *dst;
+	time_t now = cache_time();
+	guint i;
+
+	if (resolv->local_expire <= now)
+		refresh_local_addrs(resolv, now);
+
+	dst = sockaddr_bytes((union sockaddr_union *) &res->dst);
+
+	for (i = 0; i < resolv->local_addrs->len; i++) {
+		const struct local_address *local = &g_array_index(
+				resolv->local_addrs, struct local_address, i);
+
+		if (local->addr.sa.sa_family != res->dst.sa.sa_family)
+			continue;
+
+		if (best != NULL && best->prefixlen >= local->prefixlen)
+			continue;
+
+		if (mask_compare(dst, sockaddr_bytes(&local->addr),
+						local->prefixlen) == TRUE)
+			best = local;
+	}
+
+	if (best != NULL) {
+		memcpy(&res->src, &best->addr, sizeof(res->src));
+		res->reachable = TRUE;
+		return;
+	}
+
+	def = &resolv->default_src[res->dst.sa.sa_family == AF_INET6];
+
+	if (def->expire <= now) {
+		def->reachable = route_srcaddr(&res->dst.sa, &def->addr);
+		def->expire = now + SOURCE_CACHE_TTL;
+
+		debug(resolv, "default route for family %d %s",
+					res->dst.sa.sa_family,
+					def->reachable ? "found" : "missing");
+	}
+
+	if (def->reachable == FALSE)
+		return;
+
+	memcpy(&res->src, &def->addr, sizeof(res->src));
+	res->reachable = TRUE;
+}
+
 static void rfc3484_sort_results(struct resolv_lookup *lookup)
 {
 	int i;
 
 	for (i = 0; i < lookup->nr_results; i++) {
 		struct sort_result *res = &lookup->results[i];
-		find_srcaddr(res);
+		find_srcaddr(lookup->resolv, res);
 		res->precedence = match_gai_table(&res->dst.sa,
 							gai_precedences);
 		res->dst_label = match_gai_table(&res->dst.sa, gai_labels);
@@ -628,7 +1009,8 @@ static void parse_response(struct resolv_nameserver *nameserver,
 	GList *list;
 	ns_msg msg;
 	ns_rr rr;
-	int i, rcode, count;
+	guint32 ttl = G_MAXUINT32;
+	int i, rcode, count, first;
 
 	debug(resolv, "response from %s", nameserver->address);
 
@@ -680,12 +1062,18 @@ static void parse_response(struct resolv_nameserver *nameserver,
 		lookup->ipv4_query = NULL;
 	}
 
+	first = lookup->nr_results;
+
 	for (i = 0; i < count; i++) {
 		ns_parserr(&msg, ns_s_an, i, &rr);
 
 		if (ns_rr_class(rr) != ns_c_in)
 			continue;
 
+		if ((int) ns_rr_type(rr) == query->type &&
+						ns_rr_ttl(rr) < ttl)
+			ttl = ns_rr_ttl(rr);
+
 		g_assert(offsetof(struct sockaddr_in, sin_addr) ==
 				offsetof(struct sockaddr_in6, sin6_flowinfo));
 
@@ -698,6 +1086,9 @@ static void parse_response(struct resolv_nameserver *nameserver,
 		}
 	}
 
+	cache_store(resolv, query, status, ttl, lookup->results + first,
+						lookup->nr_results - first);
+
 	if (lookup->ipv4_query == NULL && lookup->ipv6_query == NULL)
 		sort_and_return_results(lookup);
 
@@ -814,6 +1205,13 @@ GResolv *g_resolv_new(int index)
 	resolv->index = index;
 	resolv->nameserver_list = NULL;
 
+	resolv->cache_size = CACHE_SIZE;
+	resolv->cache = g_hash_table_new_full(g_str_hash, g_str_equal,
+						g_free, free_cache_entry);
+
+	resolv->local_addrs = g_array_new(FALSE, FALSE,
+						sizeof(struct local_address));
+
 	res_ninit(&resolv->res);
 
 	return resolv;
@@ -847,6 +1245,11 @@ void g_resolv_unref(GResolv *resolv)
 
 	flush_nameservers(resolv);
 
+	if (resolv->cache != NULL)
+		g_hash_table_destroy(resolv->cache);
+
+	g_array_free(resolv->local_addrs, TRUE);
+
 	res_nclose(&resolv->res);
 
 	g_free(resolv);
@@ -899,6 +1302,59 @@ void g_resolv_flush_nameservers(GResolv *resolv)
 		return;
 
 	flush_nameservers(resolv);
+
+	/* Answers from the old servers may not hold for the new ones */
+	g_resolv_flush_cache(resolv);
+}
+
+void g_resolv_set_cache_size(GResolv *resolv, guint size)
+{
+	if (resolv == NULL)
+		return;
+
+	resolv->cache_size = size;
+
+	if (size == 0) {
+		if (resolv->cache != NULL) {
+			g_hash_table_destroy(resolv->cache);
+			resolv->cache = NULL;
+		}
+		return;
+	}
+
+	if (resolv->cache == NULL) {
+		resolv->cache = g_hash_table_new_full(g_str_hash, g_str_equal,
+						g_free, free_cache_entry);
+		return;
+	}
+
+	while (g_hash_table_size(resolv->cache) > size)
+		cache_make_room(resolv, cache_time());
+}
+
+void g_resolv_flush_cache(GResolv *resolv)
+{
+	if (resolv == NULL)
+		return;
+
+	/* Addresses or routes changed, look at the interfaces again */
+	resolv->local_expire = 0;
+
+	if (resolv->cache != NULL)
+		g_hash_table_remove_all(resolv->cache);
+}
+
+void g_resolv_get_cache_stats(GResolv *resolv, GResolvCacheStats *stats)
+{
+	if (resolv == NULL || stats == NULL)
+		return;
+
+	*stats = resolv->cache_stats;
+
+	if (resolv->cache != NULL)
+		stats->entries = g_hash_table_size(resolv->cache);
+	else
+		stats->entries = 0;
 }
 
 static gint add_query(struct resolv_lookup *lookup, const char *hostname, int type)
@@ -922,6 +1378,8 @@ static gint add_query(struct resolv_lookup *lookup, const char *hostname, int ty
 
 	query->resolv = lookup->resolv;
 	query->lookup = lookup;
+	query->name = g_strdup(hostname);
+	query->type = type;
 
 	g_queue_push_tail(lookup->resolv->query_queue, query);
 
@@ -935,6 +1393,17 @@ static gint add_query(struct resolv_lookup *lookup, const char *hostname, int ty
 	return 0;
 }
 
+static gboolean cached_result(gpointer user_data)
+{
+	struct resolv_lookup *lookup = user_data;
+
+	lookup->cache_idle = 0;
+
+	sort_and_return_results(lookup);
+
+	return FALSE;
+}
+
 guint g_resolv_lookup_hostname(GResolv *resolv, const char *hostname,
 				GResolvResultFunc func, gpointer user_data)
 {
@@ -979,27 +1448,36 @@ guint g_resolv_lookup_hostname(GResolv *resolv, const char *hostname,
 	lookup->result_data = user_data;
 	lookup->id = resolv->next_lookup_id++;
 
-	if (resolv->result_family != AF_INET6) {
+	if (resolv->result_family != AF_INET6 &&
+			cache_lookup(lookup, hostname, ns_t_a) == FALSE) {
 		if (add_query(lookup, hostname, ns_t_a)) {
+			g_free(lookup->results);
 			g_free(lookup);
 			return -EIO;
 		}
 	}
 
-	if (resolv->result_family != AF_INET) {
+	if (resolv->result_family != AF_INET &&
+			cache_lookup(lookup, hostname, ns_t_aaaa) == FALSE) {
 		if (add_query(lookup, hostname, ns_t_aaaa)) {
-			if (resolv->result_family != AF_INET6) {
-				destroy_query(lookup->ipv4_query);
+			if (lookup->ipv4_query != NULL) {
 				g_queue_remove(resolv->query_queue,
 						lookup->ipv4_query);
+				destroy_query(lookup->ipv4_query);
 			}
 
+			g_free(lookup->results);
 			g_free(lookup);
 			return -EIO;
 		}
 	}
 
 	g_queue_push_tail(resolv->lookup_queue, lookup);
+
+	/* Everything came from the cache, still report asynchronously */
+	if (lookup->ipv4_query == NULL && lookup->ipv6_query == NULL)
+		lookup->cache_idle = g_idle_add(cached_result, lookup);
+
 	return lookup->id;
 }
 
@@ -1014,7 +1492,7 @@ gboolean g_resolv_cancel_lookup(GResolv *resolv, guint id)
 		return FALSE;
 
 	destroy_lookup(list->data);
-	g_queue_remove(resolv->query_queue, list->data);
+	g_queue_remove(resolv->lookup_queue, list->data);
 
 	return TRUE;
 }
@@ -45,6 +45,15 @@ typedef enum {
 	G_RESOLV_RESULT_STATUS_REFUSED,
 } GResolvResultStatus;
 
+typedef struct {
+	guint entries;
+	guint hits;
+	guint negative_hits;
+	guint misses;
+	guint expired;
+	guint evictions;
+} GResolvCacheStats;
+
 typedef void (*GResolvResultFunc)(GResolvResultStatus status,
 					char **results, gpointer user_data);
 
@@ -69,6 +78,10 @@ gboolean g_resolv_cancel_lookup(GResolv *resolv, guint id);
 
 gboolean g_resolv_set_address_family(GResolv *resolv, int family);
 
+void g_resolv_set_cache_size(GResolv *resolv, guint size);
+void g_resolv_flush_cache(GResolv *resolv);
+void g_resolv_get_cache_stats(GResolv *resolv, GResolvCacheStats *stats);
+
 #ifdef __cplusplus
 }
 #endif
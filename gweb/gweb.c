@@ -29,23 +29,35 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <time.h>
+#include <sys/uio.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 
 #include "giognutls.h"
 #include "gresolv.h"
+#include "ghttp.h"
 #include "gweb.h"
 
 #define DEFAULT_BUFFER_SIZE  2048
+#define MAX_BUFFER_SIZE      65536
 
 #define SESSION_FLAG_USE_TLS	(1 << 0)
 
+#define MAX_IDLE_CONNECTIONS	4
+#define IDLE_CONNECTION_TIMEOUT	30
+
+#define CONNECT_FALLBACK_DELAY	250
+#define FAMILY_CACHE_TIMEOUT	600
+#define FAMILY_CACHE_SIZE	32
+
 enum chunk_state {
 	CHUNK_SIZE,
 	CHUNK_R_BODY,
 	CHUNK_N_BODY,
 	CHUNK_DATA,
+	CHUNK_TRAILER,
 };
 
 struct _GWebResult {
@@ -53,12 +65,23 @@ struct _GWebResult {
 	const guint8 *buffer;
 	gsize length;
 	gboolean use_chunk;
-	gchar *last_key;
-	GHashTable *headers;
+	GHttpParser *parser;
+};
+
+struct web_session;
+
+/* A single non-blocking connect racing against the other family */
+struct web_attempt {
+	struct web_session *session;
+	struct addrinfo *addr;
+	char *address;
+	GIOChannel *channel;
+	guint watch;
 };
 
 struct web_session {
 	GWeb *web;
+	guint id;
 
 	char *address;
 	char *host;
@@ -66,6 +89,11 @@ struct web_session {
 	unsigned long flags;
 	struct addrinfo *addr;
 
+	struct web_attempt *attempts[2];
+	struct addrinfo *fallback_addr;
+	char *fallback_address;
+	guint fallback_timeout;
+
 	char *content_type;
 
 	GIOChannel *transport_channel;
@@ -83,6 +111,16 @@ struct web_session {
 	gboolean body_done;
 	gboolean more_data;
 	gboolean request_started;
+	gboolean paused;
+
+	char *pool_key;
+	gboolean reused;
+	gboolean http11;
+	gboolean keep_alive;
+	gboolean response_done;
+	gboolean has_length;
+	gsize content_length;
+	gsize body_length;
 
 	enum chunk_state chunck_state;
 	gsize chunk_size;
@@ -93,6 +131,8 @@ struct web_session {
 
 	GWebResultFunc result_func;
 	GWebInputFunc input_func;
+	GWebBufferFunc buffer_func;
+	gpointer buffer_data;
 	gpointer user_data;
 };
 
@@ -105,6 +145,8 @@ struct _GWeb {
 
 	int index;
 	GList *session_list;
+	GList *idle_list;
+	GHashTable *family_cache;
 
 	GResolv *resolv;
 	char *proxy;
@@ -114,6 +156,7 @@ struct _GWeb {
 	char *http_version;
 	gboolean close_connection;
 
+
 	GWebDebugFunc debug_func;
 	gpointer debug_data;
 };
@@ -134,6 +177,82 @@ static inline void debug(GWeb *web, const char *format, ...)
 	va_end(ap);
 }
 
+/* A kept alive transport waiting to be reused for the same server */
+struct web_connection {
+	GWeb *web;
+	char *key;
+	GIOChannel *channel;
+	guint watch;
+	guint timeout;
+};
+
+static void free_connection(struct web_connection *conn)
+{
+	if (conn->watch > 0)
+		g_source_remove(conn->watch);
+
+	if (conn->timeout > 0)
+		g_source_remove(conn->timeout);
+
+	if (conn->channel != NULL)
+		g_io_channel_unref(conn->channel);
+
+	g_free(conn->key);
+	g_free(conn);
+}
+
+static void flush_connections(GWeb *web)
+{
+	GList *list;
+
+	for (list = web->idle_list; list; list = list->next)
+		free_connection(list->data);
+
+	g_list_free(web->idle_list);
+	web->idle_list = NULL;
+}
+
+static void free_attempt(struct web_attempt *attempt)
+{
+	if (attempt == NULL)
+		return;
+
+	if (attempt->watch > 0)
+		g_source_remove(attempt->watch);
+
+	if (attempt->channel != NULL)
+		g_io_channel_unref(attempt->channel);
+
+	if (attempt->addr != NULL)
+		freeaddrinfo(attempt->addr);
+
+	g_free(attempt->address);
+	g_free(attempt);
+}
+
+static void cancel_attempts(struct web_session *session)
+{
+	int i;
+
+	if (session->fallback_timeout > 0) {
+		g_source_remove(session->fallback_timeout);
+		session->fallback_timeout = 0;
+	}
+
+	for (i = 0; i < 2; i++) {
+		free_attempt(session->attempts[i]);
+		session->attempts[i] = NULL;
+	}
+
+	if (session->fallback_addr != NULL) {
+		freeaddrinfo(session->fallback_addr);
+		session->fallback_addr = NULL;
+	}
+
+	g_free(session->fallback_address);
+	session->fallback_address = NULL;
+}
+
 static void free_session(struct web_session *session)
 {
 	GWeb *web = session->web;
@@ -141,6 +260,8 @@ static void free_session(struct web_session *session)
 	if (session == NULL)
 		return;
 
+	cancel_attempts(session);
+
 	g_free(session->request);
 
 	if (session->resolv_action > 0)
@@ -155,10 +276,7 @@ static void free_session(struct web_session *session)
 	if (session->transport_channel != NULL)
 		g_io_channel_unref(session->transport_channel);
 
-	g_free(session->result.last_key);
-
-	if (session->result.headers != NULL)
-		g_hash_table_destroy(session->result.headers);
+	g_http_parser_free(session->result.parser);
 
 	if (session->send_buffer != NULL)
 		g_string_free(session->send_buffer, TRUE);
@@ -170,6 +288,7 @@ static void free_session(struct web_session *session)
 
 	g_free(session->content_type);
 
+	g_free(session->pool_key);
 	g_free(session->host);
 	g_free(session->address);
 	if (session->addr != NULL)
@@ -216,6 +335,9 @@ GWeb *g_web_new(int index)
 		return NULL;
 	}
 
+	web->family_cache = g_hash_table_new_full(g_str_hash, g_str_equal,
+							g_free, g_free);
+
 	web->accept_option = g_strdup("*/*");
 	web->user_agent = g_strdup_printf("GWeb/%s", VERSION);
 	web->close_connection = FALSE;
@@ -242,6 +364,9 @@ void g_web_unref(GWeb *web)
 		return;
 
 	flush_sessions(web);
+	flush_connections(web);
+
+	g_hash_table_destroy(web->family_cache);
 
 	g_resolv_unref(web->resolv);
 
@@ -406,6 +531,9 @@ void g_web_set_close_connection(GWeb *web, gboolean enabled)
 		return;
 
 	web->close_connection = enabled;
+
+	if (enabled == TRUE)
+		flush_connections(web);
 }
 
 gboolean g_web_get_close_connection(GWeb *web)
@@ -577,6 +705,10 @@ static gboolean send_data(GIOChannel *channel, GIOCondition cond,
 
 	process_send_buffer(session);
 
+	/* Written in one go, the connection can be parked with the reply */
+	if (session->send_buffer->len == 0 && session->more_data == FALSE)
+		session->body_done = TRUE;
+
 	if (session->body_done == TRUE) {
 		session->send_watch = 0;
 		return FALSE;
@@ -625,8 +757,49 @@ static int decode_chunked(struct web_session *session,
 			session->chunk_size = counter;
 			session->chunk_left = counter;
 
+			g_string_truncate(session->current_header, 0);
+
+			if (counter == 0) {
+				debug(session->web, "Download Done in chunk");
+				session->chunck_state = CHUNK_TRAILER;
+				break;
+			}
+
 			session->chunck_state = CHUNK_DATA;
 			break;
+		case CHUNK_TRAILER:
+			pos = memchr(ptr, '\n', len);
+			if (pos == NULL) {
+				g_string_append_len(session->current_header,
+						(gchar *) ptr, len);
+				return 0;
+			}
+
+			count = pos - ptr;
+			g_string_append_len(session->current_header,
+						(gchar *) ptr, count);
+
+			len -= count + 1;
+			ptr = pos + 1;
+
+			str = session->current_header->str;
+			count = session->current_header->len;
+			if (count > 0 && str[count - 1] == '\r')
+				count--;
+
+			g_string_truncate(session->current_header, 0);
+
+			/* An empty line ends the trailer and the response */
+			if (count == 0) {
+				session->response_done = TRUE;
+
+				/* Unexpected data, do not reuse the transport */
+				if (len > 0)
+					session->keep_alive = FALSE;
+
+				return 0;
+			}
+			break;
 		case CHUNK_R_BODY:
 			if (*ptr != '\r')
 				return -EILSEQ;
@@ -642,12 +815,6 @@ static int decode_chunked(struct web_session *session,
 			session->chunck_state = CHUNK_SIZE;
 			break;
 		case CHUNK_DATA:
-			if (session->chunk_size == 0) {
-				debug(session->web, "Download Done in chunk");
-				g_string_truncate(session->current_header, 0);
-				return 0;
-			}
-
 			if (session->chunk_left <= len) {
 				session->result.buffer = ptr;
 				session->result.length = session->chunk_left;
@@ -688,6 +855,20 @@ static int handle_body(struct web_session *session,
 	debug(session->web, "[body] length %zu", len);
 
 	if (session->result.use_chunk == FALSE) {
+		if (session->has_length == TRUE) {
+			gsize left = session->content_length -
+						session->body_length;
+
+			if (len > left) {
+				session->keep_alive = FALSE;
+				len = left;
+			}
+
+			session->body_length += len;
+			if (session->body_length == session->content_length)
+				session->response_done = TRUE;
+		}
+
 		if (len > 0) {
 			session->result.buffer = buf;
 			session->result.length = len;
@@ -708,278 +889,762 @@ static int handle_body(struct web_session *session,
 	return err;
 }
 
-static void handle_multi_line(struct web_session *session)
+static void check_keep_alive(struct web_session *session)
 {
-	gsize count;
-	char *str;
-	gchar *value;
+	const char *val;
+	char *end;
+	unsigned long length;
 
-	str = session->current_header->str;
+	session->keep_alive = FALSE;
 
-	if (str[0] != ' ' && str[0] != '\t')
+	if (session->web->close_connection == TRUE ||
+					session->http11 == FALSE)
 		return;
 
-	while (str[0] == ' ' || str[0] == '\t')
-		str++;
+	val = g_http_parser_get_header(session->result.parser, "Connection");
+	if (val != NULL && g_ascii_strcasecmp(val, "close") == 0)
+		return;
+
+	/* These never carry a body, the header is the whole response */
+	if (session->result.status == 204 || session->result.status == 304) {
+		session->keep_alive = TRUE;
+		session->response_done = TRUE;
+		return;
+	}
 
-	count = str - session->current_header->str;
-	if (count > 0) {
-		g_string_erase(session->current_header, 0, count);
-		g_string_insert_c(session->current_header, 0, ' ');
+	if (session->result.use_chunk == TRUE) {
+		session->keep_alive = TRUE;
+		return;
 	}
 
-	value = g_hash_table_lookup(session->result.headers,
-					session->result.last_key);
-	if (value != NULL) {
-		g_string_insert(session->current_header, 0, value);
+	/* Without a length only closing the connection ends the body */
+	val = g_http_parser_get_header(session->result.parser,
+							"Content-Length");
+	if (val == NULL)
+		return;
 
-		str = session->current_header->str;
+	errno = 0;
+	length = strtoul(val, &end, 10);
+	if (errno != 0 || end == val || *end != '\0')
+		return;
 
-		g_hash_table_replace(session->result.headers,
-					g_strdup(session->result.last_key),
-					g_strdup(str));
-	}
+	session->keep_alive = TRUE;
+	session->has_length = TRUE;
+	session->content_length = length;
+
+	if (length == 0)
+		session->response_done = TRUE;
 }
 
-static void add_header_field(struct web_session *session)
+static gboolean connection_idle_event(GIOChannel *channel,
+				GIOCondition cond, gpointer user_data)
 {
-	gsize count;
-	guint8 *pos;
-	char *str;
-	gchar *value;
-	gchar *key;
+	struct web_connection *conn = user_data;
+	GWeb *web = conn->web;
 
-	str = session->current_header->str;
+	/* The server closed the connection or sent unsolicited data */
+	debug(web, "dropping idle connection %s", conn->key);
 
-	pos = memchr(str, ':', session->current_header->len);
-	if (pos != NULL) {
-		*pos = '\0';
-		pos++;
+	conn->watch = 0;
 
-		key = g_strdup(str);
+	web->idle_list = g_list_remove(web->idle_list, conn);
+	free_connection(conn);
 
-		/* remove preceding white spaces */
-		while (*pos == ' ')
-			pos++;
+	return FALSE;
+}
 
-		count = (char *) pos - str;
+static gboolean connection_idle_timeout(gpointer user_data)
+{
+	struct web_connection *conn = user_data;
+	GWeb *web = conn->web;
 
-		g_string_erase(session->current_header, 0, count);
+	debug(web, "idle connection %s expired", conn->key);
 
-		value = g_hash_table_lookup(session->result.headers, key);
-		if (value != NULL) {
-			g_string_insert_c(session->current_header, 0, ' ');
-			g_string_insert_c(session->current_header, 0, ';');
+	conn->timeout = 0;
 
-			g_string_insert(session->current_header, 0, value);
-		}
+	web->idle_list = g_list_remove(web->idle_list, conn);
+	free_connection(conn);
 
-		str = session->current_header->str;
-		g_hash_table_replace(session->result.headers, key,
-							g_strdup(str));
+	return FALSE;
+}
 
-		g_free(session->result.last_key);
-		session->result.last_key = g_strdup(key);
-	}
+static void park_connection(struct web_session *session)
+{
+	GWeb *web = session->web;
+	struct web_connection *conn;
+
+	/* The request is still being sent, the stream is out of sync */
+	if (session->body_done == FALSE || session->send_watch > 0)
+		return;
+
+	if (g_list_length(web->idle_list) >= MAX_IDLE_CONNECTIONS)
+		return;
+
+	conn = g_try_new0(struct web_connection, 1);
+	if (conn == NULL)
+		return;
+
+	conn->web = web;
+	conn->key = g_strdup(session->pool_key);
+	conn->channel = session->transport_channel;
+	session->transport_channel = NULL;
+
+	conn->watch = g_io_add_watch(conn->channel,
+				G_IO_IN | G_IO_HUP | G_IO_NVAL | G_IO_ERR,
+					connection_idle_event, conn);
+	conn->timeout = g_timeout_add_seconds(IDLE_CONNECTION_TIMEOUT,
+					connection_idle_timeout, conn);
+
+	web->idle_list = g_list_prepend(web->idle_list, conn);
+
+	debug(web, "keeping connection %s", conn->key);
 }
 
-static gboolean received_data(GIOChannel *channel, GIOCondition cond,
+static void finish_response(struct web_session *session)
+{
+	GWeb *web = session->web;
+
+	session->transport_watch = 0;
+
+	/*
+	 * Park the transport before reporting the result so that a
+	 * request issued from the result callback can already reuse it.
+	 */
+	park_connection(session);
+
+	g_web_ref(web);
+
+	session->result.buffer = NULL;
+	session->result.length = 0;
+	call_result_func(session, 0);
+
+	web->session_list = g_list_remove(web->session_list, session);
+	free_session(session);
+
+	g_web_unref(web);
+}
+
+static void debug_header(const char *name, const char *value,
 							gpointer user_data)
 {
 	struct web_session *session = user_data;
-	guint8 *ptr = session->receive_buffer;
-	gsize bytes_read;
-	GIOStatus status;
 
-	if (cond & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
-		session->transport_watch = 0;
-		session->result.buffer = NULL;
-		session->result.length = 0;
-		call_result_func(session, 400);
-		return FALSE;
-	}
+	debug(session->web, "[header] %s: %s", name, value);
+}
 
-	status = g_io_channel_read_chars(channel,
-				(gchar *) session->receive_buffer,
-				session->receive_space - 1, &bytes_read, NULL);
+static gboolean header_received(struct web_session *session, gsize length)
+{
+	GHttpParser *parser = session->result.parser;
+	const char *val;
+	guint8 *body;
+	gsize body_len;
+	int err;
 
-	debug(session->web, "bytes read %zu", bytes_read);
+	err = g_http_parser_commit(parser, length);
+	if (err == 0)
+		return TRUE;
+
+	if (err < 0) {
+		debug(session->web, "Error in header parse %d", err);
 
-	if (status != G_IO_STATUS_NORMAL && status != G_IO_STATUS_AGAIN) {
 		session->transport_watch = 0;
 		session->result.buffer = NULL;
 		session->result.length = 0;
-		call_result_func(session, 0);
+		call_result_func(session, 400);
 		return FALSE;
 	}
 
-	session->receive_buffer[bytes_read] = '\0';
-
-	if (session->header_done == TRUE) {
-		if (handle_body(session, session->receive_buffer,
-							bytes_read) < 0) {
-			session->transport_watch = 0;
-			return FALSE;
-		}
-		return TRUE;
-	}
-
-	while (bytes_read > 0) {
-		guint8 *pos;
-		gsize count;
-		char *str;
+	session->header_done = TRUE;
+	session->result.status = g_http_parser_get_status(parser);
+	session->http11 = g_http_parser_is_http11(parser);
 
-		pos = memchr(ptr, '\n', bytes_read);
-		if (pos == NULL) {
-			g_string_append_len(session->current_header,
-						(gchar *) ptr, bytes_read);
-			return TRUE;
-		}
+	debug(session->web, "[header] status %u", session->result.status);
 
-		*pos = '\0';
-		count = strlen((char *) ptr);
-		if (count > 0 && ptr[count - 1] == '\r') {
-			ptr[--count] = '\0';
-			bytes_read--;
-		}
+	if (session->web->debug_func != NULL)
+		g_http_parser_foreach_header(parser, debug_header, session);
 
-		g_string_append_len(session->current_header,
-						(gchar *) ptr, count);
+	val = g_http_parser_get_header(parser, "Transfer-Encoding");
+	if (val != NULL && g_strrstr(val, "chunked") != NULL) {
+		session->result.use_chunk = TRUE;
 
-		bytes_read -= count + 1;
-		if (bytes_read > 0)
-			ptr = pos + 1;
-		else
-			ptr = NULL;
+		session->chunck_state = CHUNK_SIZE;
+		session->chunk_left = 0;
+		session->total_len = 0;
+	}
 
-		if (session->current_header->len == 0) {
-			char *val;
+	check_keep_alive(session);
 
-			session->header_done = TRUE;
+	body = g_http_parser_get_body(parser, &body_len);
 
-			val = g_hash_table_lookup(session->result.headers,
-							"Transfer-Encoding");
-			if (val != NULL) {
-				val = g_strrstr(val, "chunked");
-				if (val != NULL) {
-					session->result.use_chunk = TRUE;
+	if (handle_body(session, body, body_len) < 0) {
+		session->transport_watch = 0;
+		return FALSE;
+	}
 
-					session->chunck_state = CHUNK_SIZE;
-					session->chunk_left = 0;
-					session->total_len = 0;
-				}
-			}
+	if (session->keep_alive == TRUE && session->response_done == TRUE) {
+		finish_response(session);
+		return FALSE;
+	}
 
-			if (handle_body(session, ptr, bytes_read) < 0) {
-				session->transport_watch = 0;
-				return FALSE;
-			}
-			break;
-		}
+	return TRUE;
+}
 
-		str = session->current_header->str;
+/*
+ * Plain sockets are read with readv so that a small caller buffer can
+ * spill into the receive buffer within the same system call. TLS
+ * records can only be read through the channel, one buffer at a time.
+ */
+static gssize read_transport(struct web_session *session,
+			GIOChannel *channel, struct iovec *iov, int count)
+{
+	GIOStatus status;
+	gsize bytes_read;
+	gssize len;
 
-		if (session->result.status == 0) {
-			unsigned int code;
+	if (!(session->flags & SESSION_FLAG_USE_TLS)) {
+		len = readv(g_io_channel_unix_get_fd(channel), iov, count);
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				return -EAGAIN;
 
-			if (sscanf(str, "HTTP/%*s %u %*s", &code) == 1)
-				session->result.status = code;
+			return -errno;
 		}
 
-		debug(session->web, "[header] %s", str);
-
-		/* handle multi-line header */
-		if (str[0] == ' ' || str[0] == '\t')
-			handle_multi_line(session);
-		else
-			add_header_field(session);
+		return len;
+	}
 
-		g_string_truncate(session->current_header, 0);
+	status = g_io_channel_read_chars(channel, iov[0].iov_base,
+					iov[0].iov_len, &bytes_read, NULL);
+	switch (status) {
+	case G_IO_STATUS_NORMAL:
+		return bytes_read;
+	case G_IO_STATUS_AGAIN:
+		return -EAGAIN;
+	case G_IO_STATUS_EOF:
+		return 0;
+	case G_IO_STATUS_ERROR:
+		break;
 	}
 
-	return TRUE;
+	return -EIO;
 }
 
-static int connect_session_transport(struct web_session *session)
+static gboolean body_received(struct web_session *session,
+						GIOChannel *channel)
 {
-	GIOFlags flags;
-	int sk;
+	GWeb *web = session->web;
+	struct iovec iov[2];
+	guint8 *buf = NULL;
+	gsize size = 0;
+	gssize bytes_read;
+	int count = 0, i;
+
+	if (session->buffer_func != NULL)
+		buf = session->buffer_func(&size, session->buffer_data);
+
+	if (buf != NULL && size > 0) {
+		iov[count].iov_base = buf;
+		iov[count].iov_len = size;
+		count++;
+	}
 
-	sk = socket(session->addr->ai_family, SOCK_STREAM | SOCK_CLOEXEC,
-			IPPROTO_TCP);
-	if (sk < 0)
-		return -EIO;
+	iov[count].iov_base = session->receive_buffer;
+	iov[count].iov_len = session->receive_space - 1;
+	count++;
 
-	if (session->flags & SESSION_FLAG_USE_TLS) {
-		debug(session->web, "using TLS encryption");
-		session->transport_channel = g_io_channel_gnutls_new(sk);
-	} else {
-		debug(session->web, "no encryption");
-		session->transport_channel = g_io_channel_unix_new(sk);
-	}
+	bytes_read = read_transport(session, channel, iov, count);
+	if (bytes_read == -EAGAIN)
+		return TRUE;
 
-	if (session->transport_channel == NULL) {
-		close(sk);
-		return -ENOMEM;
+	debug(web, "bytes read %zd", bytes_read);
+
+	if (bytes_read <= 0) {
+		session->transport_watch = 0;
+		session->result.buffer = NULL;
+		session->result.length = 0;
+		call_result_func(session, 0);
+		return FALSE;
 	}
 
-	flags = g_io_channel_get_flags(session->transport_channel);
-	g_io_channel_set_flags(session->transport_channel,
-					flags | G_IO_FLAG_NONBLOCK, NULL);
+	for (i = 0; i < count && bytes_read > 0; i++) {
+		gsize len = MIN((gsize) bytes_read, iov[i].iov_len);
 
-	g_io_channel_set_encoding(session->transport_channel, NULL, NULL);
-	g_io_channel_set_buffered(session->transport_channel, FALSE);
+		if (iov[i].iov_base == session->receive_buffer)
+			session->receive_buffer[len] = '\0';
 
-	g_io_channel_set_close_on_unref(session->transport_channel, TRUE);
+		if (handle_body(session, iov[i].iov_base, len) < 0) {
+			session->transport_watch = 0;
+			return FALSE;
+		}
 
-	if (connect(sk, session->addr->ai_addr,
-			session->addr->ai_addrlen) < 0) {
-		if (errno != EINPROGRESS) {
-			close(sk);
-			return -EIO;
+		bytes_read -= len;
+
+		/* Grow the receive buffer while the link keeps filling it */
+		if (iov[i].iov_base == session->receive_buffer &&
+				len == iov[i].iov_len &&
+				session->receive_space < MAX_BUFFER_SIZE) {
+			guint8 *ptr = g_try_realloc(session->receive_buffer,
+						session->receive_space * 2);
+			if (ptr != NULL) {
+				session->receive_buffer = ptr;
+				session->receive_space *= 2;
+			}
 		}
 	}
 
-	session->transport_watch = g_io_add_watch(session->transport_channel,
-				G_IO_IN | G_IO_HUP | G_IO_NVAL | G_IO_ERR,
-						received_data, session);
-
-	session->send_watch = g_io_add_watch(session->transport_channel,
-				G_IO_OUT | G_IO_HUP | G_IO_NVAL | G_IO_ERR,
-						send_data, session);
+	if (session->keep_alive == TRUE && session->response_done == TRUE) {
+		finish_response(session);
+		return FALSE;
+	}
 
-	return 0;
+	return TRUE;
 }
 
-static int create_transport(struct web_session *session)
+static int connect_session(struct web_session *session);
+
+/*
+ * A pooled connection may have been closed by the server while it was
+ * idle, which only shows once the request has been written to it. Such
+ * a request never reached the server, so an idempotent one is sent
+ * again, once, over a new connection.
+ */
+static gboolean retry_request(struct web_session *session)
 {
-	int err;
+	if (session->reused == FALSE || session->content_type != NULL)
+		return FALSE;
 
-	err = connect_session_transport(session);
-	if (err < 0)
-		return err;
+	session->reused = FALSE;
 
-	debug(session->web, "creating session %s:%u",
-					session->address, session->port);
+	debug(session->web, "connection %s lost, reconnecting",
+							session->pool_key);
 
-	return 0;
-}
+	if (session->send_watch > 0) {
+		g_source_remove(session->send_watch);
+		session->send_watch = 0;
+	}
 
-static int parse_url(struct web_session *session,
-				const char *url, const char *proxy)
-{
-	char *scheme, *host, *port, *path;
+	g_io_channel_unref(session->transport_channel);
+	session->transport_channel = NULL;
 
-	scheme = g_strdup(url);
-	if (scheme == NULL)
-		return -EINVAL;
+	g_string_truncate(session->send_buffer, 0);
+	session->request_started = FALSE;
+	session->more_data = FALSE;
+	session->body_done = FALSE;
 
-	host = strstr(scheme, "://");
-	if (host != NULL) {
-		*host = '\0';
-		host += 3;
+	if (connect_session(session) < 0)
+		return FALSE;
 
-		if (strcasecmp(scheme, "https") == 0) {
+	return TRUE;
+}
+
+static gboolean received_data(GIOChannel *channel, GIOCondition cond,
+							gpointer user_data)
+{
+	struct web_session *session = user_data;
+	guint8 *buf;
+	gsize space, bytes_read;
+	GIOStatus status;
+
+	if (cond & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
+		session->transport_watch = 0;
+
+		if (retry_request(session) == TRUE)
+			return FALSE;
+
+		session->result.buffer = NULL;
+		session->result.length = 0;
+		call_result_func(session, 400);
+		return FALSE;
+	}
+
+	if (session->header_done == TRUE)
+		return body_received(session, channel);
+
+	/* Until the header is complete read straight into the parser */
+	buf = g_http_parser_get_space(session->result.parser, &space);
+	if (buf == NULL) {
+		session->transport_watch = 0;
+		session->result.buffer = NULL;
+		session->result.length = 0;
+		call_result_func(session, 400);
+		return FALSE;
+	}
+
+	status = g_io_channel_read_chars(channel, (gchar *) buf, space,
+							&bytes_read, NULL);
+
+	debug(session->web, "bytes read %zu", bytes_read);
+
+	if (status != G_IO_STATUS_NORMAL && status != G_IO_STATUS_AGAIN) {
+		session->transport_watch = 0;
+
+		if (retry_request(session) == TRUE)
+			return FALSE;
+
+		session->result.buffer = NULL;
+		session->result.length = 0;
+		call_result_func(session, 0);
+		return FALSE;
+	}
+
+	/* Once the server has answered the request can not be repeated */
+	if (bytes_read > 0)
+		session->reused = FALSE;
+
+	return header_received(session, bytes_read);
+}
+
+static void add_transport_watches(struct web_session *session)
+{
+	/* A paused request starts reading once it is resumed */
+	if (session->paused == FALSE)
+		session->transport_watch = g_io_add_watch(
+				session->transport_channel,
+				G_IO_IN | G_IO_HUP | G_IO_NVAL | G_IO_ERR,
+						received_data, session);
+
+	session->send_watch = g_io_add_watch(session->transport_channel,
+				G_IO_OUT | G_IO_HUP | G_IO_NVAL | G_IO_ERR,
+						send_data, session);
+}
+
+struct family_entry {
+	int family;
+	time_t expire;
+};
+
+static time_t monotonic_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec;
+}
+
+static int preferred_family(GWeb *web, const char *host)
+{
+	struct family_entry *entry;
+
+	entry = g_hash_table_lookup(web->family_cache, host);
+	if (entry == NULL)
+		return AF_UNSPEC;
+
+	if (entry->expire <= monotonic_seconds()) {
+		g_hash_table_remove(web->family_cache, host);
+		return AF_UNSPEC;
+	}
+
+	return entry->family;
+}
+
+static void remember_family(GWeb *web, const char *host, int family)
+{
+	struct family_entry *entry;
+
+	if (g_hash_table_size(web->family_cache) >= FAMILY_CACHE_SIZE)
+		g_hash_table_remove_all(web->family_cache);
+
+	entry = g_try_new0(struct family_entry, 1);
+	if (entry == NULL)
+		return;
+
+	entry->family = family;
+	entry->expire = monotonic_seconds() + FAMILY_CACHE_TIMEOUT;
+
+	g_hash_table_replace(web->family_cache, g_strdup(host), entry);
+}
+
+static int open_transport(struct web_session *session, int sk)
+{
+	GIOFlags flags;
+
+	if (session->flags & SESSION_FLAG_USE_TLS) {
+		debug(session->web, "using TLS encryption");
+		session->transport_channel = g_io_channel_gnutls_new(sk);
+	} else {
+		debug(session->web, "no encryption");
+		session->transport_channel = g_io_channel_unix_new(sk);
+	}
+
+	if (session->transport_channel == NULL) {
+		close(sk);
+		return -ENOMEM;
+	}
+
+	flags = g_io_channel_get_flags(session->transport_channel);
+	g_io_channel_set_flags(session->transport_channel,
+					flags | G_IO_FLAG_NONBLOCK, NULL);
+
+	g_io_channel_set_encoding(session->transport_channel, NULL, NULL);
+	g_io_channel_set_buffered(session->transport_channel, FALSE);
+
+	g_io_channel_set_close_on_unref(session->transport_channel, TRUE);
+
+	add_transport_watches(session);
+
+	return 0;
+}
+
+static int start_attempt(struct web_session *session,
+				struct addrinfo *addr, char *address);
+
+static void attempt_connected(struct web_session *session,
+					struct web_attempt *attempt)
+{
+	int sk = g_io_channel_unix_get_fd(attempt->channel);
+	int i;
+
+	debug(session->web, "connected to %s", attempt->address);
+
+	remember_family(session->web, session->host, attempt->addr->ai_family);
+
+	g_free(session->address);
+	session->address = g_strdup(attempt->address);
+
+	/* Hand the socket over to the transport and drop the loser */
+	g_io_channel_set_close_on_unref(attempt->channel, FALSE);
+
+	for (i = 0; i < 2; i++) {
+		if (session->attempts[i] == attempt)
+			session->attempts[i] = NULL;
+	}
+
+	free_attempt(attempt);
+	cancel_attempts(session);
+
+	if (open_transport(session, sk) < 0)
+		call_result_func(session, 409);
+}
+
+static gboolean start_fallback(struct web_session *session)
+{
+	struct addrinfo *addr = session->fallback_addr;
+	char *address = session->fallback_address;
+
+	if (addr == NULL)
+		return FALSE;
+
+	session->fallback_addr = NULL;
+	session->fallback_address = NULL;
+
+	debug(session->web, "trying fallback %s", address);
+
+	if (start_attempt(session, addr, address) < 0)
+		return FALSE;
+
+	return TRUE;
+}
+
+static void attempt_failed(struct web_session *session,
+					struct web_attempt *attempt)
+{
+	int i;
+
+	debug(session->web, "connect to %s failed", attempt->address);
+
+	for (i = 0; i < 2; i++) {
+		if (session->attempts[i] == attempt)
+			session->attempts[i] = NULL;
+	}
+
+	free_attempt(attempt);
+
+	/* Do not wait for the delay once the first choice has failed */
+	if (session->fallback_timeout > 0) {
+		g_source_remove(session->fallback_timeout);
+		session->fallback_timeout = 0;
+	}
+
+	if (start_fallback(session) == TRUE)
+		return;
+
+	if (session->attempts[0] != NULL || session->attempts[1] != NULL)
+		return;
+
+	session->result.buffer = NULL;
+	session->result.length = 0;
+	call_result_func(session, 400);
+}
+
+static gboolean attempt_event(GIOChannel *channel, GIOCondition cond,
+							gpointer user_data)
+{
+	struct web_attempt *attempt = user_data;
+	struct web_session *session = attempt->session;
+	socklen_t len = sizeof(int);
+	int err = 0;
+
+	attempt->watch = 0;
+
+	if (getsockopt(g_io_channel_unix_get_fd(channel), SOL_SOCKET,
+					SO_ERROR, &err, &len) < 0)
+		err = errno;
+
+	if (err == 0 && (cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL)))
+		err = ECONNREFUSED;
+
+	if (err != 0)
+		attempt_failed(session, attempt);
+	else
+		attempt_connected(session, attempt);
+
+	return FALSE;
+}
+
+static gboolean fallback_timeout(gpointer user_data)
+{
+	struct web_session *session = user_data;
+
+	session->fallback_timeout = 0;
+
+	start_fallback(session);
+
+	return FALSE;
+}
+
+/* Takes ownership of addr and address, also on failure */
+static int start_attempt(struct web_session *session,
+				struct addrinfo *addr, char *address)
+{
+	struct web_attempt *attempt;
+	int sk, slot;
+
+	slot = session->attempts[0] == NULL ? 0 : 1;
+
+	attempt = g_try_new0(struct web_attempt, 1);
+	if (attempt == NULL) {
+		freeaddrinfo(addr);
+		g_free(address);
+		return -ENOMEM;
+	}
+
+	attempt->session = session;
+	attempt->addr = addr;
+	attempt->address = address;
+
+	sk = socket(addr->ai_family, SOCK_STREAM | SOCK_CLOEXEC |
+						SOCK_NONBLOCK, IPPROTO_TCP);
+	if (sk < 0) {
+		free_attempt(attempt);
+		return -EIO;
+	}
+
+	attempt->channel = g_io_channel_unix_new(sk);
+	if (attempt->channel == NULL) {
+		close(sk);
+		free_attempt(attempt);
+		return -ENOMEM;
+	}
+
+	g_io_channel_set_close_on_unref(attempt->channel, TRUE);
+
+	if (connect(sk, addr->ai_addr, addr->ai_addrlen) < 0 &&
+						errno != EINPROGRESS) {
+		free_attempt(attempt);
+		return -EIO;
+	}
+
+	attempt->watch = g_io_add_watch(attempt->channel,
+				G_IO_OUT | G_IO_HUP | G_IO_NVAL | G_IO_ERR,
+						attempt_event, attempt);
+
+	session->attempts[slot] = attempt;
+
+	return 0;
+}
+
+/*
+ * Connects to the preferred address and, if the other address family
+ * is available too, starts a second attempt after a short delay or as
+ * soon as the first one fails (RFC 6555). The first to connect wins.
+ */
+static int connect_session_transport(struct web_session *session)
+{
+	struct addrinfo *addr = session->addr;
+	int err;
+
+	session->addr = NULL;
+
+	err = start_attempt(session, addr, g_strdup(session->address));
+	if (err < 0) {
+		if (start_fallback(session) == TRUE)
+			return 0;
+
+		return err;
+	}
+
+	if (session->fallback_addr != NULL)
+		session->fallback_timeout = g_timeout_add(
+					CONNECT_FALLBACK_DELAY,
+					fallback_timeout, session);
+
+	return 0;
+}
+
+static gboolean reuse_connection(struct web_session *session)
+{
+	GWeb *web = session->web;
+	struct web_connection *conn = NULL;
+	GList *list;
+
+	for (list = web->idle_list; list; list = list->next) {
+		struct web_connection *idle = list->data;
+
+		if (g_str_equal(idle->key, session->pool_key) == TRUE) {
+			conn = idle;
+			break;
+		}
+	}
+
+	if (conn == NULL)
+		return FALSE;
+
+	debug(web, "reusing connection %s", conn->key);
+
+	web->idle_list = g_list_remove(web->idle_list, conn);
+
+	session->transport_channel = conn->channel;
+	conn->channel = NULL;
+
+	free_connection(conn);
+
+	session->reused = TRUE;
+
+	add_transport_watches(session);
+
+	return TRUE;
+}
+
+static int create_transport(struct web_session *session)
+{
+	int err;
+
+	err = connect_session_transport(session);
+	if (err < 0)
+		return err;
+
+	debug(session->web, "creating session %s:%u",
+					session->address, session->port);
+
+	return 0;
+}
+
+static int parse_url(struct web_session *session,
+				const char *url, const char *proxy)
+{
+	char *scheme, *host, *port, *path;
+
+	scheme = g_strdup(url);
+	if (scheme == NULL)
+		return -EINVAL;
+
+	host = strstr(scheme, "://");
+	if (host != NULL) {
+		*host = '\0';
+		host += 3;
+
+		if (strcasecmp(scheme, "https") == 0) {
 			session->port = 443;
 			session->flags |= SESSION_FLAG_USE_TLS;
 		} else if (strcasecmp(scheme, "http") == 0) {
@@ -1062,39 +1727,82 @@ static int parse_url(struct web_session *session,
 	return 0;
 }
 
+static struct addrinfo *numeric_addrinfo(struct web_session *session,
+							const char *address)
+{
+	struct addrinfo hints, *addr = NULL;
+	char *port;
+	int ret;
+
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_flags = AI_NUMERICHOST;
+	hints.ai_family = session->web->family;
+
+	port = g_strdup_printf("%u", session->port);
+	ret = getaddrinfo(address, port, &hints, &addr);
+	g_free(port);
+
+	if (ret != 0)
+		return NULL;
+
+	return addr;
+}
+
 static void resolv_result(GResolvResultStatus status,
 					char **results, gpointer user_data)
 {
 	struct web_session *session = user_data;
-	struct addrinfo hints;
-	char *port;
-	int ret;
+	const char *primary, *fallback = NULL;
+	int i, family;
+
+	session->resolv_action = 0;
 
 	if (results == NULL || results[0] == NULL) {
 		call_result_func(session, 404);
 		return;
 	}
 
-	debug(session->web, "address %s", results[0]);
+	primary = results[0];
 
-	memset(&hints, 0, sizeof(struct addrinfo));
-	hints.ai_flags = AI_NUMERICHOST;
-	hints.ai_family = session->web->family;
+	/* The first address of the other family is raced against it */
+	for (i = 1; results[i] != NULL; i++) {
+		if ((strchr(results[i], ':') == NULL) !=
+					(strchr(primary, ':') == NULL)) {
+			fallback = results[i];
+			break;
+		}
+	}
 
-	if (session->addr != NULL) {
-		freeaddrinfo(session->addr);
-		session->addr = NULL;
+	family = preferred_family(session->web, session->host);
+
+	if (fallback != NULL && family != AF_UNSPEC &&
+			(strchr(fallback, ':') != NULL) ==
+						(family == AF_INET6)) {
+		const char *tmp = primary;
+
+		primary = fallback;
+		fallback = tmp;
 	}
 
-	port = g_strdup_printf("%u", session->port);
-	ret = getaddrinfo(results[0], port, &hints, &session->addr);
-	g_free(port);
-	if (ret != 0 || session->addr == NULL) {
+	debug(session->web, "address %s", primary);
+
+	if (session->addr != NULL)
+		freeaddrinfo(session->addr);
+
+	session->addr = numeric_addrinfo(session, primary);
+	if (session->addr == NULL) {
 		call_result_func(session, 400);
 		return;
 	}
 
-	session->address = g_strdup(results[0]);
+	g_free(session->address);
+	session->address = g_strdup(primary);
+
+	if (fallback != NULL) {
+		session->fallback_addr = numeric_addrinfo(session, fallback);
+		if (session->fallback_addr != NULL)
+			session->fallback_address = g_strdup(fallback);
+	}
 
 	if (create_transport(session) < 0) {
 		call_result_func(session, 409);
@@ -1102,6 +1810,43 @@ static void resolv_result(GResolvResultStatus status,
 	}
 }
 
+static int connect_session(struct web_session *session)
+{
+	GWeb *web = session->web;
+	struct addrinfo hints;
+	char *port;
+	int ret;
+
+	if (session->address == NULL && inet_aton(session->host, NULL) == 0) {
+		session->resolv_action = g_resolv_lookup_hostname(web->resolv,
+					session->host, resolv_result, session);
+		if (session->resolv_action == 0)
+			return -EIO;
+
+		return 0;
+	}
+
+	if (session->address == NULL)
+		session->address = g_strdup(session->host);
+
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_flags = AI_NUMERICHOST;
+	hints.ai_family = web->family;
+
+	if (session->addr != NULL) {
+		freeaddrinfo(session->addr);
+		session->addr = NULL;
+	}
+
+	port = g_strdup_printf("%u", session->port);
+	ret = getaddrinfo(session->address, port, &hints, &session->addr);
+	g_free(port);
+	if (ret != 0 || session->addr == NULL)
+		return -EINVAL;
+
+	return create_transport(session);
+}
+
 static guint do_request(GWeb *web, const char *url,
 				const char *type, GWebInputFunc input,
 				GWebResultFunc func, gpointer user_data)
@@ -1135,6 +1880,7 @@ static guint do_request(GWeb *web, const char *url,
 	}
 
 	session->web = web;
+	session->id = web->next_query_id++;
 
 	session->result_func = func;
 	session->input_func = input;
@@ -1146,9 +1892,8 @@ static guint do_request(GWeb *web, const char *url,
 		return 0;
 	}
 
-	session->result.headers = g_hash_table_new_full(g_str_hash, g_str_equal,
-							g_free, g_free);
-	if (session->result.headers == NULL) {
+	session->result.parser = g_http_parser_new();
+	if (session->result.parser == NULL) {
 		free_session(session);
 		return 0;
 	}
@@ -1159,48 +1904,24 @@ static guint do_request(GWeb *web, const char *url,
 	session->header_done = FALSE;
 	session->body_done = FALSE;
 
-	if (session->address == NULL && inet_aton(session->host, NULL) == 0) {
-		session->resolv_action = g_resolv_lookup_hostname(web->resolv,
-					session->host, resolv_result, session);
-		if (session->resolv_action == 0) {
-			free_session(session);
-			return 0;
-		}
-	} else {
-		struct addrinfo hints;
-		char *port;
-		int ret;
+	session->pool_key = g_strdup_printf("%s:%u:%s",
+			session->address ? session->address : session->host,
+			session->port,
+			session->flags & SESSION_FLAG_USE_TLS ? "tls" : "tcp");
 
-		if (session->address == NULL)
-			session->address = g_strdup(session->host);
-
-		memset(&hints, 0, sizeof(struct addrinfo));
-		hints.ai_flags = AI_NUMERICHOST;
-		hints.ai_family = session->web->family;
-
-		if (session->addr != NULL) {
-			freeaddrinfo(session->addr);
-			session->addr = NULL;
-		}
-
-		port = g_strdup_printf("%u", session->port);
-		ret = getaddrinfo(session->address, port, &hints,
-							&session->addr);
-		g_free(port);
-		if (ret != 0 || session->addr == NULL) {
-			free_session(session);
-			return 0;
-		}
+	if (web->close_connection == FALSE &&
+				reuse_connection(session) == TRUE)
+		goto done;
 
-		if (create_transport(session) < 0) {
-			free_session(session);
-			return 0;
-		}
+	if (connect_session(session) < 0) {
+		free_session(session);
+		return 0;
 	}
 
+done:
 	web->session_list = g_list_append(web->session_list, session);
 
-	return web->next_query_id++;
+	return session->id;
 }
 
 guint g_web_request_get(GWeb *web, const char *url,
@@ -1224,6 +1945,91 @@ gboolean g_web_cancel_request(GWeb *web, guint id)
 	return TRUE;
 }
 
+static struct web_session *find_session(GWeb *web, guint id)
+{
+	GList *list;
+
+	for (list = web->session_list; list; list = list->next) {
+		struct web_session *session = list->data;
+
+		if (session->id == id)
+			return session;
+	}
+
+	return NULL;
+}
+
+/*
+ * Stops reading from the transport until the request is resumed. Data
+ * that has already been read is still passed to the result function.
+ */
+gboolean g_web_pause_request(GWeb *web, guint id)
+{
+	struct web_session *session;
+
+	if (web == NULL)
+		return FALSE;
+
+	session = find_session(web, id);
+	if (session == NULL)
+		return FALSE;
+
+	session->paused = TRUE;
+
+	if (session->transport_watch > 0) {
+		g_source_remove(session->transport_watch);
+		session->transport_watch = 0;
+	}
+
+	return TRUE;
+}
+
+gboolean g_web_resume_request(GWeb *web, guint id)
+{
+	struct web_session *session;
+
+	if (web == NULL)
+		return FALSE;
+
+	session = find_session(web, id);
+	if (session == NULL || session->paused == FALSE)
+		return FALSE;
+
+	session->paused = FALSE;
+
+	if (session->transport_channel != NULL &&
+					session->transport_watch == 0)
+		session->transport_watch = g_io_add_watch(
+				session->transport_channel,
+				G_IO_IN | G_IO_HUP | G_IO_NVAL | G_IO_ERR,
+						received_data, session);
+
+	return TRUE;
+}
+
+/*
+ * Lets the caller provide the memory that the body of this request is
+ * read into. The buffer is passed back as the result chunk, so it has
+ * to stay valid until the result function returns.
+ */
+gboolean g_web_set_request_buffer_func(GWeb *web, guint id,
+				GWebBufferFunc func, gpointer user_data)
+{
+	struct web_session *session;
+
+	if (web == NULL)
+		return FALSE;
+
+	session = find_session(web, id);
+	if (session == NULL)
+		return FALSE;
+
+	session->buffer_func = func;
+	session->buffer_data = user_data;
+
+	return TRUE;
+}
+
 guint16 g_web_result_get_status(GWebResult *result)
 {
 	if (result == NULL)
@@ -1258,7 +2064,7 @@ gboolean g_web_result_get_header(GWebResult *result,
 	if (value == NULL)
 		return FALSE;
 
-	*value = g_hash_table_lookup(result->headers, header);
+	*value = g_http_parser_get_header(result->parser, header);
 
 	if (*value == NULL)
 		return FALSE;
@@ -43,6 +43,8 @@ typedef gboolean (*GWebResultFunc)(GWebResult *result, gpointer user_data);
 typedef gboolean (*GWebInputFunc)(const guint8 **data, gsize *length,
 							gpointer user_data);
 
+typedef guint8 *(*GWebBufferFunc)(gsize *size, gpointer user_data);
+
 typedef void (*GWebDebugFunc)(const char *str, gpointer user_data);
 
 GWeb *g_web_new(int index);
@@ -77,6 +79,12 @@ guint g_web_request_post(GWeb *web, const char *url,
 
 gboolean g_web_cancel_request(GWeb *web, guint id);
 
+gboolean g_web_pause_request(GWeb *web, guint id);
+gboolean g_web_resume_request(GWeb *web, guint id);
+
+gboolean g_web_set_request_buffer_func(GWeb *web, guint id,
+				GWebBufferFunc func, gpointer user_data);
+
 guint16 g_web_result_get_status(GWebResult *result);
 
 gboolean g_web_result_get_header(GWebResult *result,
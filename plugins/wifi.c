@@ -48,12 +48,14 @@
 #include <connman/technology.h>
 #include <connman/log.h>
 #include <connman/option.h>
+#include <connman/setting.h>
 
 #include <gsupplicant/gsupplicant.h>
 
 #define CLEANUP_TIMEOUT   8	/* in seconds */
 #define INACTIVE_TIMEOUT  12	/* in seconds */
 #define MAXIMUM_RETRIES   4
+#define SIGNAL_WEIGHT     4
 
 struct connman_technology *wifi_technology = NULL;
 
@@ -837,29 +839,21 @@ static unsigned char calculate_strength(GSupplicantNetwork *supplicant_network)
 	return strength;
 }
 
-static void network_added(GSupplicantNetwork *supplicant_network)
+static void add_network(struct wifi_data *wifi,
+				GSupplicantNetwork *supplicant_network)
 {
 	struct connman_network *network;
-	GSupplicantInterface *interface;
-	struct wifi_data *wifi;
 	const char *name, *identifier, *security, *group;
 	const unsigned char *ssid;
 	unsigned int ssid_len;
 	connman_bool_t wps;
 
-	DBG("");
-
-	interface = g_supplicant_network_get_interface(supplicant_network);
-	wifi = g_supplicant_interface_get_data(interface);
 	name = g_supplicant_network_get_name(supplicant_network);
 	identifier = g_supplicant_network_get_identifier(supplicant_network);
 	security = g_supplicant_network_get_security(supplicant_network);
 	group = g_supplicant_network_get_identifier(supplicant_network);
 	wps = g_supplicant_network_get_wps(supplicant_network);
 
-	if (wifi == NULL)
-		return;
-
 	ssid = g_supplicant_network_get_ssid(supplicant_network, &ssid_len);
 
 	network = connman_device_get_network(wifi->device, identifier);
@@ -877,7 +871,7 @@ static void network_added(GSupplicantNetwork *supplicant_network)
 			return;
 		}
 
-		wifi->networks = g_slist_append(wifi->networks, network);
+		wifi->networks = g_slist_prepend(wifi->networks, network);
 	}
 
 	if (name != NULL && name[0] != '\0')
@@ -896,6 +890,38 @@ static void network_added(GSupplicantNetwork *supplicant_network)
 		connman_network_set_group(network, group);
 }
 
+static void network_added(GSupplicantNetwork *supplicant_network)
+{
+	GSupplicantInterface *interface;
+	struct wifi_data *wifi;
+
+	DBG("");
+
+	interface = g_supplicant_network_get_interface(supplicant_network);
+	wifi = g_supplicant_interface_get_data(interface);
+
+	if (wifi == NULL)
+		return;
+
+	add_network(wifi, supplicant_network);
+}
+
+static void networks_added(GSupplicantInterface *interface, GSList *networks)
+{
+	struct wifi_data *wifi;
+	GSList *list;
+
+	DBG("%d networks", g_slist_length(networks));
+
+	wifi = g_supplicant_interface_get_data(interface);
+
+	if (wifi == NULL)
+		return;
+
+	for (list = networks; list != NULL; list = list->next)
+		add_network(wifi, list->data);
+}
+
 static void network_removed(GSupplicantNetwork *network)
 {
 	GSupplicantInterface *interface;
@@ -966,6 +992,7 @@ static const GSupplicantCallbacks callbacks = {
 	.scan_started		= scan_started,
 	.scan_finished		= scan_finished,
 	.network_added		= network_added,
+	.networks_added		= networks_added,
 	.network_removed	= network_removed,
 	.network_changed	= network_changed,
 	.debug			= debug,
@@ -1204,6 +1231,10 @@ static int wifi_init(void)
 	if (err < 0)
 		return err;
 
+	g_supplicant_set_signal_filter(SIGNAL_WEIGHT,
+			connman_setting_get_uint("WiFiSignalHysteresis"),
+			connman_setting_get_uint("WiFiSignalInterval"));
+
 	err = g_supplicant_register(&callbacks);
 	if (err < 0) {
 		connman_network_driver_unregister(&network_driver);
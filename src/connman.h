@@ -27,6 +27,8 @@
 
 int __connman_dbus_init(DBusConnection *conn);
 void __connman_dbus_cleanup(void);
+void __connman_dbus_set_signal_window(unsigned int msec);
+void __connman_dbus_append_statistics(DBusMessageIter *dict);
 
 DBusMessage *__connman_error_failed(DBusMessage *msg, int errnum);
 DBusMessage *__connman_error_invalid_arguments(DBusMessage *msg);
@@ -634,6 +636,7 @@ enum connman_device_type __connman_rtnl_get_device_type(int index);
 unsigned int __connman_rtnl_update_interval_add(unsigned int interval);
 unsigned int __connman_rtnl_update_interval_remove(unsigned int interval);
 int __connman_rtnl_request_update(void);
+void __connman_rtnl_append_statistics(DBusMessageIter *dict);
 int __connman_rtnl_send(const void *buf, size_t len);
 
 connman_bool_t __connman_session_mode();
@@ -664,15 +667,38 @@ void __connman_stats_service_unregister(struct connman_service *service);
 int  __connman_stats_update(struct connman_service *service,
 				connman_bool_t roaming,
 				struct connman_stats_data *data);
+void __connman_stats_flush(struct connman_service *service);
 int __connman_stats_get(struct connman_service *service,
 				connman_bool_t roaming,
 				struct connman_stats_data *data);
 
+enum connman_iptables_operation {
+	CONNMAN_IPTABLES_APPEND		= 0,
+	CONNMAN_IPTABLES_FLUSH		= 1,
+	CONNMAN_IPTABLES_NEW_CHAIN	= 2,
+	CONNMAN_IPTABLES_DELETE_CHAIN	= 3,
+};
+
+struct connman_iptables_rule {
+	enum connman_iptables_operation operation;
+	const char *chain;
+	const char *in_interface;
+	const char *out_interface;
+	const char *source;
+	const char *destination;
+	const char *match;
+	const char *target;
+	const char **options;
+};
+
 int __connman_iptables_init(void);
 void __connman_iptables_cleanup(void);
 int __connman_iptables_command(const char *format, ...)
 				__attribute__((format(printf, 1, 2)));
 int __connman_iptables_commit(const char *table_name);
+int __connman_iptables_apply(const char *table_name,
+				const struct connman_iptables_rule *rules,
+							unsigned int count);
 
 int __connman_dnsproxy_init(void);
 void __connman_dnsproxy_cleanup(void);
@@ -681,6 +707,7 @@ void __connman_dnsproxy_remove_listener(const char *interface);
 int __connman_dnsproxy_append(const char *interface, const char *domain, const char *server);
 int __connman_dnsproxy_remove(const char *interface, const char *domain, const char *server);
 void __connman_dnsproxy_flush(void);
+void __connman_dnsproxy_append_statistics(DBusMessageIter *dict);
 
 int __connman_6to4_probe(struct connman_service *service);
 void __connman_6to4_remove(struct connman_ipconfig *ipconfig);
@@ -156,6 +156,10 @@ void connman_dbus_property_append_fixed_array(DBusMessageIter *iter,
 		variant_sig = DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_BYTE_AS_STRING;
 		array_sig = DBUS_TYPE_BYTE_AS_STRING;
 		break;
+	case DBUS_TYPE_UINT32:
+		variant_sig = DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_UINT32_AS_STRING;
+		array_sig = DBUS_TYPE_UINT32_AS_STRING;
+		break;
 	default:
 		return;
 	}
@@ -209,6 +213,142 @@ void connman_dbus_property_append_array(DBusMessageIter *iter,
 
 static DBusConnection *connection = NULL;
 
+/*
+ * PropertyChanged signals are not sent right away but collected until
+ * the main loop becomes idle, or until the configured window expires.
+ * A newer change of the same property of the same object replaces the
+ * queued one, so that only the latest value goes out.
+ */
+struct pending_signal {
+	char *id;
+	DBusMessage *message;
+};
+
+static GQueue pending_signals = G_QUEUE_INIT;
+static GHashTable *pending_table = NULL;
+static guint flush_source = 0;
+static unsigned int signal_window = 0;
+static unsigned int signals_emitted = 0;
+static unsigned int signals_suppressed = 0;
+
+static void pending_signal_free(struct pending_signal *pending)
+{
+	dbus_message_unref(pending->message);
+	g_free(pending->id);
+	g_free(pending);
+}
+
+static void send_signals(void)
+{
+	struct pending_signal *pending;
+
+	while ((pending = g_queue_pop_head(&pending_signals)) != NULL) {
+		g_hash_table_remove(pending_table, pending->id);
+
+		dbus_connection_send(connection, pending->message, NULL);
+		signals_emitted++;
+
+		pending_signal_free(pending);
+	}
+}
+
+static gboolean flush_signals(gpointer user_data)
+{
+	flush_source = 0;
+
+	send_signals();
+
+	return FALSE;
+}
+
+/*
+ * Called by gdbus before it sends any other message or unregisters
+ * an object, so that clients never see the queued signals out of
+ * order or for an object that is gone already.
+ */
+static void flush_pending(DBusConnection *conn)
+{
+	if (conn != connection || g_queue_is_empty(&pending_signals))
+		return;
+
+	if (flush_source > 0) {
+		g_source_remove(flush_source);
+		flush_source = 0;
+	}
+
+	send_signals();
+}
+
+static void queue_signal(DBusMessage *signal, const char *path,
+				const char *interface, const char *key)
+{
+	struct pending_signal *pending;
+	GList *link;
+	char *id;
+
+	if (connection == NULL || pending_table == NULL) {
+		g_dbus_send_message(connection, signal);
+		return;
+	}
+
+	id = g_strdup_printf("%s %s %s", path, interface, key);
+
+	link = g_hash_table_lookup(pending_table, id);
+	if (link != NULL) {
+		pending = link->data;
+
+		g_hash_table_remove(pending_table, id);
+		g_queue_delete_link(&pending_signals, link);
+		pending_signal_free(pending);
+
+		signals_suppressed++;
+	}
+
+	pending = g_try_new0(struct pending_signal, 1);
+	if (pending == NULL) {
+		g_free(id);
+		g_dbus_send_message(connection, signal);
+		return;
+	}
+
+	pending->id = id;
+	pending->message = signal;
+
+	g_queue_push_tail(&pending_signals, pending);
+	g_hash_table_insert(pending_table, pending->id,
+						pending_signals.tail);
+
+	if (flush_source > 0)
+		return;
+
+	if (signal_window > 0)
+		flush_source = g_timeout_add(signal_window,
+						flush_signals, NULL);
+	else
+		flush_source = g_idle_add(flush_signals, NULL);
+}
+
+void __connman_dbus_set_signal_window(unsigned int msec)
+{
+	DBG("window %u ms", msec);
+
+	signal_window = msec;
+}
+
+void __connman_dbus_append_statistics(DBusMessageIter *dict)
+{
+	unsigned int pending = g_queue_get_length(&pending_signals);
+
+	connman_dbus_dict_append_basic(dict, "SignalsEmitted",
+				DBUS_TYPE_UINT32, &signals_emitted);
+	connman_dbus_dict_append_basic(dict, "SignalsSuppressed",
+				DBUS_TYPE_UINT32, &signals_suppressed);
+	connman_dbus_dict_append_basic(dict, "SignalsPending",
+				DBUS_TYPE_UINT32, &pending);
+	connman_dbus_dict_append_basic(dict, "SignalWindow",
+				DBUS_TYPE_UINT32, &signal_window);
+}
+
 dbus_bool_t connman_dbus_property_changed_basic(const char *path,
 				const char *interface, const char *key,
 							int type, void *val)
@@ -226,7 +366,7 @@ dbus_bool_t connman_dbus_property_changed_basic(const char *path,
 	dbus_message_iter_init_append(signal, &iter);
 	connman_dbus_property_append_basic(&iter, key, type, val);
 
-	g_dbus_send_message(connection, signal);
+	queue_signal(signal, path, interface, key);
 
 	return TRUE;
 }
@@ -248,7 +388,7 @@ dbus_bool_t connman_dbus_property_changed_dict(const char *path,
 	dbus_message_iter_init_append(signal, &iter);
 	connman_dbus_property_append_dict(&iter, key, function, user_data);
 
-	g_dbus_send_message(connection, signal);
+	queue_signal(signal, path, interface, key);
 
 	return TRUE;
 }
@@ -271,7 +411,7 @@ dbus_bool_t connman_dbus_property_changed_array(const char *path,
 	connman_dbus_property_append_array(&iter, key, type,
 						function, user_data);
 
-	g_dbus_send_message(connection, signal);
+	queue_signal(signal, path, interface, key);
 
 	return TRUE;
 }
@@ -376,6 +516,10 @@ int __connman_dbus_init(DBusConnection *conn)
 
 	connection = conn;
 
+	pending_table = g_hash_table_new(g_str_hash, g_str_equal);
+
+	g_dbus_set_flush_function(flush_pending);
+
 	return 0;
 }
 
@@ -383,5 +527,19 @@ void __connman_dbus_cleanup(void)
 {
 	DBG("");
 
+	if (flush_source > 0) {
+		g_source_remove(flush_source);
+		flush_source = 0;
+	}
+
+	g_dbus_set_flush_function(NULL);
+
+	if (pending_table != NULL) {
+		send_signals();
+
+		g_hash_table_destroy(pending_table);
+		pending_table = NULL;
+	}
+
 	connection = NULL;
 }
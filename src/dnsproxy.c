@@ -23,6 +23,7 @@
 #include <config.h>
 #endif
 
+#define _GNU_SOURCE
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
@@ -31,7 +32,9 @@
 #include <netinet/in.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
+#include <time.h>
 
 #include <glib.h>
 
@@ -73,10 +76,15 @@ struct domain_hdr {
 #error "Unknown byte order"
 #endif
 
-struct partial_reply {
-	uint16_t len;
-	uint16_t received;
-	unsigned char buf[];
+/*
+ * Reassembly buffer for the length prefixed messages of a TCP stream.
+ * The size is always a power of two so that positions can be masked.
+ */
+struct reply_ring {
+	unsigned char *buf;
+	unsigned int size;
+	unsigned int head;
+	unsigned int len;
 };
 
 struct server_data {
@@ -89,7 +97,26 @@ struct server_data {
 	guint timeout;
 	gboolean enabled;
 	gboolean connected;
-	struct partial_reply *incoming_reply;
+	struct server_data *parent;	/* UDP server of a TCP connection */
+	GSList *tcp_pool;		/* TCP connections of a UDP server */
+	GSList *pending;		/* IDs waiting for the connection */
+	GSList *inflight;		/* IDs sent over the connection */
+	struct reply_ring ring;
+	unsigned int srtt;		/* smoothed RTT in usec */
+	unsigned int rttvar;		/* RTT variation in usec */
+	unsigned int failrate;		/* failure rate in 1/1000 */
+	unsigned int queries;
+	unsigned int answers;
+	unsigned int failures;
+};
+
+/* Header bits and EDNS0 options of a query that shape the answer */
+struct query_flags {
+	gboolean rd;
+	gboolean cd;
+	gboolean edns;
+	gboolean dnssec_ok;
+	uint16_t udp_size;
 };
 
 struct request_data {
@@ -107,6 +134,7 @@ struct request_data {
 	guint watch;
 	guint numserv;
 	guint numresp;
+	guint numconn;
 	gpointer request;
 	gsize request_len;
 	gpointer name;
@@ -114,6 +142,30 @@ struct request_data {
 	gsize resplen;
 	struct listener_data *ifdata;
 	gboolean append_domain;
+	struct query_flags flags;
+	char *key;
+	GSList *waiters;
+	GSList *attempts;
+	guint race_timeout;
+};
+
+/* An upstream server a UDP request has been sent to */
+struct request_attempt {
+	struct server_data *server;
+	guint64 sent;
+	gboolean answered;
+	guint pending;
+};
+
+/* A UDP client attached to an identical request already in flight */
+struct request_waiter {
+	union {
+		struct sockaddr_in6 __sin6; /* Only for the length */
+		struct sockaddr sa;
+	};
+	socklen_t sa_len;
+	guint16 srcid;
+	struct listener_data *ifdata;
 };
 
 struct listener_data {
@@ -124,12 +176,114 @@ struct listener_data {
 	guint tcp_listener_watch;
 };
 
+struct cache_entry {
+	char *key;
+	time_t inserted;
+	time_t expire;
+	gboolean negative;
+	unsigned char *data;
+	unsigned int data_len;
+	GList *lru;
+};
+
+struct cache_stats {
+	unsigned int hits;
+	unsigned int negative_hits;
+	unsigned int misses;
+	unsigned int insertions;
+	unsigned int evictions;
+	unsigned int flushes;
+};
+
+#ifndef HAVE_RECVMMSG
+struct mmsghdr {
+	struct msghdr msg_hdr;
+	unsigned int msg_len;
+};
+#endif
+
+/*
+ * Up to DNS_BATCH_SIZE datagrams are read per wakeup of a UDP socket,
+ * and the datagrams sent while handling them are flushed together.
+ */
+#define DNS_BATCH_SIZE		16
+#define DNS_BATCH_BUCKETS	5
+
+struct send_batch {
+	int sk;
+	unsigned int count;
+	struct mmsghdr msgs[DNS_BATCH_SIZE];
+	struct iovec iov[DNS_BATCH_SIZE];
+	struct sockaddr_in6 addr[DNS_BATCH_SIZE];
+};
+
+struct recv_batch {
+	struct mmsghdr msgs[DNS_BATCH_SIZE];
+	struct iovec iov[DNS_BATCH_SIZE];
+	struct sockaddr_in6 addr[DNS_BATCH_SIZE];
+};
+
+enum batch_type {
+	BATCH_LISTENER_RECV,
+	BATCH_SERVER_RECV,
+	BATCH_SEND,
+	BATCH_MAX,
+};
+
+#define DNS_TYPE_SOA	6
+#define DNS_TYPE_OPT	41
+
+#define DNS_RCODE_NOERROR	0
+#define DNS_RCODE_SERVFAIL	2
+#define DNS_RCODE_NXDOMAIN	3
+#define DNS_RCODE_REFUSED	5
+
+/* RFC 2308 suggests not to keep negative answers longer than 3 hours */
+#define CACHE_MAX_NEGATIVE_TTL	(3 * 60 * 60)
+#define CACHE_MAX_TTL		(24 * 60 * 60)
+
+#define SERVER_RTO_INITIAL	400000
+#define SERVER_RTO_MIN		50000
+#define SERVER_RTO_MAX		2000000
+
+#define TCP_POOL_SIZE		2
+#define TCP_PIPELINE_DEPTH	8
+#define TCP_IDLE_TIMEOUT	30
+#define TCP_RING_MIN_SIZE	4096
+#define TCP_RING_MAX_SIZE	(128 * 1024)
+
 static GSList *server_list = NULL;
-static GSList *request_list = NULL;
 static GSList *request_pending_list = NULL;
 static guint16 request_id = 0x0000;
 static GHashTable *listener_table = NULL;
 
+/*
+ * In-flight requests are indexed by their (always even) upstream ID,
+ * the alternate ID used for appended domains is that ID plus one.
+ */
+static GHashTable *request_table = NULL;
+
+/* UDP and connected TCP servers indexed by interface, address and protocol */
+static GHashTable *server_table = NULL;
+
+/* UDP requests in flight indexed by their (qname, qtype, qclass) */
+static GHashTable *coalesce_table = NULL;
+static unsigned int coalesced_requests = 0;
+
+static unsigned int tcp_connects = 0;
+static unsigned int tcp_reused = 0;
+
+static gboolean batching = FALSE;
+static GSList *send_batches = NULL;
+static gboolean mmsg_supported = TRUE;
+static unsigned int batch_histogram[BATCH_MAX][DNS_BATCH_BUCKETS];
+
+static GHashTable *cache = NULL;
+static GQueue cache_lru = G_QUEUE_INIT;
+static unsigned int cache_size = 0;
+static unsigned int cache_limit = 0;
+static struct cache_stats cache_stats;
+
 static int protocol_offset(int protocol)
 {
 	switch (protocol) {
@@ -146,48 +300,350 @@ static int protocol_offset(int protocol)
 }
 
 static struct request_data *find_request(guint16 id)
+{
+	struct request_data *req;
+
+	req = g_hash_table_lookup(request_table, GUINT_TO_POINTER(id & ~1));
+	if (req == NULL)
+		return NULL;
+
+	if (req->dstid == id || req->altid == id)
+		return req;
+
+	return NULL;
+}
+
+static void insert_request(struct request_data *req)
+{
+	g_hash_table_replace(request_table,
+				GUINT_TO_POINTER(req->dstid), req);
+}
+
+static void remove_request(struct request_data *req)
+{
+	gpointer key = GUINT_TO_POINTER(req->dstid);
+
+	/* The ID might have been handed out again in the meantime */
+	if (g_hash_table_lookup(request_table, key) == req)
+		g_hash_table_remove(request_table, key);
+
+	if (req->key != NULL &&
+			g_hash_table_lookup(coalesce_table, req->key) == req)
+		g_hash_table_remove(coalesce_table, req->key);
+}
+
+static void request_free(struct request_data *req)
 {
 	GSList *list;
 
-	for (list = request_list; list; list = list->next) {
-		struct request_data *req = list->data;
+	for (list = req->waiters; list; list = list->next)
+		g_free(list->data);
+
+	g_slist_free(req->waiters);
+
+	for (list = req->attempts; list; list = list->next)
+		g_free(list->data);
+
+	g_slist_free(req->attempts);
+
+	if (req->race_timeout > 0)
+		g_source_remove(req->race_timeout);
+
+	g_free(req->key);
+	g_free(req->resp);
+	g_free(req->request);
+	g_free(req->name);
+	g_free(req);
+}
+
+/*
+ * Pick the next even upstream ID which is not used by any request
+ * still in flight. Returns 0 if the whole ID space is in use.
+ */
+static guint16 get_request_id(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < 0x8000; i++) {
+		request_id += 2;
+		if (request_id == 0x0000)
+			continue;
 
-		if (req->dstid == id || req->altid == id)
-			return req;
+		if (g_hash_table_lookup(request_table,
+				GUINT_TO_POINTER(request_id)) == NULL)
+			return request_id;
 	}
 
-	return NULL;
+	return 0;
+}
+
+static char *server_key(const char *interface, const char *server,
+							int protocol)
+{
+	return g_strdup_printf("%s/%s/%d", interface ? interface : "",
+							server, protocol);
 }
 
 static struct server_data *find_server(const char *interface,
 					const char *server,
 						int protocol)
 {
-	GSList *list;
+	struct server_data *data;
+	char *key;
 
 	DBG("interface %s server %s", interface, server);
 
+	if (server == NULL)
+		return NULL;
+
+	key = server_key(interface, server, protocol);
+	data = g_hash_table_lookup(server_table, key);
+	g_free(key);
+
+	return data;
+}
+
+static void index_server(struct server_data *data)
+{
+	char *key;
+
+	key = server_key(data->interface, data->server, data->protocol);
+
+	/* Like a list walk, the first registered server wins */
+	if (g_hash_table_lookup(server_table, key) != NULL) {
+		g_free(key);
+		return;
+	}
+
+	g_hash_table_insert(server_table, key, data);
+}
+
+static void unindex_server(struct server_data *data)
+{
+	GSList *list;
+	char *key;
+
+	key = server_key(data->interface, data->server, data->protocol);
+
+	if (g_hash_table_lookup(server_table, key) != data) {
+		g_free(key);
+		return;
+	}
+
+	g_hash_table_remove(server_table, key);
+
+	/* Promote another connection to the same server, if any */
 	for (list = server_list; list; list = list->next) {
-		struct server_data *data = list->data;
+		struct server_data *other = list->data;
 
-		if (interface == NULL && data->interface == NULL &&
-				g_str_equal(data->server, server) == TRUE &&
-				data->protocol == protocol)
-			return data;
+		if (other == data || other->protocol != data->protocol)
+			continue;
 
-		if (interface == NULL ||
-				data->interface == NULL || data->server == NULL)
+		if (g_strcmp0(other->interface, data->interface) != 0 ||
+				g_strcmp0(other->server, data->server) != 0)
 			continue;
 
-		if (g_str_equal(data->interface, interface) == TRUE &&
-				g_str_equal(data->server, server) == TRUE &&
-				data->protocol == protocol)
-			return data;
+		g_hash_table_insert(server_table, key, other);
+		return;
 	}
 
-	return NULL;
+	g_free(key);
+}
+
+
+static void batch_account(enum batch_type type, unsigned int count)
+{
+	unsigned int bucket;
+
+	if (count == 0)
+		return;
+
+	/* Buckets hold 1, 2-3, 4-7, 8-15 and 16 or more datagrams */
+	bucket = g_bit_storage(count) - 1;
+	if (bucket >= DNS_BATCH_BUCKETS)
+		bucket = DNS_BATCH_BUCKETS - 1;
+
+	batch_histogram[type][bucket]++;
+}
+
+static void send_batch_flush(struct send_batch *batch)
+{
+	unsigned int i, sent = 0;
+
+	if (batch->count == 0)
+		return;
+
+#ifdef HAVE_SENDMMSG
+	while (mmsg_supported == TRUE && sent < batch->count) {
+		int err;
+
+		err = sendmmsg(batch->sk, batch->msgs + sent,
+						batch->count - sent, 0);
+		if (err >= 0) {
+			sent += err;
+			continue;
+		}
+
+		if (errno == ENOSYS) {
+			mmsg_supported = FALSE;
+			break;
+		}
+
+		if (errno == EINTR)
+			continue;
+
+		/* Drop the datagram that failed and go on with the rest */
+		connman_error("Failed to send DNS message: %s",
+							strerror(errno));
+		sent++;
+	}
+#endif
+
+	for (i = sent; i < batch->count; i++) {
+		struct msghdr *hdr = &batch->msgs[i].msg_hdr;
+
+		if (sendto(batch->sk, hdr->msg_iov->iov_base,
+					hdr->msg_iov->iov_len, 0,
+					hdr->msg_name, hdr->msg_namelen) < 0)
+			connman_error("Failed to send DNS message: %s",
+							strerror(errno));
+	}
+
+	batch_account(BATCH_SEND, batch->count);
+
+	for (i = 0; i < batch->count; i++)
+		g_free(batch->iov[i].iov_base);
+
+	batch->count = 0;
+}
+
+static void flush_send_batches(void)
+{
+	GSList *list;
+
+	for (list = send_batches; list; list = list->next) {
+		struct send_batch *batch = list->data;
+
+		send_batch_flush(batch);
+		g_free(batch);
+	}
+
+	g_slist_free(send_batches);
+	send_batches = NULL;
+}
+
+/*
+ * Send a datagram on a UDP socket. While a batch of incoming datagrams
+ * is being handled, the message is queued per socket and sent together
+ * with the others once the batch is done.
+ */
+static int dns_send(int sk, const void *buf, size_t len,
+				const struct sockaddr *to, socklen_t tolen)
+{
+	struct send_batch *batch = NULL;
+	struct msghdr *hdr;
+	GSList *list;
+
+	if (batching == FALSE || tolen > sizeof(struct sockaddr_in6))
+		return sendto(sk, buf, len, 0, to, tolen);
+
+	for (list = send_batches; list; list = list->next) {
+		struct send_batch *tmp = list->data;
+
+		if (tmp->sk == sk) {
+			batch = tmp;
+			break;
+		}
+	}
+
+	if (batch == NULL) {
+		batch = g_try_new0(struct send_batch, 1);
+		if (batch == NULL)
+			return sendto(sk, buf, len, 0, to, tolen);
+
+		batch->sk = sk;
+		send_batches = g_slist_prepend(send_batches, batch);
+	}
+
+	if (batch->count == DNS_BATCH_SIZE)
+		send_batch_flush(batch);
+
+	batch->iov[batch->count].iov_base = g_try_malloc(len);
+	if (batch->iov[batch->count].iov_base == NULL)
+		return sendto(sk, buf, len, 0, to, tolen);
+
+	memcpy(batch->iov[batch->count].iov_base, buf, len);
+	batch->iov[batch->count].iov_len = len;
+
+	hdr = &batch->msgs[batch->count].msg_hdr;
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->msg_iov = &batch->iov[batch->count];
+	hdr->msg_iovlen = 1;
+
+	if (to != NULL) {
+		memcpy(&batch->addr[batch->count], to, tolen);
+		hdr->msg_name = &batch->addr[batch->count];
+		hdr->msg_namelen = tolen;
+	}
+
+	batch->count++;
+
+	return len;
+}
+
+static void recv_batch_setup(struct recv_batch *batch,
+				unsigned char *buf, size_t size)
+{
+	unsigned int i;
+
+	for (i = 0; i < DNS_BATCH_SIZE; i++) {
+		struct msghdr *hdr = &batch->msgs[i].msg_hdr;
+
+		batch->iov[i].iov_base = buf + i * size;
+		batch->iov[i].iov_len = size;
+
+		memset(hdr, 0, sizeof(*hdr));
+		hdr->msg_iov = &batch->iov[i];
+		hdr->msg_iovlen = 1;
+		hdr->msg_name = &batch->addr[i];
+		hdr->msg_namelen = sizeof(batch->addr[i]);
+	}
 }
 
+/*
+ * Drain up to DNS_BATCH_SIZE datagrams from a socket. Without
+ * recvmmsg() support a single datagram is read per wakeup.
+ */
+static int recv_datagrams(int sk, struct recv_batch *batch)
+{
+	unsigned int i;
+	int len;
+
+	for (i = 0; i < DNS_BATCH_SIZE; i++)
+		batch->msgs[i].msg_hdr.msg_namelen =
+					sizeof(batch->addr[i]);
+
+#ifdef HAVE_RECVMMSG
+	if (mmsg_supported == TRUE) {
+		int count;
+
+		count = recvmmsg(sk, batch->msgs, DNS_BATCH_SIZE,
+							MSG_DONTWAIT, NULL);
+		if (count >= 0 || errno != ENOSYS)
+			return count;
+
+		mmsg_supported = FALSE;
+	}
+#endif
+
+	len = recvmsg(sk, &batch->msgs[0].msg_hdr, 0);
+	if (len < 0)
+		return len;
+
+	batch->msgs[0].msg_len = len;
+
+	return 1;
+}
 
 static void send_response(int sk, unsigned char *buf, int len,
 				const struct sockaddr *to, socklen_t tolen,
@@ -204,72 +660,850 @@ static void send_response(int sk, unsigned char *buf, int len,
 	if (len < 12)
 		return;
 
-	hdr = (void *) (buf + offset);
+	hdr = (void *) (buf + offset);
+
+	DBG("id 0x%04x qr %d opcode %d", hdr->id, hdr->qr, hdr->opcode);
+
+	hdr->qr = 1;
+	hdr->rcode = 2;
+
+	hdr->ancount = 0;
+	hdr->nscount = 0;
+	hdr->arcount = 0;
+
+	if (protocol == IPPROTO_UDP)
+		err = dns_send(sk, buf, len, to, tolen);
+	else
+		err = sendto(sk, buf, len, 0, to, tolen);
+	if (err < 0) {
+		connman_error("Failed to send DNS response: %s",
+				strerror(errno));
+		return;
+	}
+}
+
+static time_t cache_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec;
+}
+
+static int skip_name(const unsigned char *msg, int len, int offset)
+{
+	while (offset < len) {
+		uint8_t label = msg[offset];
+
+		if ((label & 0xc0) == 0xc0)
+			return offset + 2 <= len ? offset + 2 : -EINVAL;
+
+		if (label == 0x00)
+			return offset + 1;
+
+		offset += label + 1;
+	}
+
+	return -EINVAL;
+}
+
+static void get_query_flags(unsigned char *msg, int len,
+					struct query_flags *flags);
+
+/*
+ * The cache key is built from the question section of a message,
+ * so requests and replies for the same (qname, qtype, qclass) map
+ * onto the same entry. The name is kept in its lowercased wire
+ * format, whose length prefixes keep labels containing dots apart
+ * from the labels they would otherwise be joined from.
+ *
+ * Servers echo the OPT record, the DO bit and the CD bit of a query
+ * in their reply, so these are part of the key as well. A client
+ * without EDNS0 never gets an OPT record it did not ask for, and
+ * DNSSEC answers are kept apart from plain ones.
+ */
+static char *get_cache_key(unsigned char *msg, int len)
+{
+	const struct domain_hdr *hdr = (const void *) msg;
+	struct query_flags flags;
+	GString *key;
+	int offset = sizeof(struct domain_hdr);
+	int end;
+	uint16_t qtype, qclass;
+
+	if (len < offset || ntohs(hdr->qdcount) != 1)
+		return NULL;
+
+	end = skip_name(msg, len, offset);
+	if (end < 0 || end + 4 > len)
+		return NULL;
+
+	qtype = msg[end] << 8 | msg[end + 1];
+	qclass = msg[end + 2] << 8 | msg[end + 3];
+
+	get_query_flags(msg, len, &flags);
+
+	key = g_string_sized_new(64);
+
+	g_string_append_printf(key, "%u %u %c%c%c ", qtype, qclass,
+				flags.edns == TRUE ? 'e' : '-',
+				flags.dnssec_ok == TRUE ? 'd' : '-',
+				flags.cd == TRUE ? 'c' : '-');
+
+	while (offset < len) {
+		uint8_t label = msg[offset];
+		int i;
+
+		if (label == 0x00)
+			break;
+
+		/* Compression is not expected in the question */
+		if ((label & 0xc0) != 0 || offset + label + 1 > len)
+			goto fail;
+
+		g_string_append_c(key, label);
+
+		for (i = 1; i <= label; i++) {
+			/* The key is a string, such names are not cached */
+			if (msg[offset + i] == '\0')
+				goto fail;
+
+			g_string_append_c(key,
+					g_ascii_tolower(msg[offset + i]));
+		}
+
+		offset += label + 1;
+	}
+
+	return g_string_free(key, FALSE);
+
+fail:
+	g_string_free(key, TRUE);
+
+	return NULL;
+}
+
+/*
+ * Walk the resource records of a reply and call func for each of
+ * them with the offset of its fixed (type, class, ttl, rdlength) part.
+ * Returns the offset right after the last record or a negative error.
+ */
+static int foreach_rr(unsigned char *msg, int len, unsigned int count,
+				int offset,
+				void (*func)(unsigned char *rr, int rdlen,
+							void *user_data),
+				void *user_data)
+{
+	while (count-- > 0) {
+		int rdlen;
+
+		offset = skip_name(msg, len, offset);
+		if (offset < 0 || offset + 10 > len)
+			return -EINVAL;
+
+		rdlen = msg[offset + 8] << 8 | msg[offset + 9];
+		if (offset + 10 + rdlen > len)
+			return -EINVAL;
+
+		func(msg + offset, rdlen, user_data);
+
+		offset += 10 + rdlen;
+	}
+
+	return offset;
+}
+
+struct edns_info {
+	gboolean found;
+	uint16_t udp_size;
+	gboolean dnssec_ok;
+};
+
+static void rr_edns(unsigned char *rr, int rdlen, void *user_data)
+{
+	struct edns_info *edns = user_data;
+	uint16_t type = rr[0] << 8 | rr[1];
+
+	if (type != DNS_TYPE_OPT || edns->found == TRUE)
+		return;
+
+	/* The class is the UDP size, the DO bit tops the TTL flags */
+	edns->found = TRUE;
+	edns->udp_size = rr[2] << 8 | rr[3];
+	edns->dnssec_ok = (rr[6] & 0x80) != 0;
+}
+
+/* Looks up the OPT record in the additional section of a message */
+static int get_edns(unsigned char *msg, int len, struct edns_info *edns)
+{
+	struct domain_hdr *hdr = (void *) msg;
+	int offset;
+
+	memset(edns, 0, sizeof(*edns));
+
+	if (len < (int) sizeof(struct domain_hdr) || hdr->arcount == 0)
+		return 0;
+
+	offset = skip_name(msg, len, sizeof(struct domain_hdr));
+	if (offset < 0 || offset + 4 > len)
+		return -EINVAL;
+
+	offset = foreach_rr(msg, len, ntohs(hdr->ancount) +
+					ntohs(hdr->nscount), offset + 4,
+					rr_edns, edns);
+	if (offset < 0)
+		return offset;
+
+	offset = foreach_rr(msg, len, ntohs(hdr->arcount), offset,
+							rr_edns, edns);
+	if (offset < 0)
+		return offset;
+
+	return 0;
+}
+
+static void get_query_flags(unsigned char *msg, int len,
+					struct query_flags *flags)
+{
+	struct edns_info edns;
+
+	memset(flags, 0, sizeof(*flags));
+
+	if (len < (int) sizeof(struct domain_hdr))
+		return;
+
+	flags->rd = (msg[2] & 0x01) != 0;
+	flags->cd = (msg[3] & 0x10) != 0;
+
+	if (get_edns(msg, len, &edns) == 0 && edns.found == TRUE) {
+		flags->edns = TRUE;
+		flags->dnssec_ok = edns.dnssec_ok;
+		flags->udp_size = edns.udp_size;
+	}
+}
+
+static gboolean query_flags_equal(const struct query_flags *a,
+					const struct query_flags *b)
+{
+	return a->rd == b->rd && a->cd == b->cd && a->edns == b->edns &&
+			a->dnssec_ok == b->dnssec_ok &&
+			a->udp_size == b->udp_size;
+}
+
+static inline uint32_t rr_ttl(const unsigned char *rr)
+{
+	return rr[4] << 24 | rr[5] << 16 | rr[6] << 8 | rr[7];
+}
+
+static void rr_min_ttl(unsigned char *rr, int rdlen, void *user_data)
+{
+	uint32_t *ttl = user_data;
+	uint16_t type = rr[0] << 8 | rr[1];
+
+	if (type == DNS_TYPE_OPT)
+		return;
+
+	if (rr_ttl(rr) < *ttl)
+		*ttl = rr_ttl(rr);
+}
+
+static void rr_soa_ttl(unsigned char *rr, int rdlen, void *user_data)
+{
+	uint32_t *ttl = user_data;
+	uint16_t type = rr[0] << 8 | rr[1];
+	const unsigned char *minimum;
+	uint32_t soa_ttl;
+
+	if (type != DNS_TYPE_SOA || rdlen < 20)
+		return;
+
+	/* MINIMUM is the last field of the SOA RDATA */
+	minimum = rr + 10 + rdlen - 4;
+	soa_ttl = minimum[0] << 24 | minimum[1] << 16 |
+					minimum[2] << 8 | minimum[3];
+
+	if (rr_ttl(rr) < soa_ttl)
+		soa_ttl = rr_ttl(rr);
+
+	if (soa_ttl < *ttl)
+		*ttl = soa_ttl;
+}
+
+static void rr_age_ttl(unsigned char *rr, int rdlen, void *user_data)
+{
+	uint32_t *elapsed = user_data;
+	uint16_t type = rr[0] << 8 | rr[1];
+	uint32_t ttl;
+
+	if (type == DNS_TYPE_OPT)
+		return;
+
+	ttl = rr_ttl(rr);
+	ttl = ttl > *elapsed ? ttl - *elapsed : 0;
+
+	rr[4] = ttl >> 24;
+	rr[5] = ttl >> 16;
+	rr[6] = ttl >> 8;
+	rr[7] = ttl;
+}
+
+/*
+ * Figure out for how long a reply may be cached. Positive answers
+ * use the smallest TTL of the answer section, negative answers
+ * (NXDOMAIN or NODATA) use the SOA record of the authority section
+ * as described in RFC 2308. Replies without such information are
+ * not cached at all.
+ */
+static int get_reply_ttl(unsigned char *msg, int len,
+				uint32_t *ttl, gboolean *negative)
+{
+	struct domain_hdr *hdr = (void *) msg;
+	int offset;
+
+	if (len < (int) sizeof(struct domain_hdr))
+		return -EINVAL;
+
+	if (hdr->tc == 1 || ntohs(hdr->qdcount) != 1)
+		return -EINVAL;
+
+	if (hdr->rcode != DNS_RCODE_NOERROR &&
+				hdr->rcode != DNS_RCODE_NXDOMAIN)
+		return -EINVAL;
+
+	offset = skip_name(msg, len, sizeof(struct domain_hdr));
+	if (offset < 0 || offset + 4 > len)
+		return -EINVAL;
+
+	offset += 4;
+
+	*ttl = G_MAXUINT32;
+
+	if (hdr->rcode == DNS_RCODE_NOERROR && hdr->ancount != 0) {
+		*negative = FALSE;
+
+		offset = foreach_rr(msg, len, ntohs(hdr->ancount), offset,
+							rr_min_ttl, ttl);
+		if (offset < 0)
+			return offset;
+
+		if (*ttl > CACHE_MAX_TTL)
+			*ttl = CACHE_MAX_TTL;
+	} else {
+		*negative = TRUE;
+
+		offset = foreach_rr(msg, len, ntohs(hdr->ancount), offset,
+							rr_min_ttl, ttl);
+		if (offset < 0)
+			return offset;
+
+		*ttl = G_MAXUINT32;
+
+		offset = foreach_rr(msg, len, ntohs(hdr->nscount), offset,
+							rr_soa_ttl, ttl);
+		if (offset < 0)
+			return offset;
+
+		if (*ttl > CACHE_MAX_NEGATIVE_TTL)
+			*ttl = CACHE_MAX_NEGATIVE_TTL;
+	}
+
+	if (*ttl == 0)
+		return -EINVAL;
+
+	return 0;
+}
+
+static void age_reply(unsigned char *msg, int len, uint32_t elapsed)
+{
+	struct domain_hdr *hdr = (void *) msg;
+	unsigned int count;
+	int offset;
+
+	offset = skip_name(msg, len, sizeof(struct domain_hdr));
+	if (offset < 0)
+		return;
+
+	count = ntohs(hdr->ancount) + ntohs(hdr->nscount) +
+						ntohs(hdr->arcount);
+
+	foreach_rr(msg, len, count, offset + 4, rr_age_ttl, &elapsed);
+}
+
+static void cache_entry_free(gpointer data)
+{
+	struct cache_entry *entry = data;
+
+	cache_size -= entry->data_len + strlen(entry->key) + sizeof(*entry);
+
+	g_queue_delete_link(&cache_lru, entry->lru);
+
+	g_free(entry->data);
+	g_free(entry->key);
+	g_free(entry);
+}
+
+static void cache_flush(void)
+{
+	if (cache == NULL)
+		return;
+
+	DBG("entries %u size %u", g_hash_table_size(cache), cache_size);
+
+	g_hash_table_remove_all(cache);
+
+	cache_stats.flushes++;
+}
+
+static void cache_update(unsigned char *msg, int len)
+{
+	struct cache_entry *entry;
+	unsigned int entry_size;
+	gboolean negative;
+	uint32_t ttl;
+	char *key;
+
+	if (cache == NULL || cache_limit == 0)
+		return;
+
+	if (get_reply_ttl(msg, len, &ttl, &negative) < 0)
+		return;
+
+	key = get_cache_key(msg, len);
+	if (key == NULL)
+		return;
+
+	entry_size = len + strlen(key) + sizeof(*entry);
+	if (entry_size > cache_limit) {
+		g_free(key);
+		return;
+	}
+
+	g_hash_table_remove(cache, key);
+
+	while (cache_size + entry_size > cache_limit) {
+		struct cache_entry *last = g_queue_peek_tail(&cache_lru);
+
+		if (last == NULL)
+			break;
+
+		g_hash_table_remove(cache, last->key);
+		cache_stats.evictions++;
+	}
+
+	entry = g_try_new0(struct cache_entry, 1);
+	if (entry == NULL) {
+		g_free(key);
+		return;
+	}
+
+	entry->data = g_try_malloc(len);
+	if (entry->data == NULL) {
+		g_free(entry);
+		g_free(key);
+		return;
+	}
+
+	memcpy(entry->data, msg, len);
+	entry->data_len = len;
+	entry->key = key;
+	entry->negative = negative;
+	entry->inserted = cache_time();
+	entry->expire = entry->inserted + ttl;
+
+	g_queue_push_head(&cache_lru, entry);
+	entry->lru = g_queue_peek_head_link(&cache_lru);
+
+	cache_size += entry_size;
+
+	g_hash_table_replace(cache, entry->key, entry);
+
+	cache_stats.insertions++;
+
+	DBG("%s ttl %u negative %d", key, ttl, negative);
+}
+
+/*
+ * Answer a request straight from the cache. The cached reply is
+ * handed out with the ID of the client and with TTLs reduced by the
+ * time the entry spent in the cache.
+ */
+static int cache_reply(const char *key, unsigned char *request,
+				int request_len, int sk,
+				const struct sockaddr *to, socklen_t tolen,
+				int protocol)
+{
+	struct cache_entry *entry;
+	struct domain_hdr *hdr;
+	unsigned char *reply;
+	int err, end, offset = protocol_offset(protocol);
+	time_t now;
+
+	if (cache == NULL || key == NULL || offset < 0)
+		return -EINVAL;
+
+	entry = g_hash_table_lookup(cache, key);
+
+	if (entry == NULL) {
+		cache_stats.misses++;
+		return -ENOENT;
+	}
+
+	now = cache_time();
+
+	if (entry->expire <= now) {
+		g_hash_table_remove(cache, entry->key);
+		cache_stats.misses++;
+		return -ENOENT;
+	}
+
+	hdr = (void *) (request + offset);
+
+	/* Without EDNS0 the client can not take more than 512 bytes */
+	if (protocol == IPPROTO_UDP && entry->data_len > 512 &&
+						hdr->arcount == 0) {
+		cache_stats.misses++;
+		return -ENOENT;
+	}
+
+	reply = g_try_malloc(offset + entry->data_len);
+	if (reply == NULL)
+		return -ENOMEM;
+
+	memcpy(reply + offset, entry->data, entry->data_len);
+
+	if (protocol == IPPROTO_TCP) {
+		reply[0] = entry->data_len >> 8;
+		reply[1] = entry->data_len & 0xff;
+	}
+
+	/* Keep the ID of the client request */
+	reply[offset] = request[offset];
+	reply[offset + 1] = request[offset + 1];
+
+	/*
+	 * The names only differ in case, so the question of the client
+	 * fits in place of the cached one.
+	 */
+	end = skip_name(request + offset, request_len - offset,
+					sizeof(struct domain_hdr));
+	if (end > (int) sizeof(struct domain_hdr) &&
+					end <= (int) entry->data_len)
+		memcpy(reply + offset + sizeof(struct domain_hdr),
+			request + offset + sizeof(struct domain_hdr),
+			end - sizeof(struct domain_hdr));
+
+	age_reply(reply + offset, entry->data_len, now - entry->inserted);
+
+	g_queue_unlink(&cache_lru, entry->lru);
+	g_queue_push_head_link(&cache_lru, entry->lru);
+
+	if (entry->negative == TRUE)
+		cache_stats.negative_hits++;
+	else
+		cache_stats.hits++;
+
+	DBG("%s", entry->key);
+
+	if (protocol == IPPROTO_UDP)
+		err = dns_send(sk, reply, offset + entry->data_len, to, tolen);
+	else
+		err = sendto(sk, reply, offset + entry->data_len, 0,
+								to, tolen);
+
+	g_free(reply);
+
+	if (err < 0) {
+		connman_error("Failed to send cached DNS response: %s",
+							strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
+static guint64 time_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (guint64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* How long to wait for a server before asking the next one as well */
+static unsigned int server_rto(struct server_data *server)
+{
+	unsigned int rto;
+
+	if (server->answers == 0)
+		return SERVER_RTO_INITIAL;
+
+	rto = server->srtt + 4 * server->rttvar;
+
+	return CLAMP(rto, SERVER_RTO_MIN, SERVER_RTO_MAX);
+}
+
+/*
+ * Lower is better. Servers which were never asked come first so
+ * that every server gets measured at least once.
+ */
+static guint64 server_score(struct server_data *server)
+{
+	if (server->answers == 0 && server->failures == 0)
+		return 0;
+
+	if (server->answers == 0)
+		return G_MAXUINT64;
+
+	return (guint64) server->srtt * (1000 + 4 * server->failrate) / 1000;
+}
+
+static void server_answered(struct server_data *server, unsigned int rtt)
+{
+	unsigned int delta;
+
+	if (server->answers == 0) {
+		server->srtt = rtt;
+		server->rttvar = rtt / 2;
+	} else {
+		delta = rtt > server->srtt ? rtt - server->srtt :
+							server->srtt - rtt;
+		server->rttvar = (3 * server->rttvar + delta) / 4;
+		server->srtt = (7 * server->srtt + rtt) / 8;
+	}
+
+	server->answers++;
+	server->failrate -= server->failrate / 8;
+
+	DBG("server %s rtt %u srtt %u rttvar %u", server->server,
+				rtt, server->srtt, server->rttvar);
+}
+
+/*
+ * A server which did not answer within its timeout is slow, not
+ * necessarily broken. Its RTT estimate is pushed up so that faster
+ * servers are preferred, but no failure is counted.
+ */
+static void server_slow(struct server_data *server, unsigned int waited)
+{
+	if (server->answers == 0 || waited <= server->srtt)
+		return;
+
+	server->srtt = (7 * server->srtt + waited) / 8;
+
+	DBG("server %s waited %u srtt %u", server->server, waited,
+							server->srtt);
+}
+
+static void server_failed(struct server_data *server)
+{
+	server->failures++;
+	server->failrate += (1000 - server->failrate) / 8;
+
+	DBG("server %s failure rate %u", server->server, server->failrate);
+}
+
+static void append_server_statistics(DBusMessageIter *dict, void *user_data)
+{
+	struct server_data *server = user_data;
+	unsigned int rtt = server->srtt / 1000;
+	unsigned int rttvar = server->rttvar / 1000;
+	unsigned int rto = server_rto(server) / 1000;
+
+	if (server->interface != NULL)
+		connman_dbus_dict_append_basic(dict, "Interface",
+					DBUS_TYPE_STRING, &server->interface);
+	connman_dbus_dict_append_basic(dict, "Enabled",
+					DBUS_TYPE_BOOLEAN, &server->enabled);
+	connman_dbus_dict_append_basic(dict, "Queries",
+					DBUS_TYPE_UINT32, &server->queries);
+	connman_dbus_dict_append_basic(dict, "Answers",
+					DBUS_TYPE_UINT32, &server->answers);
+	connman_dbus_dict_append_basic(dict, "Failures",
+					DBUS_TYPE_UINT32, &server->failures);
+	connman_dbus_dict_append_basic(dict, "FailureRate",
+					DBUS_TYPE_UINT32, &server->failrate);
+	connman_dbus_dict_append_basic(dict, "RTT",
+					DBUS_TYPE_UINT32, &rtt);
+	connman_dbus_dict_append_basic(dict, "RTTVariation",
+					DBUS_TYPE_UINT32, &rttvar);
+	connman_dbus_dict_append_basic(dict, "Timeout",
+					DBUS_TYPE_UINT32, &rto);
+}
+
+static void append_servers(DBusMessageIter *dict, void *user_data)
+{
+	GSList *list;
+
+	for (list = server_list; list; list = list->next) {
+		struct server_data *server = list->data;
+
+		connman_dbus_dict_append_dict(dict, server->server,
+					append_server_statistics, server);
+	}
+}
+
+void __connman_dnsproxy_append_statistics(DBusMessageIter *dict)
+{
+	unsigned int *listener_batches = batch_histogram[BATCH_LISTENER_RECV];
+	unsigned int *server_batches = batch_histogram[BATCH_SERVER_RECV];
+	unsigned int *send_batches_histogram = batch_histogram[BATCH_SEND];
+	unsigned int entries = 0;
+
+	if (cache != NULL)
+		entries = g_hash_table_size(cache);
+
+	connman_dbus_dict_append_basic(dict, "CacheHits",
+					DBUS_TYPE_UINT32, &cache_stats.hits);
+	connman_dbus_dict_append_basic(dict, "CacheNegativeHits",
+				DBUS_TYPE_UINT32, &cache_stats.negative_hits);
+	connman_dbus_dict_append_basic(dict, "CacheMisses",
+					DBUS_TYPE_UINT32, &cache_stats.misses);
+	connman_dbus_dict_append_basic(dict, "CacheInsertions",
+				DBUS_TYPE_UINT32, &cache_stats.insertions);
+	connman_dbus_dict_append_basic(dict, "CacheEvictions",
+				DBUS_TYPE_UINT32, &cache_stats.evictions);
+	connman_dbus_dict_append_basic(dict, "CacheFlushes",
+				DBUS_TYPE_UINT32, &cache_stats.flushes);
+	connman_dbus_dict_append_basic(dict, "CacheEntries",
+					DBUS_TYPE_UINT32, &entries);
+	connman_dbus_dict_append_basic(dict, "CacheSize",
+					DBUS_TYPE_UINT32, &cache_size);
+
+	connman_dbus_dict_append_basic(dict, "CoalescedRequests",
+				DBUS_TYPE_UINT32, &coalesced_requests);
+
+	connman_dbus_dict_append_basic(dict, "TCPConnections",
+					DBUS_TYPE_UINT32, &tcp_connects);
+	connman_dbus_dict_append_basic(dict, "TCPReusedConnections",
+					DBUS_TYPE_UINT32, &tcp_reused);
+
+	connman_dbus_dict_append_fixed_array(dict, "ListenerBatches",
+		DBUS_TYPE_UINT32, &listener_batches, DNS_BATCH_BUCKETS);
+	connman_dbus_dict_append_fixed_array(dict, "ServerBatches",
+		DBUS_TYPE_UINT32, &server_batches, DNS_BATCH_BUCKETS);
+	connman_dbus_dict_append_fixed_array(dict, "SendBatches",
+		DBUS_TYPE_UINT32, &send_batches_histogram, DNS_BATCH_BUCKETS);
+
+	connman_dbus_dict_append_dict(dict, "Servers", append_servers, NULL);
+}
+
+/*
+ * Hand out a reply to all clients that attached to the request,
+ * each of them with its own ID.
+ */
+static void send_to_waiters(struct request_data *req,
+				unsigned char *reply, int reply_len)
+{
+	GSList *list;
+
+	for (list = req->waiters; list; list = list->next) {
+		struct request_waiter *waiter = list->data;
+		int sk;
+
+		if (waiter->ifdata->udp_listener_channel == NULL)
+			continue;
+
+		reply[0] = waiter->srcid & 0xff;
+		reply[1] = waiter->srcid >> 8;
+
+		sk = g_io_channel_unix_get_fd(
+				waiter->ifdata->udp_listener_channel);
+
+		if (dns_send(sk, reply, reply_len,
+					&waiter->sa, waiter->sa_len) < 0)
+			connman_error("Failed to send DNS response: %s",
+							strerror(errno));
+	}
+}
+
+/*
+ * Answer a TCP client with whatever we have got so far, or with
+ * SERVFAIL, and drop the request.
+ */
+static void tcp_request_fail(struct request_data *req)
+{
+	struct domain_hdr *hdr;
 
-	DBG("id 0x%04x qr %d opcode %d", hdr->id, hdr->qr, hdr->opcode);
+	DBG("id 0x%04x", req->srcid);
 
-	hdr->qr = 1;
-	hdr->rcode = 2;
+	if (req->timeout > 0) {
+		g_source_remove(req->timeout);
+		req->timeout = 0;
+	}
 
-	hdr->ancount = 0;
-	hdr->nscount = 0;
-	hdr->arcount = 0;
+	remove_request(req);
 
-	err = sendto(sk, buf, len, 0, to, tolen);
-	if (err < 0) {
-		connman_error("Failed to send DNS response: %s",
-				strerror(errno));
-		return;
+	if (req->resplen > 0 && req->resp != NULL) {
+		if (send(req->client_sk, req->resp, req->resplen, 0) < 0)
+			connman_error("Failed to send DNS response: %s",
+							strerror(errno));
+	} else if (req->request != NULL) {
+		hdr = (void *) (req->request + 2);
+		hdr->id = req->srcid;
+		send_response(req->client_sk, req->request,
+				req->request_len, NULL, 0, IPPROTO_TCP);
 	}
+
+	close(req->client_sk);
+
+	request_free(req);
 }
 
 static gboolean request_timeout(gpointer user_data)
 {
 	struct request_data *req = user_data;
 	struct listener_data *ifdata;
+	GSList *list;
+	int sk;
 
 	DBG("id 0x%04x", req->srcid);
 
 	if (req == NULL)
 		return FALSE;
 
-	ifdata = req->ifdata;
+	if (req->protocol == IPPROTO_TCP) {
+		req->timeout = 0;
+		tcp_request_fail(req);
+		return FALSE;
+	}
 
-	request_list = g_slist_remove(request_list, req);
-	req->numserv--;
+	ifdata = req->ifdata;
 
-	if (req->resplen > 0 && req->resp != NULL) {
-		int sk, err;
+	remove_request(req);
 
-		sk = g_io_channel_unix_get_fd(ifdata->udp_listener_channel);
+	/* Servers which never answered the request have failed it */
+	for (list = req->attempts; list; list = list->next) {
+		struct request_attempt *attempt = list->data;
 
-		err = sendto(sk, req->resp, req->resplen, 0,
-						&req->sa, req->sa_len);
-		if (err < 0)
-			return FALSE;
-	} else if (req->request && req->numserv == 0) {
-		struct domain_hdr *hdr;
+		if (attempt->server != NULL && attempt->answered == FALSE)
+			server_failed(attempt->server);
+	}
 
-		if (req->protocol == IPPROTO_TCP) {
-			hdr = (void *) (req->request + 2);
-			hdr->id = req->srcid;
-			send_response(req->client_sk, req->request,
-				req->request_len, NULL, 0, IPPROTO_TCP);
+	sk = g_io_channel_unix_get_fd(ifdata->udp_listener_channel);
 
-		} else if (req->protocol == IPPROTO_UDP) {
-			int sk;
+	if (req->resplen > 0 && req->resp != NULL) {
+		if (sendto(sk, req->resp, req->resplen, 0,
+					&req->sa, req->sa_len) < 0)
+			connman_error("Failed to send DNS response: %s",
+							strerror(errno));
+
+		send_to_waiters(req, req->resp, req->resplen);
+	} else if (req->request != NULL &&
+			req->request_len >= sizeof(struct domain_hdr)) {
+		struct domain_hdr *hdr;
 
-			hdr = (void *) (req->request);
-			hdr->id = req->srcid;
-			sk = g_io_channel_unix_get_fd(
-						ifdata->udp_listener_channel);
-			send_response(sk, req->request, req->request_len,
+		hdr = (void *) (req->request);
+		hdr->id = req->srcid;
+		send_response(sk, req->request, req->request_len,
 					&req->sa, req->sa_len, IPPROTO_UDP);
-		}
+
+		/* The request has been turned into a SERVFAIL reply */
+		send_to_waiters(req, req->request, req->request_len);
 	}
 
-	g_free(req->resp);
-	g_free(req);
+	request_free(req);
 
 	return FALSE;
 }
@@ -332,13 +1566,20 @@ static int append_query(unsigned char *buf, unsigned int size,
 static int ns_resolv(struct server_data *server, struct request_data *req,
 				gpointer request, gpointer name)
 {
-	GList *list;
+	GList *list, *domains = server->domains;
 	int sk, err;
 	char *dot, *lookup = (char *) name;
 
+	/* Pooled TCP connections share the domains of their UDP server */
+	if (server->parent != NULL)
+		domains = server->parent->domains;
+
 	sk = g_io_channel_unix_get_fd(server->channel);
 
-	err = send(sk, request, req->request_len, 0);
+	if (server->protocol == IPPROTO_UDP)
+		err = dns_send(sk, request, req->request_len, NULL, 0);
+	else
+		err = send(sk, request, req->request_len, 0);
 
 	req->numserv++;
 
@@ -347,10 +1588,10 @@ static int ns_resolv(struct server_data *server, struct request_data *req,
 	if (dot != NULL && dot != lookup + strlen(lookup) - 1)
 		return 0;
 
-	if (server->domains != NULL && server->domains->data != NULL)
+	if (domains != NULL && domains->data != NULL)
 		req->append_domain = TRUE;
 
-	for (list = server->domains; list; list = list->next) {
+	for (list = domains; list; list = list->next) {
 		char *domain;
 		unsigned char alt[1024];
 		struct domain_hdr *hdr = (void *) &alt;
@@ -393,7 +1634,11 @@ static int ns_resolv(struct server_data *server, struct request_data *req,
 			alt[1] = req_len & 0xff;
 		}
 
-		err = send(sk, alt, req->request_len + domlen + 1, 0);
+		if (server->protocol == IPPROTO_UDP)
+			err = dns_send(sk, alt, req->request_len + domlen + 1,
+								NULL, 0);
+		else
+			err = send(sk, alt, req->request_len + domlen + 1, 0);
 		if (err < 0)
 			return -EIO;
 
@@ -403,10 +1648,159 @@ static int ns_resolv(struct server_data *server, struct request_data *req,
 	return 0;
 }
 
-static int forward_dns_reply(unsigned char *reply, int reply_len, int protocol)
+static gboolean udp_server_event(GIOChannel *channel, GIOCondition condition,
+							gpointer user_data);
+
+static struct request_attempt *find_attempt(struct request_data *req,
+						struct server_data *server)
+{
+	GSList *list;
+
+	for (list = req->attempts; list; list = list->next) {
+		struct request_attempt *attempt = list->data;
+
+		if (attempt->server == server)
+			return attempt;
+	}
+
+	return NULL;
+}
+
+static struct server_data *pick_server(struct request_data *req)
+{
+	struct server_data *best = NULL;
+	guint64 score, best_score = 0;
+	GSList *list;
+
+	for (list = server_list; list; list = list->next) {
+		struct server_data *data = list->data;
+
+		DBG("server %s enabled %d", data->server, data->enabled);
+
+		if (data->enabled == FALSE)
+			continue;
+
+		if (find_attempt(req, data) != NULL)
+			continue;
+
+		score = server_score(data);
+		if (best == NULL || score < best_score) {
+			best = data;
+			best_score = score;
+		}
+	}
+
+	return best;
+}
+
+static gboolean race_timeout(gpointer user_data);
+
+/*
+ * Send a UDP request to the best server it has not been sent to yet.
+ * If that server does not answer within its adaptive timeout, the
+ * next best server is raced against it.
+ */
+static gboolean resolv(struct request_data *req)
+{
+	struct request_attempt *attempt;
+	struct server_data *data;
+	guint numserv;
+
+	if (req->race_timeout > 0) {
+		g_source_remove(req->race_timeout);
+		req->race_timeout = 0;
+	}
+
+	while ((data = pick_server(req)) != NULL) {
+		attempt = g_try_new0(struct request_attempt, 1);
+		if (attempt == NULL)
+			return FALSE;
+
+		attempt->server = data;
+		attempt->sent = time_usec();
+		req->attempts = g_slist_prepend(req->attempts, attempt);
+
+		data->queries++;
+
+		if (data->watch == 0)
+			data->watch = g_io_add_watch(data->channel,
+				G_IO_IN | G_IO_NVAL | G_IO_ERR | G_IO_HUP,
+						udp_server_event, data);
+
+		numserv = req->numserv;
+
+		if (ns_resolv(data, req, req->request, req->name) < 0) {
+			server_failed(data);
+			continue;
+		}
+
+		/* Search domain variants of the query are sent as well */
+		attempt->pending = req->numserv - numserv;
+
+		req->race_timeout = g_timeout_add(server_rto(data) / 1000,
+							race_timeout, req);
+
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+static gboolean attempts_pending(struct request_data *req)
+{
+	GSList *list;
+
+	for (list = req->attempts; list; list = list->next) {
+		struct request_attempt *attempt = list->data;
+
+		if (attempt->server != NULL && attempt->pending > 0)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+static gboolean race_timeout(gpointer user_data)
+{
+	struct request_data *req = user_data;
+	struct request_attempt *attempt = req->attempts->data;
+
+	req->race_timeout = 0;
+
+	if (attempt->server != NULL && attempt->answered == FALSE)
+		server_slow(attempt->server, time_usec() - attempt->sent);
+
+	DBG("id 0x%04x", req->dstid);
+
+	resolv(req);
+
+	return FALSE;
+}
+
+/* Drop references to a server which is going away */
+static void forget_server(struct server_data *server)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+
+	g_hash_table_iter_init(&iter, request_table);
+
+	while (g_hash_table_iter_next(&iter, &key, &value) == TRUE) {
+		struct request_data *req = value;
+		struct request_attempt *attempt;
+
+		attempt = find_attempt(req, server);
+		if (attempt != NULL)
+			attempt->server = NULL;
+	}
+}
+
+static int forward_dns_reply(unsigned char *reply, int reply_len, int protocol,
+						struct server_data *server)
 {
 	struct domain_hdr *hdr;
 	struct request_data *req;
+	struct request_attempt *attempt;
 	int dns_id, sk, err, offset = protocol_offset(protocol);
 	struct listener_data *ifdata;
 
@@ -419,11 +1813,26 @@ static int forward_dns_reply(unsigned char *reply, int reply_len, int protocol)
 	DBG("Received %d bytes (id 0x%04x)", reply_len, dns_id);
 
 	req = find_request(dns_id);
-	if (req == NULL)
+	if (req == NULL || req->protocol != protocol)
 		return -EINVAL;
 
 	DBG("id 0x%04x rcode %d", hdr->id, hdr->rcode);
 
+	attempt = server != NULL ? find_attempt(req, server) : NULL;
+	if (attempt != NULL && attempt->pending > 0)
+		attempt->pending--;
+
+	if (attempt != NULL && attempt->answered == FALSE) {
+		attempt->answered = TRUE;
+
+		if (hdr->rcode == DNS_RCODE_SERVFAIL ||
+					hdr->rcode == DNS_RCODE_REFUSED)
+			server_failed(server);
+		else
+			server_answered(server,
+					time_usec() - attempt->sent);
+	}
+
 	ifdata = req->ifdata;
 
 	reply[offset] = req->srcid & 0xff;
@@ -431,7 +1840,9 @@ static int forward_dns_reply(unsigned char *reply, int reply_len, int protocol)
 
 	req->numresp++;
 
-	if (hdr->rcode == 0 || req->resp == NULL) {
+	/* A server failure does not replace an answer we already have */
+	if (req->resp == NULL || (hdr->rcode != DNS_RCODE_SERVFAIL &&
+					hdr->rcode != DNS_RCODE_REFUSED)) {
 
 		/*
 		 * If the domain name was append
@@ -459,6 +1870,11 @@ static int forward_dns_reply(unsigned char *reply, int reply_len, int protocol)
 				reply_len - (ptr - reply + domain_len));
 
 			reply_len = reply_len - domain_len;
+
+			if (protocol == IPPROTO_TCP) {
+				reply[0] = ((reply_len - 2) >> 8) & 0xff;
+				reply[1] = (reply_len - 2) & 0xff;
+			}
 		}
 
 		g_free(req->resp);
@@ -472,261 +1888,481 @@ static int forward_dns_reply(unsigned char *reply, int reply_len, int protocol)
 		req->resplen = reply_len;
 	}
 
-	if (hdr->rcode > 0 && req->numresp < req->numserv)
-		return -EINVAL;
+	/*
+	 * A negative answer is final once the server has answered all
+	 * search domain variants of the query. Raced UDP servers which
+	 * have not answered yet are not waited for.
+	 */
+	if (hdr->rcode > 0) {
+		if (protocol == IPPROTO_UDP) {
+			if (attempt != NULL && attempt->pending > 0)
+				return -EINVAL;
+		} else if (req->numresp < req->numserv)
+			return -EINVAL;
+	}
+
+	/* Ask the next server right away instead of giving up */
+	if (protocol == IPPROTO_UDP && (hdr->rcode == DNS_RCODE_SERVFAIL ||
+				hdr->rcode == DNS_RCODE_REFUSED)) {
+		if (resolv(req) == TRUE)
+			return 0;
+
+		/* A raced server might still have an answer */
+		if (attempts_pending(req) == TRUE)
+			return 0;
+	}
 
 	if (req->timeout > 0)
 		g_source_remove(req->timeout);
 
-	request_list = g_slist_remove(request_list, req);
+	remove_request(req);
+
+	if (req->append_domain == FALSE)
+		cache_update(req->resp + offset, req->resplen - offset);
 
 	if (protocol == IPPROTO_UDP) {
 		sk = g_io_channel_unix_get_fd(ifdata->udp_listener_channel);
-		err = sendto(sk, req->resp, req->resplen, 0,
-			     &req->sa, req->sa_len);
+		err = dns_send(sk, req->resp, req->resplen,
+						&req->sa, req->sa_len);
+
+		send_to_waiters(req, req->resp, req->resplen);
 	} else {
 		sk = req->client_sk;
 		err = send(sk, req->resp, req->resplen, 0);
 		close(sk);
 	}
 
-	g_free(req->resp);
-	g_free(req);
+	request_free(req);
+
+	return err;
+}
+
+static void tcp_connection_fail(struct server_data *conn);
+
+static void destroy_server(struct server_data *server)
+{
+	GList *list;
+
+	DBG("interface %s server %s", server->interface, server->server);
+
+	if (server->parent != NULL) {
+		struct server_data *parent = server->parent;
+
+		parent->tcp_pool = g_slist_remove(parent->tcp_pool, server);
+	} else {
+		while (server->tcp_pool != NULL)
+			tcp_connection_fail(server->tcp_pool->data);
+
+		server_list = g_slist_remove(server_list, server);
+		unindex_server(server);
+		forget_server(server);
+	}
+
+	if (server->watch > 0)
+		g_source_remove(server->watch);
+
+	if (server->timeout > 0)
+		g_source_remove(server->timeout);
+
+	g_io_channel_unref(server->channel);
+
+	if (server->protocol == IPPROTO_UDP)
+		connman_info("Removing DNS server %s", server->server);
+
+	g_slist_free(server->pending);
+	g_slist_free(server->inflight);
+	g_free(server->ring.buf);
+	g_free(server->server);
+	for (list = server->domains; list; list = list->next) {
+		char *domain = list->data;
+
+		server->domains = g_list_remove(server->domains, domain);
+		g_free(domain);
+	}
+	g_free(server->interface);
+	g_free(server);
+}
+
+static gboolean udp_server_event(GIOChannel *channel, GIOCondition condition,
+							gpointer user_data)
+{
+	static unsigned char buf[DNS_BATCH_SIZE][4096];
+	static struct recv_batch batch;
+	int sk, i, count;
+
+	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
+		struct server_data *data = user_data;
+
+		connman_error("Error with UDP server %s", data->server);
+		data->watch = 0;
+		return FALSE;
+	}
+
+	sk = g_io_channel_unix_get_fd(channel);
+
+	recv_batch_setup(&batch, buf[0], sizeof(buf[0]));
+
+	count = recv_datagrams(sk, &batch);
+	if (count <= 0)
+		return TRUE;
+
+	batching = TRUE;
+
+	for (i = 0; i < count; i++) {
+		int len = batch.msgs[i].msg_len;
+
+		if (len < 12)
+			continue;
+
+		forward_dns_reply(buf[i], len, IPPROTO_UDP, user_data);
+	}
+
+	batching = FALSE;
+	flush_send_batches();
+
+	batch_account(BATCH_SERVER_RECV, count);
+
+	return TRUE;
+}
+
+static int ring_grow(struct reply_ring *ring, unsigned int needed)
+{
+	unsigned char *buf;
+	unsigned int size, first;
+
+	size = ring->size > 0 ? ring->size : TCP_RING_MIN_SIZE;
+	while (size < needed)
+		size <<= 1;
+
+	if (size > TCP_RING_MAX_SIZE)
+		return -EMSGSIZE;
+
+	if (size == ring->size)
+		return 0;
+
+	buf = g_try_malloc(size);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	/* Unwrap the buffered data while moving it over */
+	first = MIN(ring->len, ring->size - ring->head);
+	if (first > 0)
+		memcpy(buf, ring->buf + ring->head, first);
+	if (ring->len > first)
+		memcpy(buf + first, ring->buf, ring->len - first);
+
+	g_free(ring->buf);
+	ring->buf = buf;
+	ring->size = size;
+	ring->head = 0;
+
+	return 0;
+}
+
+static void ring_copy(struct reply_ring *ring, unsigned int offset,
+					unsigned char *dst, unsigned int len)
+{
+	unsigned int pos = (ring->head + offset) & (ring->size - 1);
+	unsigned int first = MIN(len, ring->size - pos);
+
+	memcpy(dst, ring->buf + pos, first);
+	if (len > first)
+		memcpy(dst + first, ring->buf, len - first);
+}
+
+static void ring_consume(struct reply_ring *ring, unsigned int len)
+{
+	ring->head = (ring->head + len) & (ring->size - 1);
+	ring->len -= len;
+
+	/* Keep the next message contiguous whenever possible */
+	if (ring->len == 0)
+		ring->head = 0;
+}
+
+/*
+ * Read as much as the socket has into the free space of the ring,
+ * which can be split in two parts when the data wraps around.
+ */
+static int ring_recv(int sk, struct reply_ring *ring)
+{
+	struct iovec iov[2];
+	unsigned int tail, space;
+	int cnt = 1, err;
+	ssize_t len;
+
+	if (ring->len == ring->size) {
+		err = ring_grow(ring, ring->size + 1);
+		if (err < 0)
+			return err;
+	}
+
+	tail = (ring->head + ring->len) & (ring->size - 1);
+	space = ring->size - ring->len;
+
+	iov[0].iov_base = ring->buf + tail;
+	iov[0].iov_len = MIN(space, ring->size - tail);
+
+	if (space > iov[0].iov_len) {
+		iov[1].iov_base = ring->buf;
+		iov[1].iov_len = space - iov[0].iov_len;
+		cnt = 2;
+	}
+
+	len = readv(sk, iov, cnt);
+	if (len == 0)
+		return -ECONNRESET;
+
+	if (len < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+
+		return -errno;
+	}
+
+	ring->len += len;
+
+	return len;
+}
+
+/* Forget about IDs of requests which have been answered or dropped */
+static void tcp_prune_inflight(struct server_data *conn)
+{
+	GSList *list = conn->inflight;
+
+	while (list != NULL) {
+		GSList *next = list->next;
+		struct request_data *req;
+
+		req = find_request(GPOINTER_TO_UINT(list->data));
+		if (req == NULL || req->protocol != IPPROTO_TCP)
+			conn->inflight = g_slist_delete_link(conn->inflight,
+									list);
 
-	return err;
+		list = next;
+	}
 }
 
-static void destroy_server(struct server_data *server)
+static gboolean tcp_idle_timeout(gpointer user_data)
 {
-	GList *list;
+	struct server_data *conn = user_data;
 
-	DBG("interface %s server %s", server->interface, server->server);
+	DBG("");
 
-	server_list = g_slist_remove(server_list, server);
+	if (conn == NULL)
+		return FALSE;
 
-	if (server->watch > 0)
-		g_source_remove(server->watch);
+	conn->timeout = 0;
 
-	if (server->timeout > 0)
-		g_source_remove(server->timeout);
+	tcp_connection_fail(conn);
 
-	g_io_channel_unref(server->channel);
+	return FALSE;
+}
 
-	if (server->protocol == IPPROTO_UDP)
-		connman_info("Removing DNS server %s", server->server);
+static void tcp_check_idle(struct server_data *conn)
+{
+	tcp_prune_inflight(conn);
 
-	g_free(server->incoming_reply);
-	g_free(server->server);
-	for (list = server->domains; list; list = list->next) {
-		char *domain = list->data;
+	if (conn->pending != NULL || conn->inflight != NULL)
+		return;
 
-		server->domains = g_list_remove(server->domains, domain);
-		g_free(domain);
-	}
-	g_free(server->interface);
-	g_free(server);
+	if (conn->timeout == 0)
+		conn->timeout = g_timeout_add_seconds(TCP_IDLE_TIMEOUT,
+						tcp_idle_timeout, conn);
 }
 
-static gboolean udp_server_event(GIOChannel *channel, GIOCondition condition,
-							gpointer user_data)
+static void tcp_send_request(struct server_data *conn,
+					struct request_data *req)
 {
-	unsigned char buf[4096];
-	int sk, err, len;
-
-	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
-		struct server_data *data = user_data;
+	DBG("Sending req %s over TCP", (char *) req->name);
 
-		connman_error("Error with UDP server %s", data->server);
-		data->watch = 0;
-		return FALSE;
+	if (conn->timeout > 0) {
+		g_source_remove(conn->timeout);
+		conn->timeout = 0;
 	}
 
-	sk = g_io_channel_unix_get_fd(channel);
+	ns_resolv(conn, req, req->request, req->name);
 
-	len = recv(sk, buf, sizeof(buf), 0);
-	if (len < 12)
-		return TRUE;
+	conn->inflight = g_slist_prepend(conn->inflight,
+					GUINT_TO_POINTER(req->dstid));
+}
 
-	err = forward_dns_reply(buf, len, IPPROTO_UDP);
-	if (err < 0)
-		return TRUE;
+static void tcp_queue_request(struct server_data *conn,
+					struct request_data *req)
+{
+	req->numconn++;
 
-	return TRUE;
+	if (conn->connected == FALSE) {
+		conn->pending = g_slist_append(conn->pending,
+					GUINT_TO_POINTER(req->dstid));
+		return;
+	}
+
+	tcp_reused++;
+
+	tcp_send_request(conn, req);
 }
 
-static gboolean tcp_server_event(GIOChannel *channel, GIOCondition condition,
-							gpointer user_data)
+/*
+ * Tear down a pooled TCP connection. Clients whose request was not
+ * queued on any other connection get an error response right away.
+ */
+static void tcp_connection_fail(struct server_data *conn)
 {
-	int sk;
-	struct server_data *server = user_data;
-
-	sk = g_io_channel_unix_get_fd(channel);
-	if (sk == 0)
-		return FALSE;
+	GSList *lists[] = { conn->pending, conn->inflight };
+	unsigned int i;
 
-	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
-		GSList *list;
-hangup:
-		DBG("TCP server channel closed");
+	DBG("interface %s server %s", conn->interface, conn->server);
 
-		/*
-		 * Discard any partial response which is buffered; better
-		 * to get a proper response from a working server.
-		 */
-		g_free(server->incoming_reply);
-		server->incoming_reply = NULL;
+	conn->pending = NULL;
+	conn->inflight = NULL;
 
-		for (list = request_list; list; list = list->next) {
-			struct request_data *req = list->data;
-			struct domain_hdr *hdr;
+	for (i = 0; i < G_N_ELEMENTS(lists); i++) {
+		GSList *list;
 
-			if (req->protocol == IPPROTO_UDP)
-				continue;
+		for (list = lists[i]; list; list = list->next) {
+			struct request_data *req;
 
-			if (req->request == NULL)
+			req = find_request(GPOINTER_TO_UINT(list->data));
+			if (req == NULL || req->protocol != IPPROTO_TCP)
 				continue;
 
-			/*
-			 * If we're not waiting for any further response
-			 * from another name server, then we send an error
-			 * response to the client.
-			 */
-			if (req->numserv && --(req->numserv))
+			if (req->numconn > 0 && --(req->numconn) > 0)
 				continue;
 
-			hdr = (void *) (req->request + 2);
-			hdr->id = req->srcid;
-			send_response(req->client_sk, req->request,
-				req->request_len, NULL, 0, IPPROTO_TCP);
-
-			request_list = g_slist_remove(request_list, req);
+			tcp_request_fail(req);
 		}
 
-		destroy_server(server);
-
-		return FALSE;
+		g_slist_free(lists[i]);
 	}
 
-	if ((condition & G_IO_OUT) && !server->connected) {
-		GSList *list;
-		GList *domains;
-		struct server_data *udp_server;
-
-		udp_server = find_server(server->interface, server->server,
-								IPPROTO_UDP);
-		if (udp_server != NULL) {
-			for (domains = udp_server->domains; domains;
-						domains = domains->next) {
-				char *dom = domains->data;
+	destroy_server(conn);
+}
 
-				DBG("Adding domain %s to %s",
-						dom, server->server);
+static int tcp_process_replies(struct server_data *conn)
+{
+	struct reply_ring *ring = &conn->ring;
 
-				server->domains = g_list_append(server->domains,
-								g_strdup(dom));
-			}
-		}
+	while (ring->len >= 2) {
+		unsigned char prefix[2], *msg, *copy = NULL;
+		unsigned int msg_len;
+		guint16 id;
 
-		server->connected = TRUE;
-		server_list = g_slist_append(server_list, server);
+		ring_copy(ring, 0, prefix, 2);
+		msg_len = (prefix[0] << 8 | prefix[1]) + 2;
 
-		if (server->timeout > 0) {
-			g_source_remove(server->timeout);
-			server->timeout = 0;
+		if (ring->len < msg_len) {
+			/* Make room for the whole message up front */
+			if (msg_len > ring->size)
+				return ring_grow(ring, msg_len);
+			break;
 		}
 
-		for (list = request_list; list; list = list->next) {
-			struct request_data *req = list->data;
+		DBG("TCP reply %d bytes", msg_len);
 
-			if (req->protocol == IPPROTO_UDP)
-				continue;
+		if (ring->head + msg_len <= ring->size)
+			msg = ring->buf + ring->head;
+		else {
+			copy = g_try_malloc(msg_len);
+			if (copy == NULL)
+				return -ENOMEM;
 
-			DBG("Sending req %s over TCP", (char *)req->name);
+			ring_copy(ring, 0, copy, msg_len);
+			msg = copy;
+		}
 
-			if (req->timeout > 0)
-				g_source_remove(req->timeout);
+		if (msg_len >= 4) {
+			id = msg[2] | msg[3] << 8;
+			conn->inflight = g_slist_remove(conn->inflight,
+						GUINT_TO_POINTER(id & ~1));
 
-			req->timeout = g_timeout_add_seconds(30,
-						request_timeout, req);
-			ns_resolv(server, req, req->request, req->name);
+			forward_dns_reply(msg, msg_len, IPPROTO_TCP, NULL);
 		}
 
-	} else if (condition & G_IO_IN) {
-		struct partial_reply *reply = server->incoming_reply;
-		int bytes_recv;
+		g_free(copy);
 
-		if (!reply) {
-			unsigned char reply_len_buf[2];
-			uint16_t reply_len;
+		ring_consume(ring, msg_len);
+	}
 
-			bytes_recv = recv(sk, reply_len_buf, 2, MSG_PEEK);
-			if (!bytes_recv) {
-				goto hangup;
-			} else if (bytes_recv < 0) {
-				if (errno == EAGAIN || errno == EWOULDBLOCK)
-					return TRUE;
+	return 0;
+}
 
-				connman_error("DNS proxy error %s",
-						strerror(errno));
-				goto hangup;
-			} else if (bytes_recv < 2)
-				return TRUE;
+static gboolean tcp_server_event(GIOChannel *channel, GIOCondition condition,
+							gpointer user_data)
+{
+	int sk, err;
+	struct server_data *conn = user_data;
 
-			reply_len = reply_len_buf[1] | reply_len_buf[0] << 8;
-			reply_len += 2;
+	sk = g_io_channel_unix_get_fd(channel);
+	if (sk == 0)
+		return FALSE;
 
-			DBG("TCP reply %d bytes", reply_len);
+	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
+		DBG("TCP server channel closed");
+		goto fail;
+	}
 
-			reply = g_try_malloc(sizeof(*reply) + reply_len + 2);
-			if (!reply)
-				return TRUE;
+	if ((condition & G_IO_OUT) && !conn->connected) {
+		GSList *list, *pending = conn->pending;
 
-			reply->len = reply_len;
-			reply->received = 0;
+		conn->connected = TRUE;
+		conn->pending = NULL;
 
-			server->incoming_reply = reply;
+		if (conn->timeout > 0) {
+			g_source_remove(conn->timeout);
+			conn->timeout = 0;
 		}
 
-		while (reply->received < reply->len) {
-			bytes_recv = recv(sk, reply->buf + reply->received,
-					reply->len - reply->received, 0);
-			if (!bytes_recv) {
-				connman_error("DNS proxy TCP disconnect");
-				break;
-			} else if (bytes_recv < 0) {
-				if (errno == EAGAIN || errno == EWOULDBLOCK)
-					return TRUE;
+		for (list = pending; list; list = list->next) {
+			struct request_data *req;
 
-				connman_error("DNS proxy error %s",
-						strerror(errno));
-				break;
-			}
-			reply->received += bytes_recv;
+			req = find_request(GPOINTER_TO_UINT(list->data));
+			if (req == NULL || req->protocol != IPPROTO_TCP)
+				continue;
+
+			tcp_send_request(conn, req);
 		}
 
-		forward_dns_reply(reply->buf, reply->received, IPPROTO_TCP);
+		g_slist_free(pending);
 
-		g_free(reply);
-		server->incoming_reply = NULL;
+		tcp_check_idle(conn);
 
-		destroy_server(server);
+		/* Connected, from now on only wait for replies */
+		conn->watch = g_io_add_watch(channel,
+				G_IO_IN | G_IO_HUP | G_IO_NVAL | G_IO_ERR,
+						tcp_server_event, conn);
 
 		return FALSE;
 	}
 
-	return TRUE;
-}
+	if (condition & G_IO_IN) {
+		err = ring_recv(sk, &conn->ring);
+		if (err < 0) {
+			if (err != -ECONNRESET)
+				connman_error("DNS proxy error %s",
+							strerror(-err));
+			goto fail;
+		}
 
-static gboolean tcp_idle_timeout(gpointer user_data)
-{
-	struct server_data *server = user_data;
+		err = tcp_process_replies(conn);
+		if (err < 0) {
+			connman_error("DNS proxy invalid TCP reply: %s",
+							strerror(-err));
+			goto fail;
+		}
 
-	DBG("");
+		tcp_check_idle(conn);
+	}
 
-	if (server == NULL)
-		return FALSE;
+	return TRUE;
 
-	destroy_server(server);
+fail:
+	/*
+	 * Discard any partial response which is buffered; better
+	 * to get a proper response from a working server.
+	 */
+	conn->watch = 0;
+	tcp_connection_fail(conn);
 
 	return FALSE;
 }
@@ -860,36 +2496,52 @@ static struct server_data *create_server(const char *interface,
 		connman_info("Adding DNS server %s", data->server);
 
 		server_list = g_slist_append(server_list, data);
+		index_server(data);
 
 		return data;
 	}
 
-	return NULL;
+	tcp_connects++;
+
+	return data;
 }
 
-static gboolean resolv(struct request_data *req,
-				gpointer request, gpointer name)
+/*
+ * Pick the least loaded pooled TCP connection to a server and open
+ * another one when all of them are busy and the pool is not full.
+ */
+static struct server_data *get_tcp_connection(struct server_data *server)
 {
+	struct server_data *conn, *best = NULL;
+	unsigned int load, best_load = 0;
 	GSList *list;
 
-	for (list = server_list; list; list = list->next) {
-		struct server_data *data = list->data;
+	for (list = server->tcp_pool; list; list = list->next) {
+		conn = list->data;
 
-		DBG("server %s enabled %d", data->server, data->enabled);
+		tcp_prune_inflight(conn);
 
-		if (data->enabled == FALSE)
-			continue;
+		load = g_slist_length(conn->pending) +
+					g_slist_length(conn->inflight);
+		if (best == NULL || load < best_load) {
+			best = conn;
+			best_load = load;
+		}
+	}
 
-		if (data->watch == 0 && data->protocol == IPPROTO_UDP)
-			data->watch = g_io_add_watch(data->channel,
-				G_IO_IN | G_IO_NVAL | G_IO_ERR | G_IO_HUP,
-						udp_server_event, data);
+	if (best != NULL && (best_load < TCP_PIPELINE_DEPTH ||
+			g_slist_length(server->tcp_pool) >= TCP_POOL_SIZE))
+		return best;
 
-		if (ns_resolv(data, req, request, name) < 0)
-			continue;
-	}
+	conn = create_server(server->interface, NULL, server->server,
+								IPPROTO_TCP);
+	if (conn == NULL)
+		return best;
 
-	return TRUE;
+	conn->parent = server;
+	server->tcp_pool = g_slist_append(server->tcp_pool, conn);
+
+	return conn;
 }
 
 static void append_domain(const char *interface, const char *domain)
@@ -986,7 +2638,6 @@ int __connman_dnsproxy_remove(const char *interface, const char *domain,
 		return -ENODEV;
 
 	remove_server(interface, domain, server, IPPROTO_UDP);
-	remove_server(interface, domain, server, IPPROTO_TCP);
 
 	return 0;
 }
@@ -995,6 +2646,8 @@ void __connman_dnsproxy_flush(void)
 {
 	GSList *list;
 
+	cache_flush();
+
 	list = request_pending_list;
 	while (list) {
 		struct request_data *req = list->data;
@@ -1003,9 +2656,7 @@ void __connman_dnsproxy_flush(void)
 
 		request_pending_list =
 				g_slist_remove(request_pending_list, req);
-		resolv(req, req->request, req->name);
-		g_free(req->request);
-		g_free(req->name);
+		resolv(req);
 	}
 }
 
@@ -1035,6 +2686,9 @@ static void dnsproxy_default_changed(struct connman_service *service)
 
 	DBG("service %p", service);
 
+	/* Answers of the previous default service may not apply anymore */
+	cache_flush();
+
 	if (service == NULL) {
 		/* When no services are active, then disable DNS proxying */
 		dnsproxy_offline_mode(TRUE);
@@ -1152,6 +2806,8 @@ static gboolean tcp_listener_event(GIOChannel *channel, GIOCondition condition,
 	socklen_t client_addr_len = sizeof(client_addr);
 	GSList *list;
 	struct listener_data *ifdata = user_data;
+	guint16 id;
+	char *key;
 
 	DBG("condition 0x%x", condition);
 
@@ -1175,33 +2831,51 @@ static gboolean tcp_listener_event(GIOChannel *channel, GIOCondition condition,
 	}
 
 	len = recv(client_sk, buf, sizeof(buf), 0);
-	if (len < 2)
+	if (len < 2) {
+		close(client_sk);
 		return TRUE;
+	}
 
 	DBG("Received %d bytes (id 0x%04x)", len, buf[2] | buf[3] << 8);
 
 	err = parse_request(buf + 2, len - 2, query, sizeof(query));
-	if (err < 0 || (g_slist_length(server_list) == 0)) {
+	if (err < 0 || server_list == NULL) {
+		send_response(client_sk, buf, len, NULL, 0, IPPROTO_TCP);
+		close(client_sk);
+		return TRUE;
+	}
+
+	key = get_cache_key(buf + 2, len - 2);
+
+	err = cache_reply(key, buf, len, client_sk, NULL, 0, IPPROTO_TCP);
+	g_free(key);
+
+	if (err == 0) {
+		close(client_sk);
+		return TRUE;
+	}
+
+	id = get_request_id();
+	if (id == 0) {
 		send_response(client_sk, buf, len, NULL, 0, IPPROTO_TCP);
+		close(client_sk);
 		return TRUE;
 	}
 
 	req = g_try_new0(struct request_data, 1);
-	if (req == NULL)
+	if (req == NULL) {
+		close(client_sk);
 		return TRUE;
+	}
 
 	memcpy(&req->sa, &client_addr, client_addr_len);
 	req->sa_len = client_addr_len;
 	req->client_sk = client_sk;
 	req->protocol = IPPROTO_TCP;
 
-	request_id += 2;
-	if (request_id == 0x0000 || request_id == 0xffff)
-		request_id += 2;
-
 	req->srcid = buf[2] | (buf[3] << 8);
-	req->dstid = request_id;
-	req->altid = request_id + 1;
+	req->dstid = id;
+	req->altid = id + 1;
 	req->request_len = len;
 
 	buf[2] = req->dstid & 0xff;
@@ -1210,112 +2884,136 @@ static gboolean tcp_listener_event(GIOChannel *channel, GIOCondition condition,
 	req->numserv = 0;
 	req->ifdata = (struct listener_data *) ifdata;
 	req->append_domain = FALSE;
-	request_list = g_slist_append(request_list, req);
-
-	for (list = server_list; list; list = list->next) {
-		struct server_data *data = list->data;
-		GList *domains;
 
-		if (data->protocol != IPPROTO_UDP || data->enabled == FALSE)
-			continue;
+	req->request = g_try_malloc(req->request_len);
+	req->name = g_try_malloc(sizeof(query));
+	if (req->request == NULL || req->name == NULL) {
+		close(client_sk);
+		request_free(req);
+		return TRUE;
+	}
 
-		server = create_server(data->interface, NULL,
-					data->server, IPPROTO_TCP);
+	memcpy(req->request, buf, req->request_len);
+	memcpy(req->name, query, sizeof(query));
 
-		/*
-		 * If server is NULL, we're not connected yet.
-		 * Copy the relevant buffers and continue with
-		 * the next nameserver.
-		 * The request will actually be sent once we're
-		 * properly connected over TCP to this nameserver.
-		 */
-		if (server == NULL) {
-			req->request = g_try_malloc0(req->request_len);
-			if (req->request == NULL)
-				return TRUE;
+	insert_request(req);
 
-			memcpy(req->request, buf, req->request_len);
+	req->timeout = g_timeout_add_seconds(30, request_timeout, req);
 
-			req->name = g_try_malloc0(sizeof(query));
-			if (req->name == NULL) {
-				g_free(req->request);
-				return TRUE;
-			}
-			memcpy(req->name, query, sizeof(query));
+	/*
+	 * Queue the request on a pooled connection to each server. It is
+	 * sent right away over an established connection, otherwise as
+	 * soon as the connection is up.
+	 */
+	for (list = server_list; list; list = list->next) {
+		struct server_data *data = list->data;
 
+		if (data->enabled == FALSE)
 			continue;
-		}
-
-		if (req->timeout > 0)
-			g_source_remove(req->timeout);
-
-		for (domains = data->domains; domains;
-				domains = domains->next) {
-			char *dom = domains->data;
-
-			DBG("Adding domain %s to %s", dom, server->server);
 
-			server->domains = g_list_append(server->domains,
-						g_strdup(dom));
-		}
+		server = get_tcp_connection(data);
+		if (server == NULL)
+			continue;
 
-		req->timeout = g_timeout_add_seconds(30, request_timeout, req);
-		ns_resolv(server, req, buf, query);
+		tcp_queue_request(server, req);
 	}
 
+	if (req->numconn == 0)
+		tcp_request_fail(req);
+
 	return TRUE;
 }
 
-static gboolean udp_listener_event(GIOChannel *channel, GIOCondition condition,
-							gpointer user_data)
+static void udp_listener_request(struct listener_data *ifdata, int sk,
+				unsigned char *buf, int len,
+				const struct sockaddr *client_addr,
+				socklen_t client_addr_len)
 {
-	unsigned char buf[768];
 	char query[512];
 	struct request_data *req;
-	struct sockaddr_in6 client_addr;
-	socklen_t client_addr_len = sizeof(client_addr);
-	int sk, err, len;
-	struct listener_data *ifdata = user_data;
-
-	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
-		connman_error("Error with UDP listener channel");
-		ifdata->udp_listener_watch = 0;
-		return FALSE;
-	}
-
-	sk = g_io_channel_unix_get_fd(channel);
+	struct query_flags flags;
+	int err;
+	guint16 id;
+	char *key;
 
-	memset(&client_addr, 0, client_addr_len);
-	len = recvfrom(sk, buf, sizeof(buf), 0, (void *)&client_addr,
-		       &client_addr_len);
 	if (len < 2)
-		return TRUE;
+		return;
 
 	DBG("Received %d bytes (id 0x%04x)", len, buf[0] | buf[1] << 8);
 
+	/* Taken before parse_request() raises the EDNS0 buffer size */
+	get_query_flags(buf, len, &flags);
+
 	err = parse_request(buf, len, query, sizeof(query));
-	if (err < 0 || (g_slist_length(server_list) == 0)) {
-		send_response(sk, buf, len, (void *)&client_addr,
+	if (err < 0 || server_list == NULL) {
+		send_response(sk, buf, len, client_addr,
 				client_addr_len, IPPROTO_UDP);
-		return TRUE;
+		return;
+	}
+
+	key = get_cache_key(buf, len);
+
+	if (cache_reply(key, buf, len, sk, client_addr,
+				client_addr_len, IPPROTO_UDP) == 0) {
+		g_free(key);
+		return;
+	}
+
+	if (key != NULL) {
+		req = g_hash_table_lookup(coalesce_table, key);
+
+		/*
+		 * Only attach to requests that asked for the same kind of
+		 * answer. Recursion, DNSSEC records and validation as well
+		 * as the size of the reply all depend on these flags.
+		 */
+		if (req != NULL && query_flags_equal(&req->flags,
+							&flags) == TRUE) {
+			struct request_waiter *waiter;
+
+			waiter = g_try_new0(struct request_waiter, 1);
+			if (waiter != NULL) {
+				memcpy(&waiter->sa, client_addr,
+							client_addr_len);
+				waiter->sa_len = client_addr_len;
+				waiter->srcid = buf[0] | (buf[1] << 8);
+				waiter->ifdata = ifdata;
+
+				req->waiters = g_slist_prepend(req->waiters,
+								waiter);
+				coalesced_requests++;
+
+				DBG("Attached to request (id 0x%04x)",
+								req->dstid);
+
+				g_free(key);
+				return;
+			}
+		}
+	}
+
+	id = get_request_id();
+	if (id == 0) {
+		send_response(sk, buf, len, client_addr,
+				client_addr_len, IPPROTO_UDP);
+		g_free(key);
+		return;
 	}
 
 	req = g_try_new0(struct request_data, 1);
-	if (req == NULL)
-		return TRUE;
+	if (req == NULL) {
+		g_free(key);
+		return;
+	}
 
-	memcpy(&req->sa, &client_addr, client_addr_len);
+	memcpy(&req->sa, client_addr, client_addr_len);
 	req->sa_len = client_addr_len;
 	req->client_sk = 0;
 	req->protocol = IPPROTO_UDP;
 
-	request_id += 2;
-	if (request_id == 0x0000 || request_id == 0xffff)
-		request_id += 2;
-
 	req->srcid = buf[0] | (buf[1] << 8);
-	req->dstid = request_id;
-	req->altid = request_id + 1;
+	req->dstid = id;
+	req->altid = id + 1;
 	req->request_len = len;
 
 	buf[0] = req->dstid & 0xff;
@@ -1325,9 +3023,67 @@ static gboolean udp_listener_event(GIOChannel *channel, GIOCondition condition,
 	req->ifdata = (struct listener_data *) ifdata;
 	req->timeout = g_timeout_add_seconds(5, request_timeout, req);
 	req->append_domain = FALSE;
-	request_list = g_slist_append(request_list, req);
+	req->flags = flags;
+
+	req->request = g_try_malloc(len);
+	req->name = g_try_malloc(sizeof(query));
+	if (req->request == NULL || req->name == NULL) {
+		g_source_remove(req->timeout);
+		request_free(req);
+		g_free(key);
+		return;
+	}
+
+	memcpy(req->request, buf, len);
+	memcpy(req->name, query, sizeof(query));
+
+	insert_request(req);
+
+	if (key != NULL && g_hash_table_lookup(coalesce_table, key) == NULL) {
+		req->key = key;
+		g_hash_table_insert(coalesce_table, req->key, req);
+	} else
+		g_free(key);
+
+	resolv(req);
+}
+
+static gboolean udp_listener_event(GIOChannel *channel, GIOCondition condition,
+							gpointer user_data)
+{
+	static unsigned char buf[DNS_BATCH_SIZE][768];
+	static struct recv_batch batch;
+	struct listener_data *ifdata = user_data;
+	int sk, i, count;
+
+	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
+		connman_error("Error with UDP listener channel");
+		ifdata->udp_listener_watch = 0;
+		return FALSE;
+	}
+
+	sk = g_io_channel_unix_get_fd(channel);
+
+	recv_batch_setup(&batch, buf[0], sizeof(buf[0]));
+
+	count = recv_datagrams(sk, &batch);
+	if (count <= 0)
+		return TRUE;
+
+	batching = TRUE;
 
-	return resolv(req, buf, query);
+	for (i = 0; i < count; i++)
+		udp_listener_request(ifdata, sk, buf[i],
+				batch.msgs[i].msg_len,
+				(struct sockaddr *) &batch.addr[i],
+				batch.msgs[i].msg_hdr.msg_namelen);
+
+	batching = FALSE;
+	flush_send_batches();
+
+	batch_account(BATCH_LISTENER_RECV, count);
+
+	return TRUE;
 }
 
 static int create_dns_listener(int protocol, const char *ifname)
@@ -1494,6 +3250,8 @@ static int create_listener(const char *interface)
 
 static void destroy_listener(const char *interface)
 {
+	GHashTableIter iter;
+	gpointer key, value;
 	GSList *list;
 
 	if (interface == NULL)
@@ -1518,21 +3276,25 @@ static void destroy_listener(const char *interface)
 	g_slist_free(request_pending_list);
 	request_pending_list = NULL;
 
-	for (list = request_list; list; list = list->next) {
-		struct request_data *req = list->data;
+	g_hash_table_iter_init(&iter, request_table);
+
+	while (g_hash_table_iter_next(&iter, &key, &value) == TRUE) {
+		struct request_data *req = value;
 
 		DBG("Dropping request (id 0x%04x -> 0x%04x)",
 						req->srcid, req->dstid);
 
-		g_free(req->resp);
-		g_free(req->request);
-		g_free(req->name);
-		g_free(req);
-		list->data = NULL;
+		if (req->timeout > 0)
+			g_source_remove(req->timeout);
+
+		if (req->protocol == IPPROTO_TCP)
+			close(req->client_sk);
+
+		request_free(req);
 	}
 
-	g_slist_free(request_list);
-	request_list = NULL;
+	g_hash_table_remove_all(request_table);
+	g_hash_table_remove_all(coalesce_table);
 
 	destroy_tcp_listener(interface);
 	destroy_udp_listener(interface);
@@ -1587,6 +3349,14 @@ int __connman_dnsproxy_init(void)
 
 	listener_table = g_hash_table_new_full(g_str_hash, g_str_equal,
 							g_free, g_free);
+	request_table = g_hash_table_new(g_direct_hash, g_direct_equal);
+	coalesce_table = g_hash_table_new(g_str_hash, g_str_equal);
+	server_table = g_hash_table_new_full(g_str_hash, g_str_equal,
+								g_free, NULL);
+
+	cache_limit = connman_setting_get_uint("DNSCacheSize") * 1024;
+	cache = g_hash_table_new_full(g_str_hash, g_str_equal,
+						NULL, cache_entry_free);
 	err = __connman_dnsproxy_add_listener("lo");
 	if (err < 0)
 		return err;
@@ -1600,6 +3370,11 @@ int __connman_dnsproxy_init(void)
 destroy:
 	__connman_dnsproxy_remove_listener("lo");
 	g_hash_table_destroy(listener_table);
+	g_hash_table_destroy(request_table);
+	g_hash_table_destroy(coalesce_table);
+	g_hash_table_destroy(server_table);
+	g_hash_table_destroy(cache);
+	cache = NULL;
 
 	return err;
 }
@@ -1613,4 +3388,10 @@ void __connman_dnsproxy_cleanup(void)
 	g_hash_table_foreach(listener_table, remove_listener, NULL);
 
 	g_hash_table_destroy(listener_table);
+	g_hash_table_destroy(request_table);
+	g_hash_table_destroy(coalesce_table);
+	g_hash_table_destroy(server_table);
+
+	g_hash_table_destroy(cache);
+	cache = NULL;
 }
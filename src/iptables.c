@@ -91,9 +91,27 @@ struct connman_iptables_entry {
 	int offset;
 	int builtin;
 
+	/* A jump continues right after this entry */
+	struct connman_iptables_entry *jump;
+
 	struct ipt_entry *entry;
 };
 
+/*
+ * The head of a builtin chain is its first rule, or the policy when it
+ * is empty. The head of a user chain is its error entry. The tail is
+ * the policy or the RETURN entry, which new rules are inserted before.
+ */
+struct connman_iptables_chain {
+	GList *head;
+	GList *tail;
+};
+
+/*
+ * Offsets, jump verdicts and hook positions are only valid in the blob
+ * read from the kernel. Changes just link entries into the list and
+ * all of them are recomputed once when the table is committed.
+ */
 struct connman_iptables {
 	int ipt_sock;
 
@@ -108,6 +126,8 @@ struct connman_iptables {
 	unsigned int hook_entry[NF_INET_NUMHOOKS];
 
 	GList *entries;
+	GHashTable *chains;
+	gboolean changed;
 };
 
 static GHashTable *table_hash = NULL;
@@ -133,12 +153,6 @@ static int is_hook_entry(struct connman_iptables *table,
 	return -1;
 }
 
-static unsigned long entry_to_offset(struct connman_iptables *table,
-					struct ipt_entry *entry)
-{
-	return (void *)entry - (void *)table->blob_entries->entrytable;
-}
-
 static int target_to_verdict(char *target_name)
 {
 	if (!strcmp(target_name, LABEL_ACCEPT))
@@ -194,132 +208,163 @@ static gboolean is_jump(struct connman_iptables_entry *e)
 	return false;
 }
 
-static gboolean is_chain(struct connman_iptables *table,
-				struct connman_iptables_entry *e)
+/* Returns the chain name if the entry starts a chain */
+static const char *chain_name(struct connman_iptables_entry *e)
 {
-	struct ipt_entry *entry;
 	struct xt_entry_target *target;
 
-	entry = e->entry;
 	if (e->builtin >= 0)
-		return TRUE;
+		return hooknames[e->builtin];
 
-	target = ipt_get_target(entry);
+	target = ipt_get_target(e->entry);
 	if (!strcmp(target->u.user.name, IPT_ERROR_TARGET))
-		return TRUE;
+		return (char *)target->data;
 
-	return FALSE;
+	return NULL;
+}
+
+static gboolean is_chain(struct connman_iptables *table,
+				struct connman_iptables_entry *e)
+{
+	return chain_name(e) != NULL;
 }
 
-static GList *find_chain_head(struct connman_iptables *table,
-				char *chain_name)
+/* Indexes the chains of a freshly loaded table by name */
+static void update_chains(struct connman_iptables *table)
 {
+	struct connman_iptables_chain *chain = NULL;
 	GList *list;
-	struct connman_iptables_entry *head;
-	struct ipt_entry *entry;
-	struct xt_entry_target *target;
-	int builtin;
+
+	g_hash_table_remove_all(table->chains);
 
 	for (list = table->entries; list; list = list->next) {
-		head = list->data;
-		entry = head->entry;
+		const char *name = chain_name(list->data);
 
-		/* Buit-in chain */
-		builtin = head->builtin;
-		if (builtin >= 0 && !strcmp(hooknames[builtin], chain_name))
+		if (name == NULL)
+			continue;
+
+		if (chain != NULL)
+			chain->tail = list->prev;
+
+		/* The last entry only marks the end of the table */
+		if (list->next == NULL)
 			break;
 
-		/* User defined chain */
-		target = ipt_get_target(entry);
-		if (!strcmp(target->u.user.name, IPT_ERROR_TARGET) &&
-		    !strcmp((char *)target->data, chain_name))
+		chain = g_try_new0(struct connman_iptables_chain, 1);
+		if (chain == NULL)
 			break;
-	}
 
-	return list;
+		chain->head = list;
+		g_hash_table_replace(table->chains, g_strdup(name), chain);
+	}
 }
 
-static GList *find_chain_tail(struct connman_iptables *table,
-				char *chain_name)
+/*
+ * Kernel verdicts are offsets. They are turned into the entry that
+ * precedes the target, which stays in place while other entries are
+ * added or removed.
+ */
+static void resolve_jumps(struct connman_iptables *table)
 {
-	GList *chain_head, *list;
-	struct connman_iptables_entry *head, *tail;
-	struct ipt_entry *entry;
-	struct xt_entry_target *target;
-	int builtin;
+	GHashTable *ends;
+	GList *list;
+	struct connman_iptables_entry *e;
+	struct xt_standard_target *t;
 
-	/* First we look for the head */
-	for (list = table->entries; list; list = list->next) {
-		head = list->data;
-		entry = head->entry;
+	ends = g_hash_table_new(g_direct_hash, g_direct_equal);
 
-		/* Buit-in chain */
-		builtin = head->builtin;
-		if (builtin >= 0 && !strcmp(hooknames[builtin], chain_name))
-			break;
+	for (list = table->entries; list; list = list->next) {
+		e = list->data;
 
-		/* User defined chain */
-		target = ipt_get_target(entry);
-		if (!strcmp(target->u.user.name, IPT_ERROR_TARGET) &&
-		    !strcmp((char *)target->data, chain_name))
-			break;
+		g_hash_table_replace(ends, GINT_TO_POINTER(e->offset +
+					e->entry->next_offset), e);
 	}
 
-	if (list == NULL)
-		return NULL;
+	for (list = table->entries; list; list = list->next) {
+		e = list->data;
 
-	chain_head = list;
+		if (!is_jump(e))
+			continue;
 
-	/* Then we look for the next chain */
-	for (list = chain_head->next; list; list = list->next) {
-		tail = list->data;
-		entry = tail->entry;
+		t = (struct xt_standard_target *)ipt_get_target(e->entry);
 
-		if (is_chain(table, tail))
-			return list;
+		e->jump = g_hash_table_lookup(ends,
+					GINT_TO_POINTER(t->verdict));
+		if (e->jump == NULL)
+			connman_warn("Jump to unknown offset 0x%x", t->verdict);
 	}
 
-	/* Nothing found, we return the table end */
-	return g_list_last(table->entries);
+	g_hash_table_destroy(ends);
 }
 
-
+/*
+ * Computes entry offsets, hook entries and underflows in one pass and
+ * then points every jump at the entry after its target.
+ */
 static void update_offsets(struct connman_iptables *table)
 {
-	GList *list, *prev;
-	struct connman_iptables_entry *entry, *prev_entry;
+	GList *list;
+	struct connman_iptables_entry *entry, *prev = NULL;
+	struct xt_standard_target *t;
+	unsigned int offset = 0;
+	int hook = -1;
 
 	for (list = table->entries; list; list = list->next) {
 		entry = list->data;
 
-		if (list == table->entries) {
-			entry->offset = 0;
+		if (is_chain(table, entry)) {
+			if (hook >= 0 && prev != NULL)
+				table->underflow[hook] = prev->offset;
 
-			continue;
+			hook = entry->builtin;
+			if (hook >= 0)
+				table->hook_entry[hook] = offset;
 		}
 
-		prev = list->prev;
-		prev_entry = prev->data;
+		entry->offset = offset;
+		offset += entry->entry->next_offset;
 
-		entry->offset = prev_entry->offset +
-					prev_entry->entry->next_offset;
+		prev = entry;
 	}
+
+	for (list = table->entries; list; list = list->next) {
+		entry = list->data;
+
+		if (entry->jump == NULL)
+			continue;
+
+		t = (struct xt_standard_target *)ipt_get_target(entry->entry);
+		t->verdict = entry->jump->offset +
+					entry->jump->entry->next_offset;
+	}
+}
+
+static void free_entry(struct connman_iptables *table, GList *list)
+{
+	struct connman_iptables_entry *entry = list->data;
+
+	table->num_entries--;
+	table->size -= entry->entry->next_offset;
+
+	g_free(entry->entry);
+	g_free(entry);
+
+	table->entries = g_list_delete_link(table->entries, list);
 }
 
-static int iptables_add_entry(struct connman_iptables *table,
+/* Returns the list node of the new entry */
+static GList *iptables_add_entry(struct connman_iptables *table,
 				struct ipt_entry *entry, GList *before,
 					int builtin)
 {
-	GList *list;
-	struct connman_iptables_entry *e, *tmp, *entry_before;
-	struct xt_standard_target *t;
+	struct connman_iptables_entry *e;
 
-	if (table == NULL)
-		return -1;
+	if (table == NULL || before == NULL)
+		return NULL;
 
 	e = g_try_malloc0(sizeof(struct connman_iptables_entry));
 	if (e == NULL)
-		return -1;
+		return NULL;
 
 	e->entry = entry;
 	e->builtin = builtin;
@@ -327,113 +372,73 @@ static int iptables_add_entry(struct connman_iptables *table,
 	table->entries = g_list_insert_before(table->entries, before, e);
 	table->num_entries++;
 	table->size += entry->next_offset;
+	table->changed = TRUE;
 
-	if (before == NULL) {
-		e->offset = table->size - entry->next_offset;
-
-		return 0;
-	}
-
-	entry_before = before->data;
-
-	/*
-	 * We've just insterted a new entry. All references before it
-	 * should be bumped accordingly.
-	 */
-	for (list = table->entries; list != before; list = list->next) {
-		tmp = list->data;
-
-		if (!is_jump(tmp))
-			continue;
-
-		t = (struct xt_standard_target *)ipt_get_target(tmp->entry);
-
-		if (t->verdict >= entry_before->offset)
-			t->verdict += entry->next_offset;
-	}
-
-	update_offsets(table);
-
-	return 0;
+	return before->prev;
 }
 
 static int iptables_flush_chain(struct connman_iptables *table,
-						char *name)
+						const char *name)
 {
-	GList *chain_head, *chain_tail, *list, *next;
+	struct connman_iptables_chain *chain;
 	struct connman_iptables_entry *entry;
-	int builtin, removed = 0;
-
-	chain_head = find_chain_head(table, name);
-	if (chain_head == NULL)
-		return -EINVAL;
+	GList *list, *next;
+	int builtin;
 
-	chain_tail = find_chain_tail(table, name);
-	if (chain_tail == NULL)
+	chain = g_hash_table_lookup(table->chains, name);
+	if (chain == NULL)
 		return -EINVAL;
 
-	entry = chain_head->data;
+	entry = chain->head->data;
 	builtin = entry->builtin;
 
 	if (builtin >= 0)
-		list = chain_head;
+		list = chain->head;
 	else
-		list = chain_head->next;
+		list = chain->head->next;
 
-	if (list == chain_tail->prev)
+	if (list == chain->tail)
 		return 0;
 
-	while (list != chain_tail->prev) {
-		entry = list->data;
-		next = g_list_next(list);
-
-		table->num_entries--;
-		table->size -= entry->entry->next_offset;
-		removed += entry->entry->next_offset;
-
-		g_free(entry->entry);
-
-		table->entries = g_list_remove(table->entries, list->data);
-
+	while (list != chain->tail) {
+		next = list->next;
+		free_entry(table, list);
 		list = next;
 	}
 
 	if (builtin >= 0) {
-		struct connman_iptables_entry *e;
-
-		entry = list->data;
-
+		entry = chain->tail->data;
 		entry->builtin = builtin;
 
-		table->underflow[builtin] -= removed;
-
-		for (list = chain_tail; list; list = list->next) {
-			e = list->data;
-
-			builtin = e->builtin;
-			if (builtin < 0)
-				continue;
-
-			table->hook_entry[builtin] -= removed;
-			table->underflow[builtin] -= removed;
-		}
+		chain->head = chain->tail;
 	}
 
-	update_offsets(table);
+	table->changed = TRUE;
 
 	return 0;
 }
 
 static int iptables_add_chain(struct connman_iptables *table,
-					char *name)
+					const char *name)
 {
-	GList *last;
+	struct connman_iptables_chain *chain;
+	GList *last, *head;
 	struct ipt_entry *entry_head;
 	struct ipt_entry *entry_return;
 	struct error_target *error;
 	struct ipt_standard_target *standard;
 	u_int16_t entry_head_size, entry_return_size;
 
+	if (strlen(name) >= sizeof(error->error))
+		return -EINVAL;
+
+	if (g_hash_table_lookup(table->chains, name) != NULL)
+		return -EEXIST;
+
+	chain = g_try_new0(struct connman_iptables_chain, 1);
+	if (chain == NULL)
+		return -ENOMEM;
+
 	last = g_list_last(table->entries);
 
 	/*
@@ -462,7 +467,8 @@ static int iptables_add_chain(struct connman_iptables *table,
 	error->t.u.user.target_size = ALIGN(sizeof(struct error_target));
 	strcpy(error->error, name);
 
-	if (iptables_add_entry(table, entry_head, last, -1) < 0)
+	head = iptables_add_entry(table, entry_head, last, -1);
+	if (head == NULL)
 		goto err_head;
 
 	/* tail entry */
@@ -482,28 +488,77 @@ static int iptables_add_chain(struct connman_iptables *table,
 				ALIGN(sizeof(struct ipt_standard_target));
 	standard->verdict = XT_RETURN;
 
-	if (iptables_add_entry(table, entry_return, last, -1) < 0)
+	chain->head = head;
+	chain->tail = iptables_add_entry(table, entry_return, last, -1);
+	if (chain->tail == NULL)
 		goto err;
 
+	g_hash_table_replace(table->chains, g_strdup(name), chain);
+
 	return 0;
 
 err:
 	g_free(entry_return);
+	free_entry(table, head);
+	g_free(chain);
+
+	return -ENOMEM;
+
 err_head:
 	g_free(entry_head);
+	g_free(chain);
 
 	return -ENOMEM;
 }
 
+static int iptables_delete_chain(struct connman_iptables *table,
+					const char *name)
+{
+	struct connman_iptables_chain *chain;
+	struct connman_iptables_entry *head;
+	GList *list, *end, *next;
+
+	chain = g_hash_table_lookup(table->chains, name);
+	if (chain == NULL)
+		return -EINVAL;
+
+	head = chain->head->data;
+	if (head->builtin >= 0)
+		return -EINVAL;
+
+	for (list = table->entries; list; list = list->next) {
+		struct connman_iptables_entry *e = list->data;
+
+		if (e->jump == head)
+			return -EBUSY;
+	}
+
+	end = chain->tail->next;
+
+	for (list = chain->head; list != end; list = next) {
+		next = list->next;
+		free_entry(table, list);
+	}
+
+	g_hash_table_remove(table->chains, name);
+
+	table->changed = TRUE;
+
+	return 0;
+}
+
 static struct ipt_entry *
 new_rule(struct connman_iptables *table, struct ipt_ip *ip,
 		char *target_name, struct xtables_target *xt_t,
-		char *match_name, struct xtables_match *xt_m)
+		char *match_name, struct xtables_match *xt_m,
+		struct connman_iptables_entry **jump)
 {
 	struct ipt_entry *new_entry;
 	size_t match_size, target_size;
 	int is_builtin = is_builtin_target(target_name);
 
+	*jump = NULL;
+
 	if (xt_m)
 		match_size = xt_m->m->u.match_size;
 	else
@@ -545,107 +600,79 @@ new_rule(struct connman_iptables *table, struct ipt_ip *ip,
 		entry_target = ipt_get_target(new_entry);
 		memcpy(entry_target, xt_t->t, target_size);
 	} else {
-		struct connman_iptables_entry *target_rule;
+		struct connman_iptables_chain *chain;
 		struct xt_standard_target *target;
-		GList *chain_head;
 
 		/*
 		 * This is a user defined target, i.e. a chain jump.
-		 * We search for the chain head, and the target verdict
-		 * is the first rule's offset on this chain.
-		 * The offset is from the beginning of the table.
+		 * The verdict is the offset of the first rule of the
+		 * chain, which follows the chain head once committed.
 		 */
 
-		chain_head = find_chain_head(table, target_name);
-		if (chain_head == NULL || chain_head->next == NULL) {
+		chain = g_hash_table_lookup(table->chains, target_name);
+		if (chain == NULL || ((struct connman_iptables_entry *)
+					chain->head->data)->builtin >= 0) {
 			g_free(new_entry);
 			return NULL;
 		}
 
-		target_rule = chain_head->next->data;
+		*jump = chain->head->data;
 
 		target = (struct xt_standard_target *)ipt_get_target(new_entry);
 		strcpy(target->target.u.user.name, IPT_STANDARD_TARGET);
 		target->target.u.user.target_size = target_size;
-		target->verdict = target_rule->offset;
 	}
 
 	return new_entry;
 }
 
-static void update_hooks(struct connman_iptables *table, GList *chain_head,
-				struct ipt_entry *entry)
-{
-	GList *list;
-	struct connman_iptables_entry *head, *e;
-	int builtin;
-
-	if (chain_head == NULL)
-		return;
-
-	head = chain_head->data;
-
-	builtin = head->builtin;
-	if (builtin < 0)
-		return;
-
-	table->underflow[builtin] += entry->next_offset;
-
-	for (list = chain_head->next; list; list = list->next) {
-		e = list->data;
-
-		builtin = e->builtin;
-		if (builtin < 0)
-			continue;
-
-		table->hook_entry[builtin] += entry->next_offset;
-		table->underflow[builtin] += entry->next_offset;
-	}
-}
-
 static int
 iptables_add_rule(struct connman_iptables *table,
-				struct ipt_ip *ip, char *chain_name,
+				struct ipt_ip *ip, const char *chain_name,
 				char *target_name, struct xtables_target *xt_t,
 				char *match_name, struct xtables_match *xt_m)
 {
-	GList *chain_tail, *chain_head;
+	struct connman_iptables_chain *chain;
+	struct connman_iptables_entry *head, *jump;
 	struct ipt_entry *new_entry;
-	struct connman_iptables_entry *head;
+	GList *list;
 	int builtin = -1;
 
 	DBG("");
 
-	chain_head = find_chain_head(table, chain_name);
-	if (chain_head == NULL)
-		return -EINVAL;
-
-	chain_tail = find_chain_tail(table, chain_name);
-	if (chain_tail == NULL)
+	chain = g_hash_table_lookup(table->chains, chain_name);
+	if (chain == NULL)
 		return -EINVAL;
 
 	new_entry = new_rule(table, ip,
 				target_name, xt_t,
-				match_name, xt_m);
+				match_name, xt_m, &jump);
 	if (new_entry == NULL)
 		return -EINVAL;
 
-	update_hooks(table, chain_head, new_entry);
-
 	/*
 	 * If the chain is builtin, and does not have any rule,
 	 * then the one that we're inserting is becoming the head
 	 * and thus needs the builtin flag.
 	 */
-	head = chain_head->data;
-	if (head->builtin < 0)
-		builtin = -1;
-	else if (chain_head == chain_tail->prev) {
+	head = chain->head->data;
+	if (head->builtin >= 0 && chain->head == chain->tail)
 		builtin = head->builtin;
+
+	list = iptables_add_entry(table, new_entry, chain->tail, builtin);
+	if (list == NULL) {
+		g_free(new_entry);
+		return -ENOMEM;
+	}
+
+	((struct connman_iptables_entry *) list->data)->jump = jump;
+
+	if (builtin >= 0) {
 		head->builtin = -1;
+		chain->head = list;
 	}
 
-	return iptables_add_entry(table, new_entry, chain_tail->prev, builtin);
+	return 0;
 }
 
 static struct ipt_replace *
@@ -713,8 +740,7 @@ static void dump_ip(struct ipt_entry *entry)
 		connman_info("\tdst %s/%s", ip_string, ip_mask);
 }
 
-static void dump_target(struct connman_iptables *table,
-				struct ipt_entry *entry)
+static void dump_target(struct ipt_replace *repl, struct ipt_entry *entry)
 
 {
 	struct xtables_target *xt_t;
@@ -750,8 +776,8 @@ static void dump_target(struct connman_iptables *table,
 
 		default:
 			connman_info("\tJUMP @%p (0x%x)",
-				(char*)table->blob_entries->entrytable +
-				t->verdict, t->verdict);
+				(char *)repl->entries + t->verdict,
+				t->verdict);
 			break;
 		}
 
@@ -774,7 +800,7 @@ static void dump_target(struct connman_iptables *table,
 	}
 }
 
-static void dump_match(struct connman_iptables *table, struct ipt_entry *entry)
+static void dump_match(struct ipt_entry *entry)
 {
 	struct xtables_match *xt_m;
 	struct xt_entry_match *match;
@@ -803,19 +829,24 @@ out:
 
 }
 
-static int dump_entry(struct ipt_entry *entry,
-				struct connman_iptables *table)
+static int dump_entry(struct ipt_entry *entry, struct ipt_replace *repl)
 {
 	struct xt_entry_target *target;
 	unsigned int offset;
-	int builtin;
+	int i, builtin = -1;
 
-	offset = (char *)entry - (char *)table->blob_entries->entrytable;
+	offset = (char *)entry - (char *)repl->entries;
 	target = ipt_get_target(entry);
-	builtin = is_hook_entry(table, entry);
 
-	if (entry_to_offset(table, entry) + entry->next_offset ==
-					table->blob_entries->size) {
+	for (i = 0; i < NF_INET_NUMHOOKS; i++) {
+		if ((repl->valid_hooks & (1 << i)) &&
+					repl->hook_entry[i] == offset) {
+			builtin = i;
+			break;
+		}
+	}
+
+	if (offset + entry->next_offset == repl->size) {
 		connman_info("End of CHAIN 0x%x", offset);
 		return 0;
 	}
@@ -839,24 +870,35 @@ static int dump_entry(struct ipt_entry *entry,
 				entry->next_offset);
 	}
 
-	dump_match(table, entry);
-	dump_target(table, entry);
+	dump_match(entry);
+	dump_target(repl, entry);
 	dump_ip(entry);
 
 	return 0;
 }
 
+/*
+ * Dumps the entry list, which includes changes that are not committed
+ * yet, laid out as the blob that the next commit would hand the kernel.
+ */
 static void iptables_dump(struct connman_iptables *table)
 {
-	connman_info("%s valid_hooks=0x%08x, num_entries=%u, size=%u",
-			table->info->name,
-			table->info->valid_hooks, table->info->num_entries,
-				table->info->size);
+	struct ipt_replace *repl;
 
-	ENTRY_ITERATE(table->blob_entries->entrytable,
-			table->blob_entries->size,
-			dump_entry, table);
+	update_offsets(table);
+
+	repl = iptables_blob(table);
+	if (repl == NULL)
+		return;
+
+	connman_info("%s valid_hooks=0x%08x, num_entries=%u, size=%u%s",
+			repl->name, repl->valid_hooks, repl->num_entries,
+			repl->size, table->changed == TRUE ? " (pending)" : "");
+
+	ENTRY_ITERATE(repl->entries, repl->size, dump_entry, repl);
 
+	g_free(repl->counters);
+	g_free(repl);
 }
 
 static int iptables_get_entries(struct connman_iptables *table)
@@ -876,10 +918,11 @@ static int iptables_replace(struct connman_iptables *table,
 			 sizeof(*r) + r->size);
 }
 
+/* Entries come in table order, so they are prepended and reversed */
 static int add_entry(struct ipt_entry *entry, struct connman_iptables *table)
 {
+	struct connman_iptables_entry *e;
 	struct ipt_entry *new_entry;
-	int builtin;
 
 	new_entry = g_try_malloc0(entry->next_offset);
 	if (new_entry == NULL)
@@ -887,9 +930,21 @@ static int add_entry(struct ipt_entry *entry, struct connman_iptables *table)
 
 	memcpy(new_entry, entry, entry->next_offset);
 
-	builtin = is_hook_entry(table, entry);
+	e = g_try_new0(struct connman_iptables_entry, 1);
+	if (e == NULL) {
+		g_free(new_entry);
+		return -ENOMEM;
+	}
+
+	e->entry = new_entry;
+	e->builtin = is_hook_entry(table, entry);
+	e->offset = table->size;
+
+	table->entries = g_list_prepend(table->entries, e);
+	table->num_entries++;
+	table->size += entry->next_offset;
 
-	return iptables_add_entry(table, new_entry, NULL, builtin);
+	return 0;
 }
 
 static void table_cleanup(struct connman_iptables *table)
@@ -907,21 +962,145 @@ static void table_cleanup(struct connman_iptables *table)
 	}
 
 	g_list_free(table->entries);
+
+	if (table->chains != NULL)
+		g_hash_table_destroy(table->chains);
+
 	g_free(table->info);
 	g_free(table->blob_entries);
 	g_free(table);
 }
 
-static struct connman_iptables *iptables_init(char *table_name)
+/* Packet counters change all the time, they are not part of the rules */
+static int clear_counters(struct ipt_entry *entry, void *user_data)
 {
-	struct connman_iptables *table;
+	memset(&entry->counters, 0, sizeof(entry->counters));
+
+	return 0;
+}
+
+/*
+ * Reads the kernel table into table->info and table->blob_entries,
+ * which afterwards hold the rules as last read or committed.
+ */
+static int table_snapshot(struct connman_iptables *table)
+{
+	struct ipt_get_entries *entries;
+	socklen_t s;
+
+	s = sizeof(*table->info);
+	if (getsockopt(table->ipt_sock, IPPROTO_IP, IPT_SO_GET_INFO,
+						table->info, &s) < 0)
+		return -errno;
+
+	entries = g_try_malloc0(sizeof(struct ipt_get_entries) +
+						table->info->size);
+	if (entries == NULL)
+		return -ENOMEM;
+
+	strcpy(entries->name, table->info->name);
+	entries->size = table->info->size;
+
+	g_free(table->blob_entries);
+	table->blob_entries = entries;
+
+	if (iptables_get_entries(table) < 0)
+		return -errno;
+
+	ENTRY_ITERATE(entries->entrytable, entries->size, clear_counters, NULL);
+
+	return 0;
+}
+
+/*
+ * Other tools can replace rules without changing the number of entries
+ * or the size of the table, so the rules themselves are compared with
+ * the ones last read or committed.
+ */
+static gboolean kernel_matches_cache(struct connman_iptables *table)
+{
+	struct ipt_getinfo info;
+	struct ipt_get_entries *entries;
 	socklen_t s;
+	gboolean match;
+
+	if (table->blob_entries == NULL)
+		return FALSE;
+
+	s = sizeof(info);
+	memset(&info, 0, sizeof(info));
+	strcpy(info.name, table->info->name);
+
+	if (getsockopt(table->ipt_sock, IPPROTO_IP, IPT_SO_GET_INFO,
+							&info, &s) < 0)
+		return FALSE;
+
+	if (info.num_entries != table->info->num_entries ||
+					info.size != table->info->size)
+		return FALSE;
+
+	if (memcmp(info.hook_entry, table->info->hook_entry,
+					sizeof(info.hook_entry)) != 0 ||
+			memcmp(info.underflow, table->info->underflow,
+					sizeof(info.underflow)) != 0)
+		return FALSE;
+
+	entries = g_try_malloc0(sizeof(struct ipt_get_entries) + info.size);
+	if (entries == NULL)
+		return FALSE;
+
+	strcpy(entries->name, info.name);
+	entries->size = info.size;
+
+	s = sizeof(struct ipt_get_entries) + info.size;
+	if (getsockopt(table->ipt_sock, IPPROTO_IP, IPT_SO_GET_ENTRIES,
+							entries, &s) < 0) {
+		g_free(entries);
+		return FALSE;
+	}
+
+	ENTRY_ITERATE(entries->entrytable, entries->size, clear_counters, NULL);
+
+	match = memcmp(entries->entrytable, table->blob_entries->entrytable,
+						info.size) == 0 ? TRUE : FALSE;
+
+	g_free(entries);
+
+	return match;
+}
+
+/*
+ * A cached table with pending changes is checked against the kernel
+ * when it is committed, one without is only reused while the kernel
+ * still holds what was last read or committed.
+ */
+static gboolean table_is_current(struct connman_iptables *table)
+{
+	if (table->changed == TRUE)
+		return TRUE;
+
+	return kernel_matches_cache(table);
+}
+
+static struct connman_iptables *iptables_init(const char *table_name)
+{
+	struct connman_iptables *table;
+	int err;
 
 	DBG("%s", table_name);
 
 	table = g_hash_table_lookup(table_hash, table_name);
-	if (table != NULL)
-		return table;
+	if (table != NULL) {
+		if (table_is_current(table) == TRUE)
+			return table;
+
+		DBG("%s changed outside, reloading", table_name);
+
+		g_hash_table_remove(table_hash, table_name);
+	}
+
+	if (strlen(table_name) >= XT_TABLE_MAXNAMELEN)
+		return NULL;
 
 	table = g_try_new0(struct connman_iptables, 1);
 	if (table == NULL)
@@ -935,22 +1114,12 @@ static struct connman_iptables *iptables_init(char *table_name)
 	if (table->ipt_sock < 0)
 		goto err;
 
-	s = sizeof(*table->info);
 	strcpy(table->info->name, table_name);
-	if (getsockopt(table->ipt_sock, IPPROTO_IP, IPT_SO_GET_INFO,
-						table->info, &s) < 0)
-		goto err;
-
-	table->blob_entries = g_try_malloc0(sizeof(struct ipt_get_entries) +
-						table->info->size);
-	if (table->blob_entries == NULL)
+	if (table_snapshot(table) < 0)
 		goto err;
 
-	strcpy(table->blob_entries->name, table_name);
-	table->blob_entries->size = table->info->size;
-
-	if (iptables_get_entries(table) < 0)
-		goto err;
+	table->chains = g_hash_table_new_full(g_str_hash, g_str_equal,
+							g_free, g_free);
 
 	table->num_entries = 0;
 	table->old_entries = table->info->num_entries;
@@ -961,10 +1130,18 @@ static struct connman_iptables *iptables_init(char *table_name)
 	memcpy(table->hook_entry, table->info->hook_entry,
 				sizeof(table->info->hook_entry));
 
-	ENTRY_ITERATE(table->blob_entries->entrytable,
+	err = ENTRY_ITERATE(table->blob_entries->entrytable,
 			table->blob_entries->size,
 				add_entry, table);
 
+	table->entries = g_list_reverse(table->entries);
+
+	if (err < 0)
+		goto err;
+
+	resolve_jumps(table);
+	update_chains(table);
+
 	g_hash_table_insert(table_hash, g_strdup(table_name), table);
 
 	return table;
@@ -976,11 +1153,53 @@ err:
 	return NULL;
 }
 
+static int iptables_commit(struct connman_iptables *table)
+{
+	struct ipt_replace *repl;
+	int err;
+
+	/* Never overwrite rules changed outside since the table was read */
+	if (kernel_matches_cache(table) == FALSE) {
+		connman_warn("iptables table %s changed outside of connman",
+							table->info->name);
+		return -EAGAIN;
+	}
+
+	update_offsets(table);
+
+	repl = iptables_blob(table);
+	if (repl == NULL)
+		return -ENOMEM;
+
+	err = iptables_replace(table, repl);
+	if (err < 0)
+		err = -errno;
+
+	g_free(repl->counters);
+	g_free(repl);
+
+	if (err < 0)
+		return err;
+
+	/* The kernel now holds exactly what is cached */
+	table->old_entries = table->num_entries;
+	table->changed = FALSE;
+
+	/* Without a snapshot the next use reloads the table */
+	if (table_snapshot(table) < 0) {
+		g_free(table->blob_entries);
+		table->blob_entries = NULL;
+	}
+
+	return 0;
+}
+
 static struct option iptables_opts[] = {
 	{.name = "append",        .has_arg = 1, .val = 'A'},
 	{.name = "flush-chain",   .has_arg = 1, .val = 'F'},
 	{.name = "list",          .has_arg = 2, .val = 'L'},
 	{.name = "new-chain",     .has_arg = 1, .val = 'N'},
+	{.name = "delete-chain",  .has_arg = 1, .val = 'X'},
 	{.name = "destination",   .has_arg = 1, .val = 'd'},
 	{.name = "in-interface",  .has_arg = 1, .val = 'i'},
 	{.name = "jump",          .has_arg = 1, .val = 'j'},
@@ -997,6 +1216,177 @@ struct xtables_globals iptables_globals = {
 	.orig_opts = iptables_opts,
 };
 
+static void parse_ip(struct ipt_ip *ip, int option, const char *arg,
+							gboolean invert)
+{
+	struct in_addr addr;
+	int len;
+
+	switch (option) {
+	case 'd':
+		if (!inet_pton(AF_INET, arg, &addr))
+			break;
+
+		ip->dst = addr;
+		inet_pton(AF_INET, "255.255.255.255", &ip->dmsk);
+
+		if (invert)
+			ip->invflags |= IPT_INV_DSTIP;
+
+		break;
+
+	case 'i':
+		len = strlen(arg);
+
+		if (len + 1 > IFNAMSIZ)
+			break;
+
+		strcpy(ip->iniface, arg);
+		memset(ip->iniface_mask, 0xff, len + 1);
+
+		if (invert)
+			ip->invflags |= IPT_INV_VIA_IN;
+
+		break;
+
+	case 'o':
+		len = strlen(arg);
+
+		if (len + 1 > IFNAMSIZ)
+			break;
+
+		strcpy(ip->outiface, arg);
+		memset(ip->outiface_mask, 0xff, len + 1);
+
+		if (invert)
+			ip->invflags |= IPT_INV_VIA_OUT;
+
+		break;
+
+	case 's':
+		if (!inet_pton(AF_INET, arg, &addr))
+			break;
+
+		ip->src = addr;
+		inet_pton(AF_INET, "255.255.255.255", &ip->smsk);
+
+		if (invert)
+			ip->invflags |= IPT_INV_SRCIP;
+
+		break;
+	}
+}
+
+/* Returns NULL for chain jumps, which have no target extension */
+static struct xtables_target *prepare_target(char *target_name, int *err)
+{
+	struct xtables_target *xt_t;
+	size_t size;
+
+	*err = 0;
+
+	xt_t = xtables_find_target(target_name, XTF_TRY_LOAD);
+	if (xt_t == NULL)
+		return NULL;
+
+	size = ALIGN(sizeof(struct ipt_entry_target)) + xt_t->size;
+
+	xt_t->tflags = 0;
+	xt_t->t = g_try_malloc0(size);
+	if (xt_t->t == NULL) {
+		*err = -ENOMEM;
+		return NULL;
+	}
+
+	xt_t->t->u.target_size = size;
+	strcpy(xt_t->t->u.user.name, target_name);
+	xt_t->t->u.user.revision = xt_t->revision;
+	if (xt_t->init != NULL)
+		xt_t->init(xt_t->t);
+	iptables_globals.opts =
+		xtables_merge_options(
+#if XTABLES_VERSION_CODE > 5
+				     iptables_globals.orig_opts,
+#endif
+				     iptables_globals.opts,
+				     xt_t->extra_opts,
+				     &xt_t->option_offset);
+	if (iptables_globals.opts == NULL)
+		*err = -ENOMEM;
+
+	return xt_t;
+}
+
+static struct xtables_match *prepare_match(char *match_name, int *err)
+{
+	struct xtables_match *xt_m;
+	size_t size;
+
+	*err = 0;
+
+	xt_m = xtables_find_match(match_name, XTF_LOAD_MUST_SUCCEED, NULL);
+	if (xt_m == NULL) {
+		*err = -EINVAL;
+		return NULL;
+	}
+
+	size = ALIGN(sizeof(struct ipt_entry_match)) + xt_m->size;
+
+	xt_m->mflags = 0;
+	xt_m->m = g_try_malloc0(size);
+	if (xt_m->m == NULL) {
+		*err = -ENOMEM;
+		return NULL;
+	}
+
+	xt_m->m->u.match_size = size;
+	strcpy(xt_m->m->u.user.name, xt_m->name);
+	xt_m->m->u.user.revision = xt_m->revision;
+	if (xt_m->init != NULL)
+		xt_m->init(xt_m->m);
+	if (xt_m != xt_m->next) {
+		iptables_globals.opts =
+			xtables_merge_options(
+#if XTABLES_VERSION_CODE > 5
+					iptables_globals.orig_opts,
+#endif
+					iptables_globals.opts,
+					xt_m->extra_opts,
+					&xt_m->option_offset);
+		if (iptables_globals.opts == NULL)
+			*err = -ENOMEM;
+	}
+
+	return xt_m;
+}
+
+static void parse_extension(int c, char **argv, gboolean invert,
+				struct xtables_target *xt_t,
+				struct xtables_match *xt_m)
+{
+	if (xt_t == NULL || xt_t->parse == NULL ||
+	    !xt_t->parse(c - xt_t->option_offset, argv, invert,
+			&xt_t->tflags, NULL, &xt_t->t)) {
+		if (xt_m == NULL || xt_m->parse == NULL)
+			return;
+
+		xt_m->parse(c - xt_m->option_offset, argv,
+			invert, &xt_m->mflags, NULL, &xt_m->m);
+	}
+}
+
+/*
+ * Extension options are merged per command. Dropping them first keeps
+ * the option table from growing with every rule that is added.
+ */
+static void reset_options(void)
+{
+	if (iptables_globals.opts != iptables_globals.orig_opts)
+		xtables_free_opts(1);
+
+	iptables_globals.opts = iptables_globals.orig_opts;
+}
+
 static int iptables_command(int argc, char *argv[])
 {
 	struct connman_iptables *table;
@@ -1004,11 +1394,9 @@ static int iptables_command(int argc, char *argv[])
 	struct xtables_target *xt_t;
 	struct ipt_ip ip;
 	char *table_name, *chain, *new_chain, *match_name, *target_name;
-	char *flush_chain;
-	int c, ret, in_len, out_len;
-	size_t size;
+	char *flush_chain, *delete_chain;
+	int c, ret;
 	gboolean dump, invert;
-	struct in_addr src, dst;
 
 	if (argc == 0)
 		return -EINVAL;
@@ -1016,17 +1404,19 @@ static int iptables_command(int argc, char *argv[])
 	dump = FALSE;
 	invert = FALSE;
 	table_name = chain = new_chain = match_name = target_name = NULL;
-	flush_chain = NULL;
+	flush_chain = delete_chain = NULL;
 	memset(&ip, 0, sizeof(struct ipt_ip));
 	table = NULL;
 	xt_m = NULL;
 	xt_t = NULL;
 	ret = 0;
 
+	reset_options();
+
 	optind = 0;
 
 	while ((c = getopt_long(argc, argv,
-	   "-A:F:L::N:d:j:i:m:o:s:t:", iptables_globals.opts, NULL)) != -1) {
+	   "-A:F:L::N:X:d:j:i:m:o:s:t:", iptables_globals.opts, NULL)) != -1) {
 		switch (c) {
 		case 'A':
 			chain = optarg;
@@ -1044,115 +1434,30 @@ static int iptables_command(int argc, char *argv[])
 			new_chain = optarg;
 			break;
 
-		case 'd':
-			if (!inet_pton(AF_INET, optarg, &dst))
-				break;
-
-			ip.dst = dst;
-			inet_pton(AF_INET, "255.255.255.255", &ip.dmsk);
-
-			if (invert)
-				ip.invflags |= IPT_INV_DSTIP;
-
+		case 'X':
+			delete_chain = optarg;
 			break;
 
+		case 'd':
 		case 'i':
-			in_len = strlen(optarg);
-
-			if (in_len + 1 > IFNAMSIZ)
-				break;
-
-			strcpy(ip.iniface, optarg);
-			memset(ip.iniface_mask, 0xff, in_len + 1);
-
-			if (invert)
-				ip.invflags |= IPT_INV_VIA_IN;
-
+		case 'o':
+		case 's':
+			parse_ip(&ip, c, optarg, invert);
 			break;
 
 		case 'j':
 			target_name = optarg;
-			xt_t = xtables_find_target(target_name, XTF_TRY_LOAD);
-
-			if (xt_t == NULL)
-				break;
-
-			size = ALIGN(sizeof(struct ipt_entry_target)) +
-								xt_t->size;
-
-			xt_t->t = g_try_malloc0(size);
-			if (xt_t->t == NULL)
-				goto out;
-			xt_t->t->u.target_size = size;
-			strcpy(xt_t->t->u.user.name, target_name);
-			xt_t->t->u.user.revision = xt_t->revision;
-			if (xt_t->init != NULL)
-				xt_t->init(xt_t->t);
-			iptables_globals.opts =
-				xtables_merge_options(
-#if XTABLES_VERSION_CODE > 5
-						     iptables_globals.orig_opts,
-#endif
-						     iptables_globals.opts,
-						     xt_t->extra_opts,
-						     &xt_t->option_offset);
-			if (iptables_globals.opts == NULL)
+			xt_t = prepare_target(target_name, &ret);
+			if (ret < 0)
 				goto out;
 
 			break;
 
 		case 'm':
 			match_name = optarg;
-
-			xt_m = xtables_find_match(optarg, XTF_LOAD_MUST_SUCCEED, NULL);
-			size = ALIGN(sizeof(struct ipt_entry_match)) +
-								xt_m->size;
-			xt_m->m = g_try_malloc0(size);
-			if (xt_m == NULL)
+			xt_m = prepare_match(match_name, &ret);
+			if (ret < 0)
 				goto out;
-			xt_m->m->u.match_size = size;
-			strcpy(xt_m->m->u.user.name, xt_m->name);
-			xt_m->m->u.user.revision = xt_m->revision;
-			if (xt_m->init != NULL)
-				xt_m->init(xt_m->m);
-			if (xt_m != xt_m->next) {
-				iptables_globals.opts =
-				xtables_merge_options(
-#if XTABLES_VERSION_CODE > 5
-						iptables_globals.orig_opts,
-#endif
-						iptables_globals.opts,
-						xt_m->extra_opts,
-						&xt_m->option_offset);
-				if (iptables_globals.opts == NULL)
-					goto out;
-			}
-
-			break;
-
-		case 'o':
-			out_len = strlen(optarg);
-
-			if (out_len + 1 > IFNAMSIZ)
-				break;
-
-			strcpy(ip.outiface, optarg);
-			memset(ip.outiface_mask, 0xff, out_len + 1);
-
-			if (invert)
-				ip.invflags |= IPT_INV_VIA_OUT;
-
-			break;
-
-		case 's':
-			if (!inet_pton(AF_INET, optarg, &src))
-				break;
-
-			ip.src = src;
-			inet_pton(AF_INET, "255.255.255.255", &ip.smsk);
-
-			if (invert)
-				ip.invflags |= IPT_INV_SRCIP;
 
 			break;
 
@@ -1173,16 +1478,7 @@ static int iptables_command(int argc, char *argv[])
 			goto out;
 
 		default:
-			if (xt_t == NULL || xt_t->parse == NULL ||
-			    !xt_t->parse(c - xt_t->option_offset, argv, invert,
-					&xt_t->tflags, NULL, &xt_t->t)) {
-				if (xt_m == NULL || xt_m->parse == NULL)
-					break;
-
-				xt_m->parse(c - xt_m->option_offset, argv,
-					invert, &xt_m->mflags, NULL, &xt_m->m);
-			}
-
+			parse_extension(c, argv, invert, xt_t, xt_m);
 			break;
 		}
 
@@ -1199,6 +1495,17 @@ static int iptables_command(int argc, char *argv[])
 	}
 
 	if (dump) {
+		/* Show what the kernel has, unless changes are pending */
+		if (table->changed == FALSE) {
+			g_hash_table_remove(table_hash, table_name);
+
+			table = iptables_init(table_name);
+			if (table == NULL) {
+				ret = -EINVAL;
+				goto out;
+			}
+		}
+
 		iptables_dump(table);
 
 		ret = 0;
@@ -1208,7 +1515,15 @@ static int iptables_command(int argc, char *argv[])
 	if (flush_chain) {
 		DBG("Flush chain %s", flush_chain);
 
-		iptables_flush_chain(table, flush_chain);
+		ret = iptables_flush_chain(table, flush_chain);
+
+		goto out;
+	}
+
+	if (delete_chain) {
+		DBG("Delete chain %s", delete_chain);
+
+		ret = iptables_delete_chain(table, delete_chain);
 
 		goto out;
 	}
@@ -1226,8 +1541,10 @@ static int iptables_command(int argc, char *argv[])
 	}
 
 	if (chain) {
-		if (target_name == NULL)
-			return -1;
+		if (target_name == NULL) {
+			ret = -EINVAL;
+			goto out;
+		}
 
 		DBG("Adding %s to %s (match %s)",
 				target_name, chain, match_name);
@@ -1293,11 +1610,9 @@ int __connman_iptables_command(const char *format, ...)
 	return ret;
 }
 
-
 int __connman_iptables_commit(const char *table_name)
 {
 	struct connman_iptables *table;
-	struct ipt_replace *repl;
 	int err;
 
 	DBG("%s", table_name);
@@ -1306,19 +1621,168 @@ int __connman_iptables_commit(const char *table_name)
 	if (table == NULL)
 		return -EINVAL;
 
-	repl = iptables_blob(table);
+	err = iptables_commit(table);
+	if (err < 0)
+		g_hash_table_remove(table_hash, table_name);
 
-	err = iptables_replace(table, repl);
+	return err;
+}
 
-	g_free(repl->counters);
-	g_free(repl);
+/* Extension options of a rule, parsed like they would be by iptables */
+static int parse_options(const char **options, struct xtables_target *xt_t,
+						struct xtables_match *xt_m)
+{
+	char **argv;
+	int argc, c, ret = 0;
+
+	if (options == NULL || options[0] == NULL)
+		return 0;
+
+	for (argc = 0; options[argc] != NULL; argc++);
+
+	argv = g_try_new0(char *, argc + 2);
+	if (argv == NULL)
+		return -ENOMEM;
+
+	argv[0] = g_strdup("iptables");
+	for (c = 0; c < argc; c++)
+		argv[c + 1] = g_strdup(options[c]);
+
+	optind = 0;
 
+	while ((c = getopt_long(argc + 1, argv, "-",
+				iptables_globals.opts, NULL)) != -1) {
+		if (c == 1 || c == '?') {
+			ret = -EINVAL;
+			break;
+		}
+
+		parse_extension(c, argv, FALSE, xt_t, xt_m);
+	}
+
+	g_strfreev(argv);
+
+	return ret;
+}
+
+static int apply_rule(struct connman_iptables *table,
+				const struct connman_iptables_rule *rule)
+{
+	struct xtables_target *xt_t = NULL;
+	struct xtables_match *xt_m = NULL;
+	char *target_name, *match_name;
+	struct ipt_ip ip;
+	int err = 0;
+
+	if (rule->chain == NULL)
+		return -EINVAL;
+
+	switch (rule->operation) {
+	case CONNMAN_IPTABLES_FLUSH:
+		return iptables_flush_chain(table, rule->chain);
+	case CONNMAN_IPTABLES_NEW_CHAIN:
+		return iptables_add_chain(table, rule->chain);
+	case CONNMAN_IPTABLES_DELETE_CHAIN:
+		return iptables_delete_chain(table, rule->chain);
+	case CONNMAN_IPTABLES_APPEND:
+		break;
+	}
+
+	if (rule->target == NULL)
+		return -EINVAL;
+
+	memset(&ip, 0, sizeof(ip));
+
+	if (rule->source != NULL)
+		parse_ip(&ip, 's', rule->source, FALSE);
+	if (rule->destination != NULL)
+		parse_ip(&ip, 'd', rule->destination, FALSE);
+	if (rule->in_interface != NULL)
+		parse_ip(&ip, 'i', rule->in_interface, FALSE);
+	if (rule->out_interface != NULL)
+		parse_ip(&ip, 'o', rule->out_interface, FALSE);
+
+	reset_options();
+
+	/* The extensions keep pointers to the names */
+	target_name = (char *) rule->target;
+	match_name = (char *) rule->match;
+
+	xt_t = prepare_target(target_name, &err);
 	if (err < 0)
-	    return err;
+		goto out;
 
-	g_hash_table_remove(table_hash, table_name);
+	if (match_name != NULL) {
+		xt_m = prepare_match(match_name, &err);
+		if (err < 0)
+			goto out;
+	}
+
+	err = parse_options(rule->options, xt_t, xt_m);
+	if (err < 0)
+		goto out;
+
+	err = iptables_add_rule(table, &ip, rule->chain, target_name, xt_t,
+							match_name, xt_m);
+
+out:
+	if (xt_t)
+		g_free(xt_t->t);
+
+	if (xt_m)
+		g_free(xt_m->m);
+
+	return err;
+}
+
+/*
+ * Applies all rules to the cached table and commits it once. If any
+ * of them fails nothing is committed and the cached copy is dropped,
+ * so the next change starts again from the kernel state. Rules changed
+ * outside meanwhile are reloaded and everything is applied once more.
+ */
+int __connman_iptables_apply(const char *table_name,
+				const struct connman_iptables_rule *rules,
+							unsigned int count)
+{
+	struct connman_iptables *table;
+	gboolean reloaded = FALSE;
+	unsigned int i;
+	int err;
+
+	DBG("%s %u rules", table_name, count);
+
+retry:
+	table = iptables_init(table_name);
+	if (table == NULL)
+		return -EINVAL;
+
+	for (i = 0; i < count; i++) {
+		err = apply_rule(table, &rules[i]);
+		if (err < 0) {
+			connman_error("iptables rule %u in %s failed: %s",
+					i, rules[i].chain, strerror(-err));
+			goto fail;
+		}
+	}
+
+	err = iptables_commit(table);
+	if (err == -EAGAIN && reloaded == FALSE) {
+		/* Start again from the rules the kernel holds now */
+		g_hash_table_remove(table_hash, table_name);
+		reloaded = TRUE;
+		goto retry;
+	}
+
+	if (err < 0)
+		goto fail;
 
 	return 0;
+
+fail:
+	g_hash_table_remove(table_hash, table_name);
+
+	return err;
 }
 
 static void remove_table(gpointer user_data)
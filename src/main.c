@@ -44,8 +44,20 @@
 
 static struct {
 	connman_bool_t bg_scan;
+	unsigned int dnscache_size;
+	unsigned int strength_hysteresis;
+	unsigned int signal_window;
+	unsigned int stats_interval;
+	unsigned int wifi_hysteresis;
+	unsigned int wifi_interval;
 } connman_settings  = {
 	.bg_scan = TRUE,
+	.dnscache_size = 64,
+	.strength_hysteresis = 5,
+	.signal_window = 0,
+	.stats_interval = 0,
+	.wifi_hysteresis = 3,
+	.wifi_interval = 1000,
 };
 
 static GKeyFile *load_config(const char *file)
@@ -75,6 +87,7 @@ static void parse_config(GKeyFile *config)
 {
 	GError *error = NULL;
 	gboolean boolean;
+	int integer;
 
 	if (config == NULL)
 		return;
@@ -87,6 +100,48 @@ static void parse_config(GKeyFile *config)
 		connman_settings.bg_scan = boolean;
 
 	g_clear_error(&error);
+
+	integer = g_key_file_get_integer(config, "General",
+						"DNSCacheSize", &error);
+	if (error == NULL && integer >= 0)
+		connman_settings.dnscache_size = integer;
+
+	g_clear_error(&error);
+
+	integer = g_key_file_get_integer(config, "General",
+					"ServiceStrengthHysteresis", &error);
+	if (error == NULL && integer >= 0)
+		connman_settings.strength_hysteresis = integer;
+
+	g_clear_error(&error);
+
+	integer = g_key_file_get_integer(config, "General",
+					"SignalCoalesceWindow", &error);
+	if (error == NULL && integer >= 0)
+		connman_settings.signal_window = integer;
+
+	g_clear_error(&error);
+
+	integer = g_key_file_get_integer(config, "General",
+					"StatisticsCommitInterval", &error);
+	if (error == NULL && integer >= 0)
+		connman_settings.stats_interval = integer;
+
+	g_clear_error(&error);
+
+	integer = g_key_file_get_integer(config, "General",
+					"WiFiSignalHysteresis", &error);
+	if (error == NULL && integer >= 0)
+		connman_settings.wifi_hysteresis = integer;
+
+	g_clear_error(&error);
+
+	integer = g_key_file_get_integer(config, "General",
+					"WiFiSignalInterval", &error);
+	if (error == NULL && integer >= 0)
+		connman_settings.wifi_interval = integer;
+
+	g_clear_error(&error);
 }
 
 static GMainLoop *main_loop = NULL;
@@ -237,6 +292,29 @@ connman_bool_t connman_setting_get_bool(const char *key)
 	return FALSE;
 }
 
+unsigned int connman_setting_get_uint(const char *key)
+{
+	if (g_str_equal(key, "DNSCacheSize") == TRUE)
+		return connman_settings.dnscache_size;
+
+	if (g_str_equal(key, "ServiceStrengthHysteresis") == TRUE)
+		return connman_settings.strength_hysteresis;
+
+	if (g_str_equal(key, "SignalCoalesceWindow") == TRUE)
+		return connman_settings.signal_window;
+
+	if (g_str_equal(key, "StatisticsCommitInterval") == TRUE)
+		return connman_settings.stats_interval;
+
+	if (g_str_equal(key, "WiFiSignalHysteresis") == TRUE)
+		return connman_settings.wifi_hysteresis;
+
+	if (g_str_equal(key, "WiFiSignalInterval") == TRUE)
+		return connman_settings.wifi_interval;
+
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
 	GOptionContext *context;
@@ -334,6 +412,8 @@ int main(int argc, char *argv[])
 
 	parse_config(config);
 
+	__connman_dbus_set_signal_window(connman_settings.signal_window);
+
 	__connman_storage_init();
 	__connman_technology_init();
 	__connman_notifier_init();
@@ -65,14 +65,47 @@ static guint update_timeout = 0;
 
 struct interface_data {
 	int index;
+	unsigned short type;
 	char *name;
 	char *ident;
 	enum connman_service_type service_type;
 	enum connman_device_type device_type;
+	unsigned int generation;
 };
 
 static GHashTable *interface_list = NULL;
 
+/*
+ * IPv4 addresses and routes as last reported by the kernel. The dumps
+ * are only requested for AF_INET, so IPv6 ones are not tracked. They are
+ * only needed to find the ones removed while netlink messages were
+ * lost, since the dumps of a resync can only add objects. Each object
+ * is stamped with the generation of the dump that last reported it.
+ */
+struct address_data {
+	int index;
+	unsigned char family;
+	unsigned char prefixlen;
+	char *label;
+	char *address;
+	unsigned int generation;
+};
+
+struct route_data {
+	int index;
+	unsigned char family;
+	unsigned char scope;
+	char *dst;
+	char *gateway;
+	gboolean is_default;
+	unsigned int generation;
+};
+
+static GHashTable *address_list = NULL;
+static GHashTable *route_list = NULL;
+
+static unsigned int dump_generation = 0;
+
 static void free_interface(gpointer data)
 {
 	struct interface_data *interface = data;
@@ -85,6 +118,24 @@ static void free_interface(gpointer data)
 	g_free(interface);
 }
 
+static void free_address(gpointer data)
+{
+	struct address_data *address = data;
+
+	g_free(address->label);
+	g_free(address->address);
+	g_free(address);
+}
+
+static void free_route(gpointer data)
+{
+	struct route_data *route = data;
+
+	g_free(route->dst);
+	g_free(route->gateway);
+	g_free(route);
+}
+
 static connman_bool_t ether_blacklisted(const char *name)
 {
 	if (name == NULL)
@@ -461,6 +512,8 @@ static void process_newlink(unsigned short type, int index, unsigned flags,
 		g_hash_table_insert(interface_list,
 					GINT_TO_POINTER(index), interface);
 
+		interface->type = type;
+
 		if (type == ARPHRD_ETHER)
 			read_uevent(interface);
 
@@ -468,6 +521,8 @@ static void process_newlink(unsigned short type, int index, unsigned flags,
 			interface->index, interface->name, interface->ident);
 	}
 
+	interface->generation = dump_generation;
+
 	for (list = rtnl_list; list; list = list->next) {
 		struct connman_rtnl *rtnl = list->data;
 
@@ -486,22 +541,11 @@ static void process_newlink(unsigned short type, int index, unsigned flags,
 	}
 }
 
-static void process_dellink(unsigned short type, int index, unsigned flags,
-			unsigned change, struct ifinfomsg *msg, int bytes)
+static void remove_link(unsigned short type, int index, unsigned flags,
+			unsigned change, struct rtnl_link_stats *stats)
 {
-	struct rtnl_link_stats stats;
-	unsigned char operstate = 0xff;
-	const char *ifname = NULL;
 	GSList *list;
 
-	memset(&stats, 0, sizeof(stats));
-	extract_link(msg, bytes, NULL, &ifname, NULL, &operstate, &stats);
-
-	if (operstate != 0xff)
-		connman_info("%s {dellink} index %d operstate %u <%s>",
-						ifname, index, operstate,
-						operstate2str(operstate));
-
 	for (list = rtnl_list; list; list = list->next) {
 		struct connman_rtnl *rtnl = list->data;
 
@@ -513,13 +557,31 @@ static void process_dellink(unsigned short type, int index, unsigned flags,
 	case ARPHRD_ETHER:
 	case ARPHRD_LOOPBACK:
 	case ARPHRD_NONE:
-		__connman_ipconfig_dellink(index, &stats);
+		__connman_ipconfig_dellink(index, stats);
 		break;
 	}
 
 	g_hash_table_remove(interface_list, GINT_TO_POINTER(index));
 }
 
+static void process_dellink(unsigned short type, int index, unsigned flags,
+			unsigned change, struct ifinfomsg *msg, int bytes)
+{
+	struct rtnl_link_stats stats;
+	unsigned char operstate = 0xff;
+	const char *ifname = NULL;
+
+	memset(&stats, 0, sizeof(stats));
+	extract_link(msg, bytes, NULL, &ifname, NULL, &operstate, &stats);
+
+	if (operstate != 0xff)
+		connman_info("%s {dellink} index %d operstate %u <%s>",
+						ifname, index, operstate,
+						operstate2str(operstate));
+
+	remove_link(type, index, flags, change, &stats);
+}
+
 static void extract_ipv4_addr(struct ifaddrmsg *msg, int bytes,
 						const char **label,
 						struct in_addr *local,
@@ -572,6 +634,56 @@ static void extract_ipv6_addr(struct ifaddrmsg *msg, int bytes,
 	}
 }
 
+static char *address_key(int index, unsigned char prefixlen,
+						const char *address)
+{
+	return g_strdup_printf("%d %u %s", index, prefixlen, address);
+}
+
+static void remember_address(int index, unsigned char family,
+				const char *label, unsigned char prefixlen,
+				const char *address)
+{
+	struct address_data *data;
+	char *key;
+
+	if (family != AF_INET)
+		return;
+
+	key = address_key(index, prefixlen, address);
+
+	data = g_hash_table_lookup(address_list, key);
+	if (data == NULL) {
+		data = g_new0(struct address_data, 1);
+		data->index = index;
+		data->family = family;
+		data->prefixlen = prefixlen;
+		data->label = g_strdup(label);
+		data->address = g_strdup(address);
+
+		g_hash_table_insert(address_list, key, data);
+	} else
+		g_free(key);
+
+	data->generation = dump_generation;
+}
+
+static void remove_address(int index, unsigned char family,
+				const char *label, unsigned char prefixlen,
+				const char *address)
+{
+	char *key;
+
+	__connman_ipconfig_deladdr(index, family, label, prefixlen, address);
+
+	if (family != AF_INET)
+		return;
+
+	key = address_key(index, prefixlen, address);
+	g_hash_table_remove(address_list, key);
+	g_free(key);
+}
+
 static void process_newaddr(unsigned char family, unsigned char prefixlen,
 				int index, struct ifaddrmsg *msg, int bytes)
 {
@@ -601,6 +713,8 @@ static void process_newaddr(unsigned char family, unsigned char prefixlen,
 
 	__connman_ipconfig_newaddr(index, family, label,
 					prefixlen, ip_string);
+
+	remember_address(index, family, label, prefixlen, ip_string);
 }
 
 static void process_deladdr(unsigned char family, unsigned char prefixlen,
@@ -630,8 +744,7 @@ static void process_deladdr(unsigned char family, unsigned char prefixlen,
 	if (inet_ntop(family, src, ip_string, INET6_ADDRSTRLEN) == NULL)
 		return;
 
-	__connman_ipconfig_deladdr(index, family, label,
-					prefixlen, ip_string);
+	remove_address(index, family, label, prefixlen, ip_string);
 }
 
 static void extract_ipv4_route(struct rtmsg *msg, int bytes, int *index,
@@ -685,120 +798,152 @@ static void extract_ipv6_route(struct rtmsg *msg, int bytes, int *index,
 	}
 }
 
-static void process_newroute(unsigned char family, unsigned char scope,
-						struct rtmsg *msg, int bytes)
+static char *route_key(int index, unsigned char scope, const char *dst,
+						const char *gateway)
 {
-	GSList *list;
-	char dststr[INET6_ADDRSTRLEN], gatewaystr[INET6_ADDRSTRLEN];
-	int index = -1;
+	return g_strdup_printf("%d %u %s %s", index, scope, dst, gateway);
+}
 
-	if (family == AF_INET) {
-		struct in_addr dst = { INADDR_ANY }, gateway = { INADDR_ANY };
+static void remember_route(int index, unsigned char family,
+				unsigned char scope, const char *dst,
+				const char *gateway, gboolean is_default)
+{
+	struct route_data *data;
+	char *key;
 
-		extract_ipv4_route(msg, bytes, &index, &dst, &gateway);
+	if (family != AF_INET)
+		return;
 
-		inet_ntop(family, &dst, dststr, sizeof(dststr));
-		inet_ntop(family, &gateway, gatewaystr, sizeof(gatewaystr));
+	key = route_key(index, scope, dst, gateway);
 
-		__connman_ipconfig_newroute(index, family, scope, dststr,
-								gatewaystr);
+	data = g_hash_table_lookup(route_list, key);
+	if (data == NULL) {
+		data = g_new0(struct route_data, 1);
+		data->index = index;
+		data->family = family;
+		data->scope = scope;
+		data->dst = g_strdup(dst);
+		data->gateway = g_strdup(gateway);
+		data->is_default = is_default;
 
-		/* skip host specific routes */
-		if (scope != RT_SCOPE_UNIVERSE &&
-			!(scope == RT_SCOPE_LINK && dst.s_addr == INADDR_ANY))
-			return;
-
-		if (dst.s_addr != INADDR_ANY)
-			return;
+		g_hash_table_insert(route_list, key, data);
+	} else
+		g_free(key);
 
-	} else if (family == AF_INET6) {
-		struct in6_addr dst = IN6ADDR_ANY_INIT,
-				gateway = IN6ADDR_ANY_INIT;
+	data->generation = dump_generation;
+}
 
-		extract_ipv6_route(msg, bytes, &index, &dst, &gateway);
+static void remove_route(int index, unsigned char family,
+				unsigned char scope, const char *dst,
+				const char *gateway, gboolean is_default)
+{
+	GSList *list;
+	char *key;
 
-		inet_ntop(family, &dst, dststr, sizeof(dststr));
-		inet_ntop(family, &gateway, gatewaystr, sizeof(gatewaystr));
+	__connman_ipconfig_delroute(index, family, scope, dst, gateway);
 
-		__connman_ipconfig_newroute(index, family, scope, dststr,
-								gatewaystr);
+	if (is_default == TRUE) {
+		for (list = rtnl_list; list; list = list->next) {
+			struct connman_rtnl *rtnl = list->data;
 
-		/* skip host specific routes */
-		if (scope != RT_SCOPE_UNIVERSE &&
-			!(scope == RT_SCOPE_LINK &&
-				IN6_IS_ADDR_UNSPECIFIED(&dst)))
-			return;
+			if (rtnl->delgateway)
+				rtnl->delgateway(index, gateway);
+		}
+	}
 
-		if (!IN6_IS_ADDR_UNSPECIFIED(&dst))
-			return;
-	} else
+	if (family != AF_INET)
 		return;
 
-	for (list = rtnl_list; list; list = list->next) {
-		struct connman_rtnl *rtnl = list->data;
-
-		if (rtnl->newgateway)
-			rtnl->newgateway(index, gatewaystr);
-	}
+	key = route_key(index, scope, dst, gateway);
+	g_hash_table_remove(route_list, key);
+	g_free(key);
 }
 
-static void process_delroute(unsigned char family, unsigned char scope,
-						struct rtmsg *msg, int bytes)
+/*
+ * Only default routes are reported as gateways, host specific
+ * routes are skipped.
+ */
+static gboolean extract_route(unsigned char family, unsigned char scope,
+				struct rtmsg *msg, int bytes, int *index,
+				char *dststr, char *gatewaystr)
 {
-	GSList *list;
-	char dststr[INET6_ADDRSTRLEN], gatewaystr[INET6_ADDRSTRLEN];
-	int index = -1;
-
 	if (family == AF_INET) {
 		struct in_addr dst = { INADDR_ANY }, gateway = { INADDR_ANY };
 
-		extract_ipv4_route(msg, bytes, &index, &dst, &gateway);
-
-		inet_ntop(family, &dst, dststr, sizeof(dststr));
-		inet_ntop(family, &gateway, gatewaystr, sizeof(gatewaystr));
+		extract_ipv4_route(msg, bytes, index, &dst, &gateway);
 
-		__connman_ipconfig_delroute(index, family, scope, dststr,
-								gatewaystr);
+		inet_ntop(family, &dst, dststr, INET6_ADDRSTRLEN);
+		inet_ntop(family, &gateway, gatewaystr, INET6_ADDRSTRLEN);
 
-		/* skip host specific routes */
 		if (scope != RT_SCOPE_UNIVERSE &&
 			!(scope == RT_SCOPE_LINK && dst.s_addr == INADDR_ANY))
-			return;
-
-		if (dst.s_addr != INADDR_ANY)
-			return;
+			return FALSE;
 
-	}  else if (family == AF_INET6) {
+		return dst.s_addr == INADDR_ANY ? TRUE : FALSE;
+	} else {
 		struct in6_addr dst = IN6ADDR_ANY_INIT,
 				gateway = IN6ADDR_ANY_INIT;
 
-		extract_ipv6_route(msg, bytes, &index, &dst, &gateway);
+		extract_ipv6_route(msg, bytes, index, &dst, &gateway);
 
-		inet_ntop(family, &dst, dststr, sizeof(dststr));
-		inet_ntop(family, &gateway, gatewaystr, sizeof(gatewaystr));
+		inet_ntop(family, &dst, dststr, INET6_ADDRSTRLEN);
+		inet_ntop(family, &gateway, gatewaystr, INET6_ADDRSTRLEN);
 
-		__connman_ipconfig_delroute(index, family, scope, dststr,
-						gatewaystr);
-
-		/* skip host specific routes */
 		if (scope != RT_SCOPE_UNIVERSE &&
 			!(scope == RT_SCOPE_LINK &&
 				IN6_IS_ADDR_UNSPECIFIED(&dst)))
-			return;
+			return FALSE;
 
-		if (!IN6_IS_ADDR_UNSPECIFIED(&dst))
-			return;
-	} else
+		return IN6_IS_ADDR_UNSPECIFIED(&dst) ? TRUE : FALSE;
+	}
+}
+
+static void process_newroute(unsigned char family, unsigned char scope,
+						struct rtmsg *msg, int bytes)
+{
+	GSList *list;
+	char dststr[INET6_ADDRSTRLEN], gatewaystr[INET6_ADDRSTRLEN];
+	gboolean is_default;
+	int index = -1;
+
+	if (family != AF_INET && family != AF_INET6)
+		return;
+
+	is_default = extract_route(family, scope, msg, bytes, &index,
+							dststr, gatewaystr);
+
+	__connman_ipconfig_newroute(index, family, scope, dststr,
+							gatewaystr);
+
+	remember_route(index, family, scope, dststr, gatewaystr, is_default);
+
+	if (is_default == FALSE)
 		return;
 
 	for (list = rtnl_list; list; list = list->next) {
 		struct connman_rtnl *rtnl = list->data;
 
-		if (rtnl->delgateway)
-			rtnl->delgateway(index, gatewaystr);
+		if (rtnl->newgateway)
+			rtnl->newgateway(index, gatewaystr);
 	}
 }
 
+static void process_delroute(unsigned char family, unsigned char scope,
+						struct rtmsg *msg, int bytes)
+{
+	char dststr[INET6_ADDRSTRLEN], gatewaystr[INET6_ADDRSTRLEN];
+	gboolean is_default;
+	int index = -1;
+
+	if (family != AF_INET && family != AF_INET6)
+		return;
+
+	is_default = extract_route(family, scope, msg, bytes, &index,
+							dststr, gatewaystr);
+
+	remove_route(index, family, scope, dststr, gatewaystr, is_default);
+}
+
 static inline void print_ether(struct rtattr *attr, const char *name)
 {
 	int len = (int) RTA_PAYLOAD(attr);
@@ -1270,6 +1415,28 @@ static const char *type2string(uint16_t type)
 
 static GIOChannel *channel = NULL;
 
+/*
+ * Netlink messages are drained into one large buffer that is reused
+ * for every read. Dumps on hosts with many links, addresses or routes
+ * do not fit into a page.
+ */
+#define RTNL_BUFFER_SIZE	(32 * 1024)
+#define RTNL_SOCKET_BUFFER	(256 * 1024)
+#define RTNL_MAX_READS		32
+
+static unsigned char *rtnl_buffer = NULL;
+
+static struct {
+	unsigned int reads;
+	unsigned int messages;
+	unsigned int overruns;
+	unsigned int resyncs;
+} rtnl_stats;
+
+static gboolean resync_pending = FALSE;
+static gboolean resync_running = FALSE;
+static guint32 resync_seq = 0;
+
 struct rtnl_request {
 	struct nlmsghdr hdr;
 	struct rtgenmsg msg;
@@ -1322,21 +1489,163 @@ static int queue_request(struct rtnl_request *req)
 	return send_request(req);
 }
 
+static int send_getlink(void);
+static int send_getaddr(void);
+static int send_getroute(void);
+
+static void queue_dumps(void)
+{
+	send_getlink();
+	send_getaddr();
+	send_getroute();
+}
+
+static void queue_resync(void)
+{
+	dump_generation++;
+
+	if (send_getlink() == -ENOMEM || send_getaddr() == -ENOMEM ||
+					send_getroute() == -ENOMEM)
+		return;
+
+	/* The route dump is queued last, its end finishes the resync */
+	resync_seq = request_seq - 1;
+	resync_running = TRUE;
+}
+
+/*
+ * Everything the resync dumps did not report again is gone. Remove it
+ * the same way as if the lost RTM_DEL* messages had been received.
+ */
+static void sweep_stale(void)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+	GSList *stale, *list;
+
+	DBG("generation %u", dump_generation);
+
+	stale = NULL;
+	g_hash_table_iter_init(&iter, route_list);
+	while (g_hash_table_iter_next(&iter, &key, &value) == TRUE) {
+		struct route_data *route = value;
+
+		if (route->generation != dump_generation)
+			stale = g_slist_prepend(stale, route);
+	}
+
+	for (list = stale; list; list = list->next) {
+		struct route_data *route = list->data;
+
+		connman_info("index %d stale route %s via %s", route->index,
+						route->dst, route->gateway);
+
+		remove_route(route->index, route->family, route->scope,
+				route->dst, route->gateway, route->is_default);
+	}
+
+	g_slist_free(stale);
+
+	stale = NULL;
+	g_hash_table_iter_init(&iter, address_list);
+	while (g_hash_table_iter_next(&iter, &key, &value) == TRUE) {
+		struct address_data *address = value;
+
+		if (address->generation != dump_generation)
+			stale = g_slist_prepend(stale, address);
+	}
+
+	for (list = stale; list; list = list->next) {
+		struct address_data *address = list->data;
+
+		connman_info("index %d stale address %s/%u", address->index,
+					address->address, address->prefixlen);
+
+		remove_address(address->index, address->family,
+					address->label, address->prefixlen,
+					address->address);
+	}
+
+	g_slist_free(stale);
+
+	stale = NULL;
+	g_hash_table_iter_init(&iter, interface_list);
+	while (g_hash_table_iter_next(&iter, &key, &value) == TRUE) {
+		struct interface_data *interface = value;
+
+		if (interface->generation != dump_generation)
+			stale = g_slist_prepend(stale, interface);
+	}
+
+	for (list = stale; list; list = list->next) {
+		struct interface_data *interface = list->data;
+		struct rtnl_link_stats stats;
+
+		connman_info("%s {dellink} index %d stale", interface->name,
+							interface->index);
+
+		memset(&stats, 0, sizeof(stats));
+		remove_link(interface->type, interface->index, 0, 0, &stats);
+	}
+
+	g_slist_free(stale);
+}
+
+/*
+ * Messages got lost, so the view of links, addresses and routes might
+ * be stale. Dump everything again once the dump in progress, if any,
+ * is finished since only one dump at a time can run per socket.
+ */
+static void rtnl_resync(void)
+{
+	rtnl_stats.overruns++;
+
+	/* A resync in flight might miss objects now, so never sweep it */
+	resync_running = FALSE;
+
+	if (resync_pending == TRUE)
+		return;
+
+	connman_warn("Netlink messages lost, resynchronizing");
+
+	rtnl_stats.resyncs++;
+
+	if (request_list != NULL) {
+		resync_pending = TRUE;
+		return;
+	}
+
+	queue_resync();
+}
+
 static int process_response(guint32 seq)
 {
 	struct rtnl_request *req;
 
 	DBG("seq %d", seq);
 
+	/* Ignore answers to requests which are not in flight */
 	req = find_request(seq);
-	if (req != NULL) {
-		request_list = g_slist_remove(request_list, req);
-		g_free(req);
+	if (req == NULL)
+		return 0;
+
+	request_list = g_slist_remove(request_list, req);
+	g_free(req);
+
+	if (resync_running == TRUE && seq == resync_seq) {
+		resync_running = FALSE;
+		sweep_stale();
 	}
 
 	req = g_slist_nth_data(request_list, 0);
-	if (req == NULL)
+	if (req == NULL) {
+		if (resync_pending == TRUE) {
+			resync_pending = FALSE;
+			queue_resync();
+		}
+
 		return 0;
+	}
 
 	return send_request(req);
 }
@@ -1352,6 +1661,8 @@ static void rtnl_message(void *buf, size_t len)
 		if (!NLMSG_OK(hdr, len))
 			break;
 
+		rtnl_stats.messages++;
+
 		DBG("%s len %d type %d flags 0x%04x seq %d",
 					type2string(hdr->nlmsg_type),
 					hdr->nlmsg_len, hdr->nlmsg_type,
@@ -1359,7 +1670,9 @@ static void rtnl_message(void *buf, size_t len)
 
 		switch (hdr->nlmsg_type) {
 		case NLMSG_NOOP:
+			return;
 		case NLMSG_OVERRUN:
+			rtnl_resync();
 			return;
 		case NLMSG_DONE:
 			process_response(hdr->nlmsg_seq);
@@ -1368,6 +1681,10 @@ static void rtnl_message(void *buf, size_t len)
 			err = NLMSG_DATA(hdr);
 			DBG("error %d (%s)", -err->error,
 						strerror(-err->error));
+			/* A failed dump reported nothing, keep everything */
+			if (err->error != 0)
+				resync_running = FALSE;
+			process_response(hdr->nlmsg_seq);
 			return;
 		case RTM_NEWLINK:
 			rtnl_newlink(hdr);
@@ -1400,32 +1717,64 @@ static void rtnl_message(void *buf, size_t len)
 static gboolean netlink_event(GIOChannel *chan,
 				GIOCondition cond, gpointer data)
 {
-	unsigned char buf[4096];
-	gsize len;
-	GIOStatus status;
+	ssize_t len;
+	int sk, i;
 
 	if (cond & (G_IO_NVAL | G_IO_HUP | G_IO_ERR))
 		return FALSE;
 
-	memset(buf, 0, sizeof(buf));
+	sk = g_io_channel_unix_get_fd(chan);
 
-	status = g_io_channel_read_chars(chan, (gchar *) buf,
-						sizeof(buf), &len, NULL);
+	/* Drain the socket, but give other sources a chance as well */
+	for (i = 0; i < RTNL_MAX_READS; i++) {
+		len = recv(sk, rtnl_buffer, RTNL_BUFFER_SIZE,
+						MSG_DONTWAIT | MSG_TRUNC);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
 
-	switch (status) {
-	case G_IO_STATUS_NORMAL:
-		break;
-	case G_IO_STATUS_AGAIN:
-		return TRUE;
-	default:
-		return FALSE;
-	}
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+
+			/* The kernel dropped messages for us */
+			if (errno == ENOBUFS) {
+				rtnl_resync();
+				continue;
+			}
+
+			connman_error("Netlink read failed: %s",
+							strerror(errno));
+			return FALSE;
+		}
+
+		if (len == 0)
+			break;
+
+		rtnl_stats.reads++;
+
+		if (len > RTNL_BUFFER_SIZE) {
+			rtnl_resync();
+			continue;
+		}
 
-	rtnl_message(buf, len);
+		rtnl_message(rtnl_buffer, len);
+	}
 
 	return TRUE;
 }
 
+void __connman_rtnl_append_statistics(DBusMessageIter *dict)
+{
+	connman_dbus_dict_append_basic(dict, "Reads",
+				DBUS_TYPE_UINT32, &rtnl_stats.reads);
+	connman_dbus_dict_append_basic(dict, "Messages",
+				DBUS_TYPE_UINT32, &rtnl_stats.messages);
+	connman_dbus_dict_append_basic(dict, "Overruns",
+				DBUS_TYPE_UINT32, &rtnl_stats.overruns);
+	connman_dbus_dict_append_basic(dict, "Resyncs",
+				DBUS_TYPE_UINT32, &rtnl_stats.resyncs);
+}
+
 static int send_getlink(void)
 {
 	struct rtnl_request *req;
@@ -1561,16 +1910,32 @@ int __connman_rtnl_request_update(void)
 int __connman_rtnl_init(void)
 {
 	struct sockaddr_nl addr;
-	int sk;
+	int sk, size = RTNL_SOCKET_BUFFER;
 
 	DBG("");
 
 	interface_list = g_hash_table_new_full(g_direct_hash, g_direct_equal,
 							NULL, free_interface);
 
+	address_list = g_hash_table_new_full(g_str_hash, g_str_equal,
+							g_free, free_address);
+
+	route_list = g_hash_table_new_full(g_str_hash, g_str_equal,
+							g_free, free_route);
+
+	rtnl_buffer = g_try_malloc(RTNL_BUFFER_SIZE);
+	if (rtnl_buffer == NULL)
+		return -ENOMEM;
+
 	sk = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_ROUTE);
-	if (sk < 0)
+	if (sk < 0) {
+		g_free(rtnl_buffer);
+		rtnl_buffer = NULL;
 		return -1;
+	}
+
+	if (setsockopt(sk, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0)
+		connman_warn("Failed to enlarge netlink receive buffer");
 
 	memset(&addr, 0, sizeof(addr));
 	addr.nl_family = AF_NETLINK;
@@ -1580,6 +1945,8 @@ int __connman_rtnl_init(void)
 
 	if (bind(sk, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
 		close(sk);
+		g_free(rtnl_buffer);
+		rtnl_buffer = NULL;
 		return -1;
 	}
 
@@ -1599,9 +1966,7 @@ void __connman_rtnl_start(void)
 {
 	DBG("");
 
-	send_getlink();
-	send_getaddr();
-	send_getroute();
+	queue_dumps();
 }
 
 void __connman_rtnl_cleanup(void)
@@ -1640,10 +2005,18 @@ void __connman_rtnl_cleanup(void)
 	g_slist_free(request_list);
 	request_list = NULL;
 
+	resync_pending = FALSE;
+	resync_running = FALSE;
+
 	g_io_channel_shutdown(channel, TRUE, NULL);
 	g_io_channel_unref(channel);
 
 	channel = NULL;
 
+	g_free(rtnl_buffer);
+	rtnl_buffer = NULL;
+
+	g_hash_table_destroy(route_list);
+	g_hash_table_destroy(address_list);
 	g_hash_table_destroy(interface_list);
 }
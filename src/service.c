@@ -37,6 +37,7 @@ static DBusConnection *connection = NULL;
 
 static GSequence *service_list = NULL;
 static GHashTable *service_hash = NULL;
+static GHashTable *service_path_hash = NULL;
 static GSList *counter_list = NULL;
 
 struct connman_stats {
@@ -65,6 +66,7 @@ struct connman_service {
 	enum connman_service_state state_ipv6;
 	enum connman_service_error error;
 	connman_uint8_t strength;
+	connman_uint8_t sort_strength;
 	connman_bool_t favorite;
 	connman_bool_t immutable;
 	connman_bool_t hidden;
@@ -132,32 +134,14 @@ void __connman_service_list(DBusMessageIter *iter, void *user_data)
 	g_sequence_foreach(service_list, append_path, iter);
 }
 
-struct find_data {
-	const char *path;
-	struct connman_service *service;
-};
-
-static void compare_path(gpointer value, gpointer user_data)
-{
-	struct connman_service *service = value;
-	struct find_data *data = user_data;
-
-	if (data->service != NULL)
-		return;
-
-	if (g_strcmp0(service->path, data->path) == 0)
-		data->service = service;
-}
-
 static struct connman_service *find_service(const char *path)
 {
-	struct find_data data = { .path = path, .service = NULL };
-
 	DBG("path %s", path);
 
-	g_sequence_foreach(service_list, compare_path, &data);
+	if (path == NULL)
+		return NULL;
 
-	return data.service;
+	return g_hash_table_lookup(service_path_hash, path);
 }
 
 const char *__connman_service_type2string(enum connman_service_type type)
@@ -775,6 +759,8 @@ static void stats_stop(struct connman_service *service)
 	stats->data.time = stats->data_last.time + seconds;
 
 	stats->enabled = FALSE;
+
+	__connman_stats_flush(service);
 }
 
 static void reset_stats(struct connman_service *service)
@@ -3074,6 +3060,8 @@ static void service_free(gpointer user_data)
 	service->path = NULL;
 
 	if (path != NULL) {
+		g_hash_table_remove(service_path_hash, path);
+
 		__connman_profile_changed(FALSE);
 
 		g_dbus_unregister_interface(connection, path,
@@ -3351,7 +3339,113 @@ static gint service_compare(gconstpointer a, gconstpointer b,
 		}
 	}
 
-	return (gint) service_b->strength - (gint) service_a->strength;
+	return (gint) service_b->sort_strength -
+				(gint) service_a->sort_strength;
+}
+
+/*
+ * Only strength changes beyond the configured hysteresis affect the
+ * ordering, otherwise signal jitter keeps reshuffling the list.
+ */
+static gboolean update_sort_strength(struct connman_service *service)
+{
+	unsigned int hysteresis, delta;
+
+	if (service->strength == service->sort_strength)
+		return FALSE;
+
+	hysteresis = connman_setting_get_uint("ServiceStrengthHysteresis");
+
+	if (service->strength > service->sort_strength)
+		delta = service->strength - service->sort_strength;
+	else
+		delta = service->sort_strength - service->strength;
+
+	if (service->sort_strength != 0 && delta < hysteresis)
+		return FALSE;
+
+	service->sort_strength = service->strength;
+
+	return TRUE;
+}
+
+static struct connman_service *prev_service(GSequenceIter *iter)
+{
+	if (g_sequence_iter_is_begin(iter) == TRUE)
+		return NULL;
+
+	return g_sequence_get(g_sequence_iter_prev(iter));
+}
+
+static struct connman_service *next_service(GSequenceIter *iter)
+{
+	iter = g_sequence_iter_next(iter);
+	if (g_sequence_iter_is_end(iter) == TRUE)
+		return NULL;
+
+	return g_sequence_get(iter);
+}
+
+static void service_moved(struct connman_service *service,
+						GSequenceIter *iter)
+{
+	DBusMessage *signal;
+	const char *before = "/";
+
+	if (service->path == NULL || service->hidden == TRUE)
+		return;
+
+	for (iter = g_sequence_iter_next(iter);
+			g_sequence_iter_is_end(iter) == FALSE;
+				iter = g_sequence_iter_next(iter)) {
+		struct connman_service *next = g_sequence_get(iter);
+
+		if (next->path == NULL || next->hidden == TRUE)
+			continue;
+
+		before = next->path;
+		break;
+	}
+
+	DBG("service %p before %s", service, before);
+
+	signal = dbus_message_new_signal(CONNMAN_MANAGER_PATH,
+				CONNMAN_MANAGER_INTERFACE, "ServiceMoved");
+	if (signal == NULL)
+		return;
+
+	dbus_message_append_args(signal,
+				DBUS_TYPE_OBJECT_PATH, &service->path,
+				DBUS_TYPE_OBJECT_PATH, &before,
+							DBUS_TYPE_INVALID);
+
+	g_dbus_send_message(connection, signal);
+}
+
+/*
+ * Move a single service to its new place in the sorted list. Returns
+ * TRUE and emits ServiceMoved if its position actually changed.
+ */
+static gboolean service_reorder(struct connman_service *service)
+{
+	struct connman_service *prev, *next;
+	GSequenceIter *iter;
+
+	iter = g_hash_table_lookup(service_hash, service->identifier);
+	if (iter == NULL)
+		return FALSE;
+
+	prev = prev_service(iter);
+	next = next_service(iter);
+
+	g_sequence_sort_changed(iter, service_compare, NULL);
+
+	if (prev == prev_service(iter) && next == next_service(iter))
+		return FALSE;
+
+	service_moved(service, iter);
+
+	return TRUE;
 }
 
 /**
@@ -3495,7 +3589,7 @@ int __connman_service_set_favorite(struct connman_service *service,
 
 	favorite_changed(service);
 
-	g_sequence_sort_changed(iter, service_compare, NULL);
+	service_reorder(service);
 
 	__connman_profile_changed(FALSE);
 
@@ -3568,7 +3662,6 @@ static void report_error_cb(struct connman_service *service,
 static int __connman_service_indicate_state(struct connman_service *service)
 {
 	enum connman_service_state old_state, new_state;
-	GSequenceIter *iter;
 
 	if (service == NULL)
 		return -EINVAL;
@@ -3698,9 +3791,7 @@ static int __connman_service_indicate_state(struct connman_service *service)
 	} else
 		service->error = CONNMAN_SERVICE_ERROR_UNKNOWN;
 
-	iter = g_hash_table_lookup(service_hash, service->identifier);
-	if (iter != NULL)
-		g_sequence_sort_changed(iter, service_compare, NULL);
+	service_reorder(service);
 
 	__connman_profile_changed(FALSE);
 
@@ -4636,6 +4727,8 @@ static int service_register(struct connman_service *service)
 
 	DBG("path %s", service->path);
 
+	g_hash_table_insert(service_path_hash, service->path, service);
+
 	__connman_config_provision_service(service);
 
 	__connman_storage_load_service(service);
@@ -4984,20 +5077,24 @@ static enum connman_service_security convert_wifi_security(const char *security)
 		return CONNMAN_SERVICE_SECURITY_UNKNOWN;
 }
 
-static void update_from_network(struct connman_service *service,
+/*
+ * Returns TRUE if the service list as seen over D-Bus has changed,
+ * that is the service moved or changed its visibility.
+ */
+static gboolean update_from_network(struct connman_service *service,
 					struct connman_network *network)
 {
 	connman_uint8_t strength = service->strength;
-	GSequenceIter *iter;
+	connman_bool_t hidden = service->hidden;
 	const char *str;
 
 	DBG("service %p network %p", service, network);
 
 	if (is_connected(service) == TRUE)
-		return;
+		return FALSE;
 
 	if (is_connecting(service) == TRUE)
-		return;
+		return FALSE;
 
 	str = connman_network_get_string(network, "Name");
 	if (str != NULL) {
@@ -5036,9 +5133,11 @@ static void update_from_network(struct connman_service *service,
 	if (service->network == NULL)
 		service->network = network;
 
-	iter = g_hash_table_lookup(service_hash, service->identifier);
-	if (iter != NULL)
-		g_sequence_sort_changed(iter, service_compare, NULL);
+	if (update_sort_strength(service) == TRUE &&
+				service_reorder(service) == TRUE)
+		return TRUE;
+
+	return service->hidden != hidden;
 }
 
 /**
@@ -5077,8 +5176,8 @@ struct connman_service * __connman_service_create_from_network(struct connman_ne
 		return service;
 
 	if (service->path != NULL) {
-		update_from_network(service, network);
-		__connman_profile_changed(TRUE);
+		if (update_from_network(service, network) == TRUE)
+			__connman_profile_changed(TRUE);
 		return service;
 	}
 
@@ -5132,7 +5231,6 @@ void __connman_service_update_from_network(struct connman_network *network)
 	struct connman_service *service;
 	connman_uint8_t strength;
 	connman_bool_t roaming;
-	GSequenceIter *iter;
 	const char *name;
 	connman_bool_t stats_enable;
 
@@ -5165,6 +5263,10 @@ void __connman_service_update_from_network(struct connman_network *network)
 
 	strength_changed(service);
 
+	if (update_sort_strength(service) == TRUE &&
+				service_reorder(service) == TRUE)
+		__connman_profile_changed(TRUE);
+
 roaming:
 	roaming = connman_network_get_bool(service->network, "Roaming");
 	if (roaming == service->roaming)
@@ -5181,9 +5283,7 @@ roaming:
 
 	roaming_changed(service);
 
-	iter = g_hash_table_lookup(service_hash, service->identifier);
-	if (iter != NULL)
-		g_sequence_sort_changed(iter, service_compare, NULL);
+	service_reorder(service);
 }
 
 void __connman_service_remove_from_network(struct connman_network *network)
@@ -5690,6 +5790,8 @@ int __connman_service_init(void)
 	service_hash = g_hash_table_new_full(g_str_hash, g_str_equal,
 								NULL, NULL);
 
+	service_path_hash = g_hash_table_new(g_str_hash, g_str_equal);
+
 	service_list = g_sequence_new(service_free);
 
 	return 0;
@@ -5708,6 +5810,9 @@ void __connman_service_cleanup(void)
 	g_hash_table_destroy(service_hash);
 	service_hash = NULL;
 
+	g_hash_table_destroy(service_path_hash);
+	service_path_hash = NULL;
+
 	g_slist_free(counter_list);
 	counter_list = NULL;
 
@@ -42,58 +42,85 @@
 #define TFR
 #endif
 
-#define MAGIC 0xFA00B916
+#define MAGIC		0xFA00B917
+#define MAGIC_V1	0xFA00B916
+
+#define STATS_NR_COUNTERS	9
+#define STATS_RECORD_MAX_SIZE	64
+
+#define STATS_BASE_HOME		0x1
+#define STATS_BASE_ROAMING	0x2
+
+#define STATS_HISTORY_SLICE	64
 
 /*
- * Statistics counters are stored into a ring buffer which is stored
+ * Statistics counters are stored into a log which is stored
  * into a file
  *
  * File properties:
- *   The ring buffer is mmap to a file
+ *   The log is mmap to a file
  *   Initialy only the smallest possible amount of disk space is allocated
  *   The files grow to the configured maximal size
  *   The grows by _SC_PAGESIZE step size
  *   For each service a file is created
- *   Each file has a header where the indexes are stored
+ *   Each file has a header with the values the log starts from
  *
  * Entries properties:
  *   Each entry has a timestamp
  *   A flag to mark if the entry is either home (0) or roaming (1) entry
- *   The entries are fixed sized (stats_record)
+ *   The entries are variable sized and packed one after the other
+ *   An entry starts with a varint holding a bit which is always set,
+ *   the roaming flag and a mask of the counters that changed
+ *   It is followed by the zigzag encoded seconds since the previous
+ *   entry and by the increase of every changed counter as a varint
+ *   Increases are relative to the previous entry of the same kind
+ *   and wrap around at 32 bits like the counters do
+ *   The log ends with the first zero byte
  *
- * Ring buffer properties:
- *   There are to indexes 'begin', 'end', 'home' and 'roaming'
- *   'begin' points to the oldest entry
- *   'end' points to the newest/current entry
- *   'home' points to the current home entry
- *   'roaming' points to the current roaming entry
- *   If 'begin' == 'end' then the buffer is empty
- *   If 'end' + 1 == 'begin then it's full
- *   The ring buffer is valid in the range (begin, end]
- *   If 'home' has the value UINT_MAX', 'home' is invalid
- *   if 'roaming' has the value UINT_MAX', 'roaming' is invalid
- *   'first' points to the first entry in the ring buffer
- *   'last' points to the last entry in the ring buffer
+ * Log properties:
+ *   'begin' is the offset of the first entry
+ *   'home' and 'roaming' in the header are the values the first
+ *   home and roaming entries are relative to, valid if their flag is set
+ *   'ts' in the header is the time the first entry is relative to
+ *   If the log is full, it starts over right away with the latest
+ *   values in the header while a copy of the old entries is
+ *   summarized into the history file from idle callbacks
+ *
+ * Updates:
+ *   An update is kept in memory and written to the log after
+ *   StatisticsCommitInterval seconds, when the roaming state changes
+ *   or when the service stops, so the file is not touched on every
+ *   counter update
  *
  * History file:
- *   Same format as the ring buffer file
+ *   Same format as the log file
  *   For a period of at least 2 months dayly records are keept
  *   If older, then only a monthly record is keept
  */
 
+struct stats_record {
+	time_t ts;
+	unsigned int roaming;
+	struct connman_stats_data data;
+};
 
 struct stats_file_header {
 	unsigned int magic;
 	unsigned int begin;
-	unsigned int end;
-	unsigned int home;
-	unsigned int roaming;
+	unsigned int flags;
+	unsigned int reserved;
+	time_t ts;
+	struct stats_record home;
+	struct stats_record roaming;
 };
 
-struct stats_record {
-	time_t ts;
+/* Fixed size ring buffer used before, only read to convert old files */
+struct stats_file_header_v1 {
+	unsigned int magic;
+	unsigned int begin;
+	unsigned int end;
+	unsigned int home;
 	unsigned int roaming;
-	struct connman_stats_data data;
 };
 
 struct stats_file {
@@ -104,21 +131,57 @@ struct stats_file {
 	size_t max_len;
 
 	/* cached values */
-	struct stats_record *first;
-	struct stats_record *last;
-	struct stats_record *home;
-	struct stats_record *roaming;
+	unsigned int end;
+	time_t ts;
+	struct stats_record home;
+	struct stats_record roaming;
+	gboolean home_valid;
+	gboolean roaming_valid;
+
+	/* update not written yet */
+	struct stats_record pending;
+	gboolean pending_valid;
+	guint commit_timeout;
 
 	/* history */
 	char *history_name;
 	int account_period_offset;
+	struct stats_history *history;
 };
 
 struct stats_iter {
 	struct stats_file *file;
-	struct stats_record *begin;
-	struct stats_record *end;
-	struct stats_record *it;
+	unsigned int pos;
+	time_t ts;
+	struct stats_record home;
+	struct stats_record roaming;
+	gboolean home_valid;
+	gboolean roaming_valid;
+	struct stats_record rec;
+};
+
+enum stats_history_phase {
+	STATS_HISTORY_READ,
+	STATS_HISTORY_SKIP,
+	STATS_HISTORY_DATA,
+};
+
+/* State of a history file update in progress */
+struct stats_history {
+	struct stats_file snapshot;
+	struct stats_file history_file;
+	struct stats_file temp_file;
+	enum stats_history_phase phase;
+	struct stats_iter iter;
+	struct stats_record cur;
+	struct stats_record home;
+	struct stats_record roaming;
+	gboolean have_cur;
+	gboolean have_home;
+	gboolean have_roaming;
+	GDate date_change_step_size;
+	int account_period_offset;
+	guint idle;
 };
 
 GHashTable *stats_hash = NULL;
@@ -128,148 +191,172 @@ static struct stats_file_header *get_hdr(struct stats_file *file)
 	return (struct stats_file_header *)file->addr;
 }
 
-static struct stats_record *get_begin(struct stats_file *file)
+static unsigned int *get_counters(struct connman_stats_data *data)
 {
-	unsigned int off = get_hdr(file)->begin;
-
-	return (struct stats_record *)(file->addr + off);
+	/* All counters are unsigned int, in the order they are encoded */
+	return (unsigned int *) data;
 }
 
-static struct stats_record *get_end(struct stats_file *file)
+static int put_varint(unsigned char *buf, guint64 value)
 {
-	unsigned int off = get_hdr(file)->end;
+	int len = 0;
 
-	return (struct stats_record *)(file->addr + off);
-}
-
-static struct stats_record *get_home(struct stats_file *file)
-{
-	struct stats_file_header *hdr;
-
-	hdr = get_hdr(file);
+	while (value >= 0x80) {
+		buf[len++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
 
-	if (hdr->home == UINT_MAX)
-		return NULL;
+	buf[len++] = value;
 
-	return (struct stats_record *)(file->addr + hdr->home);
+	return len;
 }
 
-static struct stats_record *get_roaming(struct stats_file *file)
+static int get_varint(const unsigned char *buf, size_t size, guint64 *value)
 {
-	struct stats_file_header *hdr;
+	guint64 result = 0;
+	unsigned int i;
 
-	hdr = get_hdr(file);
+	for (i = 0; i < size && i < 10; i++) {
+		result |= (guint64) (buf[i] & 0x7f) << (7 * i);
 
-	if (hdr->roaming == UINT_MAX)
-		return NULL;
+		if ((buf[i] & 0x80) == 0) {
+			*value = result;
+			return i + 1;
+		}
+	}
 
-	return (struct stats_record *)(file->addr + hdr->roaming);
+	return -EINVAL;
 }
 
-static void set_end(struct stats_file *file, struct stats_record *end)
+static int encode_record(unsigned char *buf, struct stats_record *rec,
+				struct stats_record *prev, time_t ts)
 {
-	struct stats_file_header *hdr;
+	unsigned int *cur = get_counters(&rec->data);
+	unsigned int *old = get_counters(&prev->data);
+	unsigned int mask = 0, i;
+	gint64 delta;
+	int len;
+
+	for (i = 0; i < STATS_NR_COUNTERS; i++) {
+		if (cur[i] != old[i])
+			mask |= 1 << i;
+	}
 
-	hdr = get_hdr(file);
-	hdr->end = (char *)end - file->addr;
-}
+	len = put_varint(buf, mask << 2 | (rec->roaming == TRUE) << 1 | 1);
 
-static void set_home(struct stats_file *file, struct stats_record *home)
-{
-	struct stats_file_header *hdr;
+	delta = (gint64) rec->ts - ts;
+	len += put_varint(buf + len, (guint64) delta << 1 ^ (delta >> 63));
 
-	hdr = get_hdr(file);
-	hdr->home = (char *)home - file->addr;
+	for (i = 0; i < STATS_NR_COUNTERS; i++) {
+		if (mask & (1 << i))
+			len += put_varint(buf + len, cur[i] - old[i]);
+	}
+
+	return len;
 }
 
-static void set_roaming(struct stats_file *file, struct stats_record *roaming)
+static void stats_iter_init(struct stats_iter *iter, struct stats_file *file)
 {
-	struct stats_file_header *hdr;
+	struct stats_file_header *hdr = get_hdr(file);
 
-	hdr = get_hdr(file);
-	hdr->roaming = (char *)roaming - file->addr;
-}
+	memset(iter, 0, sizeof(*iter));
 
-static struct stats_record *get_next(struct stats_file *file,
-					struct stats_record *cur)
-{
-	cur++;
+	iter->file = file;
+	iter->pos = hdr->begin;
+	iter->ts = hdr->ts;
 
-	if (cur > file->last)
-		cur = file->first;
+	if (hdr->flags & STATS_BASE_HOME) {
+		iter->home = hdr->home;
+		iter->home_valid = TRUE;
+	}
 
-	return cur;
+	if (hdr->flags & STATS_BASE_ROAMING) {
+		iter->roaming = hdr->roaming;
+		iter->roaming_valid = TRUE;
+	}
 }
 
-static struct stats_record *get_iterator_begin(struct stats_file *file)
+/* Decodes the next entry, the result is valid until the next call */
+static struct stats_record *get_next_record(struct stats_iter *iter)
 {
-	return get_next(file, get_begin(file));
-}
+	const unsigned char *buf = (unsigned char *) iter->file->addr;
+	size_t len = iter->file->len;
+	unsigned int pos = iter->pos, mask, roaming, i;
+	struct stats_record *prev;
+	unsigned int counters[STATS_NR_COUNTERS];
+	guint64 value;
+	gint64 delta;
+	int n;
+
+	if (pos >= len || buf[pos] == 0)
+		return NULL;
 
-static struct stats_record *get_iterator_end(struct stats_file *file)
-{
-	return get_next(file, get_end(file));
-}
+	n = get_varint(buf + pos, len - pos, &value);
+	if (n < 0 || (value & 1) == 0 || value >> 2 >= 1 << STATS_NR_COUNTERS)
+		return NULL;
+	pos += n;
 
-static void stats_free(gpointer user_data)
-{
-	struct stats_file *file = user_data;
+	roaming = (value >> 1) & 1;
+	mask = value >> 2;
 
-	if (file == NULL)
-		return;
+	n = get_varint(buf + pos, len - pos, &value);
+	if (n < 0)
+		return NULL;
+	pos += n;
 
-	msync(file->addr, file->len, MS_SYNC);
+	delta = (gint64) (value >> 1) ^ -(gint64) (value & 1);
 
-	munmap(file->addr, file->len);
-	file->addr = NULL;
+	prev = roaming == TRUE ? &iter->roaming : &iter->home;
+	memcpy(counters, get_counters(&prev->data), sizeof(counters));
 
-	TFR(close(file->fd));
-	file->fd = -1;
+	for (i = 0; i < STATS_NR_COUNTERS; i++) {
+		if ((mask & (1 << i)) == 0)
+			continue;
 
-	if (file->history_name != NULL) {
-		g_free(file->history_name);
-		file->history_name = NULL;
-	}
+		n = get_varint(buf + pos, len - pos, &value);
+		if (n < 0 || value > G_MAXUINT32)
+			return NULL;
+		pos += n;
 
-	if (file->name != NULL) {
-		g_free(file->name);
-		file->name = NULL;
+		counters[i] += value;
 	}
 
-	g_free(file);
-}
-
-static void update_first(struct stats_file *file)
-{
-	file->first = (struct stats_record *)
-			(file->addr + sizeof(struct stats_file_header));
-}
+	iter->pos = pos;
+	iter->ts += delta;
 
-static void update_last(struct stats_file *file)
-{
-	unsigned int max_entries;
+	memcpy(get_counters(&prev->data), counters, sizeof(counters));
+	prev->ts = iter->ts;
+	prev->roaming = roaming;
 
-	max_entries = (file->len - sizeof(struct stats_file_header)) /
-			sizeof(struct stats_record);
-	file->last = file->first + max_entries - 1;
-}
+	if (roaming == TRUE)
+		iter->roaming_valid = TRUE;
+	else
+		iter->home_valid = TRUE;
 
-static void update_home(struct stats_file *file)
-{
-	file->home = get_home(file);
-}
+	iter->rec = *prev;
 
-static void update_roaming(struct stats_file *file)
-{
-	file->roaming = get_roaming(file);
+	return &iter->rec;
 }
 
 static void stats_file_update_cache(struct stats_file *file)
 {
-	update_first(file);
-	update_last(file);
-	update_home(file);
-	update_roaming(file);
+	struct stats_iter iter;
+
+	stats_iter_init(&iter, file);
+
+	while (get_next_record(&iter) != NULL)
+		;
+
+	file->end = iter.pos;
+	file->ts = iter.ts;
+	file->home = iter.home;
+	file->roaming = iter.roaming;
+	file->home_valid = iter.home_valid;
+	file->roaming_valid = iter.roaming_valid;
+
+	/* Anything after a damaged entry would be misread later on */
+	if (file->end < file->len && file->addr[file->end] != 0)
+		memset(file->addr + file->end, 0, file->len - file->end);
 }
 
 static int stats_file_remap(struct stats_file *file, size_t size)
@@ -319,8 +406,6 @@ static int stats_file_remap(struct stats_file *file, size_t size)
 	file->addr = addr;
 	file->len = new_size;
 
-	stats_file_update_cache(file);
-
 	return 0;
 }
 
@@ -359,6 +444,116 @@ static int stats_open_temp(struct stats_file *file)
 	return 0;
 }
 
+static void stats_file_init(struct stats_file *file)
+{
+	struct stats_file_header *hdr;
+
+	memset(file->addr, 0, file->len);
+
+	hdr = get_hdr(file);
+	hdr->magic = MAGIC;
+	hdr->begin = sizeof(struct stats_file_header);
+}
+
+static int append_record(struct stats_file *file,
+				struct stats_record *rec)
+{
+	unsigned char buf[STATS_RECORD_MAX_SIZE];
+	struct stats_record *prev;
+	int len, err;
+
+	if (rec->roaming == TRUE)
+		prev = &file->roaming;
+	else
+		prev = &file->home;
+
+	len = encode_record(buf, rec, prev, file->ts);
+
+	if (file->end + len > file->len) {
+		err = stats_file_remap(file, file->len +
+					sysconf(_SC_PAGESIZE));
+		if (err < 0)
+			return err;
+	}
+
+	memcpy(file->addr + file->end, buf, len);
+	file->end += len;
+
+	*prev = *rec;
+	file->ts = rec->ts;
+
+	if (rec->roaming == TRUE)
+		file->roaming_valid = TRUE;
+	else
+		file->home_valid = TRUE;
+
+	return 0;
+}
+
+/* Rewrites a file of the old fixed size format as a log */
+static void stats_file_convert(struct stats_file *file)
+{
+	struct stats_file_header_v1 hdr;
+	struct stats_record *records, base;
+	unsigned int first, slots, begin, end, count, i;
+	size_t size = sizeof(struct stats_record);
+
+	memcpy(&hdr, file->addr, sizeof(hdr));
+
+	first = sizeof(hdr);
+	slots = (file->len - first) / size;
+
+	if (slots == 0 || hdr.begin < first || hdr.end < first ||
+			hdr.begin >= first + slots * size ||
+			hdr.end >= first + slots * size) {
+		stats_file_init(file);
+		return;
+	}
+
+	begin = (hdr.begin - first) / size;
+	end = (hdr.end - first) / size;
+	count = (end + slots - begin) % slots;
+
+	DBG("file %s converting %u records", file->name, count);
+
+	records = g_try_new(struct stats_record, count);
+	if (records == NULL) {
+		stats_file_init(file);
+		return;
+	}
+
+	for (i = 0; i < count; i++)
+		memcpy(&records[i], file->addr + first +
+				((begin + 1 + i) % slots) * size, size);
+
+	memcpy(&base, file->addr + first + begin * size, size);
+
+	stats_file_init(file);
+
+	/* The latest values may still be in the slot before the first one */
+	if (hdr.home == hdr.begin) {
+		get_hdr(file)->home = base;
+		get_hdr(file)->flags |= STATS_BASE_HOME;
+	}
+
+	if (hdr.roaming == hdr.begin) {
+		get_hdr(file)->roaming = base;
+		get_hdr(file)->flags |= STATS_BASE_ROAMING;
+	}
+
+	if (get_hdr(file)->flags != 0)
+		get_hdr(file)->ts = base.ts;
+
+	stats_file_update_cache(file);
+
+	for (i = 0; i < count; i++) {
+		if (append_record(file, &records[i]) < 0)
+			break;
+	}
+
+	g_free(records);
+}
+
 static int stats_file_setup(struct stats_file *file)
 {
 	struct stats_file_header *hdr;
@@ -397,202 +592,150 @@ static int stats_file_setup(struct stats_file *file)
 
 	hdr = get_hdr(file);
 
-	if (hdr->magic != MAGIC ||
-			hdr->begin < sizeof(struct stats_file_header) ||
-			hdr->end < sizeof(struct stats_file_header) ||
-			hdr->home < sizeof(struct stats_file_header) ||
-			hdr->roaming < sizeof(struct stats_file_header) ||
-			hdr->begin > file->len ||
-			hdr->end > file->len) {
-		hdr->magic = MAGIC;
-		hdr->begin = sizeof(struct stats_file_header);
-		hdr->end = sizeof(struct stats_file_header);
-		hdr->home = UINT_MAX;
-		hdr->roaming = UINT_MAX;
+	if (hdr->magic == MAGIC_V1)
+		stats_file_convert(file);
+	else if (hdr->magic != MAGIC ||
+			hdr->begin != sizeof(struct stats_file_header))
+		stats_file_init(file);
 
-		stats_file_update_cache(file);
-	}
+	stats_file_update_cache(file);
 
 	return 0;
 }
 
-
-static struct stats_record *get_next_record(struct stats_iter *iter)
+/*
+ * Summarizing runs in low priority idle callbacks which handle at
+ * most STATS_HISTORY_SLICE records each. It works on a copy of the
+ * full log, so the log can start over and take new records right away.
+ */
+static gboolean history_append_due(struct stats_history *history,
+					struct stats_record *cur,
+					struct stats_record *next)
 {
-	if (iter->it != iter->end) {
-		struct stats_record *tmp;
+	GDate date_cur;
+	GDate date_next;
 
-		tmp = iter->it;
-		iter->it = get_next(iter->file, iter->it);
+	g_date_set_time_t(&date_cur, cur->ts);
+	g_date_set_time_t(&date_next, next->ts);
 
-		return tmp;
-	}
+	if (g_date_compare(&date_cur, &history->date_change_step_size) < 0) {
+		/* month period size */
+		GDateDay day_cur, day_next;
+		GDateMonth month_cur, month_next;
 
-	return NULL;
-}
+		month_cur = g_date_get_month(&date_cur);
+		month_next = g_date_get_month(&date_next);
 
-static int append_record(struct stats_file *file,
-				struct stats_record *rec)
-{
-	struct stats_record *cur, *next;
-	int err;
+		day_cur = g_date_get_day(&date_cur);
+		day_next = g_date_get_day(&date_next);
 
-	if (file->last == get_end(file)) {
-		err = stats_file_remap(file, file->len +
-					sysconf(_SC_PAGESIZE));
-		if (err < 0)
-			return err;
+		if (day_cur == day_next && month_cur != month_next)
+			return TRUE;
 
-		stats_file_update_cache(file);
-	}
+		if (day_cur < history->account_period_offset &&
+				day_next >= history->account_period_offset)
+			return TRUE;
 
-	cur = get_end(file);
-	next = get_next(file, cur);
-
-	memcpy(next, rec, sizeof(struct stats_record));
+		return FALSE;
+	}
 
-	set_end(file, next);
+	/* day period size */
+	if (g_date_days_between(&date_cur, &date_next) > 0)
+		return TRUE;
 
-	return 0;
+	return FALSE;
 }
 
-static struct stats_record *process_file(struct stats_iter *iter,
-					struct stats_file *temp_file,
-					struct stats_record *cur,
-					GDate *date_change_step_size,
-					int account_period_offset)
+static void history_process_record(struct stats_history *history,
+					struct stats_record *next)
 {
-	struct stats_record *home, *roaming;
-	struct stats_record *next;
-
-	home = NULL;
-	roaming = NULL;
-
-	if (cur == NULL)
-		cur = get_next_record(iter);
-	next = get_next_record(iter);
-
-	while (next != NULL) {
-		GDate date_cur;
-		GDate date_next;
-		int append;
-
-		append = FALSE;
-
-		if (cur->roaming == TRUE)
-			roaming = cur;
-		else
-			home = cur;
-
-		g_date_set_time_t(&date_cur, cur->ts);
-		g_date_set_time_t(&date_next, next->ts);
+	struct stats_record *cur = &history->cur;
 
-		if (g_date_compare(&date_cur, date_change_step_size) < 0) {
-			/* month period size */
-			GDateDay day_cur, day_next;
-			GDateMonth month_cur, month_next;
-
-			month_cur = g_date_get_month(&date_cur);
-			month_next = g_date_get_month(&date_next);
+	if (history->have_cur == FALSE) {
+		*cur = *next;
+		history->have_cur = TRUE;
+		return;
+	}
 
-			day_cur = g_date_get_day(&date_cur);
-			day_next = g_date_get_day(&date_next);
+	if (cur->roaming == TRUE) {
+		history->roaming = *cur;
+		history->have_roaming = TRUE;
+	} else {
+		history->home = *cur;
+		history->have_home = TRUE;
+	}
 
-			if (day_cur == day_next && month_cur != month_next) {
-				append = TRUE;
-			} else if (day_cur < account_period_offset &&
-					day_next >= account_period_offset) {
-				append = TRUE;
-			}
-		} else {
-			/* day period size */
-			if (g_date_days_between(&date_cur, &date_next) > 0)
-				append = TRUE;
+	if (history_append_due(history, cur, next) == TRUE) {
+		if (history->have_home == TRUE) {
+			append_record(&history->temp_file, &history->home);
+			history->have_home = FALSE;
 		}
 
-		if (append == TRUE) {
-			if (home != NULL) {
-				append_record(temp_file, home);
-				home = NULL;
-			}
-
-			if (roaming != NULL) {
-				append_record(temp_file, roaming);
-				roaming = NULL;
-			}
+		if (history->have_roaming == TRUE) {
+			append_record(&history->temp_file, &history->roaming);
+			history->have_roaming = FALSE;
 		}
-
-		cur = next;
-		next = get_next_record(iter);
 	}
 
-	return cur;
+	*cur = *next;
 }
 
-static int summarize(struct stats_file *data_file,
-			struct stats_file *history_file,
-			struct stats_file *temp_file)
+/* Returns TRUE once all records have been processed */
+static gboolean history_step(struct stats_history *history,
+					unsigned int count)
 {
-	struct stats_iter data_iter;
-	struct stats_iter history_iter;
-	struct stats_record *cur, *next;
-
-	GDate today, date_change_step_size;
-
-	/*
-	 * First calculate the date when switch from monthly
-	 * accounting period size to daily size
-	 */
-	g_date_set_time_t(&today, time(NULL));
-
-	date_change_step_size = today;
-	if (g_date_get_day(&today) - data_file->account_period_offset >= 0)
-		g_date_subtract_months(&date_change_step_size, 2);
-	else
-		g_date_subtract_months(&date_change_step_size, 3);
-
-	g_date_set_day(&date_change_step_size,
-			data_file->account_period_offset);
-
-
-	/* Now process history file */
-	cur = NULL;
-
-	if (history_file != NULL) {
-		history_iter.file = history_file;
-		history_iter.begin = get_iterator_begin(history_iter.file);
-		history_iter.end = get_iterator_end(history_iter.file);
-		history_iter.it = history_iter.begin;
+	struct stats_iter peek;
+	struct stats_record *next;
 
-		cur = process_file(&history_iter, temp_file, NULL,
-					&date_change_step_size,
-					data_file->account_period_offset);
-	}
+	while (count-- > 0) {
+		switch (history->phase) {
+		case STATS_HISTORY_READ:
+			next = get_next_record(&history->iter);
+			if (next != NULL) {
+				history_process_record(history, next);
+				break;
+			}
 
-	data_iter.file = data_file;
-	data_iter.begin = get_iterator_begin(data_iter.file);
-	data_iter.end = get_iterator_end(data_iter.file);
-	data_iter.it = data_iter.begin;
+			history->have_home = FALSE;
+			history->have_roaming = FALSE;
+
+			stats_iter_init(&history->iter, &history->snapshot);
+
+			if (history->have_cur == TRUE)
+				history->phase = STATS_HISTORY_SKIP;
+			else
+				history->phase = STATS_HISTORY_DATA;
+			break;
+
+		case STATS_HISTORY_SKIP:
+			/*
+			 * Ensure data records are newer than the history
+			 * record
+			 */
+			peek = history->iter;
+
+			next = get_next_record(&peek);
+			if (next != NULL && history->cur.ts > next->ts)
+				history->iter = peek;
+			else
+				history->phase = STATS_HISTORY_DATA;
+			break;
+
+		case STATS_HISTORY_DATA:
+			next = get_next_record(&history->iter);
+			if (next == NULL) {
+				if (history->have_cur == TRUE)
+					append_record(&history->temp_file,
+							&history->cur);
+				return TRUE;
+			}
 
-	/*
-	 * Ensure date_file records are newer than the history_file
-	 * record
-	 */
-	if (cur != NULL) {
-		next = get_next_record(&data_iter);
-		while (next != NULL && cur->ts > next->ts)
-			next = get_next_record(&data_iter);
+			history_process_record(history, next);
+			break;
+		}
 	}
 
-	/* And finally process the new data records */
-	cur = process_file(&data_iter, temp_file, cur,
-				&date_change_step_size,
-				data_file->account_period_offset);
-
-	if (cur != NULL)
-		append_record(temp_file, cur);
-
-	return 0;
+	return FALSE;
 }
 
 static void stats_file_unmap(struct stats_file *file)
@@ -633,37 +776,231 @@ static int stats_file_close_swap(struct stats_file *history_file,
 	return err;
 }
 
-static int stats_file_history_update(struct stats_file *data_file)
+static void history_free(struct stats_history *history)
+{
+	g_free(history->snapshot.addr);
+	g_free(history);
+}
+
+static void history_finish(struct stats_file *file)
+{
+	struct stats_history *history = file->history;
+
+	file->history = NULL;
+
+	if (history->idle > 0)
+		g_source_remove(history->idle);
+
+	DBG("file %s", file->history_name);
+
+	if (stats_file_close_swap(&history->history_file,
+					&history->temp_file) < 0)
+		connman_warn("history file update failed %s",
+				file->history_name);
+
+	history_free(history);
+}
+
+static gboolean history_idle(gpointer user_data)
+{
+	struct stats_file *file = user_data;
+
+	if (history_step(file->history, STATS_HISTORY_SLICE) == FALSE)
+		return TRUE;
+
+	file->history->idle = 0;
+	history_finish(file);
+
+	return FALSE;
+}
+
+/* Used when the result is needed right away, e.g. on shutdown */
+static void history_complete(struct stats_file *file)
+{
+	if (file->history == NULL)
+		return;
+
+	while (history_step(file->history, STATS_HISTORY_SLICE) == FALSE)
+		;
+
+	history_finish(file);
+}
+
+static int stats_file_history_start(struct stats_file *data_file)
 {
-	struct stats_file _history_file, *history_file;
-	struct stats_file _temp_file, *temp_file;
+	struct stats_history *history;
+	GDate today;
 	int err;
 
-	history_file = &_history_file;
-	temp_file = &_temp_file;
+	/* The log filled up again before the last run was done */
+	history_complete(data_file);
 
-	bzero(history_file, sizeof(struct stats_file));
-	bzero(temp_file, sizeof(struct stats_file));
+	history = g_try_new0(struct stats_history, 1);
+	if (history == NULL)
+		return -ENOMEM;
 
-	err = stats_open(history_file, data_file->history_name);
+	history->snapshot.fd = -1;
+	history->snapshot.len = data_file->end;
+	history->snapshot.addr = g_try_malloc(data_file->end);
+	if (history->snapshot.addr == NULL) {
+		g_free(history);
+		return -ENOMEM;
+	}
+
+	memcpy(history->snapshot.addr, data_file->addr, data_file->end);
+
+	err = stats_open(&history->history_file, data_file->history_name);
 	if (err < 0)
-		return err;
-	stats_file_setup(history_file);
+		goto err;
 
-	err = stats_open_temp(temp_file);
+	err = stats_file_setup(&history->history_file);
+	if (err < 0)
+		goto err;
+
+	err = stats_open_temp(&history->temp_file);
 	if (err < 0) {
-		stats_free(history_file);
-		return err;
+		stats_file_unmap(&history->history_file);
+		TFR(close(history->history_file.fd));
+		stats_file_cleanup(&history->history_file);
+		goto err;
 	}
-	stats_file_setup(temp_file);
+	stats_file_setup(&history->temp_file);
 
-	summarize(data_file, history_file, temp_file);
+	/*
+	 * First calculate the date when switch from monthly
+	 * accounting period size to daily size
+	 */
+	history->account_period_offset = data_file->account_period_offset;
 
-	err = stats_file_close_swap(history_file, temp_file);
+	g_date_set_time_t(&today, time(NULL));
+
+	history->date_change_step_size = today;
+	if (g_date_get_day(&today) - history->account_period_offset >= 0)
+		g_date_subtract_months(&history->date_change_step_size, 2);
+	else
+		g_date_subtract_months(&history->date_change_step_size, 3);
+
+	g_date_set_day(&history->date_change_step_size,
+			history->account_period_offset);
+
+	/* Now process history file and then the data records */
+	history->phase = STATS_HISTORY_READ;
+	stats_iter_init(&history->iter, &history->history_file);
+
+	history->idle = g_idle_add_full(G_PRIORITY_LOW, history_idle,
+					data_file, NULL);
+	data_file->history = history;
+
+	return 0;
+
+err:
+	history_free(history);
 
 	return err;
 }
 
+/* Starts the log over with the latest values as its base */
+static void stats_file_reset(struct stats_file *file)
+{
+	struct stats_file_header *hdr = get_hdr(file);
+
+	hdr->flags = 0;
+	hdr->ts = file->ts;
+
+	if (file->home_valid == TRUE) {
+		hdr->home = file->home;
+		hdr->flags |= STATS_BASE_HOME;
+	}
+
+	if (file->roaming_valid == TRUE) {
+		hdr->roaming = file->roaming;
+		hdr->flags |= STATS_BASE_ROAMING;
+	}
+
+	memset(file->addr + hdr->begin, 0, file->len - hdr->begin);
+	file->end = hdr->begin;
+}
+
+static int stats_file_commit(struct stats_file *file)
+{
+	int err;
+
+	if (file->commit_timeout > 0) {
+		g_source_remove(file->commit_timeout);
+		file->commit_timeout = 0;
+	}
+
+	if (file->pending_valid == FALSE)
+		return 0;
+
+	file->pending_valid = FALSE;
+
+	if (file->end + STATS_RECORD_MAX_SIZE > file->len) {
+		if (file->len < file->max_len) {
+			DBG("grow file %s", file->name);
+
+			err = stats_file_remap(file, file->len +
+						sysconf(_SC_PAGESIZE));
+			if (err < 0)
+				return err;
+		} else {
+			DBG("log is full, update history file");
+
+			if (stats_file_history_start(file) < 0) {
+				connman_warn("history file update failed %s",
+						file->history_name);
+			}
+
+			stats_file_reset(file);
+		}
+	}
+
+	return append_record(file, &file->pending);
+}
+
+static gboolean commit_timeout(gpointer user_data)
+{
+	struct stats_file *file = user_data;
+
+	file->commit_timeout = 0;
+
+	if (stats_file_commit(file) < 0)
+		connman_error("Failed to store statistics in %s", file->name);
+
+	return FALSE;
+}
+
+static void stats_free(gpointer user_data)
+{
+	struct stats_file *file = user_data;
+
+	if (file == NULL)
+		return;
+
+	stats_file_commit(file);
+	history_complete(file);
+
+	msync(file->addr, file->len, MS_SYNC);
+
+	munmap(file->addr, file->len);
+	file->addr = NULL;
+
+	TFR(close(file->fd));
+	file->fd = -1;
+
+	if (file->history_name != NULL) {
+		g_free(file->history_name);
+		file->history_name = NULL;
+	}
+
+	if (file->name != NULL) {
+		g_free(file->name);
+		file->name = NULL;
+	}
+
+	g_free(file);
+}
+
 int __connman_stats_service_register(struct connman_service *service)
 {
 	struct stats_file *file;
@@ -720,45 +1057,48 @@ int  __connman_stats_update(struct connman_service *service,
 				struct connman_stats_data *data)
 {
 	struct stats_file *file;
-	struct stats_record *next;
+	unsigned int interval;
 	int err;
 
 	file = g_hash_table_lookup(stats_hash, service);
 	if (file == NULL)
 		return -EEXIST;
 
-	if (file->len < file->max_len &&
-			file->last == get_end(file)) {
-		DBG("grow file %s", file->name);
+	roaming = roaming == TRUE ? TRUE : FALSE;
 
-		err = stats_file_remap(file, file->len + sysconf(_SC_PAGESIZE));
+	/* Switching between home and roaming is always recorded */
+	if (file->pending_valid == TRUE && file->pending.roaming != (unsigned int) roaming) {
+		err = stats_file_commit(file);
 		if (err < 0)
 			return err;
 	}
 
-	next = get_next(file, get_end(file));
+	file->pending.ts = time(NULL);
+	file->pending.roaming = roaming;
+	memcpy(&file->pending.data, data, sizeof(struct connman_stats_data));
+	file->pending_valid = TRUE;
 
-	if (next == get_begin(file)) {
-		DBG("ring buffer is full, update history file");
+	interval = connman_setting_get_uint("StatisticsCommitInterval");
+	if (interval == 0)
+		return stats_file_commit(file);
 
-		if (stats_file_history_update(file) < 0) {
-			connman_warn("history file update failed %s",
-					file->history_name);
-		}
-	}
+	if (file->commit_timeout == 0)
+		file->commit_timeout = g_timeout_add_seconds(interval,
+							commit_timeout, file);
 
-	next->ts = time(NULL);
-	next->roaming = roaming;
-	memcpy(&next->data, data, sizeof(struct connman_stats_data));
+	return 0;
+}
 
-	if (roaming != TRUE)
-		set_home(file, next);
-	else
-		set_roaming(file, next);
+void __connman_stats_flush(struct connman_service *service)
+{
+	struct stats_file *file;
 
-	set_end(file, next);
+	file = g_hash_table_lookup(stats_hash, service);
+	if (file == NULL)
+		return;
 
-	return 0;
+	if (stats_file_commit(file) < 0)
+		connman_error("Failed to store statistics in %s", file->name);
 }
 
 int __connman_stats_get(struct connman_service *service,
@@ -766,16 +1106,20 @@ int __connman_stats_get(struct connman_service *service,
 				struct connman_stats_data *data)
 {
 	struct stats_file *file;
-	struct stats_record *rec;
+	struct stats_record *rec = NULL;
 
 	file = g_hash_table_lookup(stats_hash, service);
 	if (file == NULL)
 		return -EEXIST;
 
-	if (roaming != TRUE)
-		rec = file->home;
-	else
-		rec = file->roaming;
+	roaming = roaming == TRUE ? TRUE : FALSE;
+
+	if (file->pending_valid == TRUE && file->pending.roaming == (unsigned int) roaming)
+		rec = &file->pending;
+	else if (roaming != TRUE && file->home_valid == TRUE)
+		rec = &file->home;
+	else if (roaming == TRUE && file->roaming_valid == TRUE)
+		rec = &file->roaming;
 
 	if (rec != NULL) {
 		memcpy(data, &rec->data,
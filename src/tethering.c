@@ -140,6 +140,7 @@ static GDHCPServer *dhcp_server_start(const char *bridge,
 {
 	GDHCPServerError error;
 	GDHCPServer *dhcp_server;
+	char *lease_file;
 	int index;
 
 	DBG("");
@@ -162,6 +163,11 @@ static GDHCPServer *dhcp_server_start(const char *bridge,
 	g_dhcp_server_set_option(dhcp_server, G_DHCP_DNS_SERVER, dns);
 	g_dhcp_server_set_ip_range(dhcp_server, start_ip, end_ip);
 
+	/* Keep the addresses of the clients across restarts */
+	lease_file = g_strdup_printf("%s/%s.leases", STORAGEDIR, bridge);
+	g_dhcp_server_set_lease_file(dhcp_server, lease_file);
+	g_free(lease_file);
+
 	g_dhcp_server_start(dhcp_server);
 
 	return dhcp_server;
@@ -295,6 +301,7 @@ static int enable_ip_forward(connman_bool_t enable)
 
 static int enable_nat(const char *interface)
 {
+	struct connman_iptables_rule rules[2];
 	int err;
 
 	if (interface == NULL)
@@ -305,33 +312,33 @@ static int enable_nat(const char *interface)
 	if (err < 0)
 		return err;
 
-	/* POSTROUTING flush */
-	err = __connman_iptables_command("-t nat -F POSTROUTING");
-	if (err < 0)
-		return err;
+	/* POSTROUTING flush and masquerading in one commit */
+	memset(rules, 0, sizeof(rules));
 
-	/* Enable masquerading */
-	err = __connman_iptables_command("-t nat -A POSTROUTING "
-					"-o %s -j MASQUERADE", interface);
-	if (err < 0)
-		return err;
+	rules[0].operation = CONNMAN_IPTABLES_FLUSH;
+	rules[0].chain = "POSTROUTING";
+
+	rules[1].operation = CONNMAN_IPTABLES_APPEND;
+	rules[1].chain = "POSTROUTING";
+	rules[1].out_interface = interface;
+	rules[1].target = "MASQUERADE";
 
-	return __connman_iptables_commit("nat");
+	return __connman_iptables_apply("nat", rules, G_N_ELEMENTS(rules));
 }
 
 static void disable_nat(const char *interface)
 {
-	int err;
+	struct connman_iptables_rule rule;
 
 	/* Disable IPv4 forwarding */
 	enable_ip_forward(FALSE);
 
 	/* POSTROUTING flush */
-	err = __connman_iptables_command("-t nat -F POSTROUTING");
-	if (err < 0)
-		return;
+	memset(&rule, 0, sizeof(rule));
+	rule.operation = CONNMAN_IPTABLES_FLUSH;
+	rule.chain = "POSTROUTING";
 
-	__connman_iptables_commit("nat");
+	__connman_iptables_apply("nat", &rule, 1);
 }
 
 void __connman_tethering_set_enabled(void)
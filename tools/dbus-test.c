@@ -27,6 +27,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <time.h>
 
 #include <gdbus.h>
 
@@ -34,8 +35,36 @@
 	printf("%s() " fmt "\n", __FUNCTION__ , ## arg); \
 } while (0)
 
+/*
+ * With --bench the signal watch dispatch of gdbus is measured on the
+ * session bus. For a growing number of watches, a signal watch with
+ * its own path and a disconnect watch with its own name are added,
+ * and signals matching one of the signal watches are sent to the bus.
+ * The processor time spent receiving and dispatching them is reported.
+ */
+
+#define BENCH_INTERFACE	"net.connman.Bench"
+#define BENCH_NAME	"net.connman.Bench.Name"
+
 static GMainLoop *main_loop = NULL;
 
+static gboolean option_bench = FALSE;
+static gint option_watches = 1000;
+static gint option_signals = 10000;
+
+static GOptionEntry options[] = {
+	{ "bench", 'b', 0, G_OPTION_ARG_NONE, &option_bench,
+				"Benchmark signal dispatch on the session bus" },
+	{ "watches", 'w', 0, G_OPTION_ARG_INT, &option_watches,
+				"Maximum number of watches", "COUNT" },
+	{ "signals", 's', 0, G_OPTION_ARG_INT, &option_signals,
+				"Number of signals per run", "COUNT" },
+	{ NULL },
+};
+
+static gint received;
+static guint timeout_id;
+
 static void sig_term(int sig)
 {
 	g_main_loop_quit(main_loop);
@@ -48,17 +77,143 @@ static void disconnect_callback(DBusConnection *conn, void *user_data)
 	g_main_loop_quit(main_loop);
 }
 
+static gboolean ping_callback(DBusConnection *conn, DBusMessage *msg,
+							void *user_data)
+{
+	if (++received == option_signals)
+		g_main_loop_quit(main_loop);
+
+	return TRUE;
+}
+
+static gboolean timeout_callback(gpointer user_data)
+{
+	printf("Timeout after %d of %d signals\n", received, option_signals);
+
+	timeout_id = 0;
+
+	g_main_loop_quit(main_loop);
+
+	return FALSE;
+}
+
+static int bench_run(DBusConnection *conn, int count)
+{
+	guint *watches;
+	clock_t start;
+	double elapsed;
+	int i;
+
+	watches = g_new0(guint, count * 2);
+
+	for (i = 0; i < count; i++) {
+		char *path, *name;
+
+		path = g_strdup_printf("/bench/%d", i);
+		name = g_strdup_printf("%s%d", BENCH_NAME, i);
+
+		watches[i * 2] = g_dbus_add_signal_watch(conn, NULL, path,
+						BENCH_INTERFACE, "Ping",
+						ping_callback, NULL, NULL);
+		watches[i * 2 + 1] = g_dbus_add_disconnect_watch(conn, name,
+							NULL, NULL, NULL);
+
+		g_free(path);
+		g_free(name);
+	}
+
+	for (i = 0; i < option_signals; i++) {
+		DBusMessage *msg;
+		char *path;
+
+		path = g_strdup_printf("/bench/%d", g_random_int_range(0,
+								count));
+
+		msg = dbus_message_new_signal(path, BENCH_INTERFACE, "Ping");
+		if (msg != NULL) {
+			dbus_connection_send(conn, msg, NULL);
+			dbus_message_unref(msg);
+		}
+
+		g_free(path);
+	}
+
+	dbus_connection_flush(conn);
+
+	received = 0;
+
+	timeout_id = g_timeout_add_seconds(30, timeout_callback, NULL);
+
+	start = clock();
+	g_main_loop_run(main_loop);
+	elapsed = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+	if (timeout_id > 0)
+		g_source_remove(timeout_id);
+
+	for (i = 0; i < count * 2; i++)
+		g_dbus_remove_watch(conn, watches[i]);
+
+	g_free(watches);
+
+	if (received < option_signals)
+		return -1;
+
+	printf("watches %6d  %8.3f us/signal\n", count * 2,
+				elapsed * 1000000 / option_signals);
+
+	return 0;
+}
+
+static int bench(DBusConnection *conn)
+{
+	int count;
+
+	for (count = 8; count < option_watches / 2; count *= 4) {
+		if (bench_run(conn, count) < 0)
+			break;
+	}
+
+	if (count >= option_watches / 2)
+		bench_run(conn, option_watches / 2);
+
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
+	GOptionContext *context;
+	GError *error = NULL;
 	DBusConnection *conn;
 	DBusError err;
 	struct sigaction sa;
 
+	context = g_option_context_new(NULL);
+	g_option_context_add_main_entries(context, options, NULL);
+
+	if (g_option_context_parse(context, &argc, &argv, &error) == FALSE) {
+		if (error != NULL) {
+			g_printerr("%s\n", error->message);
+			g_error_free(error);
+		} else
+			g_printerr("An unknown error occurred\n");
+		exit(1);
+	}
+
+	g_option_context_free(context);
+
+	if (option_bench == TRUE &&
+			(option_watches < 2 || option_signals <= 0)) {
+		fprintf(stderr, "Invalid number of watches or signals\n");
+		exit(1);
+	}
+
 	main_loop = g_main_loop_new(NULL, FALSE);
 
 	dbus_error_init(&err);
 
-	conn = g_dbus_setup_bus(DBUS_BUS_SYSTEM, NULL, &err);
+	conn = g_dbus_setup_bus(option_bench == TRUE ? DBUS_BUS_SESSION :
+					DBUS_BUS_SYSTEM, NULL, &err);
 	if (conn == NULL) {
 		if (dbus_error_is_set(&err) == TRUE) {
 			fprintf(stderr, "%s\n", err.message);
@@ -70,6 +225,11 @@ int main(int argc, char *argv[])
 
 	g_dbus_set_disconnect_function(conn, disconnect_callback, NULL, NULL);
 
+	if (option_bench == TRUE) {
+		bench(conn);
+		goto done;
+	}
+
 	memset(&sa, 0, sizeof(sa));
 	sa.sa_handler = sig_term;
 	sigaction(SIGINT, &sa, NULL);
@@ -77,6 +237,7 @@ int main(int argc, char *argv[])
 
 	g_main_loop_run(main_loop);
 
+done:
 	dbus_connection_unref(conn);
 
 	g_main_loop_unref(main_loop);
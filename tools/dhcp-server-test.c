@@ -23,14 +23,46 @@
 #include <config.h>
 #endif
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netpacket/packet.h>
+#include <net/ethernet.h>
 
 #include <gdhcp/gdhcp.h>
+#include <gdhcp/common.h>
 
 static GMainLoop *main_loop;
 
+static gint option_clients = 0;
+static gint option_window = 64;
+static gint option_timeout = 60;
+static gchar *option_start = NULL;
+static gchar *option_end = NULL;
+static gchar *option_lease_file = NULL;
+
+static GOptionEntry options[] = {
+	{ "clients", 'n', 0, G_OPTION_ARG_INT, &option_clients,
+			"Simulate COUNT clients against the server", "COUNT" },
+	{ "window", 'w', 0, G_OPTION_ARG_INT, &option_window,
+			"Number of clients in flight at once", "COUNT" },
+	{ "timeout", 't', 0, G_OPTION_ARG_INT, &option_timeout,
+			"Seconds to wait for each phase", "SECONDS" },
+	{ "start", 's', 0, G_OPTION_ARG_STRING, &option_start,
+			"First address of the pool", "ADDRESS" },
+	{ "end", 'e', 0, G_OPTION_ARG_STRING, &option_end,
+			"Last address of the pool", "ADDRESS" },
+	{ "lease-file", 'l', 0, G_OPTION_ARG_STRING, &option_lease_file,
+			"Keep the leases in a journal file", "FILE" },
+	{ NULL },
+};
+
 static void sig_term(int sig)
 {
 	g_main_loop_quit(main_loop);
@@ -71,16 +103,395 @@ static void dhcp_debug(const char *str, void *data)
 	printf("%s: %s\n", (const char *) data, str);
 }
 
+/*
+ * Load generator. Every simulated client has its own MAC address and
+ * goes through DISCOVER/OFFER/REQUEST/ACK and then renews its lease
+ * with a second REQUEST. The requests are broadcast on the interface,
+ * which loops them back to the server in this process, and the replies
+ * are picked up with a packet socket since the server sends them raw.
+ * A dummy interface with an IPv4 address keeps the traffic off the
+ * network.
+ */
+enum client_state {
+	CLIENT_IDLE,
+	CLIENT_SELECTING,
+	CLIENT_REQUESTING,
+	CLIENT_BOUND,
+};
+
+struct load_client {
+	uint8_t mac[ETH_ALEN];
+	enum client_state state;
+	uint32_t yiaddr;
+	uint32_t server_id;
+	gdouble sent;
+};
+
+struct load_test {
+	char interface[IF_NAMESIZE];
+	int ifindex;
+	int send_sk;
+	int recv_sk;
+	guint recv_watch;
+	guint tick_watch;
+	struct load_client *clients;
+	int count;
+	int next;
+	int active;
+	int done;
+	int failed;
+	int resent;
+	uint32_t xid_base;
+	gboolean renew;
+	GTimer *timer;
+};
+
+static struct load_test load;
+
+static void send_request(struct load_client *client, char type)
+{
+	struct dhcp_packet packet;
+	struct sockaddr_in addr;
+	int index = client - load.clients;
+
+	dhcp_init_header(&packet, type);
+
+	packet.xid = load.xid_base + index;
+	memcpy(packet.chaddr, client->mac, ETH_ALEN);
+
+	if (load.renew == TRUE)
+		packet.ciaddr = client->yiaddr;
+	else
+		packet.flags = htons(BROADCAST_FLAG);
+
+	if (type == DHCPREQUEST && load.renew == FALSE) {
+		dhcp_add_simple_option(&packet, DHCP_REQUESTED_IP,
+							client->yiaddr);
+		dhcp_add_simple_option(&packet, DHCP_SERVER_ID,
+							client->server_id);
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(SERVER_PORT);
+	addr.sin_addr.s_addr = INADDR_BROADCAST;
+
+	if (sendto(load.send_sk, &packet,
+			sizeof(packet) - EXTEND_FOR_BUGGY_SERVERS, 0,
+			(struct sockaddr *) &addr, sizeof(addr)) < 0)
+		printf("Failed to send request %d: %s\n", index,
+							strerror(errno));
+
+	client->sent = g_timer_elapsed(load.timer, NULL);
+}
+
+static void start_client(struct load_client *client)
+{
+	if (load.renew == TRUE) {
+		client->state = CLIENT_REQUESTING;
+		send_request(client, DHCPREQUEST);
+	} else {
+		client->state = CLIENT_SELECTING;
+		send_request(client, DHCPDISCOVER);
+	}
+}
+
+static void fill_window(void)
+{
+	while (load.active < option_window && load.next < load.count) {
+		start_client(&load.clients[load.next++]);
+		load.active++;
+	}
+}
+
+static void start_phase(gboolean renew)
+{
+	load.renew = renew;
+	load.next = 0;
+	load.active = 0;
+	load.done = 0;
+	load.failed = 0;
+	load.resent = 0;
+
+	g_timer_start(load.timer);
+
+	fill_window();
+}
+
+static void finish_phase(void)
+{
+	gdouble elapsed = g_timer_elapsed(load.timer, NULL);
+
+	printf("%s clients %6d bound %6d failed %6d resent %6d "
+			"elapsed %8.3f ms (%.1f clients/s)\n",
+			load.renew == TRUE ? "renew" : "bind ",
+			load.count, load.done, load.failed, load.resent,
+			elapsed * 1000, load.done / elapsed);
+
+	if (load.renew == FALSE && load.done == load.count) {
+		start_phase(TRUE);
+		return;
+	}
+
+	g_main_loop_quit(main_loop);
+}
+
+static void client_finished(struct load_client *client, gboolean bound)
+{
+	client->state = CLIENT_BOUND;
+	load.active--;
+
+	if (bound == TRUE)
+		load.done++;
+	else
+		load.failed++;
+
+	if (load.done + load.failed == load.count)
+		finish_phase();
+	else
+		fill_window();
+}
+
+static void handle_reply(struct dhcp_packet *packet)
+{
+	struct load_client *client;
+	uint8_t *type, *server_id;
+	uint32_t index;
+
+	index = packet->xid - load.xid_base;
+	if (index >= (uint32_t) load.count)
+		return;
+
+	client = &load.clients[index];
+	if (memcmp(packet->chaddr, client->mac, ETH_ALEN) != 0)
+		return;
+
+	type = dhcp_get_option(packet, DHCP_MESSAGE_TYPE);
+	if (type == NULL)
+		return;
+
+	switch (*type) {
+	case DHCPOFFER:
+		if (client->state != CLIENT_SELECTING)
+			break;
+
+		server_id = dhcp_get_option(packet, DHCP_SERVER_ID);
+		if (server_id == NULL)
+			break;
+
+		client->yiaddr = packet->yiaddr;
+		client->server_id = dhcp_get_unaligned((uint32_t *) server_id);
+		client->state = CLIENT_REQUESTING;
+		send_request(client, DHCPREQUEST);
+		break;
+	case DHCPACK:
+		if (client->state != CLIENT_REQUESTING)
+			break;
+
+		client_finished(client, TRUE);
+		break;
+	case DHCPNAK:
+		if (client->state == CLIENT_IDLE ||
+					client->state == CLIENT_BOUND)
+			break;
+
+		/* A refused renewal is not retried */
+		if (load.renew == TRUE) {
+			client_finished(client, FALSE);
+			break;
+		}
+
+		client->state = CLIENT_SELECTING;
+		send_request(client, DHCPDISCOVER);
+		break;
+	}
+}
+
+static gboolean recv_event(GIOChannel *channel, GIOCondition condition,
+							gpointer user_data)
+{
+	struct ip_udp_dhcp_packet packet;
+	int len;
+
+	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
+		load.recv_watch = 0;
+		return FALSE;
+	}
+
+	while (1) {
+		memset(&packet, 0, sizeof(packet));
+
+		len = recv(load.recv_sk, &packet, sizeof(packet),
+							MSG_DONTWAIT);
+		if (len < 0)
+			break;
+
+		if (len < (int) offsetof(struct ip_udp_dhcp_packet,
+							data.options))
+			continue;
+
+		if (packet.ip.protocol != IPPROTO_UDP ||
+				packet.udp.dest != htons(CLIENT_PORT))
+			continue;
+
+		if (packet.data.op != BOOTREPLY ||
+				packet.data.cookie != htonl(DHCP_MAGIC))
+			continue;
+
+		handle_reply(&packet.data);
+	}
+
+	return TRUE;
+}
+
+/* Resends lost requests and gives up after the timeout */
+static gboolean tick_event(gpointer user_data)
+{
+	gdouble now = g_timer_elapsed(load.timer, NULL);
+	int i;
+
+	if (now > option_timeout) {
+		finish_phase();
+		return TRUE;
+	}
+
+	for (i = 0; i < load.next; i++) {
+		struct load_client *client = &load.clients[i];
+
+		if (client->state != CLIENT_SELECTING &&
+				client->state != CLIENT_REQUESTING)
+			continue;
+
+		if (now - client->sent < 1)
+			continue;
+
+		/* A lost OFFER or ACK means starting over */
+		load.resent++;
+		start_client(client);
+	}
+
+	return TRUE;
+}
+
+static int setup_load_test(int ifindex, int count)
+{
+	struct sockaddr_ll ll;
+	GIOChannel *channel;
+	int i, on = 1, bufsize = 4 * 1024 * 1024;
+
+	memset(&load, 0, sizeof(load));
+	load.recv_sk = -1;
+
+	if (if_indextoname(ifindex, load.interface) == NULL)
+		return -errno;
+
+	load.send_sk = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (load.send_sk < 0)
+		return -errno;
+
+	setsockopt(load.send_sk, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on));
+
+	if (setsockopt(load.send_sk, SOL_SOCKET, SO_BINDTODEVICE,
+				load.interface, strlen(load.interface) + 1) < 0)
+		goto error;
+
+	load.recv_sk = socket(PF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC,
+							htons(ETH_P_IP));
+	if (load.recv_sk < 0)
+		goto error;
+
+	setsockopt(load.recv_sk, SOL_SOCKET, SO_RCVBUF,
+						&bufsize, sizeof(bufsize));
+
+	memset(&ll, 0, sizeof(ll));
+	ll.sll_family = AF_PACKET;
+	ll.sll_protocol = htons(ETH_P_IP);
+	ll.sll_ifindex = ifindex;
+
+	if (bind(load.recv_sk, (struct sockaddr *) &ll, sizeof(ll)) < 0)
+		goto error;
+
+	load.ifindex = ifindex;
+	load.count = count;
+	load.xid_base = g_random_int();
+	load.timer = g_timer_new();
+
+	load.clients = g_new0(struct load_client, count);
+
+	for (i = 0; i < count; i++) {
+		struct load_client *client = &load.clients[i];
+
+		/* Locally administered addresses */
+		client->mac[0] = 0x02;
+		client->mac[2] = (i + 1) >> 24;
+		client->mac[3] = (i + 1) >> 16;
+		client->mac[4] = (i + 1) >> 8;
+		client->mac[5] = (i + 1);
+	}
+
+	channel = g_io_channel_unix_new(load.recv_sk);
+	load.recv_watch = g_io_add_watch(channel,
+				G_IO_IN | G_IO_NVAL | G_IO_ERR | G_IO_HUP,
+						recv_event, NULL);
+	g_io_channel_unref(channel);
+
+	load.tick_watch = g_timeout_add(500, tick_event, NULL);
+
+	return 0;
+
+error:
+	i = -errno;
+
+	if (load.recv_sk >= 0)
+		close(load.recv_sk);
+
+	close(load.send_sk);
+
+	return i;
+}
+
+static void cleanup_load_test(void)
+{
+	if (load.recv_watch > 0)
+		g_source_remove(load.recv_watch);
+
+	if (load.tick_watch > 0)
+		g_source_remove(load.tick_watch);
+
+	close(load.recv_sk);
+	close(load.send_sk);
+
+	g_timer_destroy(load.timer);
+	g_free(load.clients);
+}
+
 
 int main(int argc, char *argv[])
 {
+	GOptionContext *context;
+	GError *gerror = NULL;
 	struct sigaction sa;
 	GDHCPServerError error;
 	GDHCPServer *dhcp_server;
-	int index;
+	int index, err;
+
+	context = g_option_context_new("<interface index>");
+	g_option_context_add_main_entries(context, options, NULL);
+
+	if (g_option_context_parse(context, &argc, &argv, &gerror) == FALSE) {
+		if (gerror != NULL) {
+			g_printerr("%s\n", gerror->message);
+			g_error_free(gerror);
+		} else
+			g_printerr("An unknown error occurred\n");
+		exit(1);
+	}
+
+	g_option_context_free(context);
 
 	if (argc < 2) {
-		printf("Usage: dhcp-server-test <interface index>\n");
+		printf("Usage: dhcp-server-test [--clients COUNT] "
+						"<interface index>\n");
 		exit(0);
 	}
 
@@ -94,19 +505,56 @@ int main(int argc, char *argv[])
 		exit(0);
 	}
 
-	g_dhcp_server_set_debug(dhcp_server, dhcp_debug, "DHCP");
+	if (option_clients <= 0)
+		g_dhcp_server_set_debug(dhcp_server, dhcp_debug, "DHCP");
 
 	g_dhcp_server_set_lease_time(dhcp_server, 3600);
 	g_dhcp_server_set_option(dhcp_server, G_DHCP_SUBNET, "255.255.0.0");
 	g_dhcp_server_set_option(dhcp_server, G_DHCP_ROUTER, "192.168.0.2");
 	g_dhcp_server_set_option(dhcp_server, G_DHCP_DNS_SERVER, "192.168.0.3");
-	g_dhcp_server_set_ip_range(dhcp_server, "192.168.0.101",
+
+	if (option_start != NULL && option_end != NULL)
+		err = g_dhcp_server_set_ip_range(dhcp_server, option_start,
+								option_end);
+	else if (option_clients > 0)
+		err = g_dhcp_server_set_ip_range(dhcp_server, "192.168.0.1",
+							"192.168.255.254");
+	else
+		err = g_dhcp_server_set_ip_range(dhcp_server, "192.168.0.101",
 							"192.168.0.102");
+	if (err < 0) {
+		printf("Invalid address range: %s\n", strerror(-err));
+		exit(1);
+	}
+
+	if (option_lease_file != NULL)
+		g_dhcp_server_set_lease_file(dhcp_server, option_lease_file);
+
 	main_loop = g_main_loop_new(NULL, FALSE);
 
 	printf("Start DHCP Server operation\n");
 
-	g_dhcp_server_start(dhcp_server);
+	if (option_lease_file != NULL) {
+		GTimer *timer = g_timer_new();
+
+		g_dhcp_server_start(dhcp_server);
+
+		printf("Started with lease file in %.3f ms\n",
+					g_timer_elapsed(timer, NULL) * 1000);
+		g_timer_destroy(timer);
+	} else
+		g_dhcp_server_start(dhcp_server);
+
+	if (option_clients > 0) {
+		err = setup_load_test(index, option_clients);
+		if (err < 0) {
+			printf("Failed to set up load test: %s\n",
+							strerror(-err));
+			exit(1);
+		}
+
+		start_phase(FALSE);
+	}
 
 	memset(&sa, 0, sizeof(sa));
 	sa.sa_handler = sig_term;
@@ -115,6 +563,9 @@ int main(int argc, char *argv[])
 
 	g_main_loop_run(main_loop);
 
+	if (option_clients > 0)
+		cleanup_load_test();
+
 	g_dhcp_server_unref(dhcp_server);
 
 	g_main_loop_unref(main_loop);
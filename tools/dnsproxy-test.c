@@ -0,0 +1,382 @@
+/*
+ *
+ *  Connection Manager
+ *
+ *  Copyright (C) 2007-2010  Intel Corporation. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <glib.h>
+
+/*
+ * Simple load generator for the DNS proxy. It sends a burst of
+ * concurrent queries for distinct names to the proxy and measures
+ * how long it takes until all of them are answered.
+ *
+ * With --edns-check it instead asks for one name with an EDNS0 OPT
+ * record and then again without one, and checks that the cached
+ * answer to the second query carries no OPT record (RFC 6891).
+ */
+
+static gchar *option_server = NULL;
+static gchar *option_domain = NULL;
+static gint option_count = 0;
+static gint option_timeout = 10;
+static gboolean option_same = FALSE;
+static gboolean option_edns_check = FALSE;
+
+static GOptionEntry options[] = {
+	{ "server", 's', 0, G_OPTION_ARG_STRING, &option_server,
+				"Address of the DNS proxy", "ADDRESS" },
+	{ "domain", 'D', 0, G_OPTION_ARG_STRING, &option_domain,
+				"Domain to append to the queries", "DOMAIN" },
+	{ "count", 'n', 0, G_OPTION_ARG_INT, &option_count,
+				"Number of concurrent queries", "COUNT" },
+	{ "timeout", 't', 0, G_OPTION_ARG_INT, &option_timeout,
+				"Seconds to wait for replies", "SECONDS" },
+	{ "same", 'S', 0, G_OPTION_ARG_NONE, &option_same,
+				"Query the same name every time" },
+	{ "edns-check", 'E', 0, G_OPTION_ARG_NONE, &option_edns_check,
+			"Check that plain queries get no cached OPT record" },
+	{ NULL },
+};
+
+static int build_query(unsigned char *buf, int size, uint16_t id,
+					const char *name, gboolean edns)
+{
+	const char *label = name;
+	int len = 12;
+
+	memset(buf, 0, 12);
+	buf[0] = id >> 8;
+	buf[1] = id & 0xff;
+	buf[2] = 0x01;		/* RD */
+	buf[5] = 0x01;		/* QDCOUNT */
+
+	while (*label != '\0') {
+		const char *dot = strchr(label, '.');
+		int label_len = dot ? dot - label : (int) strlen(label);
+
+		if (len + label_len + 17 > size)
+			return -ENOBUFS;
+
+		buf[len++] = label_len;
+		memcpy(buf + len, label, label_len);
+		len += label_len;
+
+		if (dot == NULL)
+			break;
+
+		label = dot + 1;
+	}
+
+	buf[len++] = 0x00;
+	buf[len++] = 0x00;
+	buf[len++] = 0x01;	/* A */
+	buf[len++] = 0x00;
+	buf[len++] = 0x01;	/* IN */
+
+	if (edns == FALSE)
+		return len;
+
+	buf[11] = 0x01;		/* ARCOUNT */
+
+	buf[len++] = 0x00;	/* root */
+	buf[len++] = 0x00;
+	buf[len++] = 0x29;	/* OPT */
+	buf[len++] = 0x04;
+	buf[len++] = 0xd0;	/* 1232 bytes */
+	memset(buf + len, 0, 6);
+	len += 6;
+
+	return len;
+}
+
+static int skip_name(const unsigned char *buf, int len, int offset)
+{
+	while (offset < len) {
+		if ((buf[offset] & 0xc0) == 0xc0)
+			return offset + 2;
+
+		if (buf[offset] == 0x00)
+			return offset + 1;
+
+		offset += buf[offset] + 1;
+	}
+
+	return -EINVAL;
+}
+
+/* Returns 1 when the reply has an OPT record, 0 if not */
+static int reply_has_opt(const unsigned char *buf, int len)
+{
+	int i, count, offset;
+
+	if (len < 12)
+		return -EINVAL;
+
+	offset = skip_name(buf, len, 12);
+	if (offset < 0)
+		return -EINVAL;
+
+	offset += 4;
+
+	count = (buf[6] << 8 | buf[7]) + (buf[8] << 8 | buf[9]) +
+						(buf[10] << 8 | buf[11]);
+
+	for (i = 0; i < count; i++) {
+		offset = skip_name(buf, len, offset);
+		if (offset < 0 || offset + 10 > len)
+			return -EINVAL;
+
+		if ((buf[offset] << 8 | buf[offset + 1]) == 41)
+			return 1;
+
+		offset += 10 + (buf[offset + 8] << 8 | buf[offset + 9]);
+	}
+
+	return 0;
+}
+
+static int query_once(int sk, uint16_t id, const char *name,
+					gboolean edns, unsigned char *buf)
+{
+	struct pollfd pfd = { .fd = sk, .events = POLLIN };
+	int len;
+
+	len = build_query(buf, 512, id, name, edns);
+	if (len < 0 || send(sk, buf, len, 0) < 0)
+		return -EIO;
+
+	while (poll(&pfd, 1, option_timeout * 1000) > 0) {
+		len = recv(sk, buf, 4096, 0);
+		if (len >= 12 && (buf[0] << 8 | buf[1]) == id)
+			return len;
+	}
+
+	return -ETIMEDOUT;
+}
+
+static int edns_check(struct sockaddr_in *addr)
+{
+	unsigned char buf[4096];
+	char *name;
+	int sk, len, opt, err = 1;
+
+	sk = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (sk < 0) {
+		perror("Failed to create socket");
+		return 1;
+	}
+
+	if (connect(sk, (struct sockaddr *) addr, sizeof(*addr)) < 0) {
+		perror("Failed to connect socket");
+		close(sk);
+		return 1;
+	}
+
+	name = g_strdup_printf("dnsproxy-edns.%s", option_domain);
+
+	len = query_once(sk, 1, name, TRUE, buf);
+	if (len < 0) {
+		printf("no reply to the EDNS0 query: %s\n", strerror(-len));
+		goto done;
+	}
+
+	opt = reply_has_opt(buf, len);
+	printf("EDNS0 query: %d bytes, %s OPT record\n", len,
+					opt == 1 ? "with" : "without");
+
+	len = query_once(sk, 2, name, FALSE, buf);
+	if (len < 0) {
+		printf("no reply to the plain query: %s\n", strerror(-len));
+		goto done;
+	}
+
+	opt = reply_has_opt(buf, len);
+	if (opt < 0) {
+		printf("malformed reply to the plain query\n");
+		goto done;
+	}
+
+	printf("plain query: %d bytes, %s OPT record: %s\n", len,
+				opt == 1 ? "with" : "without",
+				opt == 1 ? "FAIL" : "PASS");
+
+	err = opt;
+
+done:
+	g_free(name);
+	close(sk);
+
+	return err;
+}
+
+static int run(struct sockaddr_in *addr, int count, unsigned int round)
+{
+	unsigned char buf[512];
+	unsigned char *answered;
+	GTimer *timer;
+	int sk, i, received = 0, bufsize = 1024 * 1024;
+
+	sk = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (sk < 0) {
+		perror("Failed to create socket");
+		return -errno;
+	}
+
+	setsockopt(sk, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+
+	if (connect(sk, (struct sockaddr *) addr, sizeof(*addr)) < 0) {
+		perror("Failed to connect socket");
+		close(sk);
+		return -errno;
+	}
+
+	answered = g_new0(unsigned char, count);
+
+	timer = g_timer_new();
+
+	for (i = 0; i < count; i++) {
+		char *name;
+		int len;
+
+		if (option_same == TRUE)
+			name = g_strdup_printf("dnsproxy-test.%s",
+								option_domain);
+		else
+			name = g_strdup_printf("q%u-%d.%s", round, i,
+								option_domain);
+
+		len = build_query(buf, sizeof(buf), i, name, FALSE);
+		g_free(name);
+
+		if (len < 0 || send(sk, buf, len, 0) < 0)
+			printf("failed to send query %d\n", i);
+	}
+
+	while (received < count) {
+		struct pollfd pfd = { .fd = sk, .events = POLLIN };
+		int remain, len;
+		uint16_t id;
+
+		remain = option_timeout * 1000 -
+				(int) (g_timer_elapsed(timer, NULL) * 1000);
+		if (remain <= 0)
+			break;
+
+		if (poll(&pfd, 1, remain) <= 0)
+			break;
+
+		len = recv(sk, buf, sizeof(buf), 0);
+		if (len < 12)
+			continue;
+
+		id = buf[0] << 8 | buf[1];
+		if (id >= count || answered[id] != 0)
+			continue;
+
+		answered[id] = 1;
+		received++;
+	}
+
+	printf("queries %6d answered %6d elapsed %8.3f ms "
+				"(%.1f queries/s)\n", count, received,
+				g_timer_elapsed(timer, NULL) * 1000,
+				received / g_timer_elapsed(timer, NULL));
+
+	g_timer_destroy(timer);
+	g_free(answered);
+	close(sk);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	struct sockaddr_in addr;
+	int counts[] = { 10, 100, 1000, 10000 };
+	unsigned int i;
+
+	context = g_option_context_new(NULL);
+	g_option_context_add_main_entries(context, options, NULL);
+
+	if (g_option_context_parse(context, &argc, &argv, &error) == FALSE) {
+		if (error != NULL) {
+			g_printerr("%s\n", error->message);
+			g_error_free(error);
+		} else
+			g_printerr("An unknown error occurred\n");
+		exit(1);
+	}
+
+	g_option_context_free(context);
+
+	if (option_domain == NULL)
+		option_domain = g_strdup("example.com");
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(53);
+
+	if (inet_pton(AF_INET, option_server ? option_server : "127.0.0.1",
+						&addr.sin_addr) != 1) {
+		printf("invalid server address\n");
+		return 1;
+	}
+
+	if (option_count > 0xffff) {
+		printf("at most %d concurrent queries\n", 0xffff);
+		return 1;
+	}
+
+	if (option_edns_check == TRUE) {
+		int err = edns_check(&addr);
+
+		g_free(option_server);
+		g_free(option_domain);
+
+		return err;
+	}
+
+	if (option_count > 0)
+		run(&addr, option_count, 0);
+	else {
+		for (i = 0; i < G_N_ELEMENTS(counts); i++)
+			run(&addr, counts[i], i);
+	}
+
+	g_free(option_server);
+	g_free(option_domain);
+
+	return 0;
+}
@@ -0,0 +1,362 @@
+/*
+ *
+ *  Connection Manager
+ *
+ *  Copyright (C) 2007-2010  Intel Corporation. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gweb/ghttp.h>
+
+/*
+ * Throughput and fuzz harness for the GWeb response header parser.
+ *
+ * The throughput run compares the in-place parser with the previous
+ * line by line GString and hash table approach. The fuzz run feeds
+ * mutated responses in random sized pieces and checks that the result
+ * does not depend on how the data was split.
+ */
+
+static const char *samples[] = {
+	"HTTP/1.1 200 OK\r\n"
+	"Date: Mon, 03 Oct 2011 10:00:00 GMT\r\n"
+	"Server: Apache\r\n"
+	"X-ConnMan-Status: online\r\n"
+	"X-ConnMan-Client-IP: 192.0.2.1\r\n"
+	"X-ConnMan-Client-Country: FI\r\n"
+	"X-ConnMan-Client-Region: 18\r\n"
+	"Content-Length: 0\r\n"
+	"Content-Type: text/html\r\n"
+	"\r\n",
+
+	"HTTP/1.1 302 Found\r\n"
+	"Date: Mon, 03 Oct 2011 10:00:00 GMT\r\n"
+	"Server: Microsoft-IIS/6.0\r\n"
+	"Location: https://portal.example.com/login?"
+			"url=http%3A%2F%2Fipv4.connman.net%2Fonline%2Fstatus.html\r\n"
+	"Cache-Control: no-cache, no-store, must-revalidate\r\n"
+	"Pragma: no-cache\r\n"
+	"Expires: -1\r\n"
+	"Set-Cookie: session=0123456789abcdef; path=/\r\n"
+	"Set-Cookie: lang=en; path=/\r\n"
+	"X-Powered-By: ASP.NET\r\n"
+	"Connection: close\r\n"
+	"Content-Type: text/html; charset=utf-8\r\n"
+	"Content-Length: 1234\r\n"
+	"\r\n"
+	"<html><body>Redirecting</body></html>",
+
+	"HTTP/1.0 200 OK\n"
+	"Server: folded\n"
+	"X-Long-Header: first part\n"
+	"  second part\n"
+	"\tthird part\n"
+	"transfer-encoding: chunked\n"
+	"\n",
+};
+
+static const char *lookups[] = {
+	"Location", "X-ConnMan-Status", "Content-Length", "Set-Cookie",
+	"Transfer-Encoding", "X-Long-Header", "Connection", "Missing",
+};
+
+static gint option_iterations = 100000;
+static gint option_fuzz = 0;
+static gint option_seed = 0;
+
+static GOptionEntry options[] = {
+	{ "iterations", 'n', 0, G_OPTION_ARG_INT, &option_iterations,
+				"Number of responses to parse", "COUNT" },
+	{ "fuzz", 'f', 0, G_OPTION_ARG_INT, &option_fuzz,
+				"Run COUNT fuzz iterations instead", "COUNT" },
+	{ "seed", 's', 0, G_OPTION_ARG_INT, &option_seed,
+				"Random seed for fuzzing", "SEED" },
+	{ NULL },
+};
+
+/* The previous parser, kept here as the baseline */
+static guint16 legacy_parse(const char *data, gsize len)
+{
+	GHashTable *headers;
+	GString *line;
+	char *last_key = NULL;
+	guint16 status = 0;
+	const char *ptr = data;
+
+	headers = g_hash_table_new_full(g_str_hash, g_str_equal,
+							g_free, g_free);
+	line = g_string_sized_new(0);
+
+	while (len > 0) {
+		const char *pos = memchr(ptr, '\n', len);
+		gsize count;
+		char *str, *colon;
+
+		if (pos == NULL)
+			break;
+
+		count = pos - ptr;
+
+		g_string_append_len(line, ptr, count);
+		if (line->len > 0 && line->str[line->len - 1] == '\r')
+			g_string_truncate(line, line->len - 1);
+
+		len -= pos - ptr + 1;
+		ptr = pos + 1;
+
+		if (line->len == 0)
+			break;
+
+		str = line->str;
+
+		if (status == 0) {
+			unsigned int code;
+
+			if (sscanf(str, "HTTP/%*s %u %*s", &code) == 1)
+				status = code;
+		}
+
+		colon = strchr(str, ':');
+		if ((str[0] == ' ' || str[0] == '\t') && last_key != NULL) {
+			const char *value = g_hash_table_lookup(headers,
+								last_key);
+
+			g_hash_table_replace(headers, g_strdup(last_key),
+					g_strconcat(value ? value : "", " ",
+							g_strstrip(str), NULL));
+		} else if (colon != NULL) {
+			*colon = '\0';
+
+			g_free(last_key);
+			last_key = g_strdup(str);
+
+			g_hash_table_replace(headers, g_strdup(str),
+						g_strdup(g_strchug(colon + 1)));
+		}
+
+		g_string_truncate(line, 0);
+	}
+
+	g_free(last_key);
+	g_string_free(line, TRUE);
+	g_hash_table_destroy(headers);
+
+	return status;
+}
+
+/* Feeds the data in pieces of at most piece bytes, 0 meaning random */
+static GHttpParser *feed(const char *data, gsize len, gsize piece,
+								int *result)
+{
+	GHttpParser *parser;
+
+	parser = g_http_parser_new();
+	if (parser == NULL)
+		return NULL;
+
+	*result = 0;
+
+	while (len > 0 && *result == 0) {
+		guint8 *buf;
+		gsize space, count;
+
+		buf = g_http_parser_get_space(parser, &space);
+		if (buf == NULL) {
+			*result = -ENOBUFS;
+			break;
+		}
+
+		count = piece > 0 ? piece : (gsize) g_random_int_range(1, 64);
+		if (count > len)
+			count = len;
+		if (count > space)
+			count = space;
+
+		memcpy(buf, data, count);
+		*result = g_http_parser_commit(parser, count);
+
+		data += count;
+		len -= count;
+	}
+
+	return parser;
+}
+
+static void run_throughput(void)
+{
+	GTimer *timer;
+	gdouble legacy, current;
+	gsize bytes = 0;
+	guint i, n;
+	int result;
+
+	for (n = 0; n < G_N_ELEMENTS(samples); n++)
+		bytes += strlen(samples[n]);
+
+	timer = g_timer_new();
+
+	for (i = 0; i < (guint) option_iterations; i++)
+		for (n = 0; n < G_N_ELEMENTS(samples); n++)
+			legacy_parse(samples[n], strlen(samples[n]));
+
+	legacy = g_timer_elapsed(timer, NULL);
+
+	g_timer_start(timer);
+
+	for (i = 0; i < (guint) option_iterations; i++) {
+		for (n = 0; n < G_N_ELEMENTS(samples); n++) {
+			GHttpParser *parser;
+
+			parser = feed(samples[n], strlen(samples[n]),
+							G_MAXSIZE, &result);
+			g_http_parser_get_header(parser, "Location");
+			g_http_parser_free(parser);
+		}
+	}
+
+	current = g_timer_elapsed(timer, NULL);
+
+	g_timer_destroy(timer);
+
+	n = G_N_ELEMENTS(samples);
+
+	printf("legacy  %8.3f us/response %8.1f MB/s\n",
+			legacy * 1000000 / option_iterations / n,
+			bytes * option_iterations / legacy / 1000000);
+	printf("inplace %8.3f us/response %8.1f MB/s\n",
+			current * 1000000 / option_iterations / n,
+			bytes * option_iterations / current / 1000000);
+}
+
+static void mutate(GString *str)
+{
+	static const char noise[] = "\r\n: \t\x80\0Ab";
+	int i, count = g_random_int_range(0, 8);
+
+	for (i = 0; i < count && str->len > 0; i++) {
+		gsize pos = g_random_int_range(0, str->len);
+
+		switch (g_random_int_range(0, 4)) {
+		case 0:
+			str->str[pos] = noise[g_random_int_range(0,
+							sizeof(noise))];
+			break;
+		case 1:
+			g_string_insert_c(str, pos, noise[g_random_int_range(0,
+							sizeof(noise))]);
+			break;
+		case 2:
+			g_string_erase(str, pos, 1);
+			break;
+		case 3:
+			g_string_truncate(str, pos);
+			break;
+		}
+	}
+}
+
+static int run_fuzz(void)
+{
+	int i;
+
+	if (option_seed != 0)
+		g_random_set_seed(option_seed);
+
+	for (i = 0; i < option_fuzz; i++) {
+		GHttpParser *whole, *split;
+		GString *str;
+		int res1, res2;
+		guint n;
+
+		n = g_random_int_range(0, G_N_ELEMENTS(samples));
+		str = g_string_new(samples[n]);
+		mutate(str);
+
+		whole = feed(str->str, str->len, G_MAXSIZE, &res1);
+		split = feed(str->str, str->len, 0, &res2);
+
+		if (res1 != res2 || g_http_parser_get_status(whole) !=
+					g_http_parser_get_status(split)) {
+			printf("iteration %d: result %d/%d status %u/%u\n",
+					i, res1, res2,
+					g_http_parser_get_status(whole),
+					g_http_parser_get_status(split));
+			return 1;
+		}
+
+		for (n = 0; n < G_N_ELEMENTS(lookups); n++) {
+			const char *v1, *v2;
+
+			v1 = g_http_parser_get_header(whole, lookups[n]);
+			v2 = g_http_parser_get_header(split, lookups[n]);
+
+			if (g_strcmp0(v1, v2) != 0) {
+				printf("iteration %d: %s \"%s\" != \"%s\"\n",
+							i, lookups[n], v1, v2);
+				return 1;
+			}
+		}
+
+		g_http_parser_free(whole);
+		g_http_parser_free(split);
+		g_string_free(str, TRUE);
+	}
+
+	printf("%d fuzz iterations passed\n", option_fuzz);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	GOptionContext *context;
+	GError *error = NULL;
+
+	context = g_option_context_new(NULL);
+	g_option_context_add_main_entries(context, options, NULL);
+
+	if (g_option_context_parse(context, &argc, &argv, &error) == FALSE) {
+		if (error != NULL) {
+			g_printerr("%s\n", error->message);
+			g_error_free(error);
+		} else
+			g_printerr("An unknown error occurred\n");
+		return 1;
+	}
+
+	g_option_context_free(context);
+
+	if (option_fuzz > 0)
+		return run_fuzz();
+
+	if (option_iterations <= 0) {
+		printf("invalid number of iterations\n");
+		return 1;
+	}
+
+	run_throughput();
+
+	return 0;
+}
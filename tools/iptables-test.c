@@ -18,1210 +18,194 @@
  *
  */
 
-#include <getopt.h>
-#include <stdlib.h>
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
-#include <sys/errno.h>
-#include <sys/socket.h>
-#include <xtables.h>
-
-#include <linux/netfilter_ipv4/ip_tables.h>
 
 #include <glib.h>
 
-static const char *hooknames[] = {
-	[NF_IP_PRE_ROUTING]	= "PREROUTING",
-	[NF_IP_LOCAL_IN]	= "INPUT",
-	[NF_IP_FORWARD]		= "FORWARD",
-	[NF_IP_LOCAL_OUT]	= "OUTPUT",
-	[NF_IP_POST_ROUTING]	= "POSTROUTING",
-};
-
-#define LABEL_ACCEPT  "ACCEPT"
-#define LABEL_DROP    "DROP"
-#define LABEL_QUEUE   "QUEUE"
-#define LABEL_RETURN  "RETURN"
-
-/* fn returns 0 to continue iteration */
-#define _XT_ENTRY_ITERATE_CONTINUE(type, entries, size, n, fn, args...) \
-({								\
-	unsigned int __i;					\
-	int __n;						\
-	int __ret = 0;						\
-	type *__entry;						\
-								\
-	for (__i = 0, __n = 0; __i < (size);			\
-	     __i += __entry->next_offset, __n++) { 		\
-		__entry = (void *)(entries) + __i;		\
-		if (__n < n)					\
-			continue;				\
-								\
-		__ret = fn(__entry,  ## args);			\
-		if (__ret != 0)					\
-			break;					\
-	}							\
-	__ret;							\
-})
-
-/* fn returns 0 to continue iteration */
-#define _XT_ENTRY_ITERATE(type, entries, size, fn, args...) \
-	_XT_ENTRY_ITERATE_CONTINUE(type, entries, size, 0, fn, args)
-
-#define ENTRY_ITERATE(entries, size, fn, args...) \
-	_XT_ENTRY_ITERATE(struct ipt_entry, entries, size, fn, ## args)
-
-#define MIN_ALIGN (__alignof__(struct ipt_entry))
-
-#define ALIGN(s) (((s) + ((MIN_ALIGN)-1)) & ~((MIN_ALIGN)-1))
-
-struct error_target {
-	struct xt_entry_target t;
-	char error[IPT_TABLE_MAXNAMELEN];
-};
-
-struct connman_iptables_entry {
-	int offset;
-	int builtin;
-
-	struct ipt_entry *entry;
-};
-
-struct connman_iptables {
-	int ipt_sock;
-
-	struct ipt_getinfo *info;
-	struct ipt_get_entries *blob_entries;
-
-	unsigned int num_entries;
-	unsigned int old_entries;
-	unsigned int size;
-
-	unsigned int underflow[NF_INET_NUMHOOKS];
-	unsigned int hook_entry[NF_INET_NUMHOOKS];
-
-	GList *entries;
-};
-
-
-static struct ipt_entry *get_entry(struct connman_iptables *table,
-					unsigned int offset)
-{
-	return (struct ipt_entry *)((char *)table->blob_entries->entrytable +
-									offset);
-}
-
-static int is_hook_entry(struct connman_iptables *table,
-				struct ipt_entry *entry)
-{
-	unsigned int i;
-
-	for (i = 0; i < NF_INET_NUMHOOKS; i++) {
-		if ((table->info->valid_hooks & (1 << i))
-		&& get_entry(table, table->info->hook_entry[i]) == entry)
-			return i;
-	}
-
-	return -1;
-}
-
-static unsigned long entry_to_offset(struct connman_iptables *table,
-					struct ipt_entry *entry)
-{
-	return (void *)entry - (void *)table->blob_entries->entrytable;
-}
-
-static int target_to_verdict(char *target_name)
-{
-	if (!strcmp(target_name, LABEL_ACCEPT))
-		return -NF_ACCEPT - 1;
-
-	if (!strcmp(target_name, LABEL_DROP))
-		return -NF_DROP - 1;
-
-	if (!strcmp(target_name, LABEL_QUEUE))
-		return -NF_QUEUE - 1;
-
-	if (!strcmp(target_name, LABEL_RETURN))
-		return XT_RETURN;
-
-	return 0;
-}
-
-static gboolean is_builtin_target(char *target_name)
-{
-	if (!strcmp(target_name, LABEL_ACCEPT) ||
-		!strcmp(target_name, LABEL_DROP) ||
-		!strcmp(target_name, LABEL_QUEUE) ||
-		!strcmp(target_name, LABEL_RETURN))
-		return TRUE;
-
-	return FALSE;
-}
-
-static gboolean is_jump(struct connman_iptables_entry *e)
-{
-	struct xt_entry_target *target;
-
-	target = ipt_get_target(e->entry);
-
-	if (!strcmp(target->u.user.name, IPT_STANDARD_TARGET)) {
-		struct xt_standard_target *t;
-
-		t = (struct xt_standard_target *)target;
-
-		switch (t->verdict) {
-		case XT_RETURN:
-		case -NF_ACCEPT - 1:
-		case -NF_DROP - 1:
-		case -NF_QUEUE - 1:
-		case -NF_STOP - 1:
-			return false;
-
-		default:
-			return true;
-		}
-	}
-
-	return false;
-}
-
-static gboolean is_chain(struct connman_iptables *table,
-				struct connman_iptables_entry *e)
-{
-	struct ipt_entry *entry;
-	struct xt_entry_target *target;
+#include "../src/connman.h"
 
-	entry = e->entry;
-	if (e->builtin >= 0)
-		return TRUE;
+/*
+ * Front-end for the iptables code of the daemon. The arguments are
+ * handled like one iptables command (-A, -F, -N, -X or -L with -t,
+ * -i, -o, -s, -d, -m and -j) and the table is committed afterwards.
+ *
+ * With --bench COUNT a scratch chain in the filter table is filled
+ * with per-client rules, once committing after every rule and once
+ * as a single transaction, for growing numbers of rules.
+ */
 
-	target = ipt_get_target(entry);
-	if (!strcmp(target->u.user.name, IPT_ERROR_TARGET))
-		return TRUE;
+#define BENCH_CHAIN	"connman-bench"
 
-	return FALSE;
-}
-
-static GList *find_chain_head(struct connman_iptables *table,
-				char *chain_name)
+static int bench_chain(enum connman_iptables_operation operation)
 {
-	GList *list;
-	struct connman_iptables_entry *head;
-	struct ipt_entry *entry;
-	struct xt_entry_target *target;
-	int builtin;
-
-	for (list = table->entries; list; list = list->next) {
-		head = list->data;
-		entry = head->entry;
+	struct connman_iptables_rule rule;
 
-		/* Buit-in chain */
-		builtin = head->builtin;
-		if (builtin >= 0 && !strcmp(hooknames[builtin], chain_name))
-			break;
-
-		/* User defined chain */
-		target = ipt_get_target(entry);
-		if (!strcmp(target->u.user.name, IPT_ERROR_TARGET) &&
-		    !strcmp((char *)target->data, chain_name))
-			break;
-	}
+	memset(&rule, 0, sizeof(rule));
+	rule.operation = operation;
+	rule.chain = BENCH_CHAIN;
 
-	return list;
+	return __connman_iptables_apply("filter", &rule, 1);
 }
 
-static GList *find_chain_tail(struct connman_iptables *table,
-				char *chain_name)
+static double bench_commands(int count)
 {
-	GList *chain_head, *list;
-	struct connman_iptables_entry *head, *tail;
-	struct ipt_entry *entry;
-	struct xt_entry_target *target;
-	int builtin;
+	GTimer *timer;
+	double elapsed;
+	int i, err;
 
-	/* First we look for the head */
-	for (list = table->entries; list; list = list->next) {
-		head = list->data;
-		entry = head->entry;
+	timer = g_timer_new();
 
-		/* Buit-in chain */
-		builtin = head->builtin;
-		if (builtin >= 0 && !strcmp(hooknames[builtin], chain_name))
-			break;
+	for (i = 0; i < count; i++) {
+		err = __connman_iptables_command("-t filter -A " BENCH_CHAIN
+				" -s 10.%d.%d.%d -j ACCEPT",
+				(i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+		if (err == 0)
+			err = __connman_iptables_commit("filter");
 
-		/* User defined chain */
-		target = ipt_get_target(entry);
-		if (!strcmp(target->u.user.name, IPT_ERROR_TARGET) &&
-		    !strcmp((char *)target->data, chain_name))
+		if (err < 0) {
+			printf("rule %d failed: %s\n", i, strerror(-err));
 			break;
-	}
-
-	if (list == NULL)
-		return NULL;
-
-	chain_head = list;
-
-	/* Then we look for the next chain */
-	for (list = chain_head->next; list; list = list->next) {
-		tail = list->data;
-		entry = tail->entry;
-
-		if (is_chain(table, tail))
-			return list;
-	}
-
-	/* Nothing found, we return the table end */
-	return g_list_last(table->entries);
-}
-
-static void update_offsets(struct connman_iptables *table)
-{
-	GList *list, *prev;
-	struct connman_iptables_entry *entry, *prev_entry;
-
-	for (list = table->entries; list; list = list->next) {
-		entry = list->data;
-
-		if (list == table->entries) {
-			entry->offset = 0;
-
-			continue;
-		}
-
-		prev = list->prev;
-		prev_entry = prev->data;
-
-		entry->offset = prev_entry->offset +
-					prev_entry->entry->next_offset;
-	}
-}
-
-static int connman_add_entry(struct connman_iptables *table,
-				struct ipt_entry *entry, GList *before,
-					int builtin)
-{
-	GList *list;
-	struct connman_iptables_entry *e, *tmp, *entry_before;
-	struct xt_standard_target *t;
-
-	if (table == NULL)
-		return -1;
-
-	e = g_try_malloc0(sizeof(struct connman_iptables_entry));
-	if (e == NULL)
-		return -1;
-
-	e->entry = entry;
-	e->builtin = builtin;
-
-	table->entries = g_list_insert_before(table->entries, before, e);
-	table->num_entries++;
-	table->size += entry->next_offset;
-
-	if (before == NULL) {
-		e->offset = table->size - entry->next_offset;
-
-		return 0;
-	}
-
-	entry_before = before->data;
-
-	/*
-	 * We've just insterted a new entry. All references before it
-	 * should be bumped accordingly.
-	 */
-	for (list = table->entries; list != before; list = list->next) {
-		tmp = list->data;
-
-		if (!is_jump(tmp))
-			continue;
-
-		t = (struct xt_standard_target *)ipt_get_target(tmp->entry);
-
-		if (t->verdict >= entry_before->offset)
-			t->verdict += entry->next_offset;
-	}
-
-	update_offsets(table);
-
-	return 0;
-}
-
-static int connman_iptables_flush_chain(struct connman_iptables *table,
-						char *name)
-{
-	GList *chain_head, *chain_tail, *list, *next;
-	struct connman_iptables_entry *entry;
-	int builtin, removed = 0;
-
-	chain_head = find_chain_head(table, name);
-	if (chain_head == NULL)
-		return -EINVAL;
-
-	chain_tail = find_chain_tail(table, name);
-	if (chain_tail == NULL)
-		return -EINVAL;
-
-	entry = chain_head->data;
-	builtin = entry->builtin;
-
-	if (builtin >= 0)
-		list = chain_head;
-	else
-		list = chain_head->next;
-
-	if (list == chain_tail->prev)
-		return 0;
-
-	while (list != chain_tail->prev) {
-		entry = list->data;
-		next = g_list_next(list);
-
-		table->num_entries--;
-		table->size -= entry->entry->next_offset;
-		removed += entry->entry->next_offset;
-
-		table->entries = g_list_remove(table->entries, list->data);
-
-		list = next;
-	}
-
-	if (builtin >= 0) {
-		struct connman_iptables_entry *e;
-
-		entry = list->data;
-
-		entry->builtin = builtin;
-
-		table->underflow[builtin] -= removed;
-
-		for (list = chain_tail; list; list = list->next) {
-			e = list->data;
-
-			builtin = e->builtin;
-			if (builtin < 0)
-				continue;
-
-			table->hook_entry[builtin] -= removed;
-			table->underflow[builtin] -= removed;
 		}
 	}
 
-	update_offsets(table);
-
-	return 0;
-}
-
-static int connman_iptables_delete_chain(struct connman_iptables *table,
-						char *name)
-{
-	GList *chain_head, *chain_tail, *list, *next;
-	struct connman_iptables_entry *entry;
-
-	chain_head = find_chain_head(table, name);
-	if (chain_head == NULL)
-		return -EINVAL;
-
-	chain_tail = find_chain_tail(table, name);
-	if (chain_tail == NULL)
-		return -EINVAL;
-
-	list = chain_head;
-
-	while (list != chain_tail) {
-		entry = list->data;
-		next = g_list_next(list);
-
-		table->num_entries--;
-		table->size -= entry->entry->next_offset;
-
-		table->entries = g_list_remove(table->entries, list->data);
-
-		list = next;
-	}
-
-	update_offsets(table);
-
-	return 0;
-}
-
-static int connman_iptables_add_chain(struct connman_iptables *table,
-					char *name)
-{
-	GList *last;
-	struct ipt_entry *entry_head;
-	struct ipt_entry *entry_return;
-	struct error_target *error;
-	struct ipt_standard_target *standard;
-	u_int16_t entry_head_size, entry_return_size;
-
-	last = g_list_last(table->entries);
-
-	/*
-	 * An empty chain is composed of:
-	 * - A head entry, with no match and an error target.
-	 *   The error target data is the chain name.
-	 * - A tail entry, with no match and a standard target.
-	 *   The standard target verdict is XT_RETURN (return to the
-	 *   caller).
-	 */
-
-	/* head entry */
-	entry_head_size = sizeof(struct ipt_entry) +
-				sizeof(struct error_target);
-	entry_head = g_try_malloc0(entry_head_size);
-	if (entry_head == NULL)
-		goto err_head;
-
-	memset(entry_head, 0, entry_head_size);
-
-	entry_head->target_offset = sizeof(struct ipt_entry);
-	entry_head->next_offset = entry_head_size;
-
-	error = (struct error_target *) entry_head->elems;
-	strcpy(error->t.u.user.name, IPT_ERROR_TARGET);
-	error->t.u.user.target_size = ALIGN(sizeof(struct error_target));
-	strcpy(error->error, name);
-
-	if (connman_add_entry(table, entry_head, last, -1) < 0)
-		goto err_head;
-
-	/* tail entry */
-	entry_return_size = sizeof(struct ipt_entry) +
-				sizeof(struct ipt_standard_target);
-	entry_return = g_try_malloc0(entry_return_size);
-	if (entry_return == NULL)
-		goto err;
-
-	memset(entry_return, 0, entry_return_size);
-
-	entry_return->target_offset = sizeof(struct ipt_entry);
-	entry_return->next_offset = entry_return_size;
-
-	standard = (struct ipt_standard_target *) entry_return->elems;
-	standard->target.u.user.target_size =
-				ALIGN(sizeof(struct ipt_standard_target));
-	standard->verdict = XT_RETURN;
+	elapsed = g_timer_elapsed(timer, NULL);
 
-	if (connman_add_entry(table, entry_return, last, -1) < 0)
-		goto err;
+	g_timer_destroy(timer);
 
-	return 0;
-
-err:
-	g_free(entry_return);
-err_head:
-	g_free(entry_head);
-
-	return -ENOMEM;
+	return elapsed;
 }
 
-static struct ipt_entry *
-new_rule(struct connman_iptables *table,
-		char *target_name, struct xtables_target *xt_t,
-		char *match_name, struct xtables_match *xt_m)
+static double bench_apply(int count)
 {
-	struct ipt_entry *new_entry;
-	size_t match_size, target_size;
-	int is_builtin = is_builtin_target(target_name);
+	struct connman_iptables_rule *rules;
+	char **sources;
+	GTimer *timer;
+	double elapsed;
+	int i, err;
 
-	if (xt_m)
-		match_size = xt_m->m->u.match_size;
-	else
-		match_size = 0;
+	rules = g_new0(struct connman_iptables_rule, count);
+	sources = g_new0(char *, count + 1);
 
-	if (xt_t)
-		target_size = ALIGN(xt_t->t->u.target_size);
-	else
-		target_size = ALIGN(sizeof(struct xt_standard_target));
+	for (i = 0; i < count; i++) {
+		sources[i] = g_strdup_printf("10.%d.%d.%d", (i >> 16) & 0xff,
+						(i >> 8) & 0xff, i & 0xff);
 
-	new_entry = g_try_malloc0(sizeof(struct ipt_entry) + target_size +
-								match_size);
-	if (new_entry == NULL)
-		return NULL;
-
-	new_entry->target_offset = sizeof(struct ipt_entry) + match_size;
-	new_entry->next_offset = sizeof(struct ipt_entry) + target_size +
-								match_size;
-	if (xt_m) {
-		struct xt_entry_match *entry_match;
-
-		entry_match = (struct xt_entry_match *)new_entry->elems;
-		memcpy(entry_match, xt_m->m, match_size);
+		rules[i].operation = CONNMAN_IPTABLES_APPEND;
+		rules[i].chain = BENCH_CHAIN;
+		rules[i].source = sources[i];
+		rules[i].target = "ACCEPT";
 	}
 
-	if (xt_t) {
-		struct xt_entry_target *entry_target;
+	timer = g_timer_new();
 
-		if (is_builtin) {
-			struct xt_standard_target *target;
+	err = __connman_iptables_apply("filter", rules, count);
 
-			target = (struct xt_standard_target *)(xt_t->t);
-			strcpy(target->target.u.user.name, IPT_STANDARD_TARGET);
-			target->verdict = target_to_verdict(target_name);
-		}
+	elapsed = g_timer_elapsed(timer, NULL);
 
-		entry_target = ipt_get_target(new_entry);
-		memcpy(entry_target, xt_t->t, target_size);
-	} else {
-		struct connman_iptables_entry *target_rule;
-		struct xt_standard_target *target;
-		GList *chain_head;
+	if (err < 0)
+		printf("transaction failed: %s\n", strerror(-err));
 
-		/*
-		 * This is a user defined target, i.e. a chain jump.
-		 * We search for the chain head, and the target verdict
-		 * is the first rule's offset on this chain.
-		 * The offset is from the beginning of the table.
-		 */
-
-		chain_head = find_chain_head(table, target_name);
-		if (chain_head == NULL || chain_head->next == NULL) {
-			g_free(new_entry);
-			return NULL;
-		}
-
-		target_rule = chain_head->next->data;
-
-		target = (struct xt_standard_target *)ipt_get_target(new_entry);
-		strcpy(target->target.u.user.name, IPT_STANDARD_TARGET);
-		target->target.u.user.target_size = target_size;
-		target->verdict = target_rule->offset;
-	}
+	g_timer_destroy(timer);
+	g_strfreev(sources);
+	g_free(rules);
 
-	return new_entry;
+	return elapsed;
 }
 
-static void update_hooks(struct connman_iptables *table, GList *chain_head, struct ipt_entry *entry)
+static int run_bench(int count)
 {
-	GList *list;
-	struct connman_iptables_entry *head, *e;
-	int builtin;
+	int n, err;
 
-	if (chain_head == NULL)
-		return;
-
-	head = chain_head->data;
-
-	builtin = head->builtin;
-	if (builtin < 0)
-		return;
-
-	table->underflow[builtin] += entry->next_offset;
-
-	for (list = chain_head->next; list; list = list->next) {
-		e = list->data;
-
-		builtin = e->builtin;
-		if (builtin < 0)
-			continue;
-
-		table->hook_entry[builtin] += entry->next_offset;
-		table->underflow[builtin] += entry->next_offset;
+	err = bench_chain(CONNMAN_IPTABLES_NEW_CHAIN);
+	if (err < 0) {
+		printf("failed to create chain %s: %s\n", BENCH_CHAIN,
+							strerror(-err));
+		return 1;
 	}
-}
-
-static int
-connman_iptables_add_rule(struct connman_iptables *table, char *chain_name,
-				char *target_name, struct xtables_target *xt_t,
-				char *match_name, struct xtables_match *xt_m)
-{
-	GList *chain_tail, *chain_head;
-	struct ipt_entry *new_entry;
-	struct connman_iptables_entry *head;
-	int builtin = -1;
 
-	chain_head = find_chain_head(table, chain_name);
-	if (chain_head == NULL)
-		return -EINVAL;
+	for (n = count / 8 > 0 ? count / 8 : count; n <= count; n *= 2) {
+		double commands, apply;
 
-	chain_tail = find_chain_tail(table, chain_name);
-	if (chain_tail == NULL)
-		return -EINVAL;
+		commands = bench_commands(n);
+		bench_chain(CONNMAN_IPTABLES_FLUSH);
 
-	new_entry = new_rule(table,
-				target_name, xt_t,
-				match_name, xt_m);
-	if (new_entry == NULL)
-		return -EINVAL;
+		apply = bench_apply(n);
+		bench_chain(CONNMAN_IPTABLES_FLUSH);
 
-	update_hooks(table, chain_head, new_entry);
-
-	/*
-	 * If the chain is builtin, and does not have any rule,
-	 * then the one that we're inserting is becoming the head
-	 * and thus needs the builtin flag.
-	 */
-	head = chain_head->data;
-	if (head->builtin < 0)
-		builtin = -1;
-	else if (chain_head == chain_tail->prev) {
-		builtin = head->builtin;
-		head->builtin = -1;
+		printf("rules %6d  commit each %9.3f ms (%7.1f us/rule)  "
+				"transaction %9.3f ms (%7.1f us/rule)\n", n,
+				commands * 1000, commands * 1000000 / n,
+				apply * 1000, apply * 1000000 / n);
 	}
 
-	return connman_add_entry(table, new_entry, chain_tail->prev, builtin);
-}
+	bench_chain(CONNMAN_IPTABLES_DELETE_CHAIN);
 
-static struct ipt_replace *
-connman_iptables_blob(struct connman_iptables *table)
-{
-	struct ipt_replace *r;
-	GList *list;
-	struct connman_iptables_entry *e;
-	unsigned char *entry_index;
-
-	r = g_try_malloc0(sizeof(struct ipt_replace) + table->size);
-	if (r == NULL)
-		return NULL;
-
-	memset(r, 0, sizeof(*r) + table->size);
-
-	r->counters = g_try_malloc0(sizeof(struct xt_counters)
-				* table->old_entries);
-	if (r->counters == NULL) {
-		g_free(r);
-		return NULL;
-	}
-
-	strcpy(r->name, table->info->name);
-	r->num_entries = table->num_entries;
-	r->size = table->size;
-
-	r->num_counters = table->old_entries;
-	r->valid_hooks  = table->info->valid_hooks;
-
-	memcpy(r->hook_entry, table->hook_entry, sizeof(table->hook_entry));
-	memcpy(r->underflow, table->underflow, sizeof(table->underflow));
-
-	entry_index = (unsigned char *)r->entries;
-	for (list = table->entries; list; list = list->next) {
-		e = list->data;
-
-		memcpy(entry_index, e->entry, e->entry->next_offset);
-		entry_index += e->entry->next_offset;
-	}
-
-	return r;
-}
-
-static void dump_target(struct connman_iptables *table,
-				struct ipt_entry *entry)
-
-{
-	struct xtables_target *xt_t;
-	struct xt_entry_target *target;
-
-	target = ipt_get_target(entry);
-
-	if (!strcmp(target->u.user.name, IPT_STANDARD_TARGET)) {
-		struct xt_standard_target *t;
-
-		t = (struct xt_standard_target *)target;
-
-		switch (t->verdict) {
-		case XT_RETURN:
-			printf("\ttarget RETURN\n");
-			break;
-
-		case -NF_ACCEPT - 1:
-			printf("\ttarget ACCEPT\n");
-			break;
-
-		case -NF_DROP - 1:
-			printf("\ttarget DROP\n");
-			break;
-
-		case -NF_QUEUE - 1:
-			printf("\ttarget QUEUE\n");
-			break;
-
-		case -NF_STOP - 1:
-			printf("\ttarget STOP\n");
-			break;
-
-		default:
-			printf("\tJUMP @%p (0x%x)\n",
-				(char*)table->blob_entries->entrytable +
-				t->verdict, t->verdict);
-			break;
-		}
-
-		xt_t = xtables_find_target(IPT_STANDARD_TARGET,
-						XTF_LOAD_MUST_SUCCEED);
-
-		if(xt_t->print != NULL)
-			xt_t->print(NULL, target, 1);
-	} else {
-		xt_t = xtables_find_target(target->u.user.name, XTF_TRY_LOAD);
-		if (xt_t == NULL) {
-			printf("\ttarget %s\n", target->u.user.name);
-			return;
-		}
-
-		if(xt_t->print != NULL) {
-			printf("\ttarget ");
-			xt_t->print(NULL, target, 1);
-			printf("\n");
-		}
-	}
+	return 0;
 }
 
-static void dump_match(struct connman_iptables *table, struct ipt_entry *entry)
+static int run_command(int argc, char *argv[])
 {
-	struct xtables_match *xt_m;
-	struct xt_entry_match *match;
-
-	if (entry->elems == (unsigned char *)entry + entry->target_offset)
-		return;
-
-	match = (struct xt_entry_match *) entry->elems;
-
-	if (!strlen(match->u.user.name))
-		return;
-
-	xt_m = xtables_find_match(match->u.user.name, XTF_TRY_LOAD, NULL);
-	if (xt_m == NULL)
-		goto out;
-
-	if(xt_m->print != NULL) {
-		printf("\tmatch ");
-		xt_m->print(NULL, match, 1);
-		printf("\n");
+	const char *table_name = "filter";
+	gboolean dump = FALSE;
+	char *command;
+	int i, err;
 
-		return;
+	for (i = 1; i < argc; i++) {
+		if (g_str_equal(argv[i], "-L") == TRUE)
+			dump = TRUE;
+		else if (g_str_equal(argv[i], "-t") == TRUE && i + 1 < argc)
+			table_name = argv[i + 1];
 	}
 
-out:
-	printf("\tmatch %s\n", match->u.user.name);
+	command = g_strjoinv(" ", argv + 1);
 
-}
-
-static int connman_iptables_dump_entry(struct ipt_entry *entry,
-					struct connman_iptables *table)
-{
-	struct xt_entry_target *target;
-	unsigned int offset;
-	int builtin;
-
-	offset = (char *)entry - (char *)table->blob_entries->entrytable;
-	target = ipt_get_target(entry);
-	builtin = is_hook_entry(table, entry);
-
-	if (entry_to_offset(table, entry) + entry->next_offset ==
-					table->blob_entries->size) {
-		printf("End of CHAIN 0x%x\n", offset);
-		return 0;
-	}
+	err = __connman_iptables_command("%s", command);
+	if (err == 0 && dump == FALSE)
+		err = __connman_iptables_commit(table_name);
 
-	if (!strcmp(target->u.user.name, IPT_ERROR_TARGET)) {
-		printf("USER CHAIN (%s) %p  match %p  target %p  size %d\n",
-			target->data, entry, entry->elems,
-			(char *)entry + entry->target_offset,
-				entry->next_offset);
+	g_free(command);
 
-		return 0;
-	} else if (builtin >= 0) {
-		printf("CHAIN (%s) %p  match %p  target %p  size %d\n",
-			hooknames[builtin], entry, entry->elems,
-			(char *)entry + entry->target_offset,
-				entry->next_offset);
-	} else {
-		printf("RULE %p  match %p  target %p  size %d\n", entry,
-			entry->elems,
-			(char *)entry + entry->target_offset,
-				entry->next_offset);
+	if (err < 0) {
+		printf("%s\n", strerror(-err));
+		return 1;
 	}
 
-	dump_match(table, entry);
-	dump_target(table, entry);
-
 	return 0;
 }
 
-static void connman_iptables_dump_hook(struct connman_iptables *table)
-{
-	int i;
-	printf("hooks: \n");
-	for (i = 0; i < NF_INET_NUMHOOKS; i++) {
-		if ((table->info->valid_hooks & (1 << i)))
-			printf("%s entry %p underflow %p (%#x)\n",
-				hooknames[i],
-				table->blob_entries->entrytable +
-						table->info->hook_entry[i],
-				table->blob_entries->entrytable +
-						table->info->underflow[i],
-					table->info->underflow[i]);
-	}
-}
-
-static void connman_iptables_dump(struct connman_iptables *table)
-{
-	printf("%s valid_hooks=0x%08x, num_entries=%u, size=%u\n",
-		table->info->name,
-		table->info->valid_hooks, table->info->num_entries,
-		table->info->size);
-
-	connman_iptables_dump_hook(table);
-
-	ENTRY_ITERATE(table->blob_entries->entrytable,
-			table->blob_entries->size,
-			connman_iptables_dump_entry, table);
-
-}
-
-static int connman_iptables_get_entries(struct connman_iptables *table)
-{
-	socklen_t entry_size;
-
-	entry_size = sizeof(struct ipt_get_entries) + table->info->size;
-
-	return getsockopt(table->ipt_sock, IPPROTO_IP, IPT_SO_GET_ENTRIES,
-				table->blob_entries, &entry_size);
-}
-
-static int connman_iptables_replace(struct connman_iptables *table,
-					struct ipt_replace *r)
-{
-	return setsockopt(table->ipt_sock, IPPROTO_IP, IPT_SO_SET_REPLACE, r,
-			 sizeof(*r) + r->size);
-}
-
-static void connman_iptables_cleanup(struct connman_iptables *table)
-{
-	GList *list;
-	struct connman_iptables_entry *entry;
-
-	close(table->ipt_sock);
-
-	for (list = table->entries; list; list = list->next) {
-		entry = list->data;
-
-		g_free(entry->entry);
-	}
-
-	g_free(table->info);
-	g_free(table->blob_entries);
-	g_free(table);
-
-	xtables_free_opts(1);
-}
-
-static int connman_iptables_commit(struct connman_iptables *table)
-{
-	struct ipt_replace *repl;
-
-	repl = connman_iptables_blob(table);
-
-	return connman_iptables_replace(table, repl);
-}
-
-static int add_entry(struct ipt_entry *entry, struct connman_iptables *table)
-{
-	struct ipt_entry *new_entry;
-	int builtin;
-
-	new_entry = g_try_malloc0(entry->next_offset);
-	if (new_entry == NULL)
-		return -ENOMEM;
-
-	memcpy(new_entry, entry, entry->next_offset);
-
-	builtin = is_hook_entry(table, entry);
-
-	return connman_add_entry(table, new_entry, NULL, builtin);
-}
-
-static struct connman_iptables *connman_iptables_init(const char *table_name)
-{
-	struct connman_iptables *table;
-	socklen_t s;
-
-	table =  g_try_new0(struct connman_iptables, 1);
-	if (table == NULL)
-		return NULL;
-
-	table->info =  g_try_new0(struct ipt_getinfo, 1);
-	if (table->info == NULL)
-		goto err;
-
-	table->ipt_sock = socket(AF_INET, SOCK_RAW | SOCK_CLOEXEC, IPPROTO_RAW);
-	if (table->ipt_sock < 0)
-		goto err;
-
-	s = sizeof(*table->info);
-	strcpy(table->info->name, table_name);
-	if (getsockopt(table->ipt_sock, IPPROTO_IP, IPT_SO_GET_INFO,
-						table->info, &s) < 0)
-		goto err;
-
-	table->blob_entries = g_try_malloc0(sizeof(struct ipt_get_entries) +
-						table->info->size);
-	if (table->blob_entries == NULL)
-		goto err;
-
-	strcpy(table->blob_entries->name, table_name);
-	table->blob_entries->size = table->info->size;
-
-	if (connman_iptables_get_entries(table) < 0)
-		goto err;
-
-	table->num_entries = 0;
-	table->old_entries = table->info->num_entries;
-	table->size = 0;
-
-	memcpy(table->underflow, table->info->underflow,
-				sizeof(table->info->underflow));
-	memcpy(table->hook_entry, table->info->hook_entry,
-				sizeof(table->info->hook_entry));
-
-	ENTRY_ITERATE(table->blob_entries->entrytable,
-			table->blob_entries->size,
-				add_entry, table);
-
-
-	return table;
-
-err:
-
-	connman_iptables_cleanup(table);
-
-	return NULL;
-}
-
-
-static struct option connman_iptables_opts[] = {
-	{.name = "append",        .has_arg = 1, .val = 'A'},
-	{.name = "flush-chain",   .has_arg = 1, .val = 'F'},
-	{.name = "list",          .has_arg = 2, .val = 'L'},
-	{.name = "new-chain",     .has_arg = 1, .val = 'N'},
-	{.name = "delete-chain",  .has_arg = 1, .val = 'X'},
-	{.name = "in-interface",  .has_arg = 1, .val = 'i'},
-	{.name = "jump",          .has_arg = 1, .val = 'j'},
-	{.name = "match",         .has_arg = 1, .val = 'm'},
-	{.name = "out-interface", .has_arg = 1, .val = 'o'},
-	{.name = "table",         .has_arg = 1, .val = 't'},
-	{NULL},
-};
-
-struct xtables_globals connman_iptables_globals = {
-	.option_offset = 0,
-	.opts = connman_iptables_opts,
-	.orig_opts = connman_iptables_opts,
-};
-
 int main(int argc, char *argv[])
 {
-	struct connman_iptables *table;
-	struct xtables_match *xt_m;
-	struct xtables_target *xt_t;
-	char *table_name, *chain, *new_chain, *match_name, *target_name;
-	char *delete_chain, *flush_chain;
-	int c;
-	size_t size;
-	gboolean dump, invert, delete;
-
-	xtables_init_all(&connman_iptables_globals, NFPROTO_IPV4);
-
-	dump = FALSE;
-	invert = FALSE;
-	delete = FALSE;
-	table_name = chain = new_chain = match_name = target_name = NULL;
-	delete_chain = flush_chain = NULL;
-	table = NULL;
-	xt_m = NULL;
-	xt_t = NULL;
-
-	while ((c = getopt_long(argc, argv,
-	   "-A:F:L::N:X:j:i:m:o:t:", connman_iptables_globals.opts, NULL)) != -1) {
-		switch (c) {
-		case 'A':
-			chain = optarg;
-			break;
-
-		case 'F':
-			flush_chain = optarg;
-			break;
-
-		case 'L':
-			dump = true;
-			break;
-
-		case 'N':
-			new_chain = optarg;
-			break;
-
-		case 'X':
-			delete = true;
-			delete_chain = optarg;
-			break;
-
-		case 'j':
-			target_name = optarg;
-			xt_t = xtables_find_target(target_name, XTF_TRY_LOAD);
-
-			if (xt_t == NULL)
-				break;
-
-			size = ALIGN(sizeof(struct ipt_entry_target)) + xt_t->size;
-
-			xt_t->t = g_try_malloc0(size);
-			if (xt_t->t == NULL)
-				goto out;
-			xt_t->t->u.target_size = size;
-			strcpy(xt_t->t->u.user.name, target_name);
-			xt_t->t->u.user.revision = xt_t->revision;
-			if (xt_t->init != NULL)
-				xt_t->init(xt_t->t);
-			connman_iptables_globals.opts =
-				xtables_merge_options(
-#if XTABLES_VERSION_CODE > 5
-						     connman_iptables_globals.orig_opts,
-#endif
-						     connman_iptables_globals.opts,
-						     xt_t->extra_opts,
-						     &xt_t->option_offset);
-			if (connman_iptables_globals.opts == NULL)
-				goto out;
-
-			break;
-
-		case 'i':
-			break;
+	int ret;
 
-		case 'm':
-			match_name = optarg;
-
-			xt_m = xtables_find_match(optarg, XTF_LOAD_MUST_SUCCEED, NULL);
-			size = ALIGN(sizeof(struct ipt_entry_match)) + xt_m->size;
-			xt_m->m = g_try_malloc0(size);
-			if (xt_m == NULL)
-				goto out;
-			xt_m->m->u.match_size = size;
-			strcpy(xt_m->m->u.user.name, xt_m->name);
-			xt_m->m->u.user.revision = xt_m->revision;
-			if (xt_m->init != NULL)
-				xt_m->init(xt_m->m);
-			if (xt_m != xt_m->next) {
-				connman_iptables_globals.opts =
-					xtables_merge_options(
-#if XTABLES_VERSION_CODE > 5
-						connman_iptables_globals.orig_opts,
-#endif
-						connman_iptables_globals.opts,
-						xt_m->extra_opts,
-						&xt_m->option_offset);
-				if (connman_iptables_globals.opts == NULL)
-					goto out;
-			}
-
-			break;
-
-		case 'o':
-			break;
-
-		case 't':
-			table_name = optarg;
-			break;
-
-		case 1:
-			if (optarg[0] == '!' && optarg[1] == '\0') {
-				if (invert)
-					printf("Consecutive ! not allowed\n");
-
-				invert = TRUE;
-				optarg[0] = '\0';
-				continue;
-			}
-
-			printf("Invalid option\n");
-
-			return -1;
-
-		default:
-			if (xt_t == NULL || xt_t->parse == NULL ||
-			    !xt_t->parse(c - xt_t->option_offset, argv, invert,
-					&xt_t->tflags, NULL, &xt_t->t)) {
-				if (xt_m == NULL || xt_m->parse == NULL)
-					break;
-
-				xt_m->parse(c - xt_m->option_offset, argv,
-					invert, &xt_m->mflags, NULL, &xt_m->m);
-			}
-
-			break;
-		}
+	if (argc < 2) {
+		printf("usage: %s [--bench COUNT | iptables arguments]\n",
+								argv[0]);
+		return 1;
 	}
 
-	if (table_name == NULL)
-		table_name = "filter";
+	__connman_log_init(NULL, FALSE);
+	__connman_iptables_init();
 
-	table = connman_iptables_init(table_name);
-	if (table == NULL)
-		return -1;
-
-	if (delete) {
-		if (delete_chain == NULL)
-			goto out;
-
-		printf("Delete chain %s\n", delete_chain);
-
-		connman_iptables_delete_chain(table, delete_chain);
-
-		goto commit;
-	}
+	if (g_str_equal(argv[1], "--bench") == TRUE) {
+		int count = argc > 2 ? atoi(argv[2]) : 0;
 
-	if (flush_chain) {
-		printf("Flush chain %s\n", flush_chain);
+		if (count <= 0) {
+			printf("invalid number of rules\n");
+			ret = 1;
+		} else
+			ret = run_bench(count);
+	} else
+		ret = run_command(argc, argv);
 
-		connman_iptables_flush_chain(table, flush_chain);
+	__connman_iptables_cleanup();
+	__connman_log_cleanup();
 
-		goto commit;
-	}
-
-	if (dump) {
-		connman_iptables_dump(table);
-
-		return 0;
-	}
-
-	if (chain && new_chain)
-		return -1;
-
-	if (new_chain) {
-		printf("New chain %s\n", new_chain);
-
-		connman_iptables_add_chain(table, new_chain);
-
-		goto commit;
-	}
-
-	if (chain) {
-		if (target_name == NULL)
-			return -1;
-
-		printf("Adding %s to %s (match %s)\n", target_name, chain, match_name);
-
-		connman_iptables_add_rule(table, chain, target_name, xt_t,
-					match_name, xt_m);
-
-		goto commit;
-	}
-
-commit:
-
-	connman_iptables_commit(table);
-
-out:
-	connman_iptables_cleanup(table);
-
-	if (xt_t)
-		g_free(xt_t->t);
-
-	if (xt_m)
-		g_free(xt_m->m);
-
-	return 0;
+	return ret;
 }
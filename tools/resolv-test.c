@@ -27,6 +27,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
 
 #include <gweb/gresolv.h>
 
@@ -34,6 +38,15 @@ static GTimer *timer;
 
 static GMainLoop *main_loop;
 
+static GResolv *resolv;
+static const char *hostname;
+
+static gint option_repeat = 1;
+static gint option_answers = 0;
+
+static gint bench_lookups = 0;
+static gdouble bench_elapsed = 0;
+
 static void resolv_debug(const char *str, void *data)
 {
 	g_print("%s: %s\n", (const char *) data, str);
@@ -76,6 +89,12 @@ static void resolv_result(GResolvResultStatus status,
 
 	elapsed = g_timer_elapsed(timer, NULL);
 
+	if (option_answers > 0) {
+		bench_elapsed += elapsed;
+		bench_lookups++;
+		goto next;
+	}
+
 	g_print("elapse: %f seconds\n", elapsed);
 
 	g_print("status: %s\n", status2str(status));
@@ -85,14 +104,154 @@ static void resolv_result(GResolvResultStatus status,
 			g_print("result: %s\n", results[i]);
 	}
 
+next:
+	if (--option_repeat > 0) {
+		g_timer_start(timer);
+
+		if (g_resolv_lookup_hostname(resolv, hostname,
+					resolv_result, NULL) != 0)
+			return;
+
+		printf("failed to start lookup\n");
+	}
+
 	g_main_loop_quit(main_loop);
 }
 
+/*
+ * Minimal nameserver for --answers. It answers every query with the
+ * requested number of A or AAAA records, so that the cost of parsing
+ * and sorting large answer sets can be measured without the network.
+ */
+static gboolean bench_server_event(GIOChannel *channel, GIOCondition cond,
+							gpointer user_data)
+{
+	unsigned char buf[4096];
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	int sk, len, pos, type, size, count;
+
+	if (cond & (G_IO_NVAL | G_IO_ERR | G_IO_HUP))
+		return FALSE;
+
+	sk = g_io_channel_unix_get_fd(channel);
+
+	len = recvfrom(sk, buf, 512, 0, (struct sockaddr *) &addr, &addrlen);
+	if (len < 12)
+		return TRUE;
+
+	pos = 12;
+	while (pos < len && buf[pos] != 0)
+		pos += buf[pos] + 1;
+
+	pos += 5;
+	if (pos > len)
+		return TRUE;
+
+	type = buf[pos - 4] << 8 | buf[pos - 3];
+	size = type == 28 ? 16 : 4;
+
+	for (count = 0; count < option_answers &&
+			pos + 12 + size <= (int) sizeof(buf); count++) {
+		buf[pos++] = 0xc0;		/* pointer to the question */
+		buf[pos++] = 0x0c;
+		buf[pos++] = type >> 8;
+		buf[pos++] = type & 0xff;
+		buf[pos++] = 0x00;		/* class IN */
+		buf[pos++] = 0x01;
+		buf[pos++] = 0x00;		/* TTL 60 */
+		buf[pos++] = 0x00;
+		buf[pos++] = 0x00;
+		buf[pos++] = 0x3c;
+		buf[pos++] = 0x00;
+		buf[pos++] = size;
+
+		memset(buf + pos, 0, size);
+
+		if (size == 4) {
+			buf[pos] = 198;		/* 198.51.100.0/24 */
+			buf[pos + 1] = 51;
+			buf[pos + 2] = 100;
+		} else {
+			buf[pos] = 0x20;	/* 2001:db8::/32 */
+			buf[pos + 1] = 0x01;
+			buf[pos + 2] = 0x0d;
+			buf[pos + 3] = 0xb8;
+		}
+
+		buf[pos + size - 1] = count + 1;
+		pos += size;
+	}
+
+	buf[2] = 0x81;		/* QR, RD */
+	buf[3] = 0x80;		/* RA */
+	buf[6] = count >> 8;
+	buf[7] = count & 0xff;
+	memset(buf + 8, 0, 4);
+
+	sendto(sk, buf, pos, 0, (struct sockaddr *) &addr, addrlen);
+
+	return TRUE;
+}
+
+static int start_bench_server(void)
+{
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	GIOChannel *channel;
+	int sk;
+
+	sk = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+	if (sk < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (bind(sk, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+			getsockname(sk, (struct sockaddr *) &addr,
+							&addrlen) < 0) {
+		close(sk);
+		return -1;
+	}
+
+	channel = g_io_channel_unix_new(sk);
+	g_io_channel_set_close_on_unref(channel, TRUE);
+
+	g_io_add_watch(channel, G_IO_IN | G_IO_NVAL | G_IO_ERR | G_IO_HUP,
+						bench_server_event, NULL);
+
+	g_io_channel_unref(channel);
+
+	return ntohs(addr.sin_port);
+}
+
+static void print_cache_stats(void)
+{
+	GResolvCacheStats stats;
+
+	g_resolv_get_cache_stats(resolv, &stats);
+
+	g_print("cache: %u entries, %u hits, %u negative hits, %u misses, "
+			"%u expired, %u evicted\n", stats.entries,
+			stats.hits, stats.negative_hits, stats.misses,
+			stats.expired, stats.evictions);
+}
+
 static gboolean option_debug = FALSE;
+static gboolean option_no_cache = FALSE;
 
 static GOptionEntry options[] = {
 	{ "debug", 'd', 0, G_OPTION_ARG_NONE, &option_debug,
 					"Enable debug output" },
+	{ "repeat", 'r', 0, G_OPTION_ARG_INT, &option_repeat,
+				"Resolve the hostname COUNT times", "COUNT" },
+	{ "no-cache", 'n', 0, G_OPTION_ARG_NONE, &option_no_cache,
+					"Disable the answer cache" },
+	{ "answers", 'a', 0, G_OPTION_ARG_INT, &option_answers,
+			"Benchmark against a local server sending COUNT "
+			"addresses per query", "COUNT" },
 	{ NULL },
 };
 
@@ -101,7 +260,6 @@ int main(int argc, char *argv[])
 	GOptionContext *context;
 	GError *error = NULL;
 	struct sigaction sa;
-	GResolv *resolv;
 	int index = 0;
 
 	context = g_option_context_new(NULL);
@@ -118,7 +276,7 @@ int main(int argc, char *argv[])
 
 	g_option_context_free(context);
 
-	if (argc < 2) {
+	if (argc < 2 && option_answers == 0) {
 		printf("missing argument\n");
 		return 1;
 	}
@@ -132,18 +290,34 @@ int main(int argc, char *argv[])
 	if (option_debug == TRUE)
 		g_resolv_set_debug(resolv, resolv_debug, "RESOLV");
 
+	if (option_no_cache == TRUE)
+		g_resolv_set_cache_size(resolv, 0);
+
 	main_loop = g_main_loop_new(NULL, FALSE);
 
-	if (argc > 2) {
+	if (option_answers > 0) {
+		int port = start_bench_server();
+
+		if (port < 0) {
+			printf("failed to start benchmark server\n");
+			return 1;
+		}
+
+		/* Every lookup has to parse and sort the full answer */
+		g_resolv_set_cache_size(resolv, 0);
+		g_resolv_add_nameserver(resolv, "127.0.0.1", port, 0);
+	} else if (argc > 2) {
 		int i;
 
 		for (i = 2; i < argc; i++)
 			g_resolv_add_nameserver(resolv, argv[i], 53, 0);
 	}
 
+	hostname = argc > 1 ? argv[1] : "bench.example.com";
+
 	timer = g_timer_new();
 
-	if (g_resolv_lookup_hostname(resolv, argv[1],
+	if (g_resolv_lookup_hostname(resolv, hostname,
 					resolv_result, NULL) == 0) {
 		printf("failed to start lookup\n");
 		return 1;
@@ -158,6 +332,14 @@ int main(int argc, char *argv[])
 
 	g_timer_destroy(timer);
 
+	if (bench_lookups > 0)
+		g_print("%d lookups of %d addresses per family: "
+				"%.1f us per lookup\n", bench_lookups,
+				option_answers,
+				bench_elapsed * 1000000 / bench_lookups);
+
+	print_cache_stats();
+
 	g_resolv_unref(resolv);
 
 	g_main_loop_unref(main_loop);
@@ -46,7 +46,14 @@
 #define TFR
 #endif
 
-#define MAGIC 0xFA00B916
+#define MAGIC		0xFA00B917
+#define MAGIC_V1	0xFA00B916
+
+#define STATS_NR_COUNTERS	9
+#define STATS_RECORD_MAX_SIZE	64
+
+#define STATS_BASE_HOME		0x1
+#define STATS_BASE_ROAMING	0x2
 
 struct connman_stats_data {
 	unsigned int rx_packets;
@@ -60,20 +67,22 @@ struct connman_stats_data {
 	unsigned int time;
 };
 
-struct stats_file_header {
-	unsigned int magic;
-	unsigned int begin;
-	unsigned int end;
-	unsigned int home;
-	unsigned int roaming;
-};
-
 struct stats_record {
 	time_t ts;
 	unsigned int roaming;
 	struct connman_stats_data data;
 };
 
+struct stats_file_header {
+	unsigned int magic;
+	unsigned int begin;
+	unsigned int flags;
+	unsigned int reserved;
+	time_t ts;
+	struct stats_record home;
+	struct stats_record roaming;
+};
+
 struct stats_file {
 	int fd;
 	char *name;
@@ -82,25 +91,36 @@ struct stats_file {
 	size_t max_len;
 
 	/* cached values */
-	int max_nr;
 	int nr;
-	struct stats_record *first;
-	struct stats_record *last;
-	struct stats_record *home_first;
-	struct stats_record *roaming_first;
+	unsigned int end;
+	time_t ts;
+	struct stats_record home;
+	struct stats_record roaming;
+	gboolean home_valid;
+	gboolean roaming_valid;
+	struct stats_record last;
+	struct stats_record home_first;
+	struct stats_record roaming_first;
+	gboolean home_first_valid;
+	gboolean roaming_first_valid;
 };
 
 struct stats_iter {
 	struct stats_file *file;
-	struct stats_record *begin;
-	struct stats_record *end;
-	struct stats_record *it;
+	unsigned int pos;
+	time_t ts;
+	struct stats_record home;
+	struct stats_record roaming;
+	gboolean home_valid;
+	gboolean roaming_valid;
+	struct stats_record rec;
 };
 
 static gint option_create = 0;
 static gint option_interval = 3;
 static gboolean option_dump = FALSE;
 static gboolean option_summary = FALSE;
+static gboolean option_verify = FALSE;
 static char *option_info_file_name = NULL;
 static time_t option_start_ts = -1;
 static char *option_last_file_name = NULL;
@@ -127,6 +147,8 @@ static GOptionEntry options[] = {
 			"Dump contents of .data file" },
 	{ "summary", 's', 0, G_OPTION_ARG_NONE, &option_summary,
 			"Summary of .data file" },
+	{ "verify", 'v', 0, G_OPTION_ARG_NONE, &option_verify,
+			"Check the encoding of all entries of .data file" },
 	{ "info", 'f', 0, G_OPTION_ARG_FILENAME, &option_info_file_name,
 			".info file name" },
 	{ "startts", 't', 0, G_OPTION_ARG_CALLBACK, parse_start_ts,
@@ -142,85 +164,158 @@ static struct stats_file_header *get_hdr(struct stats_file *file)
 	return (struct stats_file_header *)file->addr;
 }
 
-static struct stats_record *get_begin(struct stats_file *file)
+static unsigned int *get_counters(struct connman_stats_data *data)
 {
-	unsigned int off = get_hdr(file)->begin;
-
-	return (struct stats_record *)(file->addr + off);
+	return (unsigned int *) data;
 }
 
-static struct stats_record *get_end(struct stats_file *file)
+static int put_varint(unsigned char *buf, guint64 value)
 {
-	unsigned int off = get_hdr(file)->end;
+	int len = 0;
+
+	while (value >= 0x80) {
+		buf[len++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
 
-	return (struct stats_record *)(file->addr + off);
+	buf[len++] = value;
+
+	return len;
 }
 
-static struct stats_record *get_home(struct stats_file *file)
+static int get_varint(const unsigned char *buf, size_t size, guint64 *value)
 {
-	struct stats_file_header *hdr;
+	guint64 result = 0;
+	unsigned int i;
 
-	hdr = get_hdr(file);
+	for (i = 0; i < size && i < 10; i++) {
+		result |= (guint64) (buf[i] & 0x7f) << (7 * i);
 
-	if (hdr->home == UINT_MAX)
-		return NULL;
+		if ((buf[i] & 0x80) == 0) {
+			*value = result;
+			return i + 1;
+		}
+	}
 
-	return (struct stats_record *)(file->addr + hdr->home);
+	return -EINVAL;
 }
 
-static struct stats_record *get_roaming(struct stats_file *file)
+static int encode_record(unsigned char *buf, struct stats_record *rec,
+				struct stats_record *prev, time_t ts)
 {
-	struct stats_file_header *hdr;
+	unsigned int *cur = get_counters(&rec->data);
+	unsigned int *old = get_counters(&prev->data);
+	unsigned int mask = 0, i;
+	gint64 delta;
+	int len;
+
+	for (i = 0; i < STATS_NR_COUNTERS; i++) {
+		if (cur[i] != old[i])
+			mask |= 1 << i;
+	}
 
-	hdr = get_hdr(file);
+	len = put_varint(buf, mask << 2 | (rec->roaming == TRUE) << 1 | 1);
 
-	if (hdr->roaming == UINT_MAX)
-		return NULL;
+	delta = (gint64) rec->ts - ts;
+	len += put_varint(buf + len, (guint64) delta << 1 ^ (delta >> 63));
+
+	for (i = 0; i < STATS_NR_COUNTERS; i++) {
+		if (mask & (1 << i))
+			len += put_varint(buf + len, cur[i] - old[i]);
+	}
 
-	return (struct stats_record *)(file->addr + hdr->roaming);
+	return len;
 }
 
-static void set_end(struct stats_file *file, struct stats_record *end)
+static void stats_iter_init(struct stats_iter *iter, struct stats_file *file)
 {
-	struct stats_file_header *hdr;
+	struct stats_file_header *hdr = get_hdr(file);
 
-	hdr = get_hdr(file);
-	hdr->end = (char *)end - file->addr;
-}
+	memset(iter, 0, sizeof(*iter));
 
-static int get_index(struct stats_file *file, struct stats_record *rec)
-{
-	return rec - file->first;
+	iter->file = file;
+	iter->pos = hdr->begin;
+	iter->ts = hdr->ts;
+
+	if (hdr->flags & STATS_BASE_HOME) {
+		iter->home = hdr->home;
+		iter->home_valid = TRUE;
+	}
+
+	if (hdr->flags & STATS_BASE_ROAMING) {
+		iter->roaming = hdr->roaming;
+		iter->roaming_valid = TRUE;
+	}
 }
 
-static struct stats_record *get_next(struct stats_file *file,
-					struct stats_record *cur)
+static struct stats_record *get_next_record(struct stats_iter *iter)
 {
-	cur++;
+	const unsigned char *buf = (unsigned char *) iter->file->addr;
+	size_t len = iter->file->len;
+	unsigned int pos = iter->pos, mask, roaming, i;
+	struct stats_record *prev;
+	unsigned int counters[STATS_NR_COUNTERS];
+	guint64 value;
+	gint64 delta;
+	int n;
+
+	if (pos >= len || buf[pos] == 0)
+		return NULL;
 
-	if (cur > file->last)
-		cur = file->first;
+	n = get_varint(buf + pos, len - pos, &value);
+	if (n < 0 || (value & 1) == 0 || value >> 2 >= 1 << STATS_NR_COUNTERS)
+		return NULL;
+	pos += n;
 
-	return cur;
-}
+	roaming = (value >> 1) & 1;
+	mask = value >> 2;
 
-static struct stats_record *get_iterator_begin(struct stats_file *file)
-{
-	return get_next(file, get_begin(file));
-}
+	n = get_varint(buf + pos, len - pos, &value);
+	if (n < 0)
+		return NULL;
+	pos += n;
 
-static struct stats_record *get_iterator_end(struct stats_file *file)
-{
-	return get_next(file, get_end(file));
+	delta = (gint64) (value >> 1) ^ -(gint64) (value & 1);
+
+	prev = roaming == TRUE ? &iter->roaming : &iter->home;
+	memcpy(counters, get_counters(&prev->data), sizeof(counters));
+
+	for (i = 0; i < STATS_NR_COUNTERS; i++) {
+		if ((mask & (1 << i)) == 0)
+			continue;
+
+		n = get_varint(buf + pos, len - pos, &value);
+		if (n < 0 || value > G_MAXUINT32)
+			return NULL;
+		pos += n;
+
+		counters[i] += value;
+	}
+
+	iter->pos = pos;
+	iter->ts += delta;
+
+	memcpy(get_counters(&prev->data), counters, sizeof(counters));
+	prev->ts = iter->ts;
+	prev->roaming = roaming;
+
+	if (roaming == TRUE)
+		iter->roaming_valid = TRUE;
+	else
+		iter->home_valid = TRUE;
+
+	iter->rec = *prev;
+
+	return &iter->rec;
 }
 
-static void stats_print_record(struct stats_record *rec)
+static void stats_print_record(unsigned int offset, struct stats_record *rec)
 {
 	char buffer[30];
 
 	strftime(buffer, 30, "%d-%m-%Y %T", localtime(&rec->ts));
-	printf("%p %lld %s %01d %d %d %d %d %d %d %d %d %d\n",
-		rec, (long long int)rec->ts, buffer,
+	printf("0x%08x %lld %s %01d %d %d %d %d %d %d %d %d %d\n",
+		offset, (long long int)rec->ts, buffer,
 		rec->roaming,
 		rec->data.rx_packets,
 		rec->data.tx_packets,
@@ -236,30 +331,16 @@ static void stats_print_record(struct stats_record *rec)
 static void stats_hdr_info(struct stats_file *file)
 {
 	struct stats_file_header *hdr;
-	struct stats_record *begin, *end, *home, *roaming;
-	unsigned int home_idx, roaming_idx;
+	unsigned int used;
 
 	hdr = get_hdr(file);
-	begin = get_begin(file);
-	end = get_end(file);
-
-	home = get_home(file);
-	if (home == NULL)
-		home_idx = UINT_MAX;
-	else
-		home_idx = get_index(file, home);
-
-	roaming = get_roaming(file);
-	if (roaming == NULL)
-		roaming_idx = UINT_MAX;
-	else
-		roaming_idx = get_index(file, roaming);
+	used = file->end - hdr->begin;
 
 	printf("Data Structure Sizes\n");
 	printf("  sizeof header   %zd/0x%02zx\n",
 		sizeof(struct stats_file_header),
 		sizeof(struct stats_file_header));
-	printf("  sizeof entry    %zd/0%02zx\n\n",
+	printf("  sizeof record   %zd/0x%02zx\n\n",
 		sizeof(struct stats_record),
 		sizeof(struct stats_record));
 
@@ -267,42 +348,48 @@ static void stats_hdr_info(struct stats_file *file)
 	printf("  addr            %p\n",  file->addr);
 	printf("  len             %zd\n", file->len);
 
-	printf("  max nr entries  %d\n", file->max_nr);
-	printf("  nr entries      %d\n\n", file->nr);
+	printf("  nr entries      %d\n", file->nr);
+	printf("  used bytes      %u\n", used);
+	printf("  bytes per entry %.1f\n\n",
+		file->nr > 0 ? (double) used / file->nr : 0.0);
 
 	printf("Header\n");
 	printf("  magic           0x%08x\n", hdr->magic);
-	printf("  begin           [%d] 0x%08x\n",
-		get_index(file, begin), hdr->begin);
-	printf("  end             [%d] 0x%08x\n",
-		get_index(file, end), hdr->end);
-	printf("  home            [%d] 0x%08x\n",
-		home_idx, hdr->home);
-	printf("  roaming         [%d] 0x%08x\n\n",
-		roaming_idx, hdr->roaming);
-
-
-	printf("Pointers\n");
-	printf("  hdr             %p\n", hdr);
-	printf("  begin           %p\n", begin);
-	printf("  end             %p\n", end);
-	printf("  home            %p\n", home);
-	printf("  romaing         %p\n", roaming);
-	printf("  first           %p\n", file->first);
-	printf("  last            %p\n\n", file->last);
+	printf("  begin           0x%08x\n", hdr->begin);
+	printf("  end             0x%08x\n", file->end);
+	printf("  flags           0x%08x\n", hdr->flags);
+	printf("  ts              %lld\n\n", (long long int)hdr->ts);
+
+	if (hdr->flags & STATS_BASE_HOME) {
+		printf("  home base       ");
+		stats_print_record(0, &hdr->home);
+	}
+
+	if (hdr->flags & STATS_BASE_ROAMING) {
+		printf("  roaming base    ");
+		stats_print_record(0, &hdr->roaming);
+	}
+
+	printf("\n");
 }
 
 static void stats_print_entries(struct stats_file *file)
 {
-	struct stats_record *it;
-	int i;
+	struct stats_iter iter;
+	struct stats_record *rec;
+	unsigned int pos;
+	int i = 0;
 
-	printf("[ idx] ptr ts ts rx_packets tx_packets rx_bytes "
+	printf("[ idx] offset ts ts rx_packets tx_packets rx_bytes "
 		"tx_bytes rx_errors tx_errors rx_dropped tx_dropped time\n\n");
 
-	for (i = 0, it = file->first; it <= file->last; it++, i++) {
-		printf("[%04d] ", i);
-		stats_print_record(it);
+	stats_iter_init(&iter, file);
+
+	pos = iter.pos;
+	while ((rec = get_next_record(&iter)) != NULL) {
+		printf("[%04d] ", i++);
+		stats_print_record(pos, rec);
+		pos = iter.pos;
 	}
 }
 
@@ -331,95 +418,127 @@ static void stats_print_rec_diff(struct stats_record *begin,
 
 static void stats_print_diff(struct stats_file *file)
 {
-	struct stats_record *begin, *end;
+	struct stats_iter iter;
+	struct stats_record *first;
 
-	begin = get_begin(file);
-	begin = get_next(file, begin);
-	end = get_end(file);
+	stats_iter_init(&iter, file);
+	first = get_next_record(&iter);
+	if (first == NULL)
+		return;
 
-	printf("\n(begin + 1)\n");
-	printf("\t[%04d] ", get_index(file, begin));
-	stats_print_record(begin);
-	printf("end\n");
-	printf("\t[%04d] ", get_index(file, end));
-	stats_print_record(end);
+	printf("\nfirst\n");
+	printf("\t");
+	stats_print_record(get_hdr(file)->begin, first);
+	printf("last\n");
+	printf("\t");
+	stats_print_record(file->end, &file->last);
 
-	if (file->home_first != NULL && get_home(file) != NULL) {
+	if (file->home_first_valid == TRUE) {
 		printf("\nhome\n");
-		stats_print_rec_diff(file->home_first, get_home(file));
+		stats_print_rec_diff(&file->home_first, &file->home);
 	}
 
-	if (file->roaming_first != NULL && get_roaming(file) != NULL) {
-		printf("\roaming\n");
-		stats_print_rec_diff(file->roaming_first, get_roaming(file));
+	if (file->roaming_first_valid == TRUE) {
+		printf("\nroaming\n");
+		stats_print_rec_diff(&file->roaming_first, &file->roaming);
 	}
 }
 
-static void update_max_nr_entries(struct stats_file *file)
-{
-	file->max_nr = (file->len - sizeof(struct stats_file_header)) /
-		sizeof(struct stats_record);
-}
-
-static void update_nr_entries(struct stats_file *file)
+/*
+ * Walks all entries and checks that they are well formed, that
+ * the timestamps do not go backwards and that nothing but zeros
+ * follow the last entry.
+ */
+static int stats_verify(struct stats_file *file)
 {
-	struct stats_record *begin, *end;
-	int nr;
+	struct stats_iter iter;
+	struct stats_record *rec;
+	time_t ts;
+	unsigned int pos, used, i;
+	int nr = 0, errors = 0;
+
+	stats_iter_init(&iter, file);
+	ts = iter.ts;
+
+	pos = iter.pos;
+	while ((rec = get_next_record(&iter)) != NULL) {
+		if (rec->ts < ts) {
+			printf("entry %d at 0x%08x goes back %lld seconds\n",
+				nr, pos, (long long int)(ts - rec->ts));
+			errors++;
+		}
 
-	begin = get_begin(file);
-	end = get_end(file);
+		if (iter.pos - pos > STATS_RECORD_MAX_SIZE) {
+			printf("entry %d at 0x%08x is %u bytes long\n",
+				nr, pos, iter.pos - pos);
+			errors++;
+		}
 
-	nr = get_index(file, end) - get_index(file, begin);
+		ts = rec->ts;
+		pos = iter.pos;
+		nr++;
+	}
 
-	if (nr < 0)
-		nr += file->max_nr;
+	if (pos < file->len && file->addr[pos] != 0) {
+		printf("malformed entry %d at 0x%08x\n", nr, pos);
+		errors++;
+	}
 
-	file->nr = nr;
-}
+	for (i = pos; i < file->len; i++) {
+		if (file->addr[i] != 0) {
+			printf("garbage after end at 0x%08x\n", i);
+			errors++;
+			break;
+		}
+	}
 
-static void update_first(struct stats_file *file)
-{
-	file->first = (struct stats_record *)(file->addr +
-					sizeof(struct stats_file_header));
-}
+	used = pos - get_hdr(file)->begin;
 
-static void update_last(struct stats_file *file)
-{
-	struct stats_record *last;
+	printf("%d entries in %u bytes, %.1f bytes per entry "
+		"(%zd bytes unencoded)\n", nr, used,
+		nr > 0 ? (double) used / nr : 0.0,
+		sizeof(struct stats_record));
 
-	last = file->first;
-	last += file->max_nr - 1;
+	if (errors > 0)
+		printf("%d errors found\n", errors);
+	else
+		printf("no errors found\n");
 
-	file->last = last;
+	return errors;
 }
 
-static int stats_file_update_cache(struct stats_file *file)
+static void stats_file_update_cache(struct stats_file *file)
 {
-	struct stats_record *it, *end;
+	struct stats_iter iter;
+	struct stats_record *rec;
 
-	update_max_nr_entries(file);
-	update_nr_entries(file);
-	update_first(file);
-	update_last(file);
-	file->home_first = NULL;
-	file->roaming_first = NULL;
+	file->nr = 0;
+	file->home_first_valid = FALSE;
+	file->roaming_first_valid = FALSE;
 
-	end = get_iterator_end(file);
-	for (it = get_iterator_begin(file);
-			it != end;
-			it = get_next(file, it)) {
+	stats_iter_init(&iter, file);
 
-		if (file->home_first == NULL && it->roaming == 0)
-			file->home_first = it;
+	while ((rec = get_next_record(&iter)) != NULL) {
+		if (file->home_first_valid == FALSE && rec->roaming == 0) {
+			file->home_first = *rec;
+			file->home_first_valid = TRUE;
+		}
 
-		if (file->roaming_first == NULL && it->roaming == 1)
-			file->roaming_first = it;
+		if (file->roaming_first_valid == FALSE && rec->roaming == 1) {
+			file->roaming_first = *rec;
+			file->roaming_first_valid = TRUE;
+		}
 
-		if (file->home_first != NULL && file->roaming_first != NULL)
-			break;
+		file->last = *rec;
+		file->nr++;
 	}
 
-	return 0;
+	file->end = iter.pos;
+	file->ts = iter.ts;
+	file->home = iter.home;
+	file->roaming = iter.roaming;
+	file->home_valid = iter.home_valid;
+	file->roaming_valid = iter.roaming_valid;
 }
 
 static int stats_file_remap(struct stats_file *file, size_t size)
@@ -458,6 +577,24 @@ static int stats_file_remap(struct stats_file *file, size_t size)
 	return 0;
 }
 
+static void stats_file_init(struct stats_file *file)
+{
+	struct stats_file_header *hdr;
+
+	memset(file->addr, 0, file->len);
+
+	hdr = get_hdr(file);
+	hdr->magic = MAGIC;
+	hdr->begin = sizeof(struct stats_file_header);
+}
+
+static void stats_close(struct stats_file *file)
+{
+	munmap(file->addr, file->len);
+	close(file->fd);
+	g_free(file->name);
+}
+
 static int stats_open(struct stats_file *file, const char *name)
 {
 	struct stats_file_header *hdr;
@@ -504,32 +641,59 @@ static int stats_open(struct stats_file *file, const char *name)
 		return err;
 	}
 
-	/* Initialize new file */
 	hdr = get_hdr(file);
-	if (hdr->magic != MAGIC ||
-			hdr->begin < sizeof(struct stats_file_header) ||
-			hdr->end < sizeof(struct stats_file_header) ||
-			hdr->home < sizeof(struct stats_file_header) ||
-			hdr->roaming < sizeof(struct stats_file_header) ||
-			hdr->begin > file->len ||
-			hdr->end > file->len) {
-		hdr->magic = MAGIC;
-		hdr->begin = sizeof(struct stats_file_header);
-		hdr->end = sizeof(struct stats_file_header);
-		hdr->home = UINT_MAX;
-		hdr->roaming = UINT_MAX;
 
+	/* connmand converts the old format, do not throw it away here */
+	if (hdr->magic == MAGIC_V1) {
+		fprintf(stderr, "%s uses the old fixed size format\n",
+			file->name);
+		stats_close(file);
+		return -EINVAL;
 	}
+
+	/* Initialize new file */
+	if (hdr->magic != MAGIC ||
+			hdr->begin != sizeof(struct stats_file_header))
+		stats_file_init(file);
+
 	stats_file_update_cache(file);
 
 	return 0;
 }
 
-static void stats_close(struct stats_file *file)
+static int append_record(struct stats_file *file,
+				struct stats_record *rec)
 {
-	munmap(file->addr, file->len);
-	close(file->fd);
-	g_free(file->name);
+	unsigned char buf[STATS_RECORD_MAX_SIZE];
+	struct stats_record *prev;
+	int len, err;
+
+	if (rec->roaming == TRUE)
+		prev = &file->roaming;
+	else
+		prev = &file->home;
+
+	len = encode_record(buf, rec, prev, file->ts);
+
+	if (file->end + len > file->len) {
+		err = stats_file_remap(file, file->len +
+					sysconf(_SC_PAGESIZE));
+		if (err < 0)
+			return err;
+	}
+
+	memcpy(file->addr + file->end, buf, len);
+	file->end += len;
+
+	*prev = *rec;
+	file->ts = rec->ts;
+
+	if (rec->roaming == TRUE)
+		file->roaming_valid = TRUE;
+	else
+		file->home_valid = TRUE;
+
+	return 0;
 }
 
 static int stats_create(struct stats_file *file, unsigned int nr,
@@ -538,132 +702,93 @@ static int stats_create(struct stats_file *file, unsigned int nr,
 {
 	unsigned int i;
 	int err;
-	struct stats_record *cur, *next;
+	struct stats_record cur, next;
 	struct stats_file_header *hdr;
 	unsigned int pkt;
 	unsigned int step_ts;
 	unsigned int roaming = FALSE;
 
-	hdr = get_hdr(file);
+	stats_file_init(file);
 
-	hdr->magic = MAGIC;
-	hdr->begin = sizeof(struct stats_file_header);
-	hdr->end = sizeof(struct stats_file_header);
-	hdr->home = UINT_MAX;
-	hdr->roaming = UINT_MAX;
+	hdr = get_hdr(file);
 
-	stats_file_update_cache(file);
+	memset(&cur, 0, sizeof(cur));
 
 	if (start != NULL) {
-		struct stats_record *rec;
+		cur = *start;
 
-		rec = get_end(file);
-		memcpy(rec, start, sizeof(struct stats_record));
+		if (start->roaming == TRUE) {
+			hdr->roaming = *start;
+			hdr->flags |= STATS_BASE_ROAMING;
+		} else {
+			hdr->home = *start;
+			hdr->flags |= STATS_BASE_HOME;
+		}
+
+		hdr->ts = start->ts;
 	} else {
-		get_end(file)->ts = start_ts;
+		cur.ts = start_ts;
+		hdr->ts = start_ts;
 	}
 
-	for (i = 0; i < nr; i++) {
-		if (file->last == get_end(file)) {
-			err = stats_file_remap(file, file->len +
-						sysconf(_SC_PAGESIZE));
-			if (err < 0)
-				return err;
-
-			stats_file_update_cache(file);
-		}
-		cur = get_end(file);
-		next = get_next(file, cur);
+	stats_file_update_cache(file);
 
+	for (i = 0; i < nr; i++) {
 		step_ts = (rand() % interval);
 		if (step_ts == 0)
 			step_ts = 1;
 
-		next->ts = cur->ts + step_ts;
-		next->roaming = roaming;
-		next->data.time = cur->data.time + step_ts;
+		next = cur;
 
-		next->data.rx_packets = cur->data.rx_packets;
-		next->data.rx_bytes = cur->data.rx_bytes;
+		next.ts = cur.ts + step_ts;
+		next.roaming = roaming;
+		next.data.time = cur.data.time + step_ts;
 
 		if (rand() % 3 == 0) {
 			pkt = rand() % 5;
-			next->data.rx_packets += pkt;
-			next->data.rx_bytes += pkt * (rand() % 1500);
+			next.data.rx_packets += pkt;
+			next.data.rx_bytes += pkt * (rand() % 1500);
 		}
 
-		next->data.tx_packets = cur->data.tx_packets;
-		next->data.tx_bytes = cur->data.tx_bytes;
-
 		if (rand() % 3 == 0) {
 			pkt = rand() % 5;
-			next->data.tx_packets += pkt;
-			next->data.tx_bytes += pkt * (rand() % 1500);
+			next.data.tx_packets += pkt;
+			next.data.tx_bytes += pkt * (rand() % 1500);
 		}
 
-		set_end(file, next);
-
-		if ((rand() % 50) == 0)
-			roaming = roaming == TRUE? FALSE : TRUE;
-
-	}
-
-	return 0;
-}
-
-static struct stats_record *get_next_record(struct stats_iter *iter)
-{
-	if (iter->it != iter->end) {
-		struct stats_record *tmp;
-
-		tmp = iter->it;
-		iter->it = get_next(iter->file, iter->it);
-
-		return tmp;
-	}
-
-	return NULL;
-}
-
-static int append_record(struct stats_file *file,
-				struct stats_record *rec)
-{
-	struct stats_record *cur, *next;
-	int err;
-
-	if (file->last == get_end(file)) {
-		err = stats_file_remap(file, file->len +
-					sysconf(_SC_PAGESIZE));
+		err = append_record(file, &next);
 		if (err < 0)
 			return err;
 
-		stats_file_update_cache(file);
-	}
-
-	cur = get_end(file);
-	next = get_next(file, cur);
+		cur = next;
 
-	memcpy(next, rec, sizeof(struct stats_record));
+		if ((rand() % 50) == 0)
+			roaming = roaming == TRUE? FALSE : TRUE;
 
-	set_end(file, next);
+	}
 
 	return 0;
 }
 
-static struct stats_record *process_file(struct stats_iter *iter,
+static gboolean process_file(struct stats_iter *iter,
 					struct stats_file *temp_file,
 					struct stats_record *cur,
+					gboolean have_cur,
 					GDate *date_change_step_size,
 					int account_period_offset)
 {
-	struct stats_record *home, *roaming;
+	struct stats_record home, roaming;
 	struct stats_record *next;
+	gboolean have_home = FALSE, have_roaming = FALSE;
 
-	home = NULL;
-	roaming = NULL;
+	if (have_cur == FALSE) {
+		next = get_next_record(iter);
+		if (next == NULL)
+			return FALSE;
+
+		*cur = *next;
+	}
 
-	if (cur == NULL)
-		cur = get_next_record(iter);
 	next = get_next_record(iter);
 
 	while (next != NULL) {
@@ -673,10 +798,13 @@ static struct stats_record *process_file(struct stats_iter *iter,
 
 		append = FALSE;
 
-		if (cur->roaming == TRUE)
-			roaming = cur;
-		else
-			home = cur;
+		if (cur->roaming == TRUE) {
+			roaming = *cur;
+			have_roaming = TRUE;
+		} else {
+			home = *cur;
+			have_home = TRUE;
+		}
 
 		g_date_set_time_t(&date_cur, cur->ts);
 		g_date_set_time_t(&date_next, next->ts);
@@ -703,22 +831,22 @@ static struct stats_record *process_file(struct stats_iter *iter,
 		}
 
 		if (append == TRUE) {
-			if (home != NULL) {
-				append_record(temp_file, home);
-				home = NULL;
+			if (have_home == TRUE) {
+				append_record(temp_file, &home);
+				have_home = FALSE;
 			}
 
-			if (roaming != NULL) {
-				append_record(temp_file, roaming);
-				roaming = NULL;
+			if (have_roaming == TRUE) {
+				append_record(temp_file, &roaming);
+				have_roaming = FALSE;
 			}
 		}
 
-		cur = next;
+		*cur = *next;
 		next = get_next_record(iter);
 	}
 
-	return cur;
+	return TRUE;
 }
 
 static int summarize(struct stats_file *data_file,
@@ -728,7 +856,9 @@ static int summarize(struct stats_file *data_file,
 {
 	struct stats_iter data_iter;
 	struct stats_iter history_iter;
-	struct stats_record *cur, *next;
+	struct stats_iter peek_iter;
+	struct stats_record cur, *next;
+	gboolean have_cur;
 
 	GDate today, date_change_step_size;
 
@@ -748,39 +878,37 @@ static int summarize(struct stats_file *data_file,
 
 
 	/* Now process history file */
-	cur = NULL;
+	have_cur = FALSE;
 
 	if (history_file != NULL) {
-		history_iter.file = history_file;
-		history_iter.begin = get_iterator_begin(history_iter.file);
-		history_iter.end = get_iterator_end(history_iter.file);
-		history_iter.it = history_iter.begin;
+		stats_iter_init(&history_iter, history_file);
 
-		cur = process_file(&history_iter, temp_file, NULL,
+		have_cur = process_file(&history_iter, temp_file, &cur, FALSE,
 					&date_change_step_size, account_period_offset);
 	}
 
-	data_iter.file = data_file;
-	data_iter.begin = get_iterator_begin(data_iter.file);
-	data_iter.end = get_iterator_end(data_iter.file);
-	data_iter.it = data_iter.begin;
+	stats_iter_init(&data_iter, data_file);
 
 	/*
 	 * Ensure date_file records are newer than the history_file
 	 * record
 	 */
-	if (cur != NULL) {
-		next = get_next_record(&data_iter);
-		while(next != NULL && cur->ts > next->ts)
-			next = get_next_record(&data_iter);
+	if (have_cur == TRUE) {
+		peek_iter = data_iter;
+
+		next = get_next_record(&peek_iter);
+		while (next != NULL && cur.ts > next->ts) {
+			data_iter = peek_iter;
+			next = get_next_record(&peek_iter);
+		}
 	}
 
 	/* And finally process the new data records */
-	cur = process_file(&data_iter, temp_file, cur,
+	have_cur = process_file(&data_iter, temp_file, &cur, have_cur,
 				&date_change_step_size, account_period_offset);
 
-	if (cur != NULL)
-		append_record(temp_file, cur);
+	if (have_cur == TRUE)
+		append_record(temp_file, &cur);
 
 	return 0;
 }
@@ -831,9 +959,10 @@ int main(int argc, char *argv[])
 
 	struct stats_file_header *hdr;
 	struct stats_file data, *data_file;
+	struct stats_file last;
 	struct stats_record *rec;
 	time_t start_ts;
-	int err;
+	int err, ret = 0;
 
 	rec = NULL;
 
@@ -867,14 +996,14 @@ int main(int argc, char *argv[])
 	}
 
 	if (option_last_file_name != NULL) {
-		struct stats_file last;
 		if (stats_open(&last, option_last_file_name) < 0) {
 			fprintf(stderr, "failed open file %s\n",
 				option_last_file_name);
 			exit(1);
 		}
 
-		rec = get_end(&last);
+		if (last.nr > 0)
+			rec = &last.last;
 	}
 
 	if (option_start_ts == -1)
@@ -901,11 +1030,14 @@ int main(int argc, char *argv[])
 	if (option_summary == TRUE)
 		stats_print_diff(data_file);
 
+	if (option_verify == TRUE && stats_verify(data_file) > 0)
+		ret = 1;
+
 	if (option_info_file_name != NULL)
 		history_file_update(data_file, option_info_file_name);
 
 err:
 	stats_close(data_file);
 
-	return 0;
+	return ret;
 }
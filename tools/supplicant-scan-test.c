@@ -0,0 +1,325 @@
+/*
+ *
+ *  Connection Manager
+ *
+ *  Copyright (C) 2007-2010  Intel Corporation. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <syslog.h>
+
+#include <gdbus.h>
+
+#include <gsupplicant/gsupplicant.h>
+
+#define DBG(fmt, arg...) do { \
+	syslog(LOG_DEBUG, "%s() " fmt, __FUNCTION__ , ## arg); \
+} while (0)
+
+/*
+ * Scans with the given interface and reports how long each scan
+ * took and how the resulting networks were handed over: one
+ * network_added call per network, or one networks_added batch.
+ */
+
+static gchar *option_ifname = NULL;
+static gchar *option_driver = NULL;
+static gint option_scans = 1;
+static gboolean option_no_batch = FALSE;
+static gboolean option_debug = FALSE;
+
+static GOptionEntry options[] = {
+	{ "ifname", 'i', 0, G_OPTION_ARG_STRING, &option_ifname,
+				"Interface to scan with", "IFNAME" },
+	{ "driver", 'd', 0, G_OPTION_ARG_STRING, &option_driver,
+				"Driver of the interface", "DRIVER" },
+	{ "scans", 'n', 0, G_OPTION_ARG_INT, &option_scans,
+				"Number of scans to run", "COUNT" },
+	{ "no-batch", 'B', 0, G_OPTION_ARG_NONE, &option_no_batch,
+				"Do not take networks as a batch" },
+	{ "debug", 'D', 0, G_OPTION_ARG_NONE, &option_debug,
+				"Show supplicant debug output" },
+	{ NULL },
+};
+
+static GMainLoop *main_loop = NULL;
+
+static GTimer *scan_timer = NULL;
+static int scans_done = 0;
+static unsigned int added_calls = 0;
+static unsigned int batch_calls = 0;
+static unsigned int networks = 0;
+static gdouble total_time = 0;
+
+static void start_scan(GSupplicantInterface *interface);
+
+static gboolean retry_scan(gpointer user_data)
+{
+	start_scan(user_data);
+
+	return FALSE;
+}
+
+static void scan_callback(int result, GSupplicantInterface *interface,
+							void *user_data)
+{
+	gdouble elapsed = g_timer_elapsed(scan_timer, NULL);
+
+	DBG("* result %d", result);
+
+	printf("scan %d: result %d %.1f ms, %u network_added, "
+				"%u networks_added with %u networks\n",
+				scans_done + 1, result, elapsed * 1000,
+				added_calls, batch_calls, networks);
+
+	total_time += elapsed;
+	added_calls = 0;
+	batch_calls = 0;
+	networks = 0;
+
+	if (++scans_done < option_scans) {
+		g_timeout_add_seconds(1, retry_scan, interface);
+		return;
+	}
+
+	printf("%d scans, %.1f ms average\n", scans_done,
+					total_time * 1000 / scans_done);
+
+	g_main_loop_quit(main_loop);
+}
+
+static void start_scan(GSupplicantInterface *interface)
+{
+	int err;
+
+	g_timer_start(scan_timer);
+
+	err = g_supplicant_interface_scan(interface, scan_callback, NULL);
+	if (err == -EALREADY || err == -EBUSY) {
+		g_timeout_add_seconds(1, retry_scan, interface);
+		return;
+	}
+
+	if (err < 0) {
+		printf("scan failed %d\n", err);
+		g_main_loop_quit(main_loop);
+	}
+}
+
+static void create_callback(int result, GSupplicantInterface *interface,
+							void *user_data)
+{
+	DBG("* result %d", result);
+
+	if (result < 0) {
+		printf("failed to create interface %s\n", option_ifname);
+		g_main_loop_quit(main_loop);
+	}
+}
+
+static void system_ready(void)
+{
+	DBG("*");
+
+	g_supplicant_interface_create(option_ifname, option_driver, NULL,
+						create_callback, NULL);
+}
+
+static void system_killed(void)
+{
+	DBG("*");
+}
+
+static void interface_added(GSupplicantInterface *interface)
+{
+	const char *ifname = g_supplicant_interface_get_ifname(interface);
+	const char *driver = g_supplicant_interface_get_driver(interface);
+
+	DBG("* ifname %s driver %s", ifname, driver);
+
+	if (g_strcmp0(ifname, option_ifname) != 0)
+		return;
+
+	start_scan(interface);
+}
+
+static void interface_removed(GSupplicantInterface *interface)
+{
+	const char *ifname = g_supplicant_interface_get_ifname(interface);
+
+	DBG("* ifname %s", ifname);
+}
+
+static void scan_started(GSupplicantInterface *interface)
+{
+	const char *ifname = g_supplicant_interface_get_ifname(interface);
+
+	DBG("* ifname %s", ifname);
+}
+
+static void scan_finished(GSupplicantInterface *interface)
+{
+	const char *ifname = g_supplicant_interface_get_ifname(interface);
+
+	DBG("* ifname %s", ifname);
+}
+
+static void network_added(GSupplicantNetwork *network)
+{
+	DBG("* name %s", g_supplicant_network_get_name(network));
+
+	added_calls++;
+	networks++;
+}
+
+static void networks_added(GSupplicantInterface *interface, GSList *list)
+{
+	DBG("* %d networks", g_slist_length(list));
+
+	batch_calls++;
+	networks += g_slist_length(list);
+}
+
+static void network_removed(GSupplicantNetwork *network)
+{
+	DBG("* name %s", g_supplicant_network_get_name(network));
+}
+
+static void debug(const char *str)
+{
+	if (option_debug == TRUE)
+		DBG("%s", str);
+}
+
+static GSupplicantCallbacks callbacks = {
+	.system_ready		= system_ready,
+	.system_killed		= system_killed,
+	.interface_added	= interface_added,
+	.interface_removed	= interface_removed,
+	.scan_started		= scan_started,
+	.scan_finished		= scan_finished,
+	.network_added		= network_added,
+	.networks_added		= networks_added,
+	.network_removed	= network_removed,
+	.debug			= debug,
+};
+
+static void sig_term(int sig)
+{
+	syslog(LOG_INFO, "Terminating");
+
+	g_main_loop_quit(main_loop);
+}
+
+static void disconnect_callback(DBusConnection *conn, void *user_data)
+{
+	syslog(LOG_ERR, "D-Bus disconnect");
+
+	g_main_loop_quit(main_loop);
+}
+
+int main(int argc, char *argv[])
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	DBusConnection *conn;
+	DBusError err;
+	struct sigaction sa;
+
+	context = g_option_context_new(NULL);
+	g_option_context_add_main_entries(context, options, NULL);
+
+	if (g_option_context_parse(context, &argc, &argv, &error) == FALSE) {
+		if (error != NULL) {
+			g_printerr("%s\n", error->message);
+			g_error_free(error);
+		} else
+			g_printerr("An unknown error occurred\n");
+		exit(1);
+	}
+
+	g_option_context_free(context);
+
+	if (option_ifname == NULL)
+		option_ifname = g_strdup("wlan0");
+
+	if (option_driver == NULL)
+		option_driver = g_strdup("nl80211,wext");
+
+	if (option_no_batch == TRUE)
+		callbacks.networks_added = NULL;
+
+	main_loop = g_main_loop_new(NULL, FALSE);
+
+	dbus_error_init(&err);
+
+	conn = g_dbus_setup_bus(DBUS_BUS_SYSTEM, NULL, &err);
+	if (conn == NULL) {
+		if (dbus_error_is_set(&err) == TRUE) {
+			fprintf(stderr, "%s\n", err.message);
+			dbus_error_free(&err);
+		} else
+			fprintf(stderr, "Can't register with system bus\n");
+		exit(1);
+	}
+
+	openlog("supplicant", LOG_NDELAY | LOG_PERROR, LOG_USER);
+
+	g_dbus_set_disconnect_function(conn, disconnect_callback, NULL, NULL);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sig_term;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	syslog(LOG_INFO, "Startup");
+
+	scan_timer = g_timer_new();
+
+	if (g_supplicant_register(&callbacks) < 0) {
+		syslog(LOG_ERR, "Failed to init supplicant");
+		goto done;
+	}
+
+	g_main_loop_run(main_loop);
+
+	g_supplicant_unregister(&callbacks);
+
+done:
+	syslog(LOG_INFO, "Exit");
+
+	g_timer_destroy(scan_timer);
+
+	dbus_connection_unref(conn);
+
+	g_main_loop_unref(main_loop);
+
+	closelog();
+
+	g_free(option_ifname);
+	g_free(option_driver);
+
+	return 0;
+}
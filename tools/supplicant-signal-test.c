@@ -0,0 +1,372 @@
+/*
+ *
+ *  Connection Manager
+ *
+ *  Copyright (C) 2007-2010  Intel Corporation. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+#include <dbus/dbus.h>
+
+#include <gsupplicant/dbus.h>
+
+/*
+ * Replays a signal trace through the supplicant signal dispatch. The
+ * trace is either the output of "dbus-monitor --system" or a generated
+ * scan with the given number of BSSs mixed with unrelated signals.
+ *
+ * The previous dispatch compared interface and member against every
+ * entry of the map and then looked the path up by string in the three
+ * tables a BSS signal touches. The current one finds the handler with
+ * two hash lookups, interns the path once and looks it up by pointer.
+ */
+
+#define IFACE_PATH	SUPPLICANT_PATH "/Interfaces/0"
+
+static gchar *option_trace = NULL;
+static gint option_bss = 100;
+static gint option_iterations = 1000;
+
+static GOptionEntry options[] = {
+	{ "trace", 't', 0, G_OPTION_ARG_STRING, &option_trace,
+				"Replay dbus-monitor output from FILE", "FILE" },
+	{ "bss", 'b', 0, G_OPTION_ARG_INT, &option_bss,
+				"Number of BSSs in the generated scan", "COUNT" },
+	{ "iterations", 'n', 0, G_OPTION_ARG_INT, &option_iterations,
+				"Number of times to replay the trace", "COUNT" },
+	{ NULL },
+};
+
+static unsigned int handled[2];
+static unsigned int current;
+
+static void count_signal(const char *path, DBusMessageIter *iter)
+{
+	handled[current]++;
+}
+
+static const struct supplicant_dbus_signal signal_map[] = {
+	{ DBUS_INTERFACE_DBUS,  "NameOwnerChanged",  count_signal },
+
+	{ SUPPLICANT_INTERFACE, "PropertiesChanged", count_signal },
+	{ SUPPLICANT_INTERFACE, "InterfaceAdded",    count_signal },
+	{ SUPPLICANT_INTERFACE, "InterfaceCreated",  count_signal },
+	{ SUPPLICANT_INTERFACE, "InterfaceRemoved",  count_signal },
+
+	{ SUPPLICANT_INTERFACE ".Interface", "PropertiesChanged", count_signal },
+	{ SUPPLICANT_INTERFACE ".Interface", "ScanDone",          count_signal },
+	{ SUPPLICANT_INTERFACE ".Interface", "BSSAdded",          count_signal },
+	{ SUPPLICANT_INTERFACE ".Interface", "BSSRemoved",        count_signal },
+	{ SUPPLICANT_INTERFACE ".Interface", "NetworkAdded",      count_signal },
+	{ SUPPLICANT_INTERFACE ".Interface", "NetworkRemoved",    count_signal },
+
+	{ SUPPLICANT_INTERFACE ".BSS", "PropertiesChanged", count_signal },
+
+	{ SUPPLICANT_INTERFACE ".Interface.WPS", "Credentials", count_signal },
+	{ SUPPLICANT_INTERFACE ".Interface.WPS", "Event",       count_signal },
+
+	{ }
+};
+
+static GPtrArray *messages;
+
+static GHashTable *string_table;
+static GHashTable *intern_table;
+static GHashTable *pointer_table;
+
+static void add_signal(const char *path, const char *interface,
+							const char *member)
+{
+	DBusMessage *message;
+	dbus_uint32_t value = 0;
+
+	message = dbus_message_new_signal(path, interface, member);
+	if (message == NULL)
+		return;
+
+	dbus_message_append_args(message, DBUS_TYPE_UINT32, &value,
+							DBUS_TYPE_INVALID);
+
+	g_ptr_array_add(messages, message);
+}
+
+static char *get_field(const char *line, const char *name)
+{
+	const char *start, *end;
+
+	start = strstr(line, name);
+	if (start == NULL)
+		return NULL;
+
+	start += strlen(name);
+
+	end = strchr(start, ';');
+	if (end == NULL)
+		end = start + strlen(start);
+
+	while (end > start && (end[-1] == '\n' || end[-1] == ' '))
+		end--;
+
+	return g_strndup(start, end - start);
+}
+
+static int load_trace(const char *filename)
+{
+	char line[1024];
+	FILE *file;
+
+	file = fopen(filename, "r");
+	if (file == NULL) {
+		perror("Failed to open trace");
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), file) != NULL) {
+		char *path, *interface, *member;
+
+		if (strncmp(line, "signal ", 7) != 0)
+			continue;
+
+		path = get_field(line, " path=");
+		interface = get_field(line, " interface=");
+		member = get_field(line, " member=");
+
+		if (path != NULL && interface != NULL && member != NULL)
+			add_signal(path, interface, member);
+
+		g_free(path);
+		g_free(interface);
+		g_free(member);
+	}
+
+	fclose(file);
+
+	return 0;
+}
+
+static void generate_scan(int count)
+{
+	int i;
+
+	add_signal(IFACE_PATH, SUPPLICANT_INTERFACE ".Interface",
+							"PropertiesChanged");
+
+	for (i = 0; i < count; i++) {
+		char *path = g_strdup_printf("%s/BSSs/%d", IFACE_PATH, i);
+
+		add_signal(IFACE_PATH, SUPPLICANT_INTERFACE ".Interface",
+								"BSSAdded");
+		add_signal(path, SUPPLICANT_INTERFACE ".BSS",
+							"PropertiesChanged");
+		add_signal("/net/connman/service/wifi_0", "net.connman.Service",
+							"PropertyChanged");
+		add_signal("/org/freedesktop/DBus", DBUS_INTERFACE_DBUS,
+							"NameAcquired");
+
+		g_free(path);
+	}
+
+	add_signal(IFACE_PATH, SUPPLICANT_INTERFACE ".Interface", "ScanDone");
+	add_signal(IFACE_PATH, SUPPLICANT_INTERFACE ".Interface",
+							"PropertiesChanged");
+}
+
+/* Every path of the trace is known, like after the first scan */
+static void setup_tables(void)
+{
+	guint i;
+
+	string_table = g_hash_table_new_full(g_str_hash, g_str_equal,
+								g_free, NULL);
+	intern_table = g_hash_table_new_full(g_str_hash, g_str_equal,
+								g_free, NULL);
+	pointer_table = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	for (i = 0; i < messages->len; i++) {
+		const char *path = dbus_message_get_path(messages->pdata[i]);
+		char *interned;
+
+		if (g_hash_table_lookup(intern_table, path) != NULL)
+			continue;
+
+		interned = g_strdup(path);
+		g_hash_table_replace(intern_table, interned, interned);
+		g_hash_table_replace(pointer_table, interned, interned);
+		g_hash_table_replace(string_table, g_strdup(path),
+							GINT_TO_POINTER(1));
+	}
+}
+
+static void legacy_dispatch(DBusMessage *message)
+{
+	DBusMessageIter iter;
+	const char *path;
+	int i, n;
+
+	path = dbus_message_get_path(message);
+	if (path == NULL)
+		return;
+
+	if (dbus_message_iter_init(message, &iter) == FALSE)
+		return;
+
+	for (i = 0; signal_map[i].interface != NULL; i++) {
+		if (dbus_message_has_interface(message,
+					signal_map[i].interface) == FALSE)
+			continue;
+
+		if (dbus_message_has_member(message,
+					signal_map[i].member) == FALSE)
+			continue;
+
+		for (n = 0; n < 3; n++)
+			g_hash_table_lookup(string_table, path);
+
+		signal_map[i].function(path, &iter);
+		break;
+	}
+}
+
+static void hashed_dispatch(DBusMessage *message)
+{
+	supplicant_dbus_signal_function function;
+	DBusMessageIter iter;
+	const char *path, *interned;
+	int n;
+
+	function = supplicant_dbus_signal_lookup(message);
+	if (function == NULL)
+		return;
+
+	path = dbus_message_get_path(message);
+	if (path == NULL)
+		return;
+
+	if (dbus_message_iter_init(message, &iter) == FALSE)
+		return;
+
+	interned = g_hash_table_lookup(intern_table, path);
+
+	for (n = 0; n < 3; n++)
+		g_hash_table_lookup(pointer_table, interned);
+
+	function(interned != NULL ? interned : path, &iter);
+}
+
+static double replay(void (*dispatch) (DBusMessage *message))
+{
+	GTimer *timer;
+	double elapsed;
+	int n;
+	guint i;
+
+	timer = g_timer_new();
+
+	for (n = 0; n < option_iterations; n++)
+		for (i = 0; i < messages->len; i++)
+			dispatch(messages->pdata[i]);
+
+	elapsed = g_timer_elapsed(timer, NULL);
+
+	g_timer_destroy(timer);
+
+	return elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	double legacy, hashed;
+	guint i, total;
+
+	context = g_option_context_new(NULL);
+	g_option_context_add_main_entries(context, options, NULL);
+
+	if (g_option_context_parse(context, &argc, &argv, &error) == FALSE) {
+		if (error != NULL) {
+			g_printerr("%s\n", error->message);
+			g_error_free(error);
+		} else
+			g_printerr("An unknown error occurred\n");
+		return 1;
+	}
+
+	g_option_context_free(context);
+
+	if (option_iterations <= 0) {
+		printf("invalid number of iterations\n");
+		return 1;
+	}
+
+	messages = g_ptr_array_new();
+
+	if (option_trace != NULL) {
+		if (load_trace(option_trace) < 0)
+			return 1;
+	} else
+		generate_scan(option_bss);
+
+	if (messages->len == 0) {
+		printf("no signals in trace\n");
+		return 1;
+	}
+
+	setup_tables();
+	supplicant_dbus_signal_register(signal_map);
+
+	current = 0;
+	legacy = replay(legacy_dispatch);
+
+	current = 1;
+	hashed = replay(hashed_dispatch);
+
+	total = messages->len * option_iterations;
+
+	printf("signals %u, handled %u\n", messages->len,
+					handled[0] / option_iterations);
+	printf("legacy %8.3f us/signal\n", legacy * 1000000 / total);
+	printf("hashed %8.3f us/signal\n", hashed * 1000000 / total);
+
+	supplicant_dbus_signal_unregister();
+
+	g_hash_table_destroy(pointer_table);
+	g_hash_table_destroy(intern_table);
+	g_hash_table_destroy(string_table);
+
+	for (i = 0; i < messages->len; i++)
+		dbus_message_unref(messages->pdata[i]);
+
+	g_ptr_array_free(messages, TRUE);
+
+	g_free(option_trace);
+
+	if (handled[0] != handled[1]) {
+		printf("dispatch mismatch %u != %u\n", handled[0], handled[1]);
+		return 1;
+	}
+
+	return 0;
+}
@@ -33,6 +33,25 @@ static GTimer *timer;
 
 static GMainLoop *main_loop;
 
+static GWeb *web;
+static const char *request_url;
+
+static gint option_count = 0;
+static gint option_buffer = 0;
+static gint option_throttle = 0;
+
+static guint request_id;
+static guint8 *body_buffer;
+static gsize body_total;
+
+/*
+ * With --count the same URL is fetched repeatedly, first with a new
+ * connection per request (cold) and then over a kept alive one (warm).
+ */
+static gboolean bench_warm = FALSE;
+static gint bench_done = 0;
+static gdouble bench_total[2];
+
 static void web_debug(const char *str, void *data)
 {
 	g_print("%s: %s\n", (const char *) data, str);
@@ -43,6 +62,65 @@ static void sig_term(int sig)
 	g_main_loop_quit(main_loop);
 }
 
+static gboolean web_result(GWebResult *result, gpointer user_data);
+
+static guint8 *get_buffer(gsize *size, gpointer user_data)
+{
+	*size = option_buffer;
+
+	return body_buffer;
+}
+
+static guint start_web_request(void)
+{
+	request_id = g_web_request_get(web, request_url, web_result, NULL);
+
+	if (request_id > 0 && body_buffer != NULL)
+		g_web_set_request_buffer_func(web, request_id,
+							get_buffer, NULL);
+
+	return request_id;
+}
+
+static gboolean bench_result(guint16 status, gdouble elapsed)
+{
+	g_print("%s request %d status %03u elapse %f ms\n",
+				bench_warm == TRUE ? "warm" : "cold",
+				bench_done + 1, status, elapsed * 1000);
+
+	bench_total[bench_warm] += elapsed;
+
+	if (++bench_done == option_count) {
+		if (bench_warm == TRUE) {
+			g_print("cold average %f ms, warm average %f ms\n",
+					bench_total[0] * 1000 / option_count,
+					bench_total[1] * 1000 / option_count);
+			g_main_loop_quit(main_loop);
+			return FALSE;
+		}
+
+		bench_warm = TRUE;
+		bench_done = 0;
+		g_web_set_close_connection(web, FALSE);
+	}
+
+	g_timer_start(timer);
+
+	if (start_web_request() == 0) {
+		fprintf(stderr, "Failed to start request\n");
+		g_main_loop_quit(main_loop);
+	}
+
+	return FALSE;
+}
+
+static gboolean resume_request(gpointer user_data)
+{
+	g_web_resume_request(web, request_id);
+
+	return FALSE;
+}
+
 static gboolean web_result(GWebResult *result, gpointer user_data)
 {
 	const guint8 *chunk;
@@ -53,15 +131,28 @@ static gboolean web_result(GWebResult *result, gpointer user_data)
 	g_web_result_get_chunk(result, &chunk, &length);
 
 	if (length > 0) {
-		printf("%s\n", (char *) chunk);
+		body_total += length;
+
+		if (option_throttle > 0) {
+			g_web_pause_request(web, request_id);
+			g_timeout_add(option_throttle, resume_request, NULL);
+		}
+
+		if (option_count == 0)
+			printf("%.*s\n", (int) length, (char *) chunk);
 		return TRUE;
 	}
 
 	status = g_web_result_get_status(result);
 
+	elapsed = g_timer_elapsed(timer, NULL);
+
+	if (option_count > 0)
+		return bench_result(status, elapsed);
+
 	g_print("status: %03u\n", status);
 
-	elapsed = g_timer_elapsed(timer, NULL);
+	g_print("body: %zu bytes\n", body_total);
 
 	g_print("elapse: %f seconds\n", elapsed);
 
@@ -87,6 +178,12 @@ static GOptionEntry options[] = {
 					"Specific user agent", "STRING" },
 	{ "http-version", 'H', 0, G_OPTION_ARG_STRING, &option_http_version,
 					"Specific HTTP version", "STRING" },
+	{ "count", 'c', 0, G_OPTION_ARG_INT, &option_count,
+				"Compare COUNT cold and warm requests", "COUNT" },
+	{ "buffer", 'b', 0, G_OPTION_ARG_INT, &option_buffer,
+				"Receive the body into a SIZE bytes buffer", "SIZE" },
+	{ "throttle", 't', 0, G_OPTION_ARG_INT, &option_throttle,
+				"Pause reading for MSEC after each chunk", "MSEC" },
 	{ NULL },
 };
 
@@ -95,7 +192,6 @@ int main(int argc, char *argv[])
 	GOptionContext *context;
 	GError *error = NULL;
 	struct sigaction sa;
-	GWeb *web;
 	int index = 0;
 
 	context = g_option_context_new(NULL);
@@ -148,9 +244,17 @@ int main(int argc, char *argv[])
 		g_free(option_http_version);
 	}
 
+	if (option_count > 0)
+		g_web_set_close_connection(web, TRUE);
+
+	if (option_buffer > 0)
+		body_buffer = g_malloc(option_buffer);
+
+	request_url = argv[1];
+
 	timer = g_timer_new();
 
-	if (g_web_request_get(web, argv[1], web_result, NULL) == 0) {
+	if (start_web_request() == 0) {
 		fprintf(stderr, "Failed to start request\n");
 		return 1;
 	}
@@ -166,6 +270,8 @@ int main(int argc, char *argv[])
 
 	g_web_unref(web);
 
+	g_free(body_buffer);
+
 	g_main_loop_unref(main_loop);
 
 	return 0;